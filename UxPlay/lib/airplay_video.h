@@ -47,6 +47,7 @@ char *get_media_playlist_by_num(airplay_video_t *airplay_video, int num);
 char *get_media_uri_by_num(airplay_video_t *airplay_video, int num);
 int get_media_uri_num(airplay_video_t *airplay_video, char * uri);
 int analyze_media_playlist(char *playlist, float *duration);
+char *adjust_yt_condensed_playlist(const char *media_playlist);
 
 void airplay_video_service_destroy(airplay_video_t *airplay_video);
 
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* The ring holds CAPTURE_SLOTS blocks.  Slots [head, head + queued) are owned by
+ * the io thread (the one at head may be being written, without the lock held);
+ * the slot after them is the one the caller is filling.  Open and close requests
+ * travel through the ring as slots of their own, so they stay ordered with the
+ * data.  Each data slot is written with a single large fwrite(). */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture_writer.h"
+#include "threads.h"
+#include "thread_policy.h"
+
+#define CAPTURE_SLOTS 16
+#define CAPTURE_BLOCK_SIZE (256 * 1024)     /* 4 MB of buffering per writer */
+#define CAPTURE_MAX_DELAY 1                  /* secs a partly filled block may wait */
+
+typedef enum capture_op_e { CAPTURE_DATA, CAPTURE_OPEN, CAPTURE_CLOSE } capture_op_t;
+
+typedef struct capture_slot_s {
+    capture_op_t op;
+    size_t len;
+    unsigned char *buf;      /* CAPTURE_BLOCK_SIZE bytes; the filename for CAPTURE_OPEN */
+} capture_slot_t;
+
+struct capture_writer_s {
+    logger_t *logger;
+    uint64_t max_file_bytes;
+    unsigned int max_file_secs;
+
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+
+    /* MUTEX LOCKED VARIABLES START */
+    capture_slot_t slots[CAPTURE_SLOTS];
+    int head;
+    int queued;
+    bool running;
+    bool discard;            /* an open/close did not fit: drop data until the next open */
+    bool rotation_due;       /* only meaningful once the io thread has opened the newest file */
+    unsigned int opens_queued, opens_done;
+    time_t last_submit;
+    uint64_t dropped;
+    /* MUTEX LOCKED VARIABLES END */
+
+    /* io thread only */
+    FILE *file;
+    char *filename;
+    uint64_t file_bytes;
+    time_t file_opened;
+};
+
+static void
+capture_writer_close_file(capture_writer_t *writer)
+{
+    if (!writer->file) {
+        return;
+    }
+    if (fclose(writer->file)) {
+        logger_log(writer->logger, LOGGER_ERR, "capture: error closing %s", writer->filename);
+    }
+    logger_log(writer->logger, LOGGER_DEBUG, "capture: closed %s (%llu bytes)", writer->filename,
+               (unsigned long long) writer->file_bytes);
+    writer->file = NULL;
+    free(writer->filename);
+    writer->filename = NULL;
+}
+
+static THREAD_RETVAL
+capture_writer_thread(void *arg)
+{
+    capture_writer_t *writer = arg;
+    assert(writer);
+    thread_policy_apply(THREAD_CLASS_OTHER, "capture_writer");
+
+    MUTEX_LOCK(writer->mutex);
+    while (writer->running || writer->queued) {
+        if (!writer->queued) {
+            pthread_cond_wait(&writer->cond, &writer->mutex);
+            continue;
+        }
+        capture_slot_t *slot = &writer->slots[writer->head];
+        MUTEX_UNLOCK(writer->mutex);
+
+        bool rotation_due = false;
+        switch (slot->op) {
+        case CAPTURE_OPEN:
+            capture_writer_close_file(writer);
+            writer->file = fopen((const char *) slot->buf, "wb");
+            if (!writer->file) {
+                logger_log(writer->logger, LOGGER_ERR, "capture: could not open file %s", (const char *) slot->buf);
+            } else {
+                /* blocks are already large: no extra stdio copy */
+                setvbuf(writer->file, NULL, _IONBF, 0);
+                writer->filename = strdup((const char *) slot->buf);
+                writer->file_bytes = 0;
+                writer->file_opened = time(NULL);
+            }
+            break;
+        case CAPTURE_CLOSE:
+            capture_writer_close_file(writer);
+            break;
+        case CAPTURE_DATA:
+            if (writer->file) {
+                if (fwrite(slot->buf, 1, slot->len, writer->file) != slot->len) {
+                    logger_log(writer->logger, LOGGER_ERR, "capture: write to %s failed", writer->filename);
+                }
+                writer->file_bytes += slot->len;
+                rotation_due = ((writer->max_file_bytes && writer->file_bytes >= writer->max_file_bytes) ||
+                                (writer->max_file_secs && time(NULL) - writer->file_opened >= writer->max_file_secs));
+            }
+            break;
+        }
+
+        MUTEX_LOCK(writer->mutex);
+        if (slot->op == CAPTURE_OPEN) {
+            writer->opens_done++;
+            writer->rotation_due = false;
+        } else if (rotation_due) {
+            writer->rotation_due = true;
+        }
+        slot->op = CAPTURE_DATA;
+        slot->len = 0;
+        writer->head = (writer->head + 1) % CAPTURE_SLOTS;
+        writer->queued--;
+    }
+    MUTEX_UNLOCK(writer->mutex);
+    capture_writer_close_file(writer);
+    return 0;
+}
+
+/* called with mutex locked: queue the slot being filled, if it holds data *
+ * (when the ring is full there is no slot being filled)                    */
+static void
+capture_writer_submit(capture_writer_t *writer)
+{
+    if (writer->queued < CAPTURE_SLOTS && writer->slots[(writer->head + writer->queued) % CAPTURE_SLOTS].len) {
+        writer->queued++;
+        writer->last_submit = time(NULL);
+        COND_SIGNAL(writer->cond);
+    }
+}
+
+capture_writer_t *
+capture_writer_init(logger_t *logger, uint64_t max_file_bytes, unsigned int max_file_secs)
+{
+    capture_writer_t *writer = calloc(1, sizeof(capture_writer_t));
+    if (!writer) {
+        return NULL;
+    }
+    writer->logger = logger;
+    writer->max_file_bytes = max_file_bytes;
+    writer->max_file_secs = max_file_secs;
+    for (int i = 0; i < CAPTURE_SLOTS; i++) {
+        writer->slots[i].buf = malloc(CAPTURE_BLOCK_SIZE);
+        if (!writer->slots[i].buf) {
+            for (int j = 0; j < i; j++) {
+                free(writer->slots[j].buf);
+            }
+            free(writer);
+            return NULL;
+        }
+    }
+    MUTEX_CREATE(writer->mutex);
+    COND_CREATE(writer->cond);
+    writer->running = true;
+    THREAD_CREATE(writer->thread, capture_writer_thread, writer);
+    if (!writer->thread) {
+        logger_log(logger, LOGGER_ERR, "capture: could not create io thread");
+        writer->running = false;
+        capture_writer_destroy(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void
+capture_writer_destroy(capture_writer_t *writer)
+{
+    if (!writer) {
+        return;
+    }
+    MUTEX_LOCK(writer->mutex);
+    bool was_running = writer->running;
+    /* hand over the partly filled slot, then let the io thread drain the ring */
+    capture_writer_submit(writer);
+    writer->running = false;
+    COND_SIGNAL(writer->cond);
+    MUTEX_UNLOCK(writer->mutex);
+    if (was_running) {
+        THREAD_JOIN(writer->thread);
+    }
+    if (writer->dropped) {
+        logger_log(writer->logger, LOGGER_WARNING, "capture: %llu writes were dropped (disk too slow)",
+                   (unsigned long long) writer->dropped);
+    }
+    for (int i = 0; i < CAPTURE_SLOTS; i++) {
+        free(writer->slots[i].buf);
+    }
+    COND_DESTROY(writer->cond);
+    MUTEX_DESTROY(writer->mutex);
+    free(writer);
+}
+
+/* called with mutex locked */
+static void
+capture_writer_queue_op(capture_writer_t *writer, capture_op_t op, const char *filename)
+{
+    capture_writer_submit(writer);
+    if (writer->queued == CAPTURE_SLOTS) {
+        writer->discard = true;
+        writer->dropped++;
+        return;
+    }
+    capture_slot_t *slot = &writer->slots[(writer->head + writer->queued) % CAPTURE_SLOTS];
+    slot->op = op;
+    if (filename) {
+        strncpy((char *) slot->buf, filename, CAPTURE_BLOCK_SIZE - 1);
+        ((char *) slot->buf)[CAPTURE_BLOCK_SIZE - 1] = '\0';
+        writer->discard = false;
+        writer->opens_queued++;
+    }
+    slot->len = 1;    /* not empty: capture_writer_submit() must not reuse it */
+    writer->queued++;
+    COND_SIGNAL(writer->cond);
+}
+
+void
+capture_writer_open(capture_writer_t *writer, const char *filename)
+{
+    MUTEX_LOCK(writer->mutex);
+    capture_writer_queue_op(writer, CAPTURE_OPEN, filename);
+    MUTEX_UNLOCK(writer->mutex);
+}
+
+void
+capture_writer_close(capture_writer_t *writer)
+{
+    MUTEX_LOCK(writer->mutex);
+    capture_writer_queue_op(writer, CAPTURE_CLOSE, NULL);
+    MUTEX_UNLOCK(writer->mutex);
+}
+
+bool
+capture_writer_write(capture_writer_t *writer, const void *data, size_t len)
+{
+    const unsigned char *src = data;
+
+    MUTEX_LOCK(writer->mutex);
+    capture_slot_t *slot = &writer->slots[(writer->head + writer->queued) % CAPTURE_SLOTS];
+    size_t space = CAPTURE_BLOCK_SIZE - slot->len;
+    size_t extra_slots = (len > space ? (len - space + CAPTURE_BLOCK_SIZE - 1) / CAPTURE_BLOCK_SIZE : 0);
+
+    /* all or nothing: a partly written frame would corrupt the capture */
+    if (writer->discard || writer->queued + 1 + extra_slots > CAPTURE_SLOTS) {
+        if (writer->dropped++ % 1000 == 0) {
+            logger_log(writer->logger, LOGGER_WARNING, "capture: disk not keeping up, dropping data "
+                       "(%llu writes dropped, %d blocks queued)", (unsigned long long) writer->dropped, writer->queued);
+        }
+        MUTEX_UNLOCK(writer->mutex);
+        return false;
+    }
+    while (len) {
+        size_t n = CAPTURE_BLOCK_SIZE - slot->len;
+        n = (n < len ? n : len);
+        memcpy(slot->buf + slot->len, src, n);
+        slot->len += n;
+        src += n;
+        len -= n;
+        if (slot->len == CAPTURE_BLOCK_SIZE) {
+            capture_writer_submit(writer);
+            slot = &writer->slots[(writer->head + writer->queued) % CAPTURE_SLOTS];
+        }
+    }
+    /* low-rate streams (audio) should not sit in memory for long */
+    if (slot->len && time(NULL) - writer->last_submit >= CAPTURE_MAX_DELAY) {
+        capture_writer_submit(writer);
+    }
+    MUTEX_UNLOCK(writer->mutex);
+    return true;
+}
+
+bool
+capture_writer_rotation_due(capture_writer_t *writer)
+{
+    MUTEX_LOCK(writer->mutex);
+    bool due = writer->rotation_due && writer->opens_done == writer->opens_queued;
+    MUTEX_UNLOCK(writer->mutex);
+    return due;
+}
+
+void
+capture_writer_get_stats(capture_writer_t *writer, unsigned int *backlog, uint64_t *dropped)
+{
+    MUTEX_LOCK(writer->mutex);
+    *backlog = (unsigned int) writer->queued;
+    *dropped = writer->dropped;
+    MUTEX_UNLOCK(writer->mutex);
+}
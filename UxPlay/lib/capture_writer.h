@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Asynchronous file writer for the raw capture (dump) options.  Data is
+ * copied into a preallocated ring of blocks and written by an io thread;
+ * callers never wait for the disk.  If the ring is full, the data is
+ * dropped and counted. */
+
+#ifndef CAPTURE_WRITER_H
+#define CAPTURE_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct capture_writer_s capture_writer_t;
+
+/* max_file_bytes, max_file_secs: capture_writer_rotation_due() becomes true when the
+ * current file reaches either limit (0 = no limit) */
+capture_writer_t *capture_writer_init(logger_t *logger, uint64_t max_file_bytes, unsigned int max_file_secs);
+void capture_writer_destroy(capture_writer_t *writer);   /* writes out everything queued */
+
+/* queued in order with the data: following writes go to the new file */
+void capture_writer_open(capture_writer_t *writer, const char *filename);
+void capture_writer_close(capture_writer_t *writer);
+
+/* returns false if the data was dropped because the disk is not keeping up */
+bool capture_writer_write(capture_writer_t *writer, const void *data, size_t len);
+
+/* the current file has reached its size or time limit: the caller should open a
+ * new one at the next point where the stream can be split */
+bool capture_writer_rotation_due(capture_writer_t *writer);
+
+/* back-pressure: blocks waiting for the io thread, and writes dropped so far */
+void capture_writer_get_stats(capture_writer_t *writer, unsigned int *backlog, uint64_t *dropped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CAPTURE_WRITER_H
@@ -577,5 +577,6 @@ void pk_to_base64(const unsigned char *pk, int pk_len, char *pk_base64, int len)
     BIO_set_close(bio, BIO_NOCLOSE);
     BIO_free_all(bio);
     memcpy(pk_base64,(*bufferPtr).data, len64);
+    BUF_MEM_free(bufferPtr);
 }
   
@@ -28,6 +28,8 @@
 #include "compat.h"
 #include "logger.h"
 #include "utils.h"
+#include "trace.h"
+#include "thread_policy.h"
 
 static const char *typename[] = {
     [CONNECTION_TYPE_UNKNOWN] = "Unknown",
@@ -55,6 +57,7 @@ struct httpd_s {
     int open_connections;
     http_connection_t *connections;
     char nohold;
+    char loopback;           /* listen on 127.0.0.1 and ::1 only */
 
     /* These variables only edited mutex locked */
     int running;
@@ -287,6 +290,23 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     return 1;
 }
 
+void
+httpd_set_loopback(httpd_t *httpd) {
+    httpd->loopback = 1;
+}
+
+int
+httpd_set_max_connections(httpd_t *httpd, int max_connections) {
+    http_connection_t *connections = calloc(max_connections, sizeof(http_connection_t));
+    if (!connections) {
+        return -1;
+    }
+    free(httpd->connections);
+    httpd->connections = connections;
+    httpd->max_connections = max_connections;
+    return 0;
+}
+
 bool
 httpd_nohold(httpd_t *httpd) {
     return (httpd->nohold ? true: false);
@@ -313,6 +333,8 @@ httpd_thread(void *arg)
 
     bool logger_debug = (logger_get_level(httpd->logger) >= LOGGER_DEBUG);
     assert(httpd);
+    trace_thread_name("httpd");
+    thread_policy_apply(THREAD_CLASS_HTTPD, "httpd");
 
     while (1) {
         fd_set rfds;
@@ -591,13 +613,15 @@ httpd_start(httpd_t *httpd, unsigned short *port)
         return 0;
     }
 
-    httpd->server_fd4 = netutils_init_socket(port, 0, 0);
+    int (*init_socket)(unsigned short *, int, int) =
+        (httpd->loopback ? netutils_init_loopback_socket : netutils_init_socket);
+    httpd->server_fd4 = init_socket(port, 0, 0);
     if (httpd->server_fd4 == -1) {
         logger_log(httpd->logger, LOGGER_ERR, "Error initialising socket %d", SOCKET_GET_ERROR());
         MUTEX_UNLOCK(httpd->run_mutex);
         return -1;
     }
-    httpd->server_fd6 = netutils_init_socket(port, 1, 0);
+    httpd->server_fd6 = init_socket(port, 1, 0);
         if (httpd->server_fd6 == -1) {
             logger_log(httpd->logger, LOGGER_WARNING, "Error initialising IPv6 socket %d", SOCKET_GET_ERROR());
             logger_log(httpd->logger, LOGGER_WARNING, "Continuing without IPv6 support");
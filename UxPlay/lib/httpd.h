@@ -38,6 +38,8 @@ struct httpd_callbacks_s {
 };
 typedef struct httpd_callbacks_s httpd_callbacks_t;
 bool httpd_nohold(httpd_t *httpd);
+void httpd_set_loopback(httpd_t *httpd);    /* call before httpd_start() */
+int httpd_set_max_connections(httpd_t *httpd, int max_connections);   /* call before httpd_start() */
 void httpd_remove_known_connections(httpd_t *httpd);
 
 int httpd_set_connection_type (httpd_t *http, void *user_data, connection_type_t type);
@@ -18,38 +18,130 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <assert.h>
 
 #include "logger.h"
 #include "compat.h"
+#include "thread_policy.h"
+
+/* Messages at LOGGER_NOTICE and below in severity (INFO, DEBUG) are formatted by the
+ * caller into a preallocated ring and delivered by a background thread, so that
+ * debug logging on the streaming threads never waits for the terminal.  More severe
+ * messages are delivered synchronously, after everything queued before them, so they
+ * are never lost if the program exits.  If the ring is full, queued messages are
+ * dropped and the number dropped is reported. */
+#define LOGGER_SLOTS 128
+#define LOGGER_ASYNC_LEVEL LOGGER_NOTICE
+
+typedef struct logger_msg_s {
+	int level;
+	char msg[LOGGER_MSG_SIZE];
+} logger_msg_t;
 
 struct logger_s {
-	mutex_handle_t lvl_mutex;
 	mutex_handle_t cb_mutex;
 
-	int level;
+	atomic_int level;
 	void *cls;
 	logger_callback_t callback;
+
+	thread_handle_t thread;
+	mutex_handle_t queue_mutex;
+	cond_handle_t queue_cond;
+	cond_handle_t drained_cond;
+
+	/* MUTEX LOCKED VARIABLES (queue_mutex) START */
+	logger_msg_t *slots;
+	int head;
+	int queued;
+	bool running;
+	unsigned long dropped;
+	/* MUTEX LOCKED VARIABLES END */
 };
 
+static void logger_write(logger_t *logger, int level, const char *msg);
+
+static THREAD_RETVAL
+logger_thread(void *arg)
+{
+	logger_t *logger = arg;
+	char notice[64];
+
+	thread_policy_set_name("logger");
+	MUTEX_LOCK(logger->queue_mutex);
+	while (logger->running || logger->queued) {
+		if (!logger->queued) {
+			pthread_cond_wait(&logger->queue_cond, &logger->queue_mutex);
+			continue;
+		}
+		logger_msg_t *slot = &logger->slots[logger->head];
+		unsigned long dropped = logger->dropped;
+		logger->dropped = 0;
+		MUTEX_UNLOCK(logger->queue_mutex);
+
+		if (dropped) {
+			snprintf(notice, sizeof(notice), "(logger: %lu messages dropped)", dropped);
+			logger_write(logger, LOGGER_WARNING, notice);
+		}
+		logger_write(logger, slot->level, slot->msg);
+
+		MUTEX_LOCK(logger->queue_mutex);
+		logger->head = (logger->head + 1) % LOGGER_SLOTS;
+		logger->queued--;
+		if (!logger->queued) {
+			/* several threads can be waiting to log synchronously */
+			pthread_cond_broadcast(&logger->drained_cond);
+		}
+	}
+	MUTEX_UNLOCK(logger->queue_mutex);
+	return 0;
+}
+
 logger_t *
 logger_init()
 {
 	logger_t *logger = calloc(1, sizeof(logger_t));
 	assert(logger);
 
-	MUTEX_CREATE(logger->lvl_mutex);
 	MUTEX_CREATE(logger->cb_mutex);
+	MUTEX_CREATE(logger->queue_mutex);
+	COND_CREATE(logger->queue_cond);
+	COND_CREATE(logger->drained_cond);
 
-	logger->level = LOGGER_WARNING;
+	atomic_init(&logger->level, LOGGER_WARNING);
 	logger->callback = NULL;
+
+	/* without the ring or the thread, every message is written synchronously */
+	logger->slots = malloc(LOGGER_SLOTS * sizeof(logger_msg_t));
+	if (logger->slots) {
+		logger->running = true;
+		THREAD_CREATE(logger->thread, logger_thread, logger);
+		if (!logger->thread) {
+			logger->running = false;
+		}
+	}
 	return logger;
 }
 
 void
 logger_destroy(logger_t *logger)
 {
-	MUTEX_DESTROY(logger->lvl_mutex);
+	MUTEX_LOCK(logger->queue_mutex);
+	bool was_running = logger->running;
+	logger->running = false;
+	COND_SIGNAL(logger->queue_cond);
+	MUTEX_UNLOCK(logger->queue_mutex);
+	if (was_running) {
+		/* delivers everything still queued */
+		THREAD_JOIN(logger->thread);
+	}
+	free(logger->slots);
+	COND_DESTROY(logger->queue_cond);
+	COND_DESTROY(logger->drained_cond);
+	MUTEX_DESTROY(logger->queue_mutex);
 	MUTEX_DESTROY(logger->cb_mutex);
 	free(logger);
 }
@@ -59,22 +151,15 @@ logger_set_level(logger_t *logger, int level)
 {
 	assert(logger);
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	logger->level = level;
-	MUTEX_UNLOCK(logger->lvl_mutex);
+	atomic_store_explicit(&logger->level, level, memory_order_relaxed);
 }
 
 int
 logger_get_level(logger_t *logger)
 {
-        int level;   
         assert(logger);
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	level = logger->level;
-	MUTEX_UNLOCK(logger->lvl_mutex);
-
-        return level;
+        return atomic_load_explicit(&logger->level, memory_order_relaxed);
 }
 
 void
@@ -121,21 +206,45 @@ logger_utf8_to_local(const char *str)
 void
 logger_log(logger_t *logger, int level, const char *fmt, ...)
 {
-	char buffer[4096];
+	char buffer[LOGGER_MSG_SIZE];
 	va_list ap;
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	if (level > logger->level) {
-		MUTEX_UNLOCK(logger->lvl_mutex);
+	if (level > atomic_load_explicit(&logger->level, memory_order_relaxed)) {
 		return;
 	}
-	MUTEX_UNLOCK(logger->lvl_mutex);
 
 	buffer[sizeof(buffer)-1] = '\0';
 	va_start(ap, fmt);
 	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
 	va_end(ap);
 
+	MUTEX_LOCK(logger->queue_mutex);
+	if (logger->running && !pthread_equal(pthread_self(), logger->thread)) {
+		if (level >= LOGGER_ASYNC_LEVEL) {
+			if (logger->queued == LOGGER_SLOTS) {
+				logger->dropped++;
+			} else {
+				logger_msg_t *slot = &logger->slots[(logger->head + logger->queued) % LOGGER_SLOTS];
+				slot->level = level;
+				memcpy(slot->msg, buffer, strlen(buffer) + 1);
+				logger->queued++;
+				COND_SIGNAL(logger->queue_cond);
+			}
+			MUTEX_UNLOCK(logger->queue_mutex);
+			return;
+		}
+		/* keep the order: deliver the queued messages first */
+		while (logger->queued) {
+			pthread_cond_wait(&logger->drained_cond, &logger->queue_mutex);
+		}
+	}
+	MUTEX_UNLOCK(logger->queue_mutex);
+	logger_write(logger, level, buffer);
+}
+
+static void
+logger_write(logger_t *logger, int level, const char *buffer)
+{
 	MUTEX_LOCK(logger->cb_mutex);
 	if (logger->callback) {
 		logger->callback(logger->cls, level, buffer);
@@ -32,6 +32,9 @@ extern "C" {
 #define LOGGER_INFO        6       /* informational */
 #define LOGGER_DEBUG       7       /* debug-level messages */
 
+/* longer messages are truncated */
+#define LOGGER_MSG_SIZE    4096
+
 typedef void (*logger_callback_t)(void *cls, int level, const char *msg);
 
 typedef struct logger_s logger_t;
@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* There is one pending slot per kind of job (clear, metadata, cover art):
+ * only the newest item of a kind matters, so a client that resends its art
+ * faster than the disk takes it just replaces the pending copy.  The worker
+ * takes the slots in that order, without the lock held while it works. */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "media_info.h"
+#include "compat.h"
+#include "crypto.h"
+#include "thread_policy.h"
+
+#define MEDIA_INFO_DIGEST_LEN 64    /* SHA-512 */
+#define MEDIA_INFO_HASH_CHARS 32    /* hex prefix of the digest shown to consumers */
+
+typedef struct media_info_tag_s {
+    const char *tag;
+    const char *name;    /* JSON key */
+    const char *label;   /* console output */
+} media_info_tag_t;
+
+/* UTF-8 string DMAP items (seen in Apple Music Radio and iTunes) */
+static const media_info_tag_t known_tags[] = {
+    { "minm", "title", "Title" },
+    { "asar", "artist", "Artist" },
+    { "asal", "album", "Album" },
+    { "asaa", "albumArtist", "Album artist" },
+    { "asgn", "genre", "Genre" },
+    { "ascp", "composer", "Composer" },
+    { "ascm", "comment", "Comment" },
+    { "ascn", "contentDescription", "Content description" },
+    { "asct", "category", "Category" },
+    { "asdt", "description", "Description" },
+    { "asfm", "format", "Format" },
+    { "asky", "keywords", "Keywords" },
+    { "aslc", "longDescription", "Long Content Description" },
+    { "assa", "sortArtist", "Sort Artist" },
+    { "assc", "sortComposer", "Sort Composer" },
+    { "assl", "sortAlbumArtist", "Sort Album artist" },
+    { "assn", "sortName", "Sort Name" },
+    { "asss", "sortSeries", "Sort Series" },
+    { "assu", "sortAlbum", "Sort Album" },
+};
+#define MEDIA_INFO_TAGS (int) (sizeof(known_tags) / sizeof(known_tags[0]))
+
+/* 95 byte png file with a 1x1 white square (single pixel): placeholder for coverart*/
+static const unsigned char empty_image[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,  0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,  0x01, 0x03, 0x00, 0x00, 0x00, 0x25, 0xdb, 0x56,
+    0xca, 0x00, 0x00, 0x00, 0x03, 0x50, 0x4c, 0x54,  0x45, 0x00, 0x00, 0x00, 0xa7, 0x7a, 0x3d, 0xda,
+    0x00, 0x00, 0x00, 0x01, 0x74, 0x52, 0x4e, 0x53,  0x00, 0x40, 0xe6, 0xd8, 0x66, 0x00, 0x00, 0x00,
+    0x0a, 0x49, 0x44, 0x41, 0x54, 0x08, 0xd7, 0x63,  0x60, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0xe2,
+    0x21, 0xbc, 0x33, 0x00, 0x00, 0x00, 0x00, 0x49,  0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82 };
+
+struct media_info_s {
+    logger_t *logger;
+    media_info_callbacks_t callbacks;
+    char *coverart_filename;
+    char *coverart_tmpname;
+
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool running;
+    bool clear_pending;
+    unsigned char *metadata;         /* pending DMAP listing item */
+    int metadata_len;
+    unsigned char *coverart;         /* pending image */
+    int coverart_len;
+    char *values[MEDIA_INFO_TAGS];   /* current metadata, by known_tags index */
+    int coverart_size;               /* of the image in the file; 0: none, or the placeholder */
+    char coverart_hash[MEDIA_INFO_HASH_CHARS + 1];
+    /* MUTEX LOCKED VARIABLES END */
+
+    /* worker thread only */
+    sha_ctx_t *sha;
+    unsigned char file_digest[MEDIA_INFO_DIGEST_LEN];
+    bool file_digest_valid;
+};
+
+static int
+media_info_parse_dmap_header(const unsigned char *header, char *tag, int *len)
+{
+    bool istag = true;
+    for (int i = 0; i < 4; i++) {
+        tag[i] = (char) header[i];
+        if (!isalpha((unsigned char) tag[i])) {
+            istag = false;
+        }
+    }
+    tag[4] = '\0';
+    *len = (int) (((uint32_t) header[4] << 24) | ((uint32_t) header[5] << 16) | ((uint32_t) header[6] << 8) | header[7]);
+    if (!istag || *len < 0) {
+        return 1;
+    }
+    return 0;
+}
+
+static int
+media_info_find_tag(const char *tag)
+{
+    for (int i = 0; i < MEDIA_INFO_TAGS; i++) {
+        if (!strcmp(tag, known_tags[i].tag)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* decodes a DMAP "mlit" (listing item): a sequence of tag/length/data items */
+static void
+media_info_process_metadata(media_info_t *info, const unsigned char *metadata, int buflen)
+{
+    char dmap_tag[5];
+    int datalen;
+
+    if (buflen < 8) {
+        logger_log(info->logger, LOGGER_ERR, "received invalid metadata, length %d < 8", buflen);
+        return;
+    } else if (media_info_parse_dmap_header(metadata, dmap_tag, &datalen)) {
+        logger_log(info->logger, LOGGER_ERR, "received invalid metadata, tag [%s]  datalen %d", dmap_tag, datalen);
+        return;
+    }
+    metadata += 8;
+    buflen -= 8;
+    if (strcmp(dmap_tag, "mlit") != 0 || datalen != buflen) {
+        logger_log(info->logger, LOGGER_ERR, "received metadata with tag %s, but is not a DMAP listingitem, "
+                   "or datalen = %d !=  buflen %d", dmap_tag, datalen, buflen);
+        return;
+    }
+
+    media_info_item_t *items = (media_info_item_t *) calloc(buflen / 8 + 1, sizeof(media_info_item_t));
+    char *values[MEDIA_INFO_TAGS] = { NULL };
+    int n_items = 0;
+    assert(items);
+    while (buflen >= 8) {
+        media_info_item_t *item = &items[n_items];
+        if (media_info_parse_dmap_header(metadata, item->tag, &item->len)) {
+            logger_log(info->logger, LOGGER_ERR, "received metadata with invalid DMAP header:  tag = [%s],  "
+                       "datalen = %d", item->tag, item->len);
+            break;
+        }
+        metadata += 8;
+        buflen -= 8;
+        if (item->len > buflen) {
+            logger_log(info->logger, LOGGER_ERR, "received metadata item [%s] with datalen %d > %d remaining bytes",
+                       item->tag, item->len, buflen);
+            break;
+        }
+        item->data = metadata;
+        int index = media_info_find_tag(item->tag);
+        if (index >= 0) {
+            item->label = known_tags[index].label;
+            if (item->len) {
+                free(values[index]);
+                values[index] = (char *) calloc(1, item->len + 1);
+                assert(values[index]);
+                memcpy(values[index], item->data, item->len);
+            }
+        }
+        n_items++;
+        metadata += item->len;
+        buflen -= item->len;
+    }
+    if (buflen != 0) {
+        logger_log(info->logger, LOGGER_ERR, "%d bytes of metadata were not processed", buflen);
+    }
+
+    MUTEX_LOCK(info->mutex);
+    for (int i = 0; i < MEDIA_INFO_TAGS; i++) {
+        free(info->values[i]);
+        info->values[i] = values[i];
+    }
+    MUTEX_UNLOCK(info->mutex);
+
+    if (info->callbacks.metadata) {
+        info->callbacks.metadata(info->callbacks.cls, items, n_items);
+    }
+    free(items);
+}
+
+/* returns false if the image was the one already in the file */
+static bool
+media_info_write_coverart(media_info_t *info, const unsigned char *image, int len)
+{
+    unsigned char digest[MEDIA_INFO_DIGEST_LEN];
+    sha_reset(info->sha);
+    sha_update(info->sha, image, len);
+    sha_final(info->sha, digest, NULL);
+    if (info->file_digest_valid && !memcmp(digest, info->file_digest, sizeof(digest))) {
+        logger_log(info->logger, LOGGER_DEBUG, "coverart size %d is unchanged, not rewritten", len);
+        return false;
+    }
+
+    /* readers of the file see either the old image or the new one, never a partial write */
+    FILE *fp = fopen(info->coverart_tmpname, "wb");
+    bool ok = (fp != NULL);
+    if (fp) {
+        ok = (fwrite(image, 1, len, fp) == (size_t) len);
+        ok = (fclose(fp) == 0) && ok;
+    }
+#ifdef _WIN32
+    ok = ok && MoveFileExA(info->coverart_tmpname, info->coverart_filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && (rename(info->coverart_tmpname, info->coverart_filename) == 0);
+#endif
+    if (!ok) {
+        logger_log(info->logger, LOGGER_ERR, "could not write coverart to %s", info->coverart_filename);
+        remove(info->coverart_tmpname);
+        info->file_digest_valid = false;
+        return false;
+    }
+    memcpy(info->file_digest, digest, sizeof(digest));
+    info->file_digest_valid = true;
+
+    bool placeholder = (image == empty_image);
+    MUTEX_LOCK(info->mutex);
+    info->coverart_size = (placeholder ? 0 : len);
+    for (int i = 0; i < MEDIA_INFO_HASH_CHARS / 2; i++) {
+        snprintf(info->coverart_hash + 2 * i, 3, "%2.2x", digest[i]);
+    }
+    MUTEX_UNLOCK(info->mutex);
+    if (!placeholder) {
+        logger_log(info->logger, LOGGER_INFO, "coverart size %d written to %s", len, info->coverart_filename);
+    }
+    return true;
+}
+
+static THREAD_RETVAL
+media_info_thread(void *arg)
+{
+    media_info_t *info = arg;
+    assert(info);
+    thread_policy_apply(THREAD_CLASS_OTHER, "media_info");
+
+    MUTEX_LOCK(info->mutex);
+    while (1) {
+        bool clear = info->clear_pending;
+        unsigned char *metadata = info->metadata;
+        int metadata_len = info->metadata_len;
+        unsigned char *coverart = info->coverart;
+        int coverart_len = info->coverart_len;
+        if (!clear && !metadata && !coverart) {
+            if (!info->running) {
+                break;
+            }
+            pthread_cond_wait(&info->cond, &info->mutex);
+            continue;
+        }
+        info->clear_pending = false;
+        info->metadata = NULL;
+        info->coverart = NULL;
+        if (clear) {
+            for (int i = 0; i < MEDIA_INFO_TAGS; i++) {
+                free(info->values[i]);
+                info->values[i] = NULL;
+            }
+        }
+        MUTEX_UNLOCK(info->mutex);
+
+        bool changed = clear;
+        if (clear && info->coverart_filename) {
+            media_info_write_coverart(info, empty_image, sizeof(empty_image));
+        }
+        if (metadata) {
+            media_info_process_metadata(info, metadata, metadata_len);
+            free(metadata);
+            changed = true;
+        }
+        if (coverart) {
+            changed = media_info_write_coverart(info, coverart, coverart_len) || changed;
+            free(coverart);
+        }
+        if (changed && info->callbacks.changed) {
+            info->callbacks.changed(info->callbacks.cls);
+        }
+
+        MUTEX_LOCK(info->mutex);
+    }
+    MUTEX_UNLOCK(info->mutex);
+    return 0;
+}
+
+media_info_t *
+media_info_init(logger_t *logger, const char *coverart_filename, const media_info_callbacks_t *callbacks)
+{
+    media_info_t *info = (media_info_t *) calloc(1, sizeof(media_info_t));
+    if (!info) {
+        return NULL;
+    }
+    info->logger = logger;
+    if (callbacks) {
+        info->callbacks = *callbacks;
+    }
+    if (coverart_filename && *coverart_filename) {
+        size_t len = strlen(coverart_filename);
+        info->coverart_filename = strdup(coverart_filename);
+        info->coverart_tmpname = (char *) malloc(len + 5);
+        if (!info->coverart_filename || !info->coverart_tmpname) {
+            free(info->coverart_filename);
+            free(info->coverart_tmpname);
+            free(info);
+            return NULL;
+        }
+        snprintf(info->coverart_tmpname, len + 5, "%s.tmp", coverart_filename);
+    }
+    info->sha = sha_init();
+
+    MUTEX_CREATE(info->mutex);
+    COND_CREATE(info->cond);
+    info->running = true;
+    THREAD_CREATE(info->thread, media_info_thread, info);
+    if (!info->thread) {
+        info->running = false;
+        media_info_destroy(info);
+        return NULL;
+    }
+    return info;
+}
+
+void
+media_info_destroy(media_info_t *info)
+{
+    if (!info) {
+        return;
+    }
+    MUTEX_LOCK(info->mutex);
+    bool was_running = info->running;
+    info->running = false;
+    COND_SIGNAL(info->cond);
+    MUTEX_UNLOCK(info->mutex);
+    if (was_running) {
+        THREAD_JOIN(info->thread);
+    }
+    free(info->metadata);
+    free(info->coverart);
+    for (int i = 0; i < MEDIA_INFO_TAGS; i++) {
+        free(info->values[i]);
+    }
+    sha_destroy(info->sha);
+    COND_DESTROY(info->cond);
+    MUTEX_DESTROY(info->mutex);
+    free(info->coverart_filename);
+    free(info->coverart_tmpname);
+    free(info);
+}
+
+static void
+media_info_queue(media_info_t *info, unsigned char **slot, int *slot_len, const void *data, int len)
+{
+    if (len <= 0) {
+        return;
+    }
+    unsigned char *copy = (unsigned char *) malloc(len);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, data, len);
+    MUTEX_LOCK(info->mutex);
+    free(*slot);
+    *slot = copy;
+    *slot_len = len;
+    COND_SIGNAL(info->cond);
+    MUTEX_UNLOCK(info->mutex);
+}
+
+void
+media_info_set_metadata(media_info_t *info, const void *dmap, int len)
+{
+    media_info_queue(info, &info->metadata, &info->metadata_len, dmap, len);
+}
+
+void
+media_info_set_coverart(media_info_t *info, const void *image, int len)
+{
+    if (!info->coverart_filename) {
+        return;
+    }
+    media_info_queue(info, &info->coverart, &info->coverart_len, image, len);
+}
+
+void
+media_info_clear(media_info_t *info)
+{
+    MUTEX_LOCK(info->mutex);
+    /* anything still pending belongs to the previous session */
+    free(info->metadata);
+    info->metadata = NULL;
+    free(info->coverart);
+    info->coverart = NULL;
+    info->clear_pending = true;
+    COND_SIGNAL(info->cond);
+    MUTEX_UNLOCK(info->mutex);
+}
+
+static void
+media_info_append(char **json, size_t *len, size_t *size, const char *str, size_t n)
+{
+    if (*len + n + 1 > *size) {
+        size_t new_size = (*size ? 2 * *size : 256);
+        while (new_size < *len + n + 1) {
+            new_size *= 2;
+        }
+        char *new_json = (char *) realloc(*json, new_size);
+        assert(new_json);
+        *json = new_json;
+        *size = new_size;
+    }
+    memcpy(*json + *len, str, n);
+    *len += n;
+    (*json)[*len] = '\0';
+}
+
+static void
+media_info_append_string(char **json, size_t *len, size_t *size, const char *str)
+{
+    media_info_append(json, len, size, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+        char escaped[8];
+        if (*p == '"' || *p == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", *p);
+        } else if (*p < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%4.4x", *p);
+        } else {
+            media_info_append(json, len, size, (const char *) p, 1);
+            continue;
+        }
+        media_info_append(json, len, size, escaped, strlen(escaped));
+    }
+    media_info_append(json, len, size, "\"", 1);
+}
+
+char *
+media_info_get_json(media_info_t *info)
+{
+    char *json = NULL;
+    size_t len = 0, size = 0;
+    const char *sep = "";
+    media_info_append(&json, &len, &size, "{", 1);
+    MUTEX_LOCK(info->mutex);
+    for (int i = 0; i < MEDIA_INFO_TAGS; i++) {
+        if (!info->values[i]) {
+            continue;
+        }
+        media_info_append(&json, &len, &size, sep, strlen(sep));
+        media_info_append_string(&json, &len, &size, known_tags[i].name);
+        media_info_append(&json, &len, &size, ":", 1);
+        media_info_append_string(&json, &len, &size, info->values[i]);
+        sep = ",";
+    }
+    if (info->coverart_size) {
+        char coverart[128];
+        snprintf(coverart, sizeof(coverart), "%s\"coverart\":{\"size\":%d,\"hash\":\"%s\"}", sep,
+                 info->coverart_size, info->coverart_hash);
+        media_info_append(&json, &len, &size, coverart, strlen(coverart));
+    }
+    MUTEX_UNLOCK(info->mutex);
+    media_info_append(&json, &len, &size, "}", 1);
+    return json;
+}
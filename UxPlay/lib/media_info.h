@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* "Now playing" information of AirPlay audio sessions: the DMAP metadata and
+ * the cover art sent by the client are handed to a worker thread, which
+ * decodes the metadata, keeps it in memory, and writes the cover art to a
+ * file.  The file is replaced by an atomic rename, and only when the image
+ * content (SHA-512) differs from what the file already holds. */
+
+#ifndef MEDIA_INFO_H
+#define MEDIA_INFO_H
+
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct media_info_s media_info_t;
+
+typedef struct media_info_item_s {
+    char tag[5];                 /* DMAP tag, e.g. "minm" */
+    const char *label;           /* e.g. "Title"; NULL if not a string item UxPlay knows */
+    const unsigned char *data;
+    int len;
+} media_info_item_t;
+
+typedef struct media_info_callbacks_s {
+    void *cls;
+    /* a DMAP listing item was decoded; items are only valid during the call */
+    void (*metadata)(void *cls, const media_info_item_t *items, int n_items);
+    /* the metadata or the cover art changed (see media_info_get_json) */
+    void (*changed)(void *cls);
+} media_info_callbacks_t;
+
+/* coverart_filename: NULL if cover art is not wanted; callbacks run on the worker thread */
+media_info_t *media_info_init(logger_t *logger, const char *coverart_filename, const media_info_callbacks_t *callbacks);
+void media_info_destroy(media_info_t *info);   /* processes what is still pending */
+
+/* copy the data and return; a newer item of the same kind replaces one still pending */
+void media_info_set_metadata(media_info_t *info, const void *dmap, int len);
+void media_info_set_coverart(media_info_t *info, const void *image, int len);
+
+/* new audio session: forget the metadata, and put a blank placeholder in the cover-art file */
+void media_info_clear(media_info_t *info);
+
+/* malloc'd JSON object: known string items by name (e.g. "title", "artist", "album"),
+ * and "coverart": {"size", "hash"} of the image in the cover-art file, if any */
+char *media_info_get_json(media_info_t *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //MEDIA_INFO_H
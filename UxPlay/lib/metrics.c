@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "httpd.h"
+
+/* Threads are spread over the shards round-robin; with more threads than shards *
+ * two threads may share one, which only costs some cache line traffic.          */
+#define METRICS_SHARDS 16
+#define METRICS_CACHE_LINE 64
+#define METRICS_MAX_TEXT 8192    /* initial size of the scrape buffer, grown on demand */
+
+typedef enum metric_type_e { METRIC_COUNTER, METRIC_GAUGE } metric_type_t;
+
+typedef struct metric_desc_s {
+    const char *name;        /* metrics sharing a name form one family, and must be adjacent */
+    const char *labels;
+    metric_type_t type;
+    double scale;            /* applied when formatting (ns -> seconds) */
+    const char *help;
+} metric_desc_t;
+
+static const metric_desc_t metric_desc[METRIC_COUNT] = {
+    [METRIC_MIRROR_PACKETS] = {"uxplay_packets_received_total", "socket=\"mirror\"", METRIC_COUNTER, 1.0,
+                               "Packets received, per socket"},
+    [METRIC_AUDIO_PACKETS] = {"uxplay_packets_received_total", "socket=\"audio\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_CONTROL_PACKETS] = {"uxplay_packets_received_total", "socket=\"control\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_TIMING_PACKETS] = {"uxplay_packets_received_total", "socket=\"timing\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_MIRROR_BYTES] = {"uxplay_bytes_received_total", "socket=\"mirror\"", METRIC_COUNTER, 1.0,
+                             "Bytes received, per socket"},
+    [METRIC_AUDIO_BYTES] = {"uxplay_bytes_received_total", "socket=\"audio\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_CONTROL_BYTES] = {"uxplay_bytes_received_total", "socket=\"control\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_TIMING_BYTES] = {"uxplay_bytes_received_total", "socket=\"timing\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_VIDEO_DECRYPT_FAILURES] = {"uxplay_decrypt_failures_total", "stream=\"video\"", METRIC_COUNTER, 1.0,
+                                       "Packets that did not decrypt to valid media"},
+    [METRIC_AUDIO_DECRYPT_FAILURES] = {"uxplay_decrypt_failures_total", "stream=\"audio\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_RESEND_REQUESTS] = {"uxplay_audio_resend_requests_total", NULL, METRIC_COUNTER, 1.0,
+                                "Retransmission requests sent for missing audio packets"},
+    [METRIC_AUDIO_BUFFER_FLUSHES] = {"uxplay_audio_buffer_flushes_total", NULL, METRIC_COUNTER, 1.0,
+                                     "Flushes of the audio reordering buffer"},
+    [METRIC_WS_FRAMES_SENT] = {"uxplay_ws_frames_total", "result=\"sent\"", METRIC_COUNTER, 1.0,
+                               "Decoded video frames offered to the WebSocket consumer"},
+    [METRIC_WS_FRAMES_DROPPED] = {"uxplay_ws_frames_total", "result=\"dropped\"", METRIC_COUNTER, 1.0, NULL},
+    [METRIC_WS_BYTES_SENT] = {"uxplay_ws_bytes_sent_total", NULL, METRIC_COUNTER, 1.0,
+                              "Bytes written to the WebSocket consumer"},
+    [METRIC_HTTPD_CONNECTIONS_TOTAL] = {"uxplay_httpd_connections_total", NULL, METRIC_COUNTER, 1.0,
+                                        "Client connections accepted by the AirPlay server"},
+    [METRIC_CLIENT_DROPPED_FRAMES] = {"uxplay_client_dropped_frames_total", NULL, METRIC_COUNTER, 1.0,
+                                      "Mirror frames dropped by the client, from its streaming reports"},
+    [METRIC_RESTREAM_PACKETS] = {"uxplay_restream_packets_sent_total", NULL, METRIC_COUNTER, 1.0,
+                                 "RTP and RTCP packets sent to restream viewers (once per group with multicast)"},
+    [METRIC_RESTREAM_BYTES] = {"uxplay_restream_bytes_sent_total", NULL, METRIC_COUNTER, 1.0,
+                               "Bytes sent to restream viewers"},
+    [METRIC_VIDEO_CAPTURE_DROPPED] = {"uxplay_capture_dropped_writes_total", "stream=\"video\"", METRIC_COUNTER, 1.0,
+                                      "Writes to the -vdmp/-admp dump files dropped because the disk was too slow"},
+    [METRIC_AUDIO_CAPTURE_DROPPED] = {"uxplay_capture_dropped_writes_total", "stream=\"audio\"", METRIC_COUNTER, 1.0,
+                                      NULL},
+    [METRIC_NTP_OFFSET] = {"uxplay_ntp_offset_seconds", NULL, METRIC_GAUGE, 1e-9,
+                           "Clock offset from the client, from the last timing exchange"},
+    [METRIC_NTP_DELAY] = {"uxplay_ntp_delay_seconds", NULL, METRIC_GAUGE, 1e-9,
+                          "Round trip delay of the timing exchange"},
+    [METRIC_NTP_DISPERSION] = {"uxplay_ntp_dispersion_seconds", NULL, METRIC_GAUGE, 1e-9,
+                               "Estimated error of the clock offset"},
+    [METRIC_VIDEO_QUEUE_BYTES] = {"uxplay_appsrc_queued_bytes", "stream=\"video\"", METRIC_GAUGE, 1.0,
+                                  "Bytes waiting in the GStreamer input queue"},
+    [METRIC_AUDIO_QUEUE_BYTES] = {"uxplay_appsrc_queued_bytes", "stream=\"audio\"", METRIC_GAUGE, 1.0, NULL},
+    [METRIC_HTTPD_CONNECTIONS] = {"uxplay_httpd_connections", NULL, METRIC_GAUGE, 1.0,
+                                  "Open client connections to the AirPlay server"},
+    [METRIC_CLIENT_SENT_FPS] = {"uxplay_mirror_fps", "side=\"client_sent\"", METRIC_GAUGE, 1e-3,
+                                "Mirror frame rate sent by the client (streaming report) and received"},
+    [METRIC_RECEIVED_FPS] = {"uxplay_mirror_fps", "side=\"received\"", METRIC_GAUGE, 1e-3, NULL},
+    [METRIC_MIRROR_BITRATE] = {"uxplay_mirror_bitrate_bits_per_second", NULL, METRIC_GAUGE, 1.0,
+                               "Mirror stream bitrate received between two client streaming reports"},
+    [METRIC_MIRROR_ARRIVAL_DELAY] = {"uxplay_mirror_arrival_delay_seconds", NULL, METRIC_GAUGE, 1e-9,
+                                     "Average time from the client timestamp of a mirror frame to its arrival"},
+    [METRIC_CLIENT_ENCODE_LATENCY] = {"uxplay_client_encode_latency_seconds", NULL, METRIC_GAUGE, 1e-9,
+                                      "Encoder latency reported by the client"},
+    [METRIC_RESTREAM_VIEWERS] = {"uxplay_restream_viewers", NULL, METRIC_GAUGE, 1.0,
+                                 "Viewers playing the RTSP restream"},
+    [METRIC_VIDEO_CAPTURE_BACKLOG] = {"uxplay_capture_backlog_blocks", "stream=\"video\"", METRIC_GAUGE, 1.0,
+                                      "Dump file blocks waiting for the capture io thread"},
+    [METRIC_AUDIO_CAPTURE_BACKLOG] = {"uxplay_capture_backlog_blocks", "stream=\"audio\"", METRIC_GAUGE, 1.0, NULL},
+};
+
+typedef struct metrics_shard_s {
+    _Alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t counter[METRIC_COUNTERS];
+} metrics_shard_t;
+
+static metrics_shard_t shards[METRICS_SHARDS];
+static atomic_int_fast64_t gauges[METRIC_COUNT - METRIC_COUNTERS];
+static atomic_uint next_shard;
+static _Thread_local metrics_shard_t *thread_shard;
+
+static httpd_t *metrics_httpd = NULL;
+
+void
+metrics_add(metric_id_t id, uint64_t n)
+{
+    assert(id < METRIC_COUNTERS);
+    if (!thread_shard) {
+        thread_shard = &shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS];
+    }
+    atomic_fetch_add_explicit(&thread_shard->counter[id], n, memory_order_relaxed);
+}
+
+void
+metrics_set(metric_id_t id, int64_t value)
+{
+    assert(id >= METRIC_COUNTERS && id < METRIC_COUNT);
+    atomic_store_explicit(&gauges[id - METRIC_COUNTERS], value, memory_order_relaxed);
+}
+
+void
+metrics_gauge_add(metric_id_t id, int64_t n)
+{
+    assert(id >= METRIC_COUNTERS && id < METRIC_COUNT);
+    atomic_fetch_add_explicit(&gauges[id - METRIC_COUNTERS], n, memory_order_relaxed);
+}
+
+uint64_t
+metrics_get(metric_id_t id)
+{
+    if (id >= METRIC_COUNTERS) {
+        return (uint64_t) atomic_load_explicit(&gauges[id - METRIC_COUNTERS], memory_order_relaxed);
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        sum += atomic_load_explicit(&shards[i].counter[id], memory_order_relaxed);
+    }
+    return sum;
+}
+
+size_t
+metrics_format(char *buf, size_t len)
+{
+    size_t pos = 0;
+    const char *family = NULL;
+
+    if (len) buf[0] = '\0';
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        const metric_desc_t *desc = &metric_desc[id];
+        /* once the buffer is full, keep counting so the caller learns the size it needs */
+        char *out = (pos < len ? buf + pos : NULL);
+        size_t room = (pos < len ? len - pos : 0);
+        int ret;
+        if (!family || strcmp(family, desc->name)) {
+            family = desc->name;
+            ret = snprintf(out, room, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help,
+                           desc->name, (desc->type == METRIC_COUNTER ? "counter" : "gauge"));
+            if (ret < 0) break;
+            pos += (size_t) ret;
+            out = (pos < len ? buf + pos : NULL);
+            room = (pos < len ? len - pos : 0);
+        }
+        if (desc->type == METRIC_COUNTER) {
+            ret = snprintf(out, room, "%s%s%s%s %llu\n", desc->name, (desc->labels ? "{" : ""),
+                           (desc->labels ? desc->labels : ""), (desc->labels ? "}" : ""),
+                           (unsigned long long) metrics_get((metric_id_t) id));
+        } else {
+            int64_t value = (int64_t) metrics_get((metric_id_t) id);
+            ret = snprintf(out, room, "%s%s%s%s %.9g\n", desc->name, (desc->labels ? "{" : ""),
+                           (desc->labels ? desc->labels : ""), (desc->labels ? "}" : ""),
+                           (double) value * desc->scale);
+        }
+        if (ret < 0) break;
+        pos += (size_t) ret;
+    }
+    return pos;
+}
+
+/* the scrape endpoint: a second httpd instance that only answers GET /metrics */
+
+static void *
+metrics_conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote,
+                  int remotelen, unsigned int zone_id)
+{
+    return opaque;    /* the logger; no per-connection state is needed */
+}
+
+static void
+metrics_conn_request(void *ptr, http_request_t *request, http_response_t **response)
+{
+    logger_t *logger = ptr;
+    const char *method = http_request_get_method(request);
+    const char *url = http_request_get_url(request);
+    const char *protocol = http_request_get_protocol(request);
+
+    *response = http_response_create();
+    if (method && url && !strcmp(method, "GET") &&
+        (!strcmp(url, "/metrics") || !strncmp(url, "/metrics?", 9))) {
+        size_t size = METRICS_MAX_TEXT;
+        size_t text_len;
+        char *text = NULL;
+        /* values can grow between two passes, so retry until the whole text fits */
+        for (;;) {
+            char *grown = realloc(text, size);
+            if (!grown) {
+                free(text);
+                logger_log(logger, LOGGER_ERR, "metrics: failed to allocate %zu bytes", size);
+                http_response_init(*response, protocol, 500, "Internal Server Error");
+                http_response_finish(*response, NULL, 0);
+                return;
+            }
+            text = grown;
+            text_len = metrics_format(text, size);
+            if (text_len < size) break;
+            size = text_len + METRICS_MAX_TEXT;
+        }
+        http_response_init(*response, protocol, 200, "OK");
+        http_response_add_header(*response, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+        http_response_finish(*response, text, (int) text_len);
+        free(text);
+    } else {
+        logger_log(logger, LOGGER_DEBUG, "metrics: no handler for %s %s", method, url);
+        http_response_init(*response, protocol, 404, "Not Found");
+        http_response_finish(*response, NULL, 0);
+    }
+}
+
+static void
+metrics_conn_destroy(void *ptr)
+{
+}
+
+int
+metrics_server_start(logger_t *logger, unsigned short *port)
+{
+    httpd_callbacks_t callbacks;
+
+    if (metrics_httpd) {
+        return 0;
+    }
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.opaque = logger;
+    callbacks.conn_init = metrics_conn_init;
+    callbacks.conn_request = metrics_conn_request;
+    callbacks.conn_destroy = metrics_conn_destroy;
+
+    metrics_httpd = httpd_init(logger, &callbacks, 0);
+    if (!metrics_httpd) {
+        return -1;
+    }
+    httpd_set_loopback(metrics_httpd);
+    int ret = httpd_start(metrics_httpd, port);
+    if (ret != 1) {
+        httpd_destroy(metrics_httpd);
+        metrics_httpd = NULL;
+        return -1;
+    }
+    logger_log(logger, LOGGER_INFO, "metrics: serving http://127.0.0.1:%u/metrics", (unsigned int) *port);
+    return 0;
+}
+
+void
+metrics_server_stop()
+{
+    if (metrics_httpd) {
+        httpd_destroy(metrics_httpd);
+        metrics_httpd = NULL;
+    }
+}
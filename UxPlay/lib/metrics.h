@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Process-wide runtime metrics.  Counters are kept in per-thread shards, so
+ * metrics_add() is a relaxed atomic add on a cache line no other thread writes;
+ * the shards are only summed when the metrics are read.  Gauges hold the last
+ * value set.  metrics_server_start() serves them as Prometheus text on
+ * http://127.0.0.1:<port>/metrics */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* counters first, then gauges; metrics of one family (see metrics.c) must be adjacent */
+typedef enum metric_id_e {
+    METRIC_MIRROR_PACKETS,
+    METRIC_AUDIO_PACKETS,
+    METRIC_CONTROL_PACKETS,
+    METRIC_TIMING_PACKETS,
+    METRIC_MIRROR_BYTES,
+    METRIC_AUDIO_BYTES,
+    METRIC_CONTROL_BYTES,
+    METRIC_TIMING_BYTES,
+    METRIC_VIDEO_DECRYPT_FAILURES,
+    METRIC_AUDIO_DECRYPT_FAILURES,
+    METRIC_RESEND_REQUESTS,
+    METRIC_AUDIO_BUFFER_FLUSHES,
+    METRIC_WS_FRAMES_SENT,
+    METRIC_WS_FRAMES_DROPPED,
+    METRIC_WS_BYTES_SENT,
+    METRIC_HTTPD_CONNECTIONS_TOTAL,
+    METRIC_CLIENT_DROPPED_FRAMES,
+    METRIC_RESTREAM_PACKETS,
+    METRIC_RESTREAM_BYTES,
+    METRIC_VIDEO_CAPTURE_DROPPED,
+    METRIC_AUDIO_CAPTURE_DROPPED,
+    METRIC_COUNTERS,                     /* not a metric */
+    METRIC_NTP_OFFSET = METRIC_COUNTERS, /* gauges, in ns, bytes or 1/1000 frames per second */
+    METRIC_NTP_DELAY,
+    METRIC_NTP_DISPERSION,
+    METRIC_VIDEO_QUEUE_BYTES,
+    METRIC_AUDIO_QUEUE_BYTES,
+    METRIC_HTTPD_CONNECTIONS,
+    METRIC_CLIENT_SENT_FPS,
+    METRIC_RECEIVED_FPS,
+    METRIC_MIRROR_BITRATE,
+    METRIC_MIRROR_ARRIVAL_DELAY,
+    METRIC_CLIENT_ENCODE_LATENCY,
+    METRIC_RESTREAM_VIEWERS,
+    METRIC_VIDEO_CAPTURE_BACKLOG,
+    METRIC_AUDIO_CAPTURE_BACKLOG,
+    METRIC_COUNT
+} metric_id_t;
+
+void metrics_add(metric_id_t id, uint64_t n);
+void metrics_set(metric_id_t id, int64_t value);
+void metrics_gauge_add(metric_id_t id, int64_t n);
+uint64_t metrics_get(metric_id_t id);    /* counters are summed over all threads */
+
+/* Prometheus text exposition format; like snprintf, returns the full length, *
+ * which is >= len when the output was truncated                              */
+size_t metrics_format(char *buf, size_t len);
+
+/* start/stop the loopback-only scrape endpoint; *port is updated if it was 0 */
+int metrics_server_start(logger_t *logger, unsigned short *port);
+void metrics_server_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //METRICS_H
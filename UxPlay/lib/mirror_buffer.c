@@ -85,9 +85,16 @@ mirror_buffer_init(logger_t *logger, const unsigned char *aeskey)
 void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char* input, unsigned char* output, int inputLen) {
     // Start decrypting
     if (mirror_buffer->nextDecryptCount > 0) {//mirror_buffer->nextDecryptCount = 10
-        for (int i = 0; i < mirror_buffer->nextDecryptCount; i++) {
+        // never touch bytes past the payload: with in-place decryption they are the next frame
+        int leftover = (inputLen < mirror_buffer->nextDecryptCount ? inputLen : mirror_buffer->nextDecryptCount);
+        for (int i = 0; i < leftover; i++) {
             output[i] = (input[i] ^ mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i]);
         }
+        if (leftover < mirror_buffer->nextDecryptCount) {
+            // payload shorter than the unused keystream: keep the rest for the next payload
+            mirror_buffer->nextDecryptCount -= leftover;
+            return;
+        }
     }
     // Handling encrypted bytes
     int encryptlen = ((inputLen - mirror_buffer->nextDecryptCount) / 16) * 16;
@@ -95,8 +102,10 @@ void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char* input,
     aes_ctr_start_fresh_block(mirror_buffer->aes_ctx);
     aes_ctr_decrypt(mirror_buffer->aes_ctx, input + mirror_buffer->nextDecryptCount,
                     input + mirror_buffer->nextDecryptCount, encryptlen);
-    // Copy to output
-    memcpy(output + mirror_buffer->nextDecryptCount, input + mirror_buffer->nextDecryptCount, encryptlen);
+    // Copy to output (output may be input: decryption in place)
+    if (output != input) {
+        memcpy(output + mirror_buffer->nextDecryptCount, input + mirror_buffer->nextDecryptCount, encryptlen);
+    }
     // int outputlength = mirror_buffer->nextDecryptCount + encryptlen;
     // Processing remaining length
     int restlen = (inputLen - mirror_buffer->nextDecryptCount) % 16;
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* The buffer is used linearly: frames are parsed from start, recv() appends at
+ * end.  When the buffer is empty both go back to 0; otherwise only the
+ * incomplete frame at its tail is moved down, and only when it would not fit
+ * (or too little room is left for a useful recv), so with a buffer several
+ * IDR frames long most frames are never moved at all. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "mirror_reader.h"
+#include "byteutils.h"
+#include "compat.h"
+
+#define MIRROR_READER_MAX_PAYLOAD (64 * 1024 * 1024)
+#define MIRROR_READER_MIN_RECV (64 * 1024)
+
+#if defined(WIN32)
+#define CAST (char *)
+#else
+#define CAST
+#endif
+
+struct mirror_reader_s {
+    logger_t *logger;
+    unsigned char *buf;
+    size_t capacity;
+    size_t start;        /* first byte not yet returned as a frame */
+    size_t end;          /* end of the data received */
+    size_t frame_len;    /* length of the incomplete frame at start, once its header is in */
+};
+
+mirror_reader_t *
+mirror_reader_init(logger_t *logger, size_t capacity)
+{
+    mirror_reader_t *reader = calloc(1, sizeof(mirror_reader_t));
+    if (!reader) {
+        return NULL;
+    }
+    reader->logger = logger;
+    reader->capacity = (capacity > 2 * MIRROR_READER_MIN_RECV ? capacity : 2 * MIRROR_READER_MIN_RECV);
+    reader->buf = malloc(reader->capacity);
+    if (!reader->buf) {
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+void
+mirror_reader_destroy(mirror_reader_t *reader)
+{
+    if (reader) {
+        free(reader->buf);
+        free(reader);
+    }
+}
+
+void
+mirror_reader_reset(mirror_reader_t *reader)
+{
+    reader->start = 0;
+    reader->end = 0;
+    reader->frame_len = 0;
+}
+
+size_t
+mirror_reader_pending(mirror_reader_t *reader)
+{
+    return reader->end - reader->start;
+}
+
+/* make room for the rest of the incomplete frame, and for a recv of a useful size */
+static bool
+mirror_reader_make_room(mirror_reader_t *reader)
+{
+    size_t pending = reader->end - reader->start;
+    if (!pending) {
+        reader->start = reader->end = 0;
+        return true;
+    }
+    size_t needed = (reader->frame_len > pending ? reader->frame_len - pending : 0);
+    if (needed < MIRROR_READER_MIN_RECV) {
+        needed = MIRROR_READER_MIN_RECV;
+    }
+    if (reader->capacity - reader->end >= needed) {
+        return true;
+    }
+    if (pending + needed > reader->capacity) {
+        size_t capacity = reader->capacity;
+        while (capacity < pending + needed) {
+            capacity *= 2;
+        }
+        unsigned char *buf = malloc(capacity);
+        if (!buf) {
+            return false;
+        }
+        memcpy(buf, reader->buf + reader->start, pending);
+        free(reader->buf);
+        reader->buf = buf;
+        reader->capacity = capacity;
+        logger_log(reader->logger, LOGGER_DEBUG, "mirror_reader: buffer grown to %zu bytes", capacity);
+    } else {
+        memmove(reader->buf, reader->buf + reader->start, pending);
+    }
+    reader->start = 0;
+    reader->end = pending;
+    return true;
+}
+
+int
+mirror_reader_fill(mirror_reader_t *reader, int fd)
+{
+    assert(reader);
+    if (!mirror_reader_make_room(reader)) {
+        SOCKET_SET_ERROR(SOCKET_ERRORNAME(ENOMEM));
+        return -1;
+    }
+    int ret = recv(fd, CAST (reader->buf + reader->end), (int) (reader->capacity - reader->end), 0);
+    if (ret > 0) {
+        reader->end += (size_t) ret;
+    }
+    return ret;
+}
+
+int
+mirror_reader_next(mirror_reader_t *reader, mirror_frame_t *frame)
+{
+    assert(reader);
+    size_t available = reader->end - reader->start;
+    if (available < MIRROR_FRAME_HEADER_LEN) {
+        reader->frame_len = 0;
+        return 0;
+    }
+    unsigned char *header = reader->buf + reader->start;
+    int32_t payload_size = (int32_t) byteutils_get_int(header, 0);
+    if (payload_size < 0 || payload_size > MIRROR_READER_MAX_PAYLOAD) {
+        logger_log(reader->logger, LOGGER_ERR, "mirror_reader: invalid payload size %d", payload_size);
+        return -1;
+    }
+    reader->frame_len = MIRROR_FRAME_HEADER_LEN + (size_t) payload_size;
+    if (available < reader->frame_len) {
+        return 0;
+    }
+    frame->header = header;
+    frame->payload = header + MIRROR_FRAME_HEADER_LEN;
+    frame->payload_size = (int) payload_size;
+    reader->start += reader->frame_len;
+    reader->frame_len = 0;
+    return 1;
+}
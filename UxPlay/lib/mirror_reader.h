@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Framed reader for the mirror TCP stream (a 128-byte header, whose first four
+ * bytes are the little-endian payload size, then the payload).  Each
+ * mirror_reader_fill() is one recv() of whatever the socket has into a large
+ * buffer; mirror_reader_next() then hands out the complete frames it holds in
+ * place, without copying them. */
+
+#ifndef MIRROR_READER_H
+#define MIRROR_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIRROR_FRAME_HEADER_LEN 128
+
+typedef struct mirror_reader_s mirror_reader_t;
+
+typedef struct mirror_frame_s {
+    unsigned char *header;       /* MIRROR_FRAME_HEADER_LEN bytes */
+    unsigned char *payload;
+    int payload_size;
+} mirror_frame_t;
+
+/* capacity is the initial buffer size; it grows if a single frame is larger */
+mirror_reader_t *mirror_reader_init(logger_t *logger, size_t capacity);
+void mirror_reader_destroy(mirror_reader_t *reader);
+
+/* forget buffered data, for a new connection */
+void mirror_reader_reset(mirror_reader_t *reader);
+
+/* one recv() on a non-blocking socket: returns the bytes read, 0 if the peer
+ * closed the connection, or -1 (see SOCKET_GET_ERROR(); EAGAIN if there was
+ * nothing to read).  Frames returned earlier by mirror_reader_next() are
+ * invalidated. */
+int mirror_reader_fill(mirror_reader_t *reader, int fd);
+
+/* 1: *frame is the next complete frame; 0: more data is needed;
+ * -1: the header announces an impossible payload size (corrupt stream) */
+int mirror_reader_next(mirror_reader_t *reader, mirror_frame_t *frame);
+
+/* bytes of an incomplete frame that are buffered */
+size_t mirror_reader_pending(mirror_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //MIRROR_READER_H
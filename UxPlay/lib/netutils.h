@@ -19,6 +19,7 @@ int netutils_init();
 void netutils_cleanup();
 
 int netutils_init_socket(unsigned short *port, int use_ipv6, int use_udp);
+int netutils_init_loopback_socket(unsigned short *port, int use_ipv6, int use_udp);
 unsigned char *netutils_get_address(void *sockaddr, int *length, unsigned int *zone_id);
 int netutils_parse_address(int family, const char *src, void *dst, int dstlen);
 
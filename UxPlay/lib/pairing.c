@@ -24,6 +24,8 @@
 #include "pairing.h"
 #include "crypto.h"
 #include "srp.h"
+#include "threads.h"
+#include "thread_policy.h"
 
 #define SALT_KEY "Pair-Verify-AES-Key"
 #define SALT_IV "Pair-Verify-AES-IV"
@@ -33,10 +35,51 @@ typedef struct srp_s {
     unsigned char verifier[SRP_VERIFIER_SIZE];
     unsigned char session_key[SRP_SESSION_KEY_SIZE];
     unsigned char private_key[SRP_PRIVATE_KEY_SIZE];
+    const unsigned char *gb;     /* precomputed g^private_key, or NULL */
+    int len_gb;
 } srp_t;
 
+/* handshake material that does not depend on the client is precomputed by a *
+ * background thread, so that reconnecting clients do not wait for it         */
+#define PRECOMPUTED_ECDH_KEYS 4
+#define PRECOMPUTED_SRP_KEYS 2
+
+/* returning clients: a fixed-PIN SRP verifier is reused (as a server storing  *
+ * (salt, verifier) would)                                                     */
+#define CLIENT_CACHE_SIZE 8
+
+typedef struct srp_ephemeral_s {
+    unsigned char b[SRP_PRIVATE_KEY_SIZE];
+    const unsigned char *gb;       /* g^b mod N */
+    int len_gb;
+} srp_ephemeral_t;
+
+typedef struct client_cache_entry_s {
+    unsigned int last_used;        /* 0 = unused entry */
+    char device_id[SRP_USERNAME_SIZE + 1];
+    char pin[6];
+    bool has_verifier;
+    unsigned char salt[SRP_SALT_SIZE];
+    unsigned char verifier[SRP_VERIFIER_SIZE];
+} client_cache_entry_t;
+
 struct pairing_s {
     ed25519_key_t *ed;
+
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool running;
+    bool precompute_srp;           /* set once a client has used pair-setup-pin */
+    x25519_key_t *ecdh_keys[PRECOMPUTED_ECDH_KEYS];
+    int n_ecdh_keys;
+    srp_ephemeral_t srp_keys[PRECOMPUTED_SRP_KEYS];
+    int n_srp_keys;
+    client_cache_entry_t clients[CLIENT_CACHE_SIZE];
+    unsigned int cache_clock;
+    /* MUTEX LOCKED VARIABLES END */
 };
 
 typedef enum {
@@ -48,6 +91,7 @@ typedef enum {
 
 struct pairing_session_s {
     status_t status;
+    pairing_t *pairing;
 
     ed25519_key_t *ed_ours;
     ed25519_key_t *ed_theirs;
@@ -64,6 +108,13 @@ struct pairing_session_s {
     srp_t *srp;
 };
 
+static void
+srp_free(srp_t *srp)
+{
+    free((void *) srp->gb);
+    free(srp);
+}
+
 static int
 derive_key_internal(pairing_session_t *session, const unsigned char *salt, unsigned int saltlen, unsigned char *key, unsigned int keylen)
 {
@@ -83,6 +134,44 @@ derive_key_internal(pairing_session_t *session, const unsigned char *salt, unsig
     return 0;
 }
 
+static THREAD_RETVAL
+pairing_precompute_thread(void *arg)
+{
+    pairing_t *pairing = arg;
+    assert(pairing);
+    thread_policy_apply(THREAD_CLASS_OTHER, "pairing");
+
+    MUTEX_LOCK(pairing->mutex);
+    while (pairing->running) {
+        bool need_ecdh = (pairing->n_ecdh_keys < PRECOMPUTED_ECDH_KEYS);
+        bool need_srp = (pairing->precompute_srp && pairing->n_srp_keys < PRECOMPUTED_SRP_KEYS);
+        if (!need_ecdh && !need_srp) {
+            pthread_cond_wait(&pairing->cond, &pairing->mutex);
+            continue;
+        }
+        MUTEX_UNLOCK(pairing->mutex);
+
+        x25519_key_t *ecdh_key = NULL;
+        srp_ephemeral_t srp_key = { 0 };
+        if (need_ecdh) {
+            ecdh_key = x25519_key_generate();
+        } else {
+            get_random_bytes(srp_key.b, SRP_PRIVATE_KEY_SIZE);
+            srp_create_server_ephemeral_base(SRP_NG, srp_key.b, SRP_PRIVATE_KEY_SIZE,
+                                             &srp_key.gb, &srp_key.len_gb, NULL, NULL);
+        }
+
+        MUTEX_LOCK(pairing->mutex);
+        if (ecdh_key) {
+            pairing->ecdh_keys[pairing->n_ecdh_keys++] = ecdh_key;
+        } else if (srp_key.gb) {
+            pairing->srp_keys[pairing->n_srp_keys++] = srp_key;
+        }
+    }
+    MUTEX_UNLOCK(pairing->mutex);
+    return 0;
+}
+
 pairing_t *
 pairing_init_generate(const char *device_id, const char *keyfile, int *result)
 {
@@ -95,9 +184,68 @@ pairing_init_generate(const char *device_id, const char *keyfile, int *result)
 
     pairing->ed = ed25519_key_generate(device_id, keyfile, result);
 
+    MUTEX_CREATE(pairing->mutex);
+    COND_CREATE(pairing->cond);
+    pairing->running = true;
+    THREAD_CREATE(pairing->thread, pairing_precompute_thread, pairing);
+    if (!pairing->thread) {
+        /* not fatal: handshake material is then computed when needed */
+        pairing->running = false;
+    }
+
     return pairing;
 }
 
+/* precomputed key if one is ready, otherwise a new one */
+static x25519_key_t *
+pairing_get_ecdh_key(pairing_t *pairing)
+{
+    x25519_key_t *key = NULL;
+    MUTEX_LOCK(pairing->mutex);
+    if (pairing->n_ecdh_keys) {
+        key = pairing->ecdh_keys[--pairing->n_ecdh_keys];
+        COND_SIGNAL(pairing->cond);
+    }
+    MUTEX_UNLOCK(pairing->mutex);
+    return (key ? key : x25519_key_generate());
+}
+
+/* returns false (and enables precomputation for next time) if none is ready */
+static bool
+pairing_get_srp_ephemeral(pairing_t *pairing, srp_ephemeral_t *srp_key)
+{
+    bool found = false;
+    MUTEX_LOCK(pairing->mutex);
+    pairing->precompute_srp = true;
+    if (pairing->n_srp_keys) {
+        *srp_key = pairing->srp_keys[--pairing->n_srp_keys];
+        found = true;
+    }
+    COND_SIGNAL(pairing->cond);
+    MUTEX_UNLOCK(pairing->mutex);
+    return found;
+}
+
+/* called with mutex locked; returns the least recently used entry if there is no match */
+static client_cache_entry_t *
+pairing_cache_find(pairing_t *pairing, const char *device_id, bool *found)
+{
+    client_cache_entry_t *oldest = &pairing->clients[0];
+    for (int i = 0; i < CLIENT_CACHE_SIZE; i++) {
+        client_cache_entry_t *entry = &pairing->clients[i];
+        if (entry->last_used && !strcmp(entry->device_id, device_id)) {
+            *found = true;
+            entry->last_used = ++pairing->cache_clock;
+            return entry;
+        }
+        if (entry->last_used < oldest->last_used) {
+            oldest = entry;
+        }
+    }
+    *found = false;
+    return oldest;
+}
+
 void
 pairing_get_public_key(pairing_t *pairing, unsigned char public_key[ED25519_KEY_SIZE])
 {
@@ -133,6 +281,7 @@ pairing_session_init(pairing_t *pairing)
     }
 
     session->ed_ours = ed25519_key_copy(pairing->ed);
+    session->pairing = pairing;
 
     session->status = STATUS_INITIAL;
     session->srp = NULL;
@@ -173,7 +322,7 @@ pairing_session_handshake(pairing_session_t *session, const unsigned char ecdh_k
     session->ecdh_theirs = x25519_key_from_raw(ecdh_key);
     session->ed_theirs = ed25519_key_from_raw(ed_key);
 
-    session->ecdh_ours = x25519_key_generate();
+    session->ecdh_ours = pairing_get_ecdh_key(session->pairing);
 
     x25519_derive_secret(session->ecdh_secret, session->ecdh_ours, session->ecdh_theirs);
 
@@ -273,7 +422,7 @@ pairing_session_destroy(pairing_session_t *session)
         x25519_key_destroy(session->ecdh_ours);
         x25519_key_destroy(session->ecdh_theirs);
         if (session->srp) {
-            free(session->srp);
+            srp_free(session->srp);
             session->srp = NULL;
         }
         free(session);
@@ -284,6 +433,23 @@ void
 pairing_destroy(pairing_t *pairing)
 {
     if (pairing) {
+        MUTEX_LOCK(pairing->mutex);
+        bool was_running = pairing->running;
+        pairing->running = false;
+        COND_SIGNAL(pairing->cond);
+        MUTEX_UNLOCK(pairing->mutex);
+        if (was_running) {
+            THREAD_JOIN(pairing->thread);
+        }
+        for (int i = 0; i < pairing->n_ecdh_keys; i++) {
+            x25519_key_destroy(pairing->ecdh_keys[i]);
+        }
+        for (int i = 0; i < pairing->n_srp_keys; i++) {
+            free((void *) pairing->srp_keys[i].gb);
+        }
+        memset(pairing->clients, 0, sizeof(pairing->clients));
+        COND_DESTROY(pairing->cond);
+        MUTEX_DESTROY(pairing->mutex);
         ed25519_key_destroy(pairing->ed);
         free(pairing);
     }
@@ -315,7 +481,7 @@ srp_new_user(pairing_session_t *session, pairing_t *pairing, const char *device_
     strncpy(session->username, device_id, SRP_USERNAME_SIZE);
     
     if (session->srp) {
-        free (session->srp);
+        srp_free(session->srp);
         session->srp = NULL;
     }
     session->srp = (srp_t *) calloc(1, sizeof(srp_t));
@@ -323,7 +489,14 @@ srp_new_user(pairing_session_t *session, pairing_t *pairing, const char *device_
         return -2;
     }
 
-    get_random_bytes(session->srp->private_key, SRP_PRIVATE_KEY_SIZE);
+    srp_ephemeral_t srp_key = { 0 };
+    if (pairing_get_srp_ephemeral(pairing, &srp_key)) {
+        memcpy(session->srp->private_key, srp_key.b, SRP_PRIVATE_KEY_SIZE);
+        session->srp->gb = srp_key.gb;
+        session->srp->len_gb = srp_key.len_gb;
+    } else {
+        get_random_bytes(session->srp->private_key, SRP_PRIVATE_KEY_SIZE);
+    }
     
     const unsigned char *srp_b = session->srp->private_key;
     unsigned char * srp_B;
@@ -333,24 +506,53 @@ srp_new_user(pairing_session_t *session, pairing_t *pairing, const char *device_
     int len_B;
     int len_s;
     int len_v;
-    srp_create_salted_verification_key(SRP_SHA, SRP_NG, device_id,
-                                       (const unsigned char *) pin, strlen (pin),
-                                       (const unsigned char **) &srp_s, &len_s,
-                                       (const unsigned char **) &srp_v, &len_v,
-                                       NULL, NULL);
-    if (len_s != SRP_SALT_SIZE || len_v != SRP_VERIFIER_SIZE) {
-        return -3;
-    }
 
-    memcpy(session->srp->salt, srp_s, SRP_SALT_SIZE);
-    memcpy(session->srp->verifier, srp_v, SRP_VERIFIER_SIZE);
+    /* the verifier only depends on device_id, pin and salt: reuse it for a returning client */
+    bool found;
+    MUTEX_LOCK(pairing->mutex);
+    client_cache_entry_t *entry = pairing_cache_find(pairing, device_id, &found);
+    if (found && entry->has_verifier && !strcmp(entry->pin, pin)) {
+        memcpy(session->srp->salt, entry->salt, SRP_SALT_SIZE);
+        memcpy(session->srp->verifier, entry->verifier, SRP_VERIFIER_SIZE);
+        MUTEX_UNLOCK(pairing->mutex);
+    } else {
+        MUTEX_UNLOCK(pairing->mutex);
+        srp_create_salted_verification_key(SRP_SHA, SRP_NG, device_id,
+                                           (const unsigned char *) pin, strlen (pin),
+                                           (const unsigned char **) &srp_s, &len_s,
+                                           (const unsigned char **) &srp_v, &len_v,
+                                           NULL, NULL);
+        if (len_s != SRP_SALT_SIZE || len_v != SRP_VERIFIER_SIZE) {
+            free(srp_s);
+            free(srp_v);
+            return -3;
+        }
+        memcpy(session->srp->salt, srp_s, SRP_SALT_SIZE);
+        memcpy(session->srp->verifier, srp_v, SRP_VERIFIER_SIZE);
+        free(srp_s);
+        free(srp_v);
+
+        MUTEX_LOCK(pairing->mutex);
+        entry = pairing_cache_find(pairing, device_id, &found);
+        if (!found) {
+            memset(entry, 0, sizeof(client_cache_entry_t));
+            entry->last_used = ++pairing->cache_clock;
+            strncpy(entry->device_id, device_id, SRP_USERNAME_SIZE);
+        }
+        strncpy(entry->pin, pin, sizeof(entry->pin) - 1);
+        memcpy(entry->salt, session->srp->salt, SRP_SALT_SIZE);
+        memcpy(entry->verifier, session->srp->verifier, SRP_VERIFIER_SIZE);
+        entry->has_verifier = true;
+        MUTEX_UNLOCK(pairing->mutex);
+    }
 
     *salt = (char *) session->srp->salt;
-    *len_salt = len_s;
+    *len_salt = SRP_SALT_SIZE;
 
     srp_create_server_ephemeral_key(SRP_SHA, SRP_NG,
-                                    srp_v, len_v,
+                                    session->srp->verifier, SRP_VERIFIER_SIZE,
                                     srp_b, len_b,
+                                    session->srp->gb, session->srp->len_gb,
                                     (const unsigned char **) &srp_B, &len_B,
                                     NULL, NULL, 1);
 
@@ -377,6 +579,7 @@ srp_validate_proof(pairing_session_t *session, pairing_t *pairing, const unsigne
                                                     (const unsigned char *) session->srp->verifier, SRP_VERIFIER_SIZE,
                                                     A, len_A,
                                                     b, len_b,
+                                                    session->srp->gb, session->srp->len_gb,
                                                     &B, &len_B, NULL, NULL, 1);
 
     srp_verifier_verify_session(verifier, proof, &M2);
@@ -384,7 +587,7 @@ srp_validate_proof(pairing_session_t *session, pairing_t *pairing, const unsigne
     if (authenticated == 0) {
         /* HTTP 470 should be sent to client if not verified.*/
         srp_verifier_delete(verifier);
-        free (session->srp);
+        srp_free(session->srp);
         session->srp = NULL;
         return -1;
     }
@@ -424,7 +627,7 @@ srp_confirm_pair_setup(pairing_session_t *session, pairing_t *pairing,
     aesIV[15]++;
 
     /* SRP6a data is no longer needed */
-    free(session->srp);
+    srp_free(session->srp);
     session->srp = NULL;
 
     /* decrypt client epk to authenticate client using auth_tag */
@@ -13,6 +13,7 @@
  *  Lesser General Public License for more details.
  */
 
+#include <stdbool.h>
 #include "crypto.h"
 
 #ifndef PAIRING_H
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "raop.h"
 #include "raop_rtp.h"
@@ -32,6 +33,10 @@
 #include "compat.h"
 #include "raop_rtp_mirror.h"
 #include "raop_ntp.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define SECOND_IN_NSECS 1000000000UL
 
 struct raop_s {
     /* Callbacks for audio and video */
@@ -66,6 +71,9 @@ struct raop_s {
     int audio_delay_micros;
     int max_ntp_timeouts;
 
+    /* busy-poll the mirror stream socket for this long after data (0: off) */
+    unsigned int mirror_busy_poll_us;
+
      /* for temporary storage of pin during pair-pin start */
      unsigned short pin;
      bool use_pin;
@@ -80,6 +88,15 @@ struct raop_s {
      bool hls_support;
 };
 
+typedef enum setup_step_e {
+    SETUP_STEP_PAIR_SETUP,      /* pair-setup and pair-setup-pin */
+    SETUP_STEP_PAIR_VERIFY,
+    SETUP_STEP_FP_SETUP,
+    SETUP_STEP_SETUP,
+    SETUP_STEP_OTHER,
+    SETUP_STEPS
+} setup_step_t;
+
 struct raop_conn_s {
     raop_t *raop;
     raop_ntp_t *raop_ntp;
@@ -102,12 +119,55 @@ struct raop_conn_s {
     char *client_session_id;
 
     bool have_active_remote;
+
+    /* time spent in the handlers until streaming starts (RECORD) */
+    uint64_t setup_start;
+    uint64_t setup_time[SETUP_STEPS];
+    bool setup_reported;
 };
 typedef struct raop_conn_s raop_conn_t;
 
 #include "raop_handlers.h"
 #include "http_handlers.h"
 
+static uint64_t
+conn_time_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+/* accounts the time a handler took; the breakdown is logged when streaming starts */
+static void
+conn_setup_timing(raop_conn_t *conn, raop_handler_t handler, const char *method, const char *url, uint64_t elapsed) {
+    setup_step_t step = SETUP_STEP_OTHER;
+    if (handler == &raop_handler_pairsetup || handler == &raop_handler_pairsetup_pin) {
+        step = SETUP_STEP_PAIR_SETUP;
+    } else if (handler == &raop_handler_pairverify) {
+        step = SETUP_STEP_PAIR_VERIFY;
+    } else if (handler == &raop_handler_fpsetup) {
+        step = SETUP_STEP_FP_SETUP;
+    } else if (handler == &raop_handler_setup) {
+        step = SETUP_STEP_SETUP;
+    }
+    logger_log(conn->raop->logger, LOGGER_DEBUG, "%s %s handled in %.3f ms", method, url, (double) elapsed / 1e6);
+    if (conn->setup_reported) {
+        return;
+    }
+    conn->setup_time[step] += elapsed;
+    if (handler == &raop_handler_record) {
+        conn->setup_reported = true;
+        logger_log(conn->raop->logger, LOGGER_INFO, "connection setup: %.1f ms since connect; handlers: "
+                   "pair-setup %.1f ms, pair-verify %.1f ms, fp-setup %.1f ms, SETUP %.1f ms, other %.1f ms",
+                   (double) (conn_time_ns() - conn->setup_start) / 1e6,
+                   (double) conn->setup_time[SETUP_STEP_PAIR_SETUP] / 1e6,
+                   (double) conn->setup_time[SETUP_STEP_PAIR_VERIFY] / 1e6,
+                   (double) conn->setup_time[SETUP_STEP_FP_SETUP] / 1e6,
+                   (double) conn->setup_time[SETUP_STEP_SETUP] / 1e6,
+                   (double) conn->setup_time[SETUP_STEP_OTHER] / 1e6);
+    }
+}
+
 static void *
 conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen, unsigned int zone_id) {
     raop_t *raop = opaque;
@@ -120,6 +180,7 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
         return NULL;
     }
     conn->raop = raop;
+    conn->setup_start = conn_time_ns();
     conn->raop_rtp = NULL;
     conn->raop_rtp_mirror = NULL;
     conn->raop_ntp = NULL;
@@ -162,6 +223,8 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
 
 
     conn->have_active_remote = false;
+    metrics_add(METRIC_HTTPD_CONNECTIONS_TOTAL, 1);
+    metrics_gauge_add(METRIC_HTTPD_CONNECTIONS, 1);
     
     if (raop->callbacks.conn_init) {
         raop->callbacks.conn_init(raop->callbacks.cls);
@@ -407,7 +470,18 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     }
 
     if (handler != NULL) {
+        char trace_name[48];
+        const char *trace_cat = (cseq ? "rtsp" : "http");
+        if (trace_enabled()) {
+            snprintf(trace_name, sizeof(trace_name), "%s %s", method, url);
+            trace_begin(trace_cat, trace_name);
+        }
+        uint64_t handler_start = conn_time_ns();
         handler(conn, request, *response, &response_data, &response_datalen);
+        conn_setup_timing(conn, handler, method, url, conn_time_ns() - handler_start);
+        if (trace_enabled()) {
+            trace_end(trace_cat, trace_name);
+        }
     } else {
       logger_log(conn->raop->logger, LOGGER_INFO,
 		 "Unhandled Client Request: %s %s %s", method, url, protocol);
@@ -469,6 +543,7 @@ conn_destroy(void *ptr) {
     raop_conn_t *conn = ptr;
 
     logger_log(conn->raop->logger, LOGGER_DEBUG, "Destroying connection");
+    metrics_gauge_add(METRIC_HTTPD_CONNECTIONS, -1);
 
     if (conn->raop->callbacks.conn_destroy) {
         conn->raop->callbacks.conn_destroy(conn->raop->callbacks.cls);
@@ -556,6 +631,7 @@ raop_init(raop_callbacks_t *callbacks) {
 
     raop->max_ntp_timeouts = 0;
     raop->audio_delay_micros = 250000;
+    raop->mirror_busy_poll_us = 0;
 
     raop->hls_support = false;
 
@@ -670,6 +746,9 @@ int raop_set_plist(raop_t *raop, const char *plist_item, const int value) {
             raop->audio_delay_micros = value;
         }
         if (raop->audio_delay_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "mirror_busy_poll_us") == 0) {
+        raop->mirror_busy_poll_us = (unsigned int) (value > 0 ? value : 0);
+        if ((int) raop->mirror_busy_poll_us != value) retval = 1;
     } else if (strcmp(plist_item, "pin") == 0) {
         raop->pin = value;
         raop->use_pin = true;
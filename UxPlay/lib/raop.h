@@ -89,6 +89,10 @@ struct raop_callbacks_s {
     void  (*export_dacp) (void *cls, const char *active_remote, const char *dacp_id);
     void  (*video_reset) (void *cls);
     void  (*video_set_codec)(void *cls, video_codec_t codec);
+    void  (*video_report)(void *cls, video_report_struct *report);
+    /* display size and frame rate to advertise to a client (preset to the configured ones, may lower them);
+     * streaming: this connection already sends the stream being decoded */
+    void  (*video_get_display)(void *cls, bool streaming, uint16_t *width, uint16_t *height, uint8_t *max_fps);
     /* for HLS video player controls */
     void  (*on_video_play) (void *cls, const char *location, const float start_position);
     void  (*on_video_scrub) (void *cls, const float position);
@@ -32,6 +32,7 @@
 #include "global.h"
 #include "utils.h"
 #include "byteutils.h"
+#include "metrics.h"
 
 #define RAOP_BUFFER_LENGTH 32
 
@@ -293,6 +294,7 @@ void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t res
 
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq) {
     assert(raop_buffer);
+    metrics_add(METRIC_AUDIO_BUFFER_FLUSHES, 1);
 
     for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
         if (raop_buffer->entries[i].payload_data) {
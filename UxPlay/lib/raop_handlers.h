@@ -136,18 +136,31 @@ raop_handler_info(raop_conn_t *conn,
     plist_t mac_address_node = plist_new_string(hw_addr);
     plist_dict_set_item(res_node, "macAddress", mac_address_node);
 
+    /* what this client is invited to send may depend on the current load */
+    uint16_t width = conn->raop->width;
+    uint16_t height = conn->raop->height;
+    uint8_t max_fps = conn->raop->maxFPS;
+    if (conn->raop->callbacks.video_get_display) {
+        conn->raop->callbacks.video_get_display(conn->raop->callbacks.cls, (conn->raop_rtp_mirror != NULL),
+                                                &width, &height, &max_fps);
+    }
+    if (width != conn->raop->width || height != conn->raop->height || max_fps != conn->raop->maxFPS) {
+        logger_log(conn->raop->logger, LOGGER_INFO, "advertising display %ux%u maxFPS %u to this client (configured %ux%u maxFPS %u)",
+                   width, height, max_fps, conn->raop->width, conn->raop->height, conn->raop->maxFPS);
+    }
+
     plist_t displays_node = plist_new_array();
     plist_t displays_0_node = plist_new_dict();
     plist_t displays_0_width_physical_node = plist_new_uint(0);
     plist_t displays_0_height_physical_node = plist_new_uint(0);
     plist_t displays_0_uuid_node = plist_new_string("e0ff8a27-6738-3d56-8a16-cc53aacee925");
-    plist_t displays_0_width_node = plist_new_uint(conn->raop->width);
-    plist_t displays_0_height_node = plist_new_uint(conn->raop->height);
-    plist_t displays_0_width_pixels_node = plist_new_uint(conn->raop->width);
-    plist_t displays_0_height_pixels_node = plist_new_uint(conn->raop->height);
+    plist_t displays_0_width_node = plist_new_uint(width);
+    plist_t displays_0_height_node = plist_new_uint(height);
+    plist_t displays_0_width_pixels_node = plist_new_uint(width);
+    plist_t displays_0_height_pixels_node = plist_new_uint(height);
     plist_t displays_0_rotation_node = plist_new_bool(0); /* set to true in AppleTV gen 3 (which has features bit 8  set */
     plist_t displays_0_refresh_rate_node = plist_new_real((double) 1.0 / conn->raop->refreshRate);  /* set as real 0.166666  = 60hz in AppleTV gen 3 */
-    plist_t displays_0_max_fps_node = plist_new_uint(conn->raop->maxFPS);
+    plist_t displays_0_max_fps_node = plist_new_uint(max_fps);
     plist_t displays_0_overscanned_node = plist_new_bool(conn->raop->overscanned);
     plist_t displays_0_features = plist_new_uint(14);
 
@@ -783,7 +796,8 @@ raop_handler_setup(raop_conn_t *conn,
 
                     if (conn->raop_rtp_mirror) {
                         raop_rtp_mirror_init_aes(conn->raop_rtp_mirror, &stream_connection_id);
-                        raop_rtp_mirror_start(conn->raop_rtp_mirror, &dport, conn->raop->clientFPSdata);
+                        raop_rtp_mirror_start(conn->raop_rtp_mirror, &dport, conn->raop->clientFPSdata,
+                                              conn->raop->mirror_busy_poll_us);
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
                     } else {
                         logger_log(conn->raop->logger, LOGGER_ERR, "Mirroring not initialized at SETUP, playing will fail!");
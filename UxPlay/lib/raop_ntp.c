@@ -36,6 +36,9 @@
 #include "netutils.h"
 #include "byteutils.h"
 #include "utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
 
 #define SECOND_IN_NSECS 1000000000UL
 #define RAOP_NTP_DATA_COUNT   8
@@ -277,6 +280,8 @@ raop_ntp_thread(void *arg)
     int timeout_counter = 0;
     bool conn_reset = false;
     bool logger_debug = (logger_get_level(raop_ntp->logger) >= LOGGER_DEBUG);
+    trace_thread_name("raop_ntp");
+    thread_policy_apply(THREAD_CLASS_NTP, "raop_ntp");
       
     while (1) {
         MUTEX_LOCK(raop_ntp->run_mutex);
@@ -290,15 +295,16 @@ raop_ntp_thread(void *arg)
         raop_ntp_flush_socket(raop_ntp->tsock);
 
         // Send request
+        trace_begin("ntp", "exchange");
         uint64_t send_time = raop_ntp_get_local_time(raop_ntp);
         byteutils_put_ntp_timestamp(request, 24, send_time);
         int send_len = sendto(raop_ntp->tsock, (char *)request, sizeof(request), 0,
                               (struct sockaddr *) &raop_ntp->remote_saddr, raop_ntp->remote_saddr_len);
         if (logger_debug) {
-            char *str = utils_data_to_string(request, sizeof(request), 16);
+            char str[LOGGER_MSG_SIZE];
+            utils_data_to_buffer(request, sizeof(request), 16, str, sizeof(str));
             logger_log(raop_ntp->logger, LOGGER_DEBUG, "\nraop_ntp send time type_t=%d packetlen = %d, now = %8.6f\n%s",
                        request[1] &~0x80, sizeof(request), (double) send_time / SECOND_IN_NSECS, str);
-            free(str);
         }
         if (send_len < 0) {
             int sock_err = SOCKET_GET_ERROR();
@@ -316,12 +322,15 @@ raop_ntp_thread(void *arg)
                            timeout_counter, raop_ntp->max_ntp_timeouts, time);
                 if (timeout_counter ==  raop_ntp->max_ntp_timeouts) {
                     conn_reset = true;   /* client is no longer responding */
+                    trace_end("ntp", "exchange");
                     break;
                 }
 	    } else {
                 //local time of the server when the NTP response packet returns
                 int64_t t3 = (int64_t) raop_ntp_get_local_time(raop_ntp);
                 timeout_counter = 0;
+                metrics_add(METRIC_TIMING_PACKETS, 1);
+                metrics_add(METRIC_TIMING_BYTES, response_len);
 
                 // Local time of the server when the NTP request packet leaves the server
                 int64_t t0 = (int64_t) byteutils_get_ntp_timestamp(response, 8);
@@ -333,12 +342,12 @@ raop_ntp_thread(void *arg)
                 int64_t t2 = (int64_t) raop_remote_timestamp_to_nano_seconds(raop_ntp, byteutils_get_long_be(response, 24));
 
                 if (logger_debug) {
-                    char *str = utils_data_to_string(response, response_len, 16);                   
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(response, response_len, 16, str, sizeof(str));                   
                     logger_log(raop_ntp->logger, LOGGER_DEBUG,
                                "raop_ntp receive time type_t=%d packetlen = %d, now = %8.6f t1 = %8.6f, t2 = %8.6f\n%s",
                                response[1] &~0x80, response_len, (double) t3 / SECOND_IN_NSECS, (double) t1 / SECOND_IN_NSECS,
                                (double) t2 / SECOND_IN_NSECS, str); 
-                    free(str);
                 }
 		// The iOS client device sends its time in  seconds relative to an arbitrary Epoch (the last boot).
                 // For a little bonus confusion, they add SECONDS_FROM_1900_TO_1970.
@@ -371,11 +380,16 @@ raop_ntp_thread(void *arg)
                 raop_ntp->sync_dispersion = dispersion;
                 raop_ntp->sync_delay = delay;
                 MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
+                metrics_set(METRIC_NTP_OFFSET, offset);
+                metrics_set(METRIC_NTP_DELAY, delay);
+                metrics_set(METRIC_NTP_DISPERSION, (int64_t) dispersion);
 
                 logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
             }
         }
 
+        trace_end("ntp", "exchange");
+
         // Sleep for 3 seconds
         struct timespec wait_time;
         MUTEX_LOCK(raop_ntp->wait_mutex);
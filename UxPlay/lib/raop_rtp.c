@@ -32,6 +32,9 @@
 #include "mirror_buffer.h"
 #include "stream.h"
 #include "utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
 
 #define NO_FLUSH (-42)
 
@@ -86,10 +89,6 @@ struct raop_rtp_s {
 
     float volume;
     int volume_changed;
-    unsigned char *metadata;
-    int metadata_len;
-    unsigned char *coverart;
-    int coverart_len;
     char *dacp_id;
     char *active_remote_header;
     unsigned int progress_start;
@@ -174,8 +173,6 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     
     raop_rtp->dacp_id = NULL;
     raop_rtp->active_remote_header = NULL;
-    raop_rtp->metadata = NULL;
-    raop_rtp->coverart = NULL;
 
     memcpy(&raop_rtp->callbacks, callbacks, sizeof(raop_callbacks_t));
     raop_rtp->buffer = raop_buffer_init(logger, aeskey, aesiv);
@@ -204,8 +201,6 @@ raop_rtp_destroy(raop_rtp_t *raop_rtp)
         raop_rtp_stop(raop_rtp);
         MUTEX_DESTROY(raop_rtp->run_mutex);
         raop_buffer_destroy(raop_rtp->buffer);
-        free(raop_rtp->metadata);
-        free(raop_rtp->coverart);
         free(raop_rtp->dacp_id);
         free(raop_rtp->active_remote_header);
         free(raop_rtp);
@@ -226,6 +221,7 @@ raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short cou
     addrlen = raop_rtp->control_saddr_len;
 
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp got resend request %d %d", seqnum, count);
+    metrics_add(METRIC_RESEND_REQUESTS, 1);
     ourseqnum = raop_rtp->control_seqnum++;
 
     /* Fill the request buffer */
@@ -283,10 +279,6 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     int flush;
     float volume;
     int volume_changed;
-    unsigned char *metadata;
-    int metadata_len;
-    unsigned char *coverart;
-    int coverart_len;
     char *dacp_id;
     char *active_remote_header;
     unsigned int progress_start;
@@ -311,18 +303,6 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     flush = raop_rtp->flush;
     raop_rtp->flush = NO_FLUSH;
 
-    /* Read the metadata */
-    metadata = raop_rtp->metadata;
-    metadata_len = raop_rtp->metadata_len;
-    raop_rtp->metadata = NULL;
-    raop_rtp->metadata_len = 0;
-
-    /* Read the coverart */
-    coverart = raop_rtp->coverart;
-    coverart_len = raop_rtp->coverart_len;
-    raop_rtp->coverart = NULL;
-    raop_rtp->coverart_len = 0;
-
     /* Read DACP remote control data */
     dacp_id = raop_rtp->dacp_id;
     active_remote_header = raop_rtp->active_remote_header;
@@ -353,21 +333,6 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
         }
     }
 
-    if (metadata != NULL) {
-        if (raop_rtp->callbacks.audio_set_metadata) {
-            raop_rtp->callbacks.audio_set_metadata(raop_rtp->callbacks.cls, metadata, metadata_len);
-        }
-        free(metadata);
-        metadata = NULL;
-    }
-
-    if (coverart != NULL) {
-        if (raop_rtp->callbacks.audio_set_coverart) {
-            raop_rtp->callbacks.audio_set_coverart(raop_rtp->callbacks.cls, coverart, coverart_len);
-        }
-        free(coverart);
-        coverart = NULL;
-    }
     if (dacp_id && active_remote_header) {
         if (raop_rtp->callbacks.audio_remote_control_id) {
             raop_rtp->callbacks.audio_remote_control_id(raop_rtp->callbacks.cls, dacp_id, active_remote_header);
@@ -461,6 +426,8 @@ raop_rtp_thread_udp(void *arg)
 
     assert(raop_rtp);
     bool logger_debug = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG);
+    trace_thread_name("raop_rtp audio");
+    thread_policy_apply(THREAD_CLASS_AUDIO, "raop_rtp audio");
     raop_rtp->ntp_start_time = raop_ntp_get_local_time(raop_rtp->ntp);
     raop_rtp->rtp_clock_started = false;
     for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; i++) {
@@ -517,6 +484,10 @@ raop_rtp_thread_udp(void *arg)
 	    } else {
                 packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0, NULL, NULL);
             }
+            if (packetlen > 0) {
+                metrics_add(METRIC_CONTROL_PACKETS, 1);
+                metrics_add(METRIC_CONTROL_BYTES, packetlen);
+            }
             int type_c = packet[1] & ~0x80;
             logger_log(raop_rtp->logger, LOGGER_DEBUG, "\nraop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
 
@@ -537,10 +508,10 @@ raop_rtp_thread_udp(void *arg)
                     assert(result >= 0);
                 } else if (logger_debug) {
                     /* type_c = 0x56 packets  with length 8 have been reported */
-                    char *str = utils_data_to_string(packet, packetlen, 16);
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(packet, packetlen, 16, str, sizeof(str));
                     logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received empty resent audio packet length %d, seqnum=%u:\n%s",
                                packetlen, seqnum, str);
-                    free (str);
                 }
             } else if (type_c == 0x54 && packetlen >= 20) {
                 /* packet[0] = 0x90 (first sync ?) or 0x80 (subsequent ones)
@@ -563,18 +534,18 @@ raop_rtp_thread_udp(void *arg)
                 uint64_t sync_ntp_remote = raop_remote_timestamp_to_nano_seconds(raop_rtp->ntp, sync_ntp_raw);
                 if (logger_debug) {
                     uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp, sync_ntp_remote);
-                    char *str = utils_data_to_string(packet, packetlen, 20);
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(packet, packetlen, 20, str, sizeof(str));
                     logger_log(raop_rtp->logger, LOGGER_DEBUG,
                                "raop_rtp sync: client ntp=%8.6f, ntp = %8.6f, ntp_start_time %8.6f\nts_client = %8.6f sync_rtp=%u\n%s",
                                (double) sync_ntp_remote / SEC, (double) sync_ntp_local / SEC,
                                (double) raop_rtp->ntp_start_time / SEC, (double) sync_ntp_remote / SEC, sync_rtp, str);
-                    free(str);
                 }
                 raop_rtp_sync_clock(raop_rtp, &sync_ntp_remote, &sync_rtp64);		
             } else if (logger_debug) {
-                char *str = utils_data_to_string(packet, packetlen, 16);
+                char str[LOGGER_MSG_SIZE];
+                utils_data_to_buffer(packet, packetlen, 16, str, sizeof(str));
                 logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown udp control packet\n%s", str);
-                free(str);
             }
         }
 
@@ -619,16 +590,20 @@ raop_rtp_thread_udp(void *arg)
             // Receiving audio data here
             saddrlen = sizeof(saddr);
             packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0, NULL, NULL);
+            if (packetlen > 0) {
+                metrics_add(METRIC_AUDIO_PACKETS, 1);
+                metrics_add(METRIC_AUDIO_BYTES, packetlen);
+            }
             // rtp payload type
             //int type_d = packet[1] & ~0x80;
             //logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp type_d 0x%02x, packetlen = %d", type_d, packetlen);
 	    
             if (packetlen < 12)  {
                 if (logger_debug) {
-                    char *str = utils_data_to_string(packet, packetlen, 16);
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(packet, packetlen, 16, str, sizeof(str));
                     logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received short type_d = 0x%2x  packet with length %d:\n%s",
                                packet[1] & ~0x80, packetlen, str);
-                    free (str);
                 }
                 continue;
 	    }
@@ -665,7 +640,9 @@ raop_rtp_thread_udp(void *arg)
 	    } else {
                 no_data_yet = false;
 	    }
+            trace_begin("audio", "enqueue");
             int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, &ntp_time, &rtp_time, 1);
+            trace_end("audio", "enqueue");
             assert(result >= 0);
 
 	    if (raop_rtp->ct == 2 && !have_synced) {
@@ -679,6 +656,7 @@ raop_rtp_thread_udp(void *arg)
                 uint64_t rtp64_timestamp;
                 uint64_t ntp_timestamp;
 
+                trace_begin("audio", "dequeue");
                 while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &ntp_timestamp, &rtp64_timestamp, &seqnum, no_resend))) {
                     audio_decode_struct audio_data; 
                     audio_data.rtp_time = rtp64_timestamp;
@@ -700,7 +678,9 @@ raop_rtp_thread_udp(void *arg)
                         audio_data.ntp_time_remote = raop_ntp_convert_local_time(raop_rtp->ntp, audio_data.ntp_time_local);
                         audio_data.sync_status = 0;
                     }
+                    trace_begin("audio", "push");
                     raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
+                    trace_end("audio", "push");
                     free(payload);
                     if (logger_debug) {
                         uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
@@ -712,6 +692,8 @@ raop_rtp_thread_udp(void *arg)
                     }
                 }
 
+                trace_end("audio", "dequeue");
+
                 /* Handle possible resend requests */
                 if (!no_resend) {
                     raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
@@ -793,43 +775,29 @@ raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 void
 raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
 {
-    unsigned char *metadata;
-
     assert(raop_rtp);
 
     if (datalen <= 0) {
         return;
     }
-    metadata = malloc(datalen);
-    assert(metadata);
-    memcpy(metadata, data, datalen);
-
-    /* Set metadata in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->metadata = metadata;
-    raop_rtp->metadata_len = datalen;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    /* not through the audio thread: the callback hands the data to a worker of its own */
+    if (raop_rtp->callbacks.audio_set_metadata) {
+        raop_rtp->callbacks.audio_set_metadata(raop_rtp->callbacks.cls, data, datalen);
+    }
 }
 
 void
 raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
 {
-    unsigned char *coverart;
-
     assert(raop_rtp);
 
     if (datalen <= 0) {
         return;
     }
-    coverart = malloc(datalen);
-    assert(coverart);
-    memcpy(coverart, data, datalen);
-
-    /* Set coverart in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->coverart = coverart;
-    raop_rtp->coverart_len = datalen;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    /* not through the audio thread: the callback hands the image to a worker of its own */
+    if (raop_rtp->callbacks.audio_set_coverart) {
+        raop_rtp->callbacks.audio_set_coverart(raop_rtp->callbacks.cls, data, datalen);
+    }
 }
 
 void
@@ -35,8 +35,12 @@
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "mirror_reader.h"
 #include "stream.h"
 #include "utils.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
 #include "plist/plist.h"
 
 #ifdef _WIN32
@@ -104,6 +108,9 @@ struct raop_rtp_mirror_s {
 
      /* switch for displaying client FPS data */
      uint8_t show_client_FPS_data;
+
+     /* 0, or how long to keep polling the stream socket after data arrived */
+     unsigned int busy_poll_us;
 };
 
 static int
@@ -170,7 +177,185 @@ raop_rtp_mirror_init_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamCon
     mirror_buffer_init_aes(raop_rtp_mirror->buffer, streamConnectionID);
 }
 
+/* Replaces the 4-byte big-endian size that prefixes each NAL unit of a decrypted
+ * mirror payload with the Annex-B start code, in place, and counts the NAL units.
+ * Returns false if the sizes do not add up to len or a NAL header is invalid
+ * (failed decryption). */
+bool
+raop_rtp_mirror_nalus_to_annexb(logger_t *logger, unsigned char *data, int len, bool h265_video, bool logger_debug,
+                                int *nal_count)
+{
+    static const unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+    int nalu_size = 0;
+    int nalus_count = 0;
+    *nal_count = 0;
+    while (nalu_size < len) {
+        int nc_len = byteutils_get_int_be(data, nalu_size);
+        if (nc_len < 0 || nalu_size + 4 > len) {
+            return false;
+        }
+        memcpy(data + nalu_size, nal_start_code, 4);
+        nalu_size += 4;
+        *nal_count = ++nalus_count;
+        /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
+        if (data[nalu_size] & 0x80) {
+            return false;
+        }
+        int nalu_type;
+        if (h265_video) {
+            nalu_type = data[nalu_size] & 0x7e >> 1;;
+            //logger_log(logger, LOGGER_DEBUG," h265 video, NALU type %d, size %d", nalu_type, nc_len);
+        } else {
+            nalu_type = data[nalu_size] & 0x1f;
+            int ref_idc = (data[nalu_size] >> 5);
+            switch (nalu_type) {
+            case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
+            case 5:   /*IDR, slice_layer_without_partitioning */
+            case 1:   /*non-IDR, slice_layer_without_partitioning */
+                break;
+            case 2:   /* slice data partition A */
+            case 3:   /* slice data partition B */
+            case 4:   /* slice data partition C */
+                logger_log(logger, LOGGER_INFO,
+                           "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                           "processed bytes %d, payloadsize = %d nalus_count = %d",
+                           nalu_type, ref_idc, nc_len, nalu_size, len, nalus_count);
+                break;
+            case 6:
+                if (logger_debug) {
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(data + nalu_size, nc_len, 16, str, sizeof(str));
+                    logger_log(logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);
+                    logger_log(logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
+                }
+                break;
+            case 7:
+                if (logger_debug) {
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(data + nalu_size, nc_len, 16, str, sizeof(str));
+                    logger_log(logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);
+                    logger_log(logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
+                }
+                break;
+            case 8:
+                if (logger_debug) {
+                    char str[LOGGER_MSG_SIZE];
+                    utils_data_to_buffer(data + nalu_size, nc_len, 16, str, sizeof(str));
+                    logger_log(logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);
+                    logger_log(logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
+                }
+                break;
+            default:
+                logger_log(logger, LOGGER_INFO,
+                           "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                           "processed bytes %d, payloadsize = %d nalus_count = %d",
+                           nalu_type, ref_idc, nc_len, nalu_size, len, nalus_count);
+                break;
+            }
+        }
+        nalu_size += nc_len;
+    }
+    return (nalu_size == len);
+}
+
+/* The streaming report plist (as seen from iOS and macOS clients) has two arrays of dicts:
+ *   fpsInfo:       {name, eachFPS}    frame rates at the stages of the client's pipeline
+ *                  (SubS: submitted, B4En: before encoder, EnDp: encoder drops, IdEn, IdDp,
+ *                   EQDp: encoder queue drops, QueF: queued, Sent: sent)
+ *   timestampInfo: {name, timestamp}  when the last frame passed each stage, in seconds
+ *                  (SubSu, BePxT, AfPxT, BefEn: before encoder, EmEnc: emitted by encoder,
+ *                   QueFr, SndFr: sent)
+ * Entries with other names are ignored.  Returns false if neither array was found. */
+static bool
+raop_rtp_mirror_parse_report(plist_t root, video_report_struct *report)
+{
+    double before_encoder = -1.0, emitted = -1.0, submitted = -1.0, sent = -1.0;
+    bool found = false;
+
+    report->client_sent_fps = -1.0;
+    report->client_submitted_fps = -1.0;
+    report->client_dropped_fps = -1.0;
+    report->client_encode_ms = -1.0;
+    report->client_send_ms = -1.0;
+    if (!root || plist_get_node_type(root) != PLIST_DICT) {
+        return false;
+    }
+
+    plist_t fps_info = plist_dict_get_item(root, "fpsInfo");
+    if (fps_info && plist_get_node_type(fps_info) == PLIST_ARRAY) {
+        found = true;
+        for (uint32_t i = 0; i < plist_array_get_size(fps_info); i++) {
+            plist_t item = plist_array_get_item(fps_info, i);
+            plist_t name_node = plist_dict_get_item(item, "name");
+            plist_t fps_node = plist_dict_get_item(item, "eachFPS");
+            if (!name_node || !fps_node || plist_get_node_type(fps_node) != PLIST_REAL) {
+                continue;
+            }
+            char *name = NULL;
+            double fps = 0.0;
+            plist_get_string_val(name_node, &name);
+            plist_get_real_val(fps_node, &fps);
+            if (!name) {
+                continue;
+            }
+            if (!strcmp(name, "Sent")) {
+                report->client_sent_fps = fps;
+            } else if (!strcmp(name, "SubS")) {
+                report->client_submitted_fps = fps;
+            } else if (!strcmp(name, "EnDp") || !strcmp(name, "IdDp") || !strcmp(name, "EQDp")) {
+                report->client_dropped_fps = (report->client_dropped_fps < 0.0 ? fps : report->client_dropped_fps + fps);
+            }
+            free(name);
+        }
+    }
+
+    plist_t timestamp_info = plist_dict_get_item(root, "timestampInfo");
+    if (timestamp_info && plist_get_node_type(timestamp_info) == PLIST_ARRAY) {
+        found = true;
+        for (uint32_t i = 0; i < plist_array_get_size(timestamp_info); i++) {
+            plist_t item = plist_array_get_item(timestamp_info, i);
+            plist_t name_node = plist_dict_get_item(item, "name");
+            plist_t time_node = plist_dict_get_item(item, "timestamp");
+            if (!name_node || !time_node || plist_get_node_type(time_node) != PLIST_REAL) {
+                continue;
+            }
+            char *name = NULL;
+            double timestamp = 0.0;
+            plist_get_string_val(name_node, &name);
+            plist_get_real_val(time_node, &timestamp);
+            if (!name) {
+                continue;
+            }
+            if (!strcmp(name, "BefEn")) {
+                before_encoder = timestamp;
+            } else if (!strcmp(name, "EmEnc")) {
+                emitted = timestamp;
+            } else if (!strcmp(name, "SubSu")) {
+                submitted = timestamp;
+            } else if (!strcmp(name, "SndFr")) {
+                sent = timestamp;
+            }
+            free(name);
+        }
+    }
+
+    /* the stages may have been passed by different frames; anything outside 0-10 s is not a latency */
+    if (before_encoder >= 0.0 && emitted >= before_encoder && emitted - before_encoder < 10.0) {
+        report->client_encode_ms = 1000.0 * (emitted - before_encoder);
+    }
+    if (submitted >= 0.0 && sent >= submitted && sent - submitted < 10.0) {
+        report->client_send_ms = 1000.0 * (sent - submitted);
+    }
+    return found;
+}
+
 #define RAOP_PACKET_LEN 32768
+/* room for several 4K H.265 IDR frames */
+#define MIRROR_READER_CAPACITY (4 * 1024 * 1024)
+#define MIRROR_SO_RCVBUF (4 * 1024 * 1024)
 /**
  * Mirror
  */
@@ -181,13 +366,9 @@ raop_rtp_mirror_thread(void *arg)
     assert(raop_rtp_mirror);
 
     int stream_fd = -1;
-    unsigned char packet[128];
-    memset(packet, 0 , 128);
     unsigned char* sps_pps = NULL;
     bool prepend_sps_pps = false;
     int sps_pps_len = 0;
-    unsigned char* payload = NULL;
-    unsigned int readstart = 0;
     bool conn_reset = false;
     uint64_t ntp_timestamp_nal = 0;
     uint64_t ntp_timestamp_raw = 0;
@@ -195,17 +376,37 @@ raop_rtp_mirror_thread(void *arg)
     uint64_t ntp_timestamp_local  = 0;
     unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
     bool logger_debug = (logger_get_level(raop_rtp_mirror->logger) >= LOGGER_DEBUG);
+    trace_thread_name("raop_rtp_mirror");
+    thread_policy_apply(THREAD_CLASS_MIRROR, "raop_rtp_mirror");
     bool h265_video = false;
     video_codec_t codec;
     const char h264[] = "h264";
     const char h265[] = "h265";
     bool unsupported_codec = false;
     bool video_stream_suspended = false;
-    
+    uint64_t busy_poll_ns = (uint64_t) raop_rtp_mirror->busy_poll_us * 1000;
+    uint64_t spin_deadline = 0;
+    /* received since the last client streaming report, to set beside it */
+    uint64_t report_time = 0;
+    uint32_t report_frames = 0;
+    uint64_t report_bytes = 0;
+    int64_t report_delay_sum = 0;
+    double client_dropped = 0.0;
+    mirror_reader_t *reader = mirror_reader_init(raop_rtp_mirror->logger, MIRROR_READER_CAPACITY);
+    if (!reader) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not allocate the receive buffer");
+        MUTEX_LOCK(raop_rtp_mirror->run_mutex);
+        raop_rtp_mirror->running = false;
+        MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
+        return 0;
+    }
+
     while (1) {
         fd_set rfds;
         struct timeval tv;
         int nfds, ret;
+        mirror_frame_t frame;
+        int next = 0;
         MUTEX_LOCK(raop_rtp_mirror->run_mutex);
         if (!raop_rtp_mirror->running) {
             MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
@@ -214,9 +415,16 @@ raop_rtp_mirror_thread(void *arg)
         }
         MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
-        /* Set timeout valu to 5ms */
+        /* Set timeout valu to 5ms; busy-polling (timeout 0) for busy_poll_us after data arrived */
         tv.tv_sec = 0;
         tv.tv_usec = 5000;
+        if (spin_deadline) {
+            if (raop_ntp_get_local_time(raop_rtp_mirror->ntp) < spin_deadline) {
+                tv.tv_usec = 0;
+            } else {
+                spin_deadline = 0;
+            }
+        }
 
         /* Get the correct nfds value and set rfds */
         FD_ZERO(&rfds);
@@ -251,14 +459,16 @@ raop_rtp_mirror_thread(void *arg)
                 break;
             }
 
-            // We're calling recv for a certain amount of data, so we need a timeout
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 5000;
-            if (setsockopt(stream_fd, SOL_SOCKET, SO_RCVTIMEO, CAST &tv, sizeof(tv)) < 0) {
+            // The reader takes whatever has arrived, so recv must never block
+#ifdef WIN32
+            u_long nonblocking = 1;
+#else
+            int nonblocking = 1;
+#endif
+            if (ioctlsocket(stream_fd, FIONBIO, &nonblocking) < 0) {
                 int sock_err = SOCKET_GET_ERROR();
                 logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
-                           "raop_rtp_mirror could not set stream socket timeout %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+                           "raop_rtp_mirror could not make stream socket non-blocking %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
                 break;
             }
 
@@ -287,36 +497,62 @@ raop_rtp_mirror_thread(void *arg)
                 logger_log(raop_rtp_mirror->logger, LOGGER_WARNING,
                            "raop_rtp_mirror could not set stream socket keepalive probes %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
             }
-            readstart = 0;
+#ifdef SO_BUSY_POLL
+            if (busy_poll_ns) {
+                /* the kernel also spins on the device queue in recv */
+                option = (int) raop_rtp_mirror->busy_poll_us;
+                if (setsockopt(stream_fd, SOL_SOCKET, SO_BUSY_POLL, CAST &option, sizeof(option)) < 0) {
+                    int sock_err = SOCKET_GET_ERROR();
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror could not set stream socket busy poll %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+                }
+            }
+#endif
+            mirror_reader_reset(reader);
+            report_time = 0;
+            report_frames = 0;
+            report_bytes = 0;
+            report_delay_sum = 0;
+            client_dropped = 0.0;
         }
 
         if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
-
-            // The first 128 bytes are some kind of header for the payload that follows
-            while (payload == NULL && readstart < 128) {
-                unsigned char* pos  = packet + readstart;
-                ret = recv(stream_fd, CAST pos, 128 - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
-            if (payload == NULL && ret == 0) {
+            /* one recv of all that has arrived; it may hold several frames, or part of one */
+            trace_begin("mirror", "recv");
+            ret = mirror_reader_fill(reader, stream_fd);
+            trace_end("mirror", "recv");
+            if (ret == 0) {
+                if (mirror_reader_pending(reader)) {
+                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
+                               "raop_rtp_mirror tcp socket was closed by client (recv returned 0) with %zu bytes of a frame",
+                               mirror_reader_pending(reader));
+                    break;
+                }
                 logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                           "raop_rtp_mirror tcp socket was closed by client (recv returned 0); got %d bytes of 128 byte header",readstart);
-                FD_CLR(stream_fd, &rfds);
+                           "raop_rtp_mirror tcp socket was closed by client (recv returned 0)");
+                closesocket(stream_fd);
                 stream_fd = -1;
+                spin_deadline = 0;
                 continue;
-            } else if (payload == NULL && ret == -1) {
+            } else if (ret == -1) {
                 int sock_err = SOCKET_GET_ERROR();
-                if (sock_err == SOCKET_ERRORNAME(EAGAIN) || sock_err == SOCKET_ERRORNAME(EWOULDBLOCK)) continue; // Timeouts can happen even if the connection is fine
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
-                           "raop_rtp_mirror error  in header recv: %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
-                if (sock_err == SOCKET_ERRORNAME(ECONNRESET)) conn_reset = true;; 
+                if (sock_err == SOCKET_ERRORNAME(EAGAIN) || sock_err == SOCKET_ERRORNAME(EWOULDBLOCK)) continue;
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+                if (sock_err == SOCKET_ERRORNAME(ECONNRESET)) conn_reset = true;
                 break;
             }
+            if (busy_poll_ns) {
+                spin_deadline = raop_ntp_get_local_time(raop_rtp_mirror->ntp) + busy_poll_ns;
+            }
+        }
+
+        while (stream_fd != -1 && (next = mirror_reader_next(reader, &frame)) > 0) {
+            /* frame points into the reader's buffer, valid until the next recv */
+            unsigned char *packet = frame.header;
+            unsigned char *payload = frame.payload;
 
             /*packet[0:3] contains the payload size */
-            int payload_size = byteutils_get_int(packet, 0);
+            int payload_size = frame.payload_size;
             char packet_description[13] = {0};
 	    char *p = packet_description;
             int n = sizeof(packet_description);
@@ -354,29 +590,8 @@ raop_rtp_mirror_thread(void *arg)
 
             /* "streaming report" packets have no timestamp in packet[8:15] */
 
-            if (payload == NULL) {
-                payload = malloc(payload_size);
-                readstart = 0;
-            }
-
-            while (readstart < payload_size) {
-                // Payload data
-                unsigned char *pos = payload + readstart;
-                ret = recv(stream_fd, CAST pos, payload_size - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
-            if (ret == 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket was closed by client (recv returned 0)");
-                break;
-            } else if (ret == -1) {
-                int sock_err = SOCKET_GET_ERROR();
-                if (sock_err == SOCKET_ERRORNAME(EAGAIN) || sock_err == SOCKET_ERRORNAME(EWOULDBLOCK)) continue; // Timeouts can happen even if the connection is fine
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
-                if (errno == SOCKET_ERRORNAME(ECONNRESET)) conn_reset = true;
-                break;
-            }
+            metrics_add(METRIC_MIRROR_PACKETS, 1);
+            metrics_add(METRIC_MIRROR_BYTES, MIRROR_FRAME_HEADER_LEN + payload_size);
 
 	    switch (packet[4]) {
             case  0x00:
@@ -388,9 +603,12 @@ raop_rtp_mirror_thread(void *arg)
                 // counting nano seconds since last boot.
 
                 ntp_timestamp_local = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
+                uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+                int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
+                report_frames++;
+                report_bytes += payload_size;
+                report_delay_sum += latency;
                 if (logger_debug) {
-                    uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
-                    int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
                     logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
                                "raop_rtp video: now = %8.6f, ntp = %8.6f, latency = %8.6f, ts = %8.6f, %s %s",
                                (double) ntp_now / SEC, (double) ntp_timestamp_local / SEC, (double) latency / SEC,
@@ -424,101 +642,40 @@ raop_rtp_mirror_thread(void *arg)
                         prepend_sps_pps = false;
                 }
 		
+                /* decrypt in place in the reader's buffer; prepended NALs go into the 128-byte
+                 * header (already parsed) just before the payload, if they fit there */
+                unsigned char *payload_allocated = NULL;
+                payload_decrypted = payload;
+                payload_out = payload;
                 if (prepend_sps_pps) {
                     assert(sps_pps);
-                    payload_out = (unsigned char*)  malloc(payload_size + sps_pps_len);
-                    payload_decrypted = payload_out + sps_pps_len;
+                    if (sps_pps_len <= MIRROR_FRAME_HEADER_LEN) {
+                        payload_out = payload - sps_pps_len;
+                    } else {
+                        payload_allocated = (unsigned char*) malloc(payload_size + sps_pps_len);
+                        payload_out = payload_allocated;
+                        payload_decrypted = payload_out + sps_pps_len;
+                    }
                     memcpy(payload_out, sps_pps, sps_pps_len);
                     free (sps_pps);
 		    sps_pps = NULL;
-                } else {
-                    payload_out = (unsigned char*)  malloc(payload_size);
-                    payload_decrypted = payload_out;
                 }
                 // Decrypt data
+                trace_begin("mirror", "decrypt");
                 mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
 
                 // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
                 // start code for the NAL Byte-Stream Format.
-                bool valid_data = true;
-                int nalu_size = 0;
                 int nalus_count = 0;
-                while (nalu_size < payload_size) {
-                    int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
-                    if (nc_len < 0 || nalu_size + 4 > payload_size) {
-                        valid_data = false;
-                        break;
-                    }
-                    memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
-                    nalu_size += 4;
-                    nalus_count++;
-                    /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
-                    if (payload_decrypted[nalu_size] & 0x80) {
-                        valid_data = false;
-                        break;
-                    }
-		    int nalu_type;
-		    if (h265_video) {
-                        nalu_type = payload_decrypted[nalu_size] & 0x7e >> 1;;
-                        //logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG," h265 video, NALU type %d, size %d", nalu_type, nc_len);
-		    } else {
-                        nalu_type = payload_decrypted[nalu_size] & 0x1f;
-                        int ref_idc = (payload_decrypted[nalu_size] >> 5);
-                        switch (nalu_type) {
-                        case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
-                        case 5:   /*IDR, slice_layer_without_partitioning */
-                        case 1:   /*non-IDR, slice_layer_without_partitioning */
-                            break;
-	                case 2:   /* slice data partition A */
-                        case 3:   /* slice data partition B */
-                        case 4:   /* slice data partition C */
-                            logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                       "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                       "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                       nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-                            break;
-                        case 6:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        case 7:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        case 8:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        default:
-                            logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                       "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                       "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                       nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-			    break;
-		        }
-		    }
-                    nalu_size += nc_len;
-                }
-                if (nalu_size != payload_size) valid_data = false;
+                bool valid_data = raop_rtp_mirror_nalus_to_annexb(raop_rtp_mirror->logger, payload_decrypted,
+                                                                  payload_size, h265_video, logger_debug,
+                                                                  &nalus_count);
                 if(!valid_data) {
                     logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
                     payload_out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
+                    metrics_add(METRIC_VIDEO_DECRYPT_FAILURES, 1);
                 }
+                trace_end("mirror", "decrypt");
 
 		
                 payload_decrypted = NULL;
@@ -538,8 +695,10 @@ raop_rtp_mirror_thread(void *arg)
                     prepend_sps_pps =  false;
                 }
 
+                trace_begin("mirror", "push");
                 raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &video_data);
-                free(payload_out);
+                trace_end("mirror", "push");
+                free(payload_allocated);
                 break;
             case 0x01:
                 /* 128-byte observed packet header structure 
@@ -635,9 +794,9 @@ raop_rtp_mirror_thread(void *arg)
                     ptr += 5;
                     vps = ptr;
                     if (logger_debug) {
-                        char *str = utils_data_to_string(vps, vps_size, 16);
+                        char str[LOGGER_MSG_SIZE];
+                        utils_data_to_buffer(vps, vps_size, 16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "h265 vps size %d\n%s",vps_size, str);
-                        free(str);
                     }
                     ptr += vps_size;
                     if (memcmp(ptr, sps_start_code, 4)) {
@@ -649,9 +808,9 @@ raop_rtp_mirror_thread(void *arg)
 		    ptr += 5;
                     sps = ptr;
                     if (logger_debug) {
-                        char *str = utils_data_to_string(sps, sps_size, 16);
+                        char str[LOGGER_MSG_SIZE];
+                        utils_data_to_buffer(sps, sps_size, 16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "h265 sps size %d\n%s",vps_size, str);
-                        free(str);
                     }
                     ptr += sps_size;
                     if (memcmp(ptr, pps_start_code, 4)) {
@@ -663,9 +822,9 @@ raop_rtp_mirror_thread(void *arg)
                     ptr += 5;
                     pps = ptr;
                     if (logger_debug) {
-                        char *str = utils_data_to_string(pps, pps_size, 16);
+                        char str[LOGGER_MSG_SIZE];
+                        utils_data_to_buffer(pps, pps_size, 16, str, sizeof(str));
 		        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "h265 pps size %d\n%s",pps_size, str);
-                        free(str);
                     }
 
                     sps_pps_len = vps_size + sps_size + pps_size + 12;
@@ -693,25 +852,23 @@ raop_rtp_mirror_thread(void *arg)
                     unsigned char *picture_parameter_set = payload + sps_size + 11;
                     int data_size = 6;
                     if (logger_debug) {
-                        char *str = utils_data_to_string(payload, data_size, 16);
+                        char str[LOGGER_MSG_SIZE];
+                        utils_data_to_buffer(payload, data_size, 16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: SPS+PPS header size = %d", data_size);		
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 SPS+PPS header:\n%s", str);
-                        free(str);
-                        str = utils_data_to_string(sequence_parameter_set, sps_size,16);
+                        utils_data_to_buffer(sequence_parameter_set, sps_size,16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d",  sps_size);		
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                        free(str);
-                        str = utils_data_to_string(picture_parameter_set, pps_size, 16);
+                        utils_data_to_buffer(picture_parameter_set, pps_size, 16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", pps_size);
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Picture Parameter Set:\n%s", str);
-                        free(str);
                     }
                     data_size = payload_size - sps_size - pps_size - 11; 
                     if (data_size > 0 && logger_debug) {
-                        char *str = utils_data_to_string (picture_parameter_set + pps_size, data_size, 16);
+                        char str[LOGGER_MSG_SIZE];
+                        utils_data_to_buffer(picture_parameter_set + pps_size, data_size, 16, str, sizeof(str));
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder size = %d", data_size);
                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder of SPS+PPS packet:\n%s", str);
-                        free(str);
                     } else if (data_size < 0) {
                         logger_log(raop_rtp_mirror->logger, LOGGER_ERR, " pps_sps error: packet remainder size = %d < 0", data_size);
                     }
@@ -752,7 +909,7 @@ raop_rtp_mirror_thread(void *arg)
                  * Sometimes (e.g, when the client has a locked screen), there is a 25kB trailer attached to the packet.    *
                  * This 25000 Byte trailer with unidentified content seems to be the same data each time it is sent.        */
 
-                if (payload_size && raop_rtp_mirror->show_client_FPS_data) {
+                if (payload_size) {
                     //char *str = utils_data_to_string(packet, 128, 16);
                     //logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "type 5 video packet header:\n%s", str);
                     //free (str);
@@ -760,22 +917,66 @@ raop_rtp_mirror_thread(void *arg)
                     int plist_size = payload_size;
                     if (payload_size > 25000) {
 		        plist_size = payload_size - 25000;
-                        if (logger_debug) {
-                            char *str = utils_data_to_string(payload + plist_size, 16, 16);
+                        if (logger_debug && raop_rtp_mirror->show_client_FPS_data) {
+                            char str[LOGGER_MSG_SIZE];
+                            utils_data_to_buffer(payload + plist_size, 16, 16, str, sizeof(str));
                             logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
                                        "video_info packet had 25kB trailer; first 16 bytes are:\n%s", str);
-                        free(str);
                         }
                     }
+                    plist_t root_node = NULL;
                     if (plist_size) {
+                        plist_from_bin((char *) payload, plist_size, &root_node);
+                    }
+                    if (root_node && raop_rtp_mirror->show_client_FPS_data) {
                         char *plist_xml;
                         uint32_t plist_len;
-                        plist_t root_node = NULL;
-                        plist_from_bin((char *) payload, plist_size, &root_node);
                         plist_to_xml(root_node, &plist_xml, &plist_len);
                         logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "%s", plist_xml);
                         free(plist_xml);
                     }
+
+                    video_report_struct report;
+                    if (raop_rtp_mirror_parse_report(root_node, &report)) {
+                        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+                        report.ntp_time_local = ntp_now;
+                        report.interval = (report_time ? (double) (ntp_now - report_time) / SEC : 0.0);
+                        report.received_fps = -1.0;
+                        report.received_bitrate = -1.0;
+                        report.arrival_delay_ms = -1.0;
+                        if (report.interval > 0.0) {
+                            report.received_fps = report_frames / report.interval;
+                            report.received_bitrate = 8.0 * report_bytes / report.interval;
+                            if (report.client_dropped_fps > 0.0) {
+                                uint64_t previous = (uint64_t) client_dropped;
+                                client_dropped += report.client_dropped_fps * report.interval;
+                                metrics_add(METRIC_CLIENT_DROPPED_FRAMES, (uint64_t) client_dropped - previous);
+                            }
+                            metrics_set(METRIC_RECEIVED_FPS, (int64_t) (1000.0 * report.received_fps));
+                            metrics_set(METRIC_MIRROR_BITRATE, (int64_t) report.received_bitrate);
+                        }
+                        report.client_dropped_frames = (uint64_t) client_dropped;
+                        if (report_frames) {
+                            report.arrival_delay_ms = (double) report_delay_sum / report_frames / 1000000.0;
+                            metrics_set(METRIC_MIRROR_ARRIVAL_DELAY, report_delay_sum / report_frames);
+                        }
+                        if (report.client_sent_fps >= 0.0) {
+                            metrics_set(METRIC_CLIENT_SENT_FPS, (int64_t) (1000.0 * report.client_sent_fps));
+                        }
+                        if (report.client_encode_ms >= 0.0) {
+                            metrics_set(METRIC_CLIENT_ENCODE_LATENCY, (int64_t) (1000000.0 * report.client_encode_ms));
+                        }
+                        if (raop_rtp_mirror->callbacks.video_report) {
+                            raop_rtp_mirror->callbacks.video_report(raop_rtp_mirror->callbacks.cls, &report);
+                        }
+                        report_time = ntp_now;
+                        report_frames = 0;
+                        report_bytes = 0;
+                        report_delay_sum = 0;
+                    }
+                    if (root_node) {
+                        plist_free(root_node);
+                    }
                 }
                 break;
             default:
@@ -784,15 +985,15 @@ raop_rtp_mirror_thread(void *arg)
                 break;
             }
 
-            free(payload);
-            payload = NULL;
-            memset(packet, 0, 128);
-            readstart = 0;
             if (unsupported_codec) {
                 break;
             }
         }
+        if (next < 0 || unsupported_codec) {
+            break;
+        }
     }
+    mirror_reader_destroy(reader);
     /* Close the stream file descriptor */
     if (stream_fd != -1) {
         closesocket(stream_fd);
@@ -829,6 +1030,22 @@ raop_rtp_mirror_init_socket(raop_rtp_mirror_t *raop_rtp_mirror, int use_ipv6)
         goto sockets_cleanup;
     }
 
+    /* A large receive window absorbs the burst of a (4K H.265) IDR frame; the
+     * window scale is negotiated at connect, so this must be set before listen() */
+    int rcvbuf = MIRROR_SO_RCVBUF;
+    if (setsockopt(dsock, SOL_SOCKET, SO_RCVBUF, CAST &rcvbuf, sizeof(rcvbuf)) < 0) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING,
+                   "raop_rtp_mirror could not set receive buffer size %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+    } else {
+        socklen_t optlen = sizeof(rcvbuf);
+        if (getsockopt(dsock, SOL_SOCKET, SO_RCVBUF, CAST &rcvbuf, &optlen) == 0 && rcvbuf < MIRROR_SO_RCVBUF) {
+            /* Linux caps it at net.core.rmem_max (and reports twice the value set) */
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                       "raop_rtp_mirror receive buffer is %d bytes (asked for %d)", rcvbuf, MIRROR_SO_RCVBUF);
+        }
+    }
+
     /* Listen to the data socket if using TCP */
     if (listen(dsock, 1) < 0) {
         goto sockets_cleanup;
@@ -850,7 +1067,7 @@ raop_rtp_mirror_init_socket(raop_rtp_mirror_t *raop_rtp_mirror, int use_ipv6)
 
 void
 raop_rtp_mirror_start(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport,
-                      uint8_t show_client_FPS_data)
+                      uint8_t show_client_FPS_data, unsigned int busy_poll_us)
 {
     logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror starting mirroring");
     int use_ipv6 = 0;
@@ -858,6 +1075,7 @@ raop_rtp_mirror_start(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror
     assert(raop_rtp_mirror);
     assert(mirror_data_lport);
     raop_rtp_mirror->show_client_FPS_data = show_client_FPS_data;
+    raop_rtp_mirror->busy_poll_us = busy_poll_us;
 
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
     if (raop_rtp_mirror->running || !raop_rtp_mirror->joined) {
@@ -19,6 +19,7 @@
 #define RAOP_RTP_MIRROR_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "raop.h"
 #include "logger.h"
 
@@ -28,7 +29,10 @@ typedef struct h264codec_s h264codec_t;
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp,
                                         const char *remote, int remotelen, const unsigned char *aeskey);
 void raop_rtp_mirror_init_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamConnectionID);
-void raop_rtp_mirror_start(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport, uint8_t show_client_FPS_data);
+void raop_rtp_mirror_start(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport, uint8_t show_client_FPS_data,
+                           unsigned int busy_poll_us);
 void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror);
 void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror);
+bool raop_rtp_mirror_nalus_to_annexb(logger_t *logger, unsigned char *data, int len, bool h265_video, bool logger_debug,
+                                     int *nal_count);
 #endif //RAOP_RTP_MIRROR_H
@@ -0,0 +1,760 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Packets are built and sent on the thread that pushes the data (the mirror
+ * and audio threads), as soon as it arrives: nothing is queued, so viewers
+ * get the stream with no more delay than the network adds.  RTSP requests
+ * are answered on the httpd thread; the mutex guards the viewer list. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "restream.h"
+#include "httpd.h"
+#include "netutils.h"
+#include "compat.h"
+#include "sockets.h"
+#include "byteutils.h"
+#include "crypto.h"
+#include "utils.h"
+#include "metrics.h"
+#include "threads.h"
+
+#define RESTREAM_MAX_VIEWERS 64
+#define RESTREAM_PAYLOAD 1400       /* RTP payload bytes: packets fit a 1500-byte Ethernet MTU */
+#define RESTREAM_RTP_HEADER 12
+#define RESTREAM_PT_VIDEO 96
+#define RESTREAM_PT_AUDIO 97
+#define RESTREAM_MCAST_PORT 5004    /* video RTP, RTCP = +1; audio +2, +3 */
+#define RESTREAM_SR_INTERVAL 1000000000ULL   /* ns between RTCP sender reports, per track */
+#define RESTREAM_MAX_PARAM 256      /* largest parameter set kept for the SDP */
+#define RESTREAM_MAX_SDP 2048
+
+enum { TRACK_VIDEO, TRACK_AUDIO, TRACKS };
+
+typedef struct restream_track_s {
+    int rtp_sock, rtcp_sock;
+    unsigned short port;             /* RTP; RTCP is port + 1 */
+    struct sockaddr_in group_rtp, group_rtcp;
+    uint32_t ssrc;
+    uint32_t ts_offset;
+    uint16_t seq;
+    uint32_t packets, octets;        /* for the sender reports */
+    uint64_t last_sr;
+} restream_track_t;
+
+typedef struct restream_conn_s restream_conn_t;
+struct restream_conn_s {
+    unsigned char local[16];
+    int locallen;
+    char remote[64];
+    struct sockaddr_in remote_addr;  /* port 0: not IPv4, can only use multicast */
+    char session[17];                /* empty until the first SETUP */
+    bool setup[TRACKS];
+    struct sockaddr_in rtp_addr[TRACKS], rtcp_addr[TRACKS];
+    bool playing;
+    restream_conn_t *next;
+};
+
+typedef struct restream_param_s {
+    unsigned char data[RESTREAM_MAX_PARAM];
+    int len;
+} restream_param_t;
+
+static logger_t *restream_logger = NULL;
+static httpd_t *restream_httpd = NULL;
+static mutex_handle_t restream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static restream_conn_t *restream_conns = NULL;
+static restream_track_t tracks[TRACKS];
+static bool multicast = false;
+static char multicast_addr[INET_ADDRSTRLEN];
+static unsigned char multicast_ttl = 1;
+static int playing_unicast[TRACKS];  /* viewers receiving each track */
+static int playing_multicast;
+static bool video_is_h265 = false;
+static unsigned char audio_ct = 0;   /* 4: AAC-LC, 8: AAC-ELD, else no audio track */
+static restream_param_t vps, sps, pps;
+
+static void
+restream_put_be32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char) (value >> 24);
+    p[1] = (unsigned char) (value >> 16);
+    p[2] = (unsigned char) (value >> 8);
+    p[3] = (unsigned char) value;
+}
+
+/* call with restream_mutex held */
+static void
+restream_sendto(int sock, const unsigned char *packet, int len, const struct sockaddr_in *addr)
+{
+    if (sendto(sock, (const char *) packet, len, 0, (const struct sockaddr *) addr, sizeof(*addr)) == len) {
+        metrics_add(METRIC_RESTREAM_PACKETS, 1);
+        metrics_add(METRIC_RESTREAM_BYTES, len);
+    }
+}
+
+/* call with restream_mutex held */
+static void
+restream_send(int t, const unsigned char *packet, int len, bool rtcp)
+{
+    restream_track_t *track = &tracks[t];
+    int sock = (rtcp ? track->rtcp_sock : track->rtp_sock);
+    if (multicast) {
+        if (playing_multicast) {
+            restream_sendto(sock, packet, len, (rtcp ? &track->group_rtcp : &track->group_rtp));
+        }
+        return;
+    }
+    for (restream_conn_t *conn = restream_conns; conn; conn = conn->next) {
+        if (conn->playing && conn->setup[t]) {
+            restream_sendto(sock, packet, len, (rtcp ? &conn->rtcp_addr[t] : &conn->rtp_addr[t]));
+        }
+    }
+}
+
+static bool
+restream_has_viewers(int t)
+{
+    return (multicast ? playing_multicast > 0 : playing_unicast[t] > 0);
+}
+
+static void
+restream_rtp_header(unsigned char *packet, int t, bool marker, uint32_t timestamp)
+{
+    restream_track_t *track = &tracks[t];
+    packet[0] = 0x80;   /* version 2 */
+    packet[1] = (unsigned char) ((t == TRACK_VIDEO ? RESTREAM_PT_VIDEO : RESTREAM_PT_AUDIO) | (marker ? 0x80 : 0));
+    packet[2] = (unsigned char) (track->seq >> 8);
+    packet[3] = (unsigned char) track->seq;
+    restream_put_be32(packet + 4, timestamp);
+    restream_put_be32(packet + 8, track->ssrc);
+    track->seq++;
+}
+
+/* RTCP sender report: lets viewers map both tracks' RTP timestamps to one clock, for lip sync */
+static void
+restream_sender_report(int t, uint32_t timestamp, uint64_t ntp_time)
+{
+    restream_track_t *track = &tracks[t];
+    unsigned char report[28];
+    if (track->last_sr && ntp_time < track->last_sr + RESTREAM_SR_INTERVAL) {
+        return;
+    }
+    track->last_sr = ntp_time;
+    report[0] = 0x80;
+    report[1] = 200;    /* SR */
+    report[2] = 0;
+    report[3] = 6;      /* length in 32-bit words - 1 */
+    restream_put_be32(report + 4, track->ssrc);
+    byteutils_put_ntp_timestamp(report, 8, ntp_time);
+    restream_put_be32(report + 16, timestamp);
+    restream_put_be32(report + 20, track->packets);
+    restream_put_be32(report + 24, track->octets);
+    restream_send(t, report, sizeof(report), true);
+}
+
+/* RFC 6184 (H264) and RFC 7798 (H265): single NAL unit packets, or fragmentation units */
+static void
+restream_send_nal(const unsigned char *nal, int len, uint32_t timestamp, bool last)
+{
+    unsigned char packet[RESTREAM_RTP_HEADER + RESTREAM_PAYLOAD];
+    restream_track_t *track = &tracks[TRACK_VIDEO];
+
+    if (len <= RESTREAM_PAYLOAD) {
+        restream_rtp_header(packet, TRACK_VIDEO, last, timestamp);
+        memcpy(packet + RESTREAM_RTP_HEADER, nal, len);
+        restream_send(TRACK_VIDEO, packet, RESTREAM_RTP_HEADER + len, false);
+        track->packets++;
+        track->octets += len;
+        return;
+    }
+
+    int nal_header = (video_is_h265 ? 2 : 1);
+    int fu_header = nal_header + 1;
+    unsigned char type;
+    if (video_is_h265) {
+        type = (nal[0] >> 1) & 0x3f;
+        packet[RESTREAM_RTP_HEADER] = (nal[0] & 0x81) | (49 << 1);   /* FU */
+        packet[RESTREAM_RTP_HEADER + 1] = nal[1];
+    } else {
+        type = nal[0] & 0x1f;
+        packet[RESTREAM_RTP_HEADER] = (nal[0] & 0xe0) | 28;          /* FU-A */
+    }
+    const unsigned char *p = nal + nal_header;
+    int remaining = len - nal_header;
+    bool first = true;
+    while (remaining > 0) {
+        int chunk = RESTREAM_PAYLOAD - fu_header;
+        bool end = (remaining <= chunk);
+        if (end) {
+            chunk = remaining;
+        }
+        restream_rtp_header(packet, TRACK_VIDEO, last && end, timestamp);
+        packet[RESTREAM_RTP_HEADER + nal_header] = type | (first ? 0x80 : 0) | (end ? 0x40 : 0);
+        memcpy(packet + RESTREAM_RTP_HEADER + fu_header, p, chunk);
+        restream_send(TRACK_VIDEO, packet, RESTREAM_RTP_HEADER + fu_header + chunk, false);
+        track->packets++;
+        track->octets += fu_header + chunk;
+        p += chunk;
+        remaining -= chunk;
+        first = false;
+    }
+}
+
+/* offset of the next 00 00 01 start code at or after i, or len */
+static int
+restream_find_start_code(const unsigned char *data, int len, int i)
+{
+    while (i + 2 < len) {
+        if (data[i + 2] > 1) {
+            i += 3;
+        } else if (!data[i] && !data[i + 1] && data[i + 2] == 1) {
+            return i;
+        } else {
+            i++;
+        }
+    }
+    return len;
+}
+
+/* keeps the parameter sets for sprop-* in the SDP; returns false if nal is not one */
+static bool
+restream_keep_parameter_set(const unsigned char *nal, int len)
+{
+    restream_param_t *param = NULL;
+    if (video_is_h265) {
+        switch ((nal[0] >> 1) & 0x3f) {
+        case 32: param = &vps; break;
+        case 33: param = &sps; break;
+        case 34: param = &pps; break;
+        default: return false;
+        }
+    } else {
+        switch (nal[0] & 0x1f) {
+        case 7: param = &sps; break;
+        case 8: param = &pps; break;
+        default: return false;
+        }
+    }
+    if (len <= RESTREAM_MAX_PARAM) {
+        memcpy(param->data, nal, len);
+        param->len = len;
+    }
+    return true;
+}
+
+void
+restream_push_video(const unsigned char *data, int data_len, uint64_t ntp_time)
+{
+    if (!restream_httpd) {
+        return;
+    }
+    MUTEX_LOCK(restream_mutex);
+    /* restream_stop() may have closed the sockets since the unlocked check */
+    if (!restream_httpd) {
+        MUTEX_UNLOCK(restream_mutex);
+        return;
+    }
+    bool send = restream_has_viewers(TRACK_VIDEO);
+    uint32_t timestamp = (uint32_t) ((ntp_time / 1000) * 9 / 100) + tracks[TRACK_VIDEO].ts_offset;  /* 90 kHz */
+    int start = restream_find_start_code(data, data_len, 0);
+    while (start < data_len) {
+        int nal = start + 3;
+        int next = restream_find_start_code(data, data_len, nal);
+        int end = next;
+        while (end > nal && !data[end - 1]) {
+            end--;   /* trailing zero bytes, e.g. the first byte of a 4-byte start code */
+        }
+        if (end - nal >= 2) {
+            bool parameter_set = restream_keep_parameter_set(data + nal, end - nal);
+            if (!send && !parameter_set) {
+                break;   /* parameter sets lead an access unit: no need to look further */
+            }
+            if (send) {
+                restream_send_nal(data + nal, end - nal, timestamp, next >= data_len);
+            }
+        }
+        start = next;
+    }
+    if (send) {
+        restream_sender_report(TRACK_VIDEO, timestamp, ntp_time);
+    }
+    MUTEX_UNLOCK(restream_mutex);
+}
+
+/* RFC 3640 mpeg4-generic, AAC-hbr mode: one AU per packet, with a 16-bit AU header */
+void
+restream_push_audio(const unsigned char *data, int data_len, uint64_t ntp_time)
+{
+    unsigned char packet[RESTREAM_RTP_HEADER + 4 + RESTREAM_PAYLOAD];
+    if (!restream_httpd || data_len <= 0 || data_len > RESTREAM_PAYLOAD) {
+        return;
+    }
+    MUTEX_LOCK(restream_mutex);
+    if (restream_httpd && (audio_ct == 4 || audio_ct == 8) && restream_has_viewers(TRACK_AUDIO)) {
+        restream_track_t *track = &tracks[TRACK_AUDIO];
+        uint32_t timestamp = (uint32_t) ((ntp_time / 1000) * 441 / 10000) + track->ts_offset;  /* 44.1 kHz */
+        restream_rtp_header(packet, TRACK_AUDIO, true, timestamp);
+        unsigned char *p = packet + RESTREAM_RTP_HEADER;
+        p[0] = 0;
+        p[1] = 16;     /* AU-headers-length, in bits */
+        p[2] = (unsigned char) (data_len >> 5);
+        p[3] = (unsigned char) ((data_len & 0x1f) << 3);   /* 13-bit size, 3-bit index = 0 */
+        memcpy(p + 4, data, data_len);
+        restream_send(TRACK_AUDIO, packet, RESTREAM_RTP_HEADER + 4 + data_len, false);
+        track->packets++;
+        track->octets += 4 + data_len;
+        restream_sender_report(TRACK_AUDIO, timestamp, ntp_time);
+    }
+    MUTEX_UNLOCK(restream_mutex);
+}
+
+void
+restream_set_video_codec(bool is_h265)
+{
+    MUTEX_LOCK(restream_mutex);
+    if (is_h265 != video_is_h265) {
+        vps.len = sps.len = pps.len = 0;
+        if (restream_httpd && (playing_unicast[TRACK_VIDEO] || playing_multicast)) {
+            logger_log(restream_logger, LOGGER_WARNING, "restream: video codec changed to %s, "
+                       "viewers must reconnect", (is_h265 ? "h265" : "h264"));
+        }
+    }
+    video_is_h265 = is_h265;
+    MUTEX_UNLOCK(restream_mutex);
+}
+
+void
+restream_set_audio_format(unsigned char ct)
+{
+    MUTEX_LOCK(restream_mutex);
+    audio_ct = ct;
+    MUTEX_UNLOCK(restream_mutex);
+}
+
+/* RTSP */
+
+static size_t
+restream_sdp_base64(char *buf, size_t len, const restream_param_t *param)
+{
+    char base64[2 * RESTREAM_MAX_PARAM];
+    pk_to_base64(param->data, param->len, base64, sizeof(base64));
+    return (size_t) snprintf(buf, len, "%s", base64);
+}
+
+/* call with restream_mutex held; returns 0 if there is no stream to describe yet */
+static int
+restream_build_sdp(restream_conn_t *conn, char *sdp, size_t len)
+{
+    char local[64], connection[INET_ADDRSTRLEN + 4];
+    size_t pos;
+    if (!sps.len || !pps.len || (video_is_h265 && !vps.len)) {
+        return 0;
+    }
+    utils_ipaddress_to_string(conn->locallen, conn->local, 0, local, sizeof(local));
+    if (multicast) {
+        snprintf(connection, sizeof(connection), "%s/%u", multicast_addr, multicast_ttl);
+    } else {
+        snprintf(connection, sizeof(connection), "0.0.0.0");
+    }
+    pos = snprintf(sdp, len,
+                   "v=0\r\n"
+                   "o=- %u 1 IN %s %s\r\n"
+                   "s=UxPlay\r\n"
+                   "c=IN IP4 %s\r\n"
+                   "t=0 0\r\n"
+                   "a=control:*\r\n"
+                   "a=range:npt=0-\r\n",
+                   tracks[TRACK_VIDEO].ssrc, (conn->locallen == 16 ? "IP6" : "IP4"), local, connection);
+    if (pos >= len) {
+        return 0;
+    }
+    pos += snprintf(sdp + pos, len - pos, "m=video %u RTP/AVP %d\r\n",
+                    (multicast ? RESTREAM_MCAST_PORT : 0), RESTREAM_PT_VIDEO);
+    if (pos >= len) {
+        return 0;
+    }
+    if (video_is_h265) {
+        pos += snprintf(sdp + pos, len - pos, "a=rtpmap:%d H265/90000\r\na=fmtp:%d sprop-vps=",
+                        RESTREAM_PT_VIDEO, RESTREAM_PT_VIDEO);
+        if (pos < len) pos += restream_sdp_base64(sdp + pos, len - pos, &vps);
+        if (pos < len) pos += snprintf(sdp + pos, len - pos, ";sprop-sps=");
+        if (pos < len) pos += restream_sdp_base64(sdp + pos, len - pos, &sps);
+        if (pos < len) pos += snprintf(sdp + pos, len - pos, ";sprop-pps=");
+        if (pos < len) pos += restream_sdp_base64(sdp + pos, len - pos, &pps);
+    } else {
+        pos += snprintf(sdp + pos, len - pos, "a=rtpmap:%d H264/90000\r\n"
+                        "a=fmtp:%d packetization-mode=1;profile-level-id=%02X%02X%02X;sprop-parameter-sets=",
+                        RESTREAM_PT_VIDEO, RESTREAM_PT_VIDEO, sps.data[1], sps.data[2], sps.data[3]);
+        if (pos < len) pos += restream_sdp_base64(sdp + pos, len - pos, &sps);
+        if (pos < len) pos += snprintf(sdp + pos, len - pos, ",");
+        if (pos < len) pos += restream_sdp_base64(sdp + pos, len - pos, &pps);
+    }
+    if (pos < len) {
+        pos += snprintf(sdp + pos, len - pos, "\r\na=control:trackID=%d\r\n", TRACK_VIDEO);
+    }
+    if ((audio_ct == 4 || audio_ct == 8) && pos < len) {
+        /* AudioSpecificConfig as in the audio renderer's codec_data */
+        pos += snprintf(sdp + pos, len - pos, "m=audio %u RTP/AVP %d\r\n"
+                        "a=rtpmap:%d mpeg4-generic/44100/2\r\n"
+                        "a=fmtp:%d streamtype=5;profile-level-id=1;mode=AAC-hbr;sizelength=13;"
+                        "indexlength=3;indexdeltalength=3;config=%s\r\n"
+                        "a=control:trackID=%d\r\n",
+                        (multicast ? RESTREAM_MCAST_PORT + 2 : 0), RESTREAM_PT_AUDIO, RESTREAM_PT_AUDIO,
+                        RESTREAM_PT_AUDIO, (audio_ct == 8 ? "F8E85000" : "1210"), TRACK_AUDIO);
+    }
+    return (pos < len ? (int) pos : 0);
+}
+
+static void *
+restream_conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote,
+                   int remotelen, unsigned int zone_id)
+{
+    restream_conn_t *conn = calloc(1, sizeof(restream_conn_t));
+    if (!conn || locallen > (int) sizeof(conn->local)) {
+        free(conn);
+        return NULL;
+    }
+    memcpy(conn->local, local, locallen);
+    conn->locallen = locallen;
+    utils_ipaddress_to_string(remotelen, remote, zone_id, conn->remote, sizeof(conn->remote));
+    if (remotelen == 4) {
+        conn->remote_addr.sin_family = AF_INET;
+        memcpy(&conn->remote_addr.sin_addr, remote, 4);
+    }
+    MUTEX_LOCK(restream_mutex);
+    conn->next = restream_conns;
+    restream_conns = conn;
+    MUTEX_UNLOCK(restream_mutex);
+    return conn;
+}
+
+/* call with restream_mutex held */
+static void
+restream_conn_stop(restream_conn_t *conn)
+{
+    if (conn->playing) {
+        for (int t = 0; t < TRACKS; t++) {
+            if (conn->setup[t]) {
+                playing_unicast[t] -= (multicast ? 0 : 1);
+            }
+        }
+        playing_multicast -= (multicast ? 1 : 0);
+        conn->playing = false;
+        metrics_set(METRIC_RESTREAM_VIEWERS, multicast ? playing_multicast : playing_unicast[TRACK_VIDEO]);
+        logger_log(restream_logger, LOGGER_INFO, "restream: viewer %s stopped", conn->remote);
+    }
+}
+
+static void
+restream_conn_destroy(void *ptr)
+{
+    restream_conn_t *conn = ptr;
+    MUTEX_LOCK(restream_mutex);
+    restream_conn_stop(conn);
+    for (restream_conn_t **p = &restream_conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    MUTEX_UNLOCK(restream_mutex);
+    free(conn);
+}
+
+static int
+restream_track_from_url(const char *url)
+{
+    const char *track = strstr(url, "trackID=");
+    if (!track) {
+        return -1;
+    }
+    int t = atoi(track + strlen("trackID="));
+    return (t >= 0 && t < TRACKS ? t : -1);
+}
+
+/* call with restream_mutex held; returns the RTSP status */
+static int
+restream_setup(restream_conn_t *conn, int t, const char *transport, char *reply, size_t len)
+{
+    restream_track_t *track = &tracks[t];
+    if (!transport || strstr(transport, "RTP/AVP/TCP")) {
+        return 461;    /* interleaved RTP is not supported */
+    }
+    if (multicast) {
+        snprintf(reply, len, "RTP/AVP;multicast;destination=%s;port=%u-%u;ttl=%u", multicast_addr,
+                 ntohs(track->group_rtp.sin_port), ntohs(track->group_rtcp.sin_port), multicast_ttl);
+    } else {
+        const char *ports = strstr(transport, "client_port=");
+        unsigned int rtp_port = 0, rtcp_port = 0;
+        if (strstr(transport, "multicast") || !conn->remote_addr.sin_family || !ports) {
+            return 461;
+        }
+        int n = sscanf(ports + strlen("client_port="), "%u-%u", &rtp_port, &rtcp_port);
+        if (n < 1 || !rtp_port || rtp_port > 65535 || rtcp_port > 65535) {
+            return 461;
+        }
+        if (n == 1) {
+            rtcp_port = rtp_port + 1;
+        }
+        conn->rtp_addr[t] = conn->remote_addr;
+        conn->rtp_addr[t].sin_port = htons((unsigned short) rtp_port);
+        conn->rtcp_addr[t] = conn->remote_addr;
+        conn->rtcp_addr[t].sin_port = htons((unsigned short) rtcp_port);
+        snprintf(reply, len, "RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u;ssrc=%08X",
+                 rtp_port, rtcp_port, track->port, track->port + 1, track->ssrc);
+    }
+    if (conn->playing && !conn->setup[t] && !multicast) {
+        playing_unicast[t]++;
+    }
+    conn->setup[t] = true;
+    if (!conn->session[0]) {
+        unsigned char random[8];
+        get_random_bytes(random, sizeof(random));
+        for (int i = 0; i < 8; i++) {
+            snprintf(conn->session + 2 * i, 3, "%02X", random[i]);
+        }
+    }
+    return 200;
+}
+
+static void
+restream_conn_request(void *ptr, http_request_t *request, http_response_t **response)
+{
+    restream_conn_t *conn = ptr;
+    const char *method = http_request_get_method(request);
+    const char *url = http_request_get_url(request);
+    const char *protocol = http_request_get_protocol(request);
+    const char *cseq = http_request_get_header(request, "CSeq");
+    const char *session = http_request_get_header(request, "Session");
+    char transport[160] = "";
+    char *sdp = NULL;
+    int sdp_len = 0;
+    int code = 200;
+
+    *response = http_response_create();
+    if (!method || !url) {
+        http_response_init(*response, protocol, 400, "Bad Request");
+        http_response_finish(*response, NULL, 0);
+        return;
+    }
+
+    MUTEX_LOCK(restream_mutex);
+    if (session && conn->session[0] && strncmp(session, conn->session, strlen(conn->session))) {
+        code = 454;
+    } else if (!strcmp(method, "OPTIONS") || !strcmp(method, "GET_PARAMETER") ||
+               !strcmp(method, "SET_PARAMETER")) {
+        /* GET_PARAMETER is the usual keep-alive */
+    } else if (!strcmp(method, "DESCRIBE")) {
+        sdp = malloc(RESTREAM_MAX_SDP);
+        if (!sdp || !(sdp_len = restream_build_sdp(conn, sdp, RESTREAM_MAX_SDP))) {
+            code = 503;     /* no mirror session (yet) */
+        }
+    } else if (!strcmp(method, "SETUP")) {
+        int t = restream_track_from_url(url);
+        code = (t < 0 ? 404 : restream_setup(conn, t, http_request_get_header(request, "Transport"),
+                                             transport, sizeof(transport)));
+    } else if (!strcmp(method, "PLAY")) {
+        if (!conn->session[0]) {
+            code = 455;
+        } else if (!conn->playing) {
+            conn->playing = true;
+            for (int t = 0; t < TRACKS; t++) {
+                if (conn->setup[t]) {
+                    playing_unicast[t] += (multicast ? 0 : 1);
+                }
+            }
+            playing_multicast += (multicast ? 1 : 0);
+            metrics_set(METRIC_RESTREAM_VIEWERS, multicast ? playing_multicast : playing_unicast[TRACK_VIDEO]);
+            logger_log(restream_logger, LOGGER_INFO, "restream: viewer %s playing (%s)", conn->remote,
+                       (multicast ? "multicast" : "unicast"));
+        }
+    } else if (!strcmp(method, "PAUSE")) {
+        restream_conn_stop(conn);
+    } else if (!strcmp(method, "TEARDOWN")) {
+        restream_conn_stop(conn);
+        memset(conn->setup, 0, sizeof(conn->setup));
+        conn->session[0] = '\0';
+        session = NULL;
+    } else {
+        code = 501;
+    }
+    MUTEX_UNLOCK(restream_mutex);
+
+    switch (code) {
+    case 200: http_response_init(*response, protocol, 200, "OK"); break;
+    case 404: http_response_init(*response, protocol, 404, "Not Found"); break;
+    case 454: http_response_init(*response, protocol, 454, "Session Not Found"); break;
+    case 455: http_response_init(*response, protocol, 455, "Method Not Valid in This State"); break;
+    case 461: http_response_init(*response, protocol, 461, "Unsupported Transport"); break;
+    case 503: http_response_init(*response, protocol, 503, "Service Unavailable"); break;
+    default: http_response_init(*response, protocol, 501, "Not Implemented"); break;
+    }
+    if (cseq) {
+        http_response_add_header(*response, "CSeq", cseq);
+    }
+    if (code == 200) {
+        if (!strcmp(method, "OPTIONS")) {
+            http_response_add_header(*response, "Public",
+                                     "OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER");
+        } else if (sdp_len) {
+            char base[256];
+            size_t url_len = strlen(url);
+            snprintf(base, sizeof(base), "%s%s", url, (url_len && url[url_len - 1] == '/' ? "" : "/"));
+            http_response_add_header(*response, "Content-Base", base);
+            http_response_add_header(*response, "Content-Type", "application/sdp");
+        } else if (transport[0]) {
+            http_response_add_header(*response, "Transport", transport);
+        } else if (!strcmp(method, "PLAY")) {
+            http_response_add_header(*response, "Range", "npt=0.000-");
+        }
+        if (conn->session[0] && (session || transport[0])) {
+            http_response_add_header(*response, "Session", conn->session);
+        }
+    } else if (code == 461) {
+        logger_log(restream_logger, LOGGER_INFO, "restream: viewer %s asked for unsupported transport %s",
+                   conn->remote, http_request_get_header(request, "Transport"));
+    }
+    http_response_finish(*response, (sdp_len ? sdp : NULL), sdp_len);
+    free(sdp);
+}
+
+/* a UDP socket pair on consecutive ports (RTP even, RTCP odd), as RTSP clients expect */
+static int
+restream_open_track(restream_track_t *track, int t)
+{
+    unsigned char random[10];
+    for (int attempt = 0; attempt < 16; attempt++) {
+        unsigned short port = 0, rtcp_port;
+        int rtp_sock = netutils_init_socket(&port, 0, 1);
+        if (rtp_sock == -1) {
+            return -1;
+        }
+        rtcp_port = port + 1;
+        if (!(port & 1)) {
+            int rtcp_sock = netutils_init_socket(&rtcp_port, 0, 1);
+            if (rtcp_sock != -1) {
+                track->rtp_sock = rtp_sock;
+                track->rtcp_sock = rtcp_sock;
+                track->port = port;
+                break;
+            }
+        }
+        closesocket(rtp_sock);
+    }
+    if (!track->port) {
+        return -1;
+    }
+    get_random_bytes(random, sizeof(random));
+    memcpy(&track->ssrc, random, 4);
+    memcpy(&track->ts_offset, random + 4, 4);
+    memcpy(&track->seq, random + 8, 2);
+    if (multicast) {
+        int ttl = multicast_ttl;
+        setsockopt(track->rtp_sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &ttl, sizeof(ttl));
+        setsockopt(track->rtcp_sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &ttl, sizeof(ttl));
+        track->group_rtp.sin_family = AF_INET;
+        inet_pton(AF_INET, multicast_addr, &track->group_rtp.sin_addr);
+        track->group_rtcp = track->group_rtp;
+        track->group_rtp.sin_port = htons(RESTREAM_MCAST_PORT + 2 * t);
+        track->group_rtcp.sin_port = htons(RESTREAM_MCAST_PORT + 2 * t + 1);
+    }
+    return 0;
+}
+
+static void
+restream_close_tracks()
+{
+    for (int t = 0; t < TRACKS; t++) {
+        if (tracks[t].port) {
+            closesocket(tracks[t].rtp_sock);
+            closesocket(tracks[t].rtcp_sock);
+        }
+    }
+    memset(tracks, 0, sizeof(tracks));
+}
+
+int
+restream_start(logger_t *logger, unsigned short *port, const char *multicast_group, unsigned char ttl)
+{
+    httpd_callbacks_t callbacks;
+    struct in_addr group;
+
+    if (restream_httpd) {
+        return 0;
+    }
+    restream_logger = logger;
+    multicast = (multicast_group != NULL);
+    if (multicast) {
+        if (inet_pton(AF_INET, multicast_group, &group) != 1 || (ntohl(group.s_addr) >> 28) != 0xe) {
+            logger_log(logger, LOGGER_ERR, "restream: %s is not an IPv4 multicast address", multicast_group);
+            return -1;
+        }
+        snprintf(multicast_addr, sizeof(multicast_addr), "%s", multicast_group);
+        multicast_ttl = ttl;
+    }
+    for (int t = 0; t < TRACKS; t++) {
+        if (restream_open_track(&tracks[t], t) < 0) {
+            logger_log(logger, LOGGER_ERR, "restream: could not open the RTP sockets");
+            restream_close_tracks();
+            return -1;
+        }
+    }
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.opaque = NULL;
+    callbacks.conn_init = restream_conn_init;
+    callbacks.conn_request = restream_conn_request;
+    callbacks.conn_destroy = restream_conn_destroy;
+
+    httpd_t *httpd = httpd_init(logger, &callbacks, 0);
+    if (!httpd || httpd_set_max_connections(httpd, RESTREAM_MAX_VIEWERS) < 0 ||
+        httpd_start(httpd, port) != 1) {
+        if (httpd) {
+            httpd_destroy(httpd);
+        }
+        restream_close_tracks();
+        return -1;
+    }
+    /* the push functions only see the server once it runs */
+    MUTEX_LOCK(restream_mutex);
+    restream_httpd = httpd;
+    MUTEX_UNLOCK(restream_mutex);
+    if (multicast) {
+        logger_log(logger, LOGGER_INFO, "restream: serving rtsp://<this host>:%u/ (multicast to %s, ports %d-%d)",
+                   (unsigned int) *port, multicast_addr, RESTREAM_MCAST_PORT, RESTREAM_MCAST_PORT + 3);
+    } else {
+        logger_log(logger, LOGGER_INFO, "restream: serving rtsp://<this host>:%u/", (unsigned int) *port);
+    }
+    return 0;
+}
+
+void
+restream_stop()
+{
+    if (restream_httpd) {
+        httpd_t *httpd = restream_httpd;
+        /* the push functions see the server gone before the sockets close */
+        MUTEX_LOCK(restream_mutex);
+        restream_httpd = NULL;
+        MUTEX_UNLOCK(restream_mutex);
+        httpd_destroy(httpd);
+        MUTEX_LOCK(restream_mutex);
+        restream_close_tracks();
+        MUTEX_UNLOCK(restream_mutex);
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Rebroadcast of the mirror stream to RTSP viewers, without decoding: the
+ * H264/H265 access units are packetized per RFC 6184/7798 and AAC audio per
+ * RFC 3640, and sent over RTP/UDP, either to each viewer (unicast) or once to
+ * a multicast group.  The RTSP server is an httpd instance, like the metrics
+ * endpoint, so rtsp://<host>:<port>/ can be opened by ffplay, VLC, gstreamer... */
+
+#ifndef RESTREAM_H
+#define RESTREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* multicast_group: NULL for unicast; else RTP goes to multicast_group, ports 5004-5007 */
+int restream_start(logger_t *logger, unsigned short *port, const char *multicast_group, unsigned char ttl);
+void restream_stop();
+
+/* announce the streams of the current session (raop callbacks) */
+void restream_set_video_codec(bool is_h265);
+void restream_set_audio_format(unsigned char ct);
+
+/* Annex-B access unit / raw AAC frame; ntp_time (ns, local realtime clock) sets the RTP timestamp */
+void restream_push_video(const unsigned char *data, int data_len, uint64_t ntp_time);
+void restream_push_audio(const unsigned char *data, int data_len, uint64_t ntp_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RESTREAM_H
@@ -676,9 +676,43 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
  * On failure, bytes_B and bytes_b  will be set to NULL 
  * len_B  and len_will be set to 0
  */
+/* Out: bytes_gb, len_gb (g^b mod N, which does not depend on the verifier, so it *
+ * can be computed ahead of time and passed to the functions below)              *
+ * On failure, bytes_gb will be set to NULL and len_gb will be set to 0           */
+void srp_create_server_ephemeral_base( SRP_NGType ng_type,
+                                       const unsigned char * bytes_b, int len_b,
+                                       const unsigned char ** bytes_gb, int * len_gb,
+                                       const char * n_hex, const char * g_hex ) {
+  BIGNUM             *b    = BN_bin2bn(bytes_b, len_b, NULL);
+  BIGNUM             *gb   = BN_new();
+  BN_CTX             *ctx  = BN_CTX_new();
+  NGConstant         *ng   = new_ng( ng_type, n_hex, g_hex );
+
+  *len_gb   = 0;
+  *bytes_gb = 0;
+
+  if( !b || !gb || !ctx || !ng )
+    goto cleanup_and_exit;
+
+  BN_mod_exp(gb, ng->g, b, ng->N, ctx);
+  *bytes_gb = (const unsigned char *)malloc( BN_num_bytes(gb) );
+  if (*bytes_gb) {
+    *len_gb = BN_num_bytes(gb);
+    BN_bn2bin( gb, (unsigned char *) *bytes_gb );
+  }
+
+ cleanup_and_exit:
+  delete_ng( ng );
+  BN_free(b);
+  BN_free(gb);
+  BN_CTX_free(ctx);
+}
+
+/* g^b is computed here unless bytes_gb is given */
 void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
                                       const unsigned char * bytes_v, int len_v,  
                                       const unsigned char * bytes_b, int len_b,
+                                      const unsigned char * bytes_gb, int len_gb,
                                       const unsigned char ** bytes_B, int * len_B,
                                       const char * n_hex, const char * g_hex,
                                       int rfc5054_compat ) {
@@ -708,16 +742,18 @@ void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
     goto cleanup_and_exit;
 
   /* B = kv + g^b */
+  if (bytes_gb && len_gb)
+    BN_bin2bn(bytes_gb, len_gb, tmp2);
+  else
+    BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
   if (rfc5054_compat)
     {
       BN_mod_mul(tmp1, k, v, ng->N, ctx);
-      BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
       BN_mod_add(B, tmp1, tmp2, ng->N, ctx);
     }
   else
     {
       BN_mul(tmp1, k, v, ctx);
-      BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
       BN_add(B, tmp1, tmp2);
     }
 
@@ -746,6 +782,7 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
                                         const unsigned char * bytes_A, int len_A,
 #ifdef APPLE_VARIANT
 					const unsigned char * bytes_b, int len_b,
+					const unsigned char * bytes_gb, int len_gb,
 #endif
                                         const unsigned char ** bytes_B, int * len_B,
                                         const char * n_hex, const char * g_hex,
@@ -822,16 +859,20 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
        }
 
        /* B = kv + g^b */
+#ifdef APPLE_VARIANT
+       if (bytes_gb && len_gb && len_b && bytes_b)
+          BN_bin2bn(bytes_gb, len_gb, tmp2);
+       else
+#endif
+       BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
        if (rfc5054_compat)
        {
           BN_mod_mul(tmp1, k, v, ng->N, ctx);
-          BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
           BN_mod_add(B, tmp1, tmp2, ng->N, ctx);
        }
        else
        {
           BN_mul(tmp1, k, v, ctx);
-          BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
           BN_add(B, tmp1, tmp2);
        }
 
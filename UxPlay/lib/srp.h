@@ -131,6 +131,15 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
 
 
 #ifdef APPLE_VARIANT
+/* Out: bytes_gb, len_gb: g^b mod N, which does not depend on the verifier and can
+ * be computed ahead of time (the expensive part of creating B).
+ * On failure, bytes_gb will be set to NULL and len_gb will be set to 0
+ */
+void srp_create_server_ephemeral_base( SRP_NGType ng_type,
+                                       const unsigned char * bytes_b, int len_b,
+                                       const unsigned char ** bytes_gb, int * len_gb,
+                                       const char * n_hex, const char * g_hex );
+
 /* Out: bytes_B, len_B
  * On failure, bytes_B will be set to NULL and len_B will be set to 0
  *
@@ -138,10 +147,12 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
  *
  * bytes_b should be a pointer to a cryptographically secure random array of length 
  * len_b bytes (for example, produced with OpenSSL's RAND_bytes(bytes_b, len_b)).
+ * bytes_gb (from srp_create_server_ephemeral_base() with the same b) may be NULL.
  */
 void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
                                       const unsigned char * bytes_v, int len_v,  
                                       const unsigned char * bytes_b, int len_b,
+                                      const unsigned char * bytes_gb, int len_gb,
                                       const unsigned char ** bytes_B, int * len_B,
 				      const char * n_hex, const char * g_hex,
 				      int rfc5054_compat );
@@ -163,6 +174,7 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
                                         const unsigned char * bytes_A, int len_A,
 #ifdef APPLE_VARIANT
 					const unsigned char * bytes_b, int len_b,
+					const unsigned char * bytes_gb, int len_gb,
 #endif
                                         const unsigned char ** bytes_B, int * len_B,
                                         const char * n_hex, const char * g_hex,
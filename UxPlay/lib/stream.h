@@ -41,4 +41,20 @@ typedef struct {
     unsigned short seqnum;
 } audio_decode_struct;
 
+/* a client "streaming report" (once per second), with what was received over the same interval;
+ * values that are not known (missing from the report, or no interval yet) are negative */
+typedef struct {
+    double client_sent_fps;
+    double client_submitted_fps;   /* frames captured and submitted for encoding */
+    double client_dropped_fps;     /* frames dropped by the client's encoder and send queue */
+    double client_encode_ms;       /* encoder latency */
+    double client_send_ms;         /* from submission to send */
+    uint64_t client_dropped_frames;   /* estimated total for this stream */
+    double interval;               /* seconds since the previous report */
+    double received_fps;
+    double received_bitrate;       /* bits/s */
+    double arrival_delay_ms;       /* average arrival time - sender timestamp (local clock) */
+    uint64_t ntp_time_local;       /* arrival of the report */
+} video_report_struct;
+
 #endif //AIRPLAYSERVER_STREAM_H
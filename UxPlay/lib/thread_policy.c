@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Affinity and per-thread nice levels are only available on Linux (a nice
+ * level set with setpriority() on a thread id only affects that thread there);
+ * elsewhere, asking for them is reported as unsupported.  A refused policy is
+ * logged as a warning once per thread class, not once per thread. */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_policy.h"
+#include "threads.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define THREAD_POLICY_MAX_CPUS 64
+
+typedef enum {
+    THREAD_SCHED_DEFAULT,
+    THREAD_SCHED_FIFO,
+    THREAD_SCHED_RR,
+    THREAD_SCHED_NICE
+} thread_sched_t;
+
+typedef struct thread_policy_s {
+    thread_sched_t sched;
+    int value;           /* real-time priority or nice level */
+    uint64_t cpus;       /* affinity mask, 0: unchanged */
+} thread_policy_t;
+
+static const char *class_names[THREAD_CLASS_COUNT] = {
+    "other", "mirror", "audio", "ntp", "httpd", "ws", "gst-video", "gst-audio"
+};
+
+static thread_policy_t policies[THREAD_CLASS_COUNT];
+static logger_t *policy_logger = NULL;
+static atomic_bool warned[THREAD_CLASS_COUNT];
+
+static int
+thread_policy_parse_cpus(const char *str, uint64_t *cpus)
+{
+    *cpus = 0;
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str) {
+            return -1;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= THREAD_POLICY_MAX_CPUS) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            *cpus |= (uint64_t) 1 << cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        str = end;
+    }
+    return (*cpus ? 0 : -1);
+}
+
+static int
+thread_policy_parse_sched(const char *str, size_t len, thread_policy_t *policy)
+{
+    char buf[32];
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    policy->sched = THREAD_SCHED_DEFAULT;
+    policy->value = 0;
+    if (len == 0 || !strcmp(buf, "default")) {
+        return 0;
+    }
+
+    char *slash = strchr(buf, '/');
+    if (!slash) {
+        return -1;
+    }
+    *slash = '\0';
+    char *end;
+    long value = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end) {
+        return -1;
+    }
+    if (!strcmp(buf, "fifo") || !strcmp(buf, "rr")) {
+        /* POSIX only guarantees 32 levels; Linux has 1-99 */
+        if (value < 1 || value > 99) {
+            return -1;
+        }
+        policy->sched = (buf[0] == 'f' ? THREAD_SCHED_FIFO : THREAD_SCHED_RR);
+    } else if (!strcmp(buf, "nice")) {
+        if (value < -20 || value > 19) {
+            return -1;
+        }
+        policy->sched = THREAD_SCHED_NICE;
+    } else {
+        return -1;
+    }
+    policy->value = (int) value;
+    return 0;
+}
+
+int
+thread_policy_set(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    if (!colon) {
+        return -1;
+    }
+    size_t class_len = colon - spec;
+    int first = -1, last = -1;
+    if (class_len == 3 && !strncmp(spec, "all", 3)) {
+        first = 0;
+        last = THREAD_CLASS_COUNT - 1;
+    } else {
+        for (int i = 0; i < THREAD_CLASS_COUNT; i++) {
+            if (strlen(class_names[i]) == class_len && !strncmp(spec, class_names[i], class_len)) {
+                first = last = i;
+                break;
+            }
+        }
+    }
+    if (first < 0) {
+        return -1;
+    }
+
+    thread_policy_t policy = { 0 };
+    const char *sched = colon + 1;
+    const char *cpus = strchr(sched, ':');
+    if (thread_policy_parse_sched(sched, (cpus ? (size_t) (cpus - sched) : strlen(sched)), &policy) < 0) {
+        return -1;
+    }
+    if (cpus && thread_policy_parse_cpus(cpus + 1, &policy.cpus) < 0) {
+        return -1;
+    }
+    for (int i = first; i <= last; i++) {
+        policies[i] = policy;
+    }
+    return 0;
+}
+
+static void
+thread_policy_describe(const thread_policy_t *policy, char *str, size_t len)
+{
+    int n;
+    switch (policy->sched) {
+    case THREAD_SCHED_FIFO:
+        n = snprintf(str, len, "SCHED_FIFO priority %d", policy->value);
+        break;
+    case THREAD_SCHED_RR:
+        n = snprintf(str, len, "SCHED_RR priority %d", policy->value);
+        break;
+    case THREAD_SCHED_NICE:
+        n = snprintf(str, len, "nice %d", policy->value);
+        break;
+    default:
+        n = snprintf(str, len, "default scheduling");
+        break;
+    }
+    if (!policy->cpus) {
+        snprintf(str + n, len - n, ", any cpu");
+        return;
+    }
+    const char *sep = ", cpus ";
+    for (int cpu = 0; cpu < THREAD_POLICY_MAX_CPUS && n < (int) len; cpu++) {
+        if (!(policy->cpus & ((uint64_t) 1 << cpu))) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < THREAD_POLICY_MAX_CPUS && (policy->cpus & ((uint64_t) 1 << (last + 1)))) {
+            last++;
+        }
+        if (last > cpu) {
+            n += snprintf(str + n, len - n, "%s%d-%d", sep, cpu, last);
+        } else {
+            n += snprintf(str + n, len - n, "%s%d", sep, cpu);
+        }
+        sep = ",";
+        cpu = last;
+    }
+}
+
+void
+thread_policy_report(logger_t *logger)
+{
+    policy_logger = logger;
+    bool any = false;
+    for (int i = 0; i < THREAD_CLASS_COUNT; i++) {
+        const thread_policy_t *policy = &policies[i];
+        if (policy->sched == THREAD_SCHED_DEFAULT && !policy->cpus) {
+            continue;
+        }
+        char description[128];
+        thread_policy_describe(policy, description, sizeof(description));
+        logger_log(logger, LOGGER_INFO, "thread policy %-9s: %s", class_names[i], description);
+        any = true;
+
+#ifdef __linux__
+        /* refused for an unprivileged user unless the resource limits allow it
+         * (/etc/security/limits.conf); CAP_SYS_NICE is not checked here */
+        struct rlimit limit;
+        if (geteuid() != 0) {
+            if ((policy->sched == THREAD_SCHED_FIFO || policy->sched == THREAD_SCHED_RR) &&
+                !getrlimit(RLIMIT_RTPRIO, &limit) && limit.rlim_cur != RLIM_INFINITY &&
+                limit.rlim_cur < (rlim_t) policy->value) {
+                logger_log(logger, LOGGER_WARNING, "thread policy %s: priority %d is above RLIMIT_RTPRIO (%d) "
+                           "and will be refused unless uxplay has CAP_SYS_NICE", class_names[i], policy->value,
+                           (int) limit.rlim_cur);
+            } else if (policy->sched == THREAD_SCHED_NICE && policy->value < 0 &&
+                       !getrlimit(RLIMIT_NICE, &limit) && limit.rlim_cur != RLIM_INFINITY &&
+                       20 - (int) limit.rlim_cur > policy->value) {
+                logger_log(logger, LOGGER_WARNING, "thread policy %s: nice %d is below the RLIMIT_NICE floor (%d) "
+                           "and will be refused unless uxplay has CAP_SYS_NICE", class_names[i], policy->value,
+                           20 - (int) limit.rlim_cur);
+            }
+        }
+        cpu_set_t allowed;
+        if (policy->cpus && !sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            for (int cpu = 0; cpu < THREAD_POLICY_MAX_CPUS; cpu++) {
+                if ((policy->cpus & ((uint64_t) 1 << cpu)) && !CPU_ISSET(cpu, &allowed)) {
+                    logger_log(logger, LOGGER_WARNING, "thread policy %s: cpu %d is not available to uxplay",
+                               class_names[i], cpu);
+                }
+            }
+        }
+#else
+        if (policy->cpus || policy->sched == THREAD_SCHED_NICE) {
+            logger_log(logger, LOGGER_WARNING, "thread policy %s: cpu affinity and per-thread nice levels "
+                       "are not supported on this platform", class_names[i]);
+        }
+#endif
+    }
+    if (!any) {
+        logger_log(logger, LOGGER_DEBUG, "thread policy: default scheduling for all threads, on any cpu");
+    }
+}
+
+void
+thread_policy_set_name(const char *name)
+{
+#if defined(__linux__)
+    char buf[16];   /* the kernel limit, including the terminating NUL */
+    snprintf(buf, sizeof(buf), "%s", name);
+    pthread_setname_np(pthread_self(), buf);
+#elif defined(__APPLE__)
+    pthread_setname_np(name);
+#else
+    (void) name;
+#endif
+}
+
+/* returns 0, or an errno value */
+static int
+thread_policy_set_sched(const thread_policy_t *policy)
+{
+    switch (policy->sched) {
+    case THREAD_SCHED_FIFO:
+    case THREAD_SCHED_RR: {
+#ifdef _WIN32
+        return ENOTSUP;
+#else
+        struct sched_param param = { 0 };
+        param.sched_priority = policy->value;
+        return pthread_setschedparam(pthread_self(), (policy->sched == THREAD_SCHED_FIFO ? SCHED_FIFO : SCHED_RR),
+                                     &param);
+#endif
+    }
+    case THREAD_SCHED_NICE:
+#ifdef __linux__
+        return (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), policy->value) ? errno : 0);
+#else
+        return ENOTSUP;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static int
+thread_policy_set_affinity(const thread_policy_t *policy)
+{
+    if (!policy->cpus) {
+        return 0;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < THREAD_POLICY_MAX_CPUS; cpu++) {
+        if (policy->cpus & ((uint64_t) 1 << cpu)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return ENOTSUP;
+#endif
+}
+
+void
+thread_policy_apply(thread_class_t thread_class, const char *name)
+{
+    if (name) {
+        thread_policy_set_name(name);
+    }
+    const thread_policy_t *policy = &policies[thread_class];
+    if (policy->sched == THREAD_SCHED_DEFAULT && !policy->cpus) {
+        return;
+    }
+
+    int sched_ret = thread_policy_set_sched(policy);
+    int affinity_ret = thread_policy_set_affinity(policy);
+    if (!policy_logger) {
+        return;
+    }
+    if (!sched_ret && !affinity_ret) {
+        char description[128];
+        thread_policy_describe(policy, description, sizeof(description));
+        logger_log(policy_logger, LOGGER_DEBUG, "thread \"%s\" (%s): %s", (name ? name : "?"),
+                   class_names[thread_class], description);
+    } else if (!atomic_exchange(&warned[thread_class], true)) {
+        if (sched_ret) {
+            logger_log(policy_logger, LOGGER_WARNING, "thread \"%s\" (%s): could not set its %s: %s",
+                       (name ? name : "?"), class_names[thread_class],
+                       (policy->sched == THREAD_SCHED_NICE ? "nice level" : "real-time priority"), strerror(sched_ret));
+        }
+        if (affinity_ret) {
+            logger_log(policy_logger, LOGGER_WARNING, "thread \"%s\" (%s): could not set its cpu affinity: %s",
+                       (name ? name : "?"), class_names[thread_class], strerror(affinity_ret));
+        }
+    }
+}
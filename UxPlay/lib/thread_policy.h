@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Names the server threads and places them by class: CPU affinity, and either
+ * a real-time policy (SCHED_FIFO/SCHED_RR with a priority) or a nice level.
+ * Each thread applies the policy of its class to itself when it starts, so
+ * threads created by libraries (the GStreamer streaming threads) are covered
+ * the same way as ours.  The policies are set before any thread starts and
+ * are read-only afterwards. */
+
+#ifndef THREAD_POLICY_H
+#define THREAD_POLICY_H
+
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    THREAD_CLASS_OTHER,      /* capture writer, media info, ... */
+    THREAD_CLASS_MIRROR,     /* mirror stream reception, video jitter buffer */
+    THREAD_CLASS_AUDIO,      /* audio RTP reception */
+    THREAD_CLASS_NTP,        /* clock synchronization with the client */
+    THREAD_CLASS_HTTPD,      /* RTSP/HTTP servers */
+    THREAD_CLASS_WS,         /* libwebsockets service */
+    THREAD_CLASS_GST_VIDEO,  /* GStreamer streaming threads of the video pipelines */
+    THREAD_CLASS_GST_AUDIO,  /* GStreamer streaming threads of the audio pipelines */
+    THREAD_CLASS_COUNT
+} thread_class_t;
+
+/* spec: <class>:<policy>[:<cpus>], class one of the names above ("gst-video"...)
+ * or "all"; policy "fifo/<prio>", "rr/<prio>", "nice/<n>" or empty (unchanged);
+ * cpus a list like "2-3,6".  Returns -1 if spec is invalid. */
+int thread_policy_set(const char *spec);
+
+/* logs the configured policies and what is likely to be refused; later
+ * failures to apply a policy are logged to logger too */
+void thread_policy_report(logger_t *logger);
+
+/* names the calling thread and applies the policy of thread_class to it */
+void thread_policy_apply(thread_class_t thread_class, const char *name);
+
+/* only names the calling thread: for the logger threads, which must not log
+ * a failure to apply a policy to themselves */
+void thread_policy_set_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //THREAD_POLICY_H
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Each thread gets its own buffer on its first event, found again through a
+ * pthread key.  The buffer mutex is only contended while trace_dump() copies
+ * that buffer, so recording an event never waits for another traced thread.
+ * Buffers of threads that have exited are freed after their events are dumped. */
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "threads.h"
+
+#define TRACE_EVENTS 16384        /* per thread; when full, the oldest events are overwritten */
+#define TRACE_NAME_LEN 48
+#define TRACE_THREAD_NAME_LEN 32
+
+typedef struct trace_event_s {
+    uint64_t ts;                  /* CLOCK_MONOTONIC, ns */
+    const char *cat;
+    char ph;                      /* 'B', 'E' or 'i' */
+    char name[TRACE_NAME_LEN];
+} trace_event_t;
+
+typedef struct trace_buffer_s {
+    struct trace_buffer_s *next;
+    unsigned int tid;
+    mutex_handle_t mutex;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool exited;
+    char thread_name[TRACE_THREAD_NAME_LEN];
+    uint64_t count;               /* events recorded since the last dump */
+    trace_event_t events[TRACE_EVENTS];
+    /* MUTEX LOCKED VARIABLES END */
+} trace_buffer_t;
+
+static atomic_bool enabled;
+static logger_t *trace_logger = NULL;
+static char *trace_prefix = NULL;
+static pthread_key_t buffer_key;
+
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* MUTEX LOCKED VARIABLES START */
+static trace_buffer_t *buffers = NULL;
+static unsigned int next_tid = 0;
+static unsigned int dump_count = 0;
+/* MUTEX LOCKED VARIABLES END */
+
+static void
+trace_copy_name(char *dst, const char *src, size_t len)
+{
+    size_t n = (src ? strlen(src) : 0);
+    n = (n < len - 1 ? n : len - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+/* pthread key destructor: runs when a traced thread exits */
+static void
+trace_thread_exit(void *arg)
+{
+    trace_buffer_t *buffer = arg;
+    MUTEX_LOCK(buffer->mutex);
+    buffer->exited = true;
+    MUTEX_UNLOCK(buffer->mutex);
+}
+
+static trace_buffer_t *
+trace_get_buffer()
+{
+    trace_buffer_t *buffer = pthread_getspecific(buffer_key);
+    if (buffer) {
+        return buffer;
+    }
+    buffer = calloc(1, sizeof(trace_buffer_t));
+    if (!buffer) {
+        return NULL;
+    }
+    MUTEX_CREATE(buffer->mutex);
+    pthread_mutex_lock(&buffers_mutex);
+    buffer->tid = ++next_tid;
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_mutex);
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+static void
+trace_record(char ph, const char *cat, const char *name)
+{
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_buffer_t *buffer = trace_get_buffer();
+    if (!buffer) {
+        return;
+    }
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    MUTEX_LOCK(buffer->mutex);
+    trace_event_t *event = &buffer->events[buffer->count++ % TRACE_EVENTS];
+    event->ts = (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+    event->cat = cat;
+    event->ph = ph;
+    trace_copy_name(event->name, name, sizeof(event->name));
+    MUTEX_UNLOCK(buffer->mutex);
+}
+
+void
+trace_begin(const char *cat, const char *name)
+{
+    trace_record('B', cat, name);
+}
+
+void
+trace_end(const char *cat, const char *name)
+{
+    trace_record('E', cat, name);
+}
+
+void
+trace_instant(const char *cat, const char *name)
+{
+    trace_record('i', cat, name);
+}
+
+void
+trace_thread_name(const char *name)
+{
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_buffer_t *buffer = trace_get_buffer();
+    if (buffer) {
+        MUTEX_LOCK(buffer->mutex);
+        trace_copy_name(buffer->thread_name, name, sizeof(buffer->thread_name));
+        MUTEX_UNLOCK(buffer->mutex);
+    }
+}
+
+bool
+trace_enabled()
+{
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+static void
+trace_write_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+int
+trace_dump()
+{
+    if (!atomic_load(&enabled)) {
+        return -1;
+    }
+    trace_event_t *events = malloc(TRACE_EVENTS * sizeof(trace_event_t));
+    if (!events) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&buffers_mutex);
+    uint64_t pending = 0;
+    for (trace_buffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+        MUTEX_LOCK(buffer->mutex);
+        pending += buffer->count;
+        MUTEX_UNLOCK(buffer->mutex);
+    }
+    if (!pending) {
+        /* nothing new since the last dump */
+        pthread_mutex_unlock(&buffers_mutex);
+        free(events);
+        return 0;
+    }
+    size_t len = strlen(trace_prefix) + 16;
+    char *filename = malloc(len);
+    if (!filename) {
+        pthread_mutex_unlock(&buffers_mutex);
+        free(events);
+        return -1;
+    }
+    snprintf(filename, len, "%s-%u.json", trace_prefix, ++dump_count);
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        logger_log(trace_logger, LOGGER_ERR, "trace: could not open %s", filename);
+        pthread_mutex_unlock(&buffers_mutex);
+        free(filename);
+        free(events);
+        return -1;
+    }
+
+    int written = 0;
+    uint64_t overwritten = 0;
+    fprintf(fp, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"uxplay\"}}");
+    trace_buffer_t **link = &buffers;
+    while (*link) {
+        trace_buffer_t *buffer = *link;
+        char thread_name[TRACE_THREAD_NAME_LEN];
+
+        /* copy out, so the traced thread is only held up for a memcpy */
+        MUTEX_LOCK(buffer->mutex);
+        uint64_t count = buffer->count;
+        size_t n = (size_t) (count < TRACE_EVENTS ? count : TRACE_EVENTS);
+        size_t first = (size_t) ((count - n) % TRACE_EVENTS);
+        size_t n1 = (first + n <= TRACE_EVENTS ? n : TRACE_EVENTS - first);
+        memcpy(events, buffer->events + first, n1 * sizeof(trace_event_t));
+        memcpy(events + n1, buffer->events, (n - n1) * sizeof(trace_event_t));
+        buffer->count = 0;
+        memcpy(thread_name, buffer->thread_name, sizeof(thread_name));
+        bool exited = buffer->exited;
+        MUTEX_UNLOCK(buffer->mutex);
+        overwritten += count - n;
+
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", buffer->tid);
+        if (thread_name[0]) {
+            trace_write_string(fp, thread_name);
+        } else {
+            fprintf(fp, "\"thread %u\"", buffer->tid);
+        }
+        fprintf(fp, "}}");
+        for (size_t i = 0; i < n; i++) {
+            fprintf(fp, ",\n{\"name\":");
+            trace_write_string(fp, events[i].name);
+            fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",%s\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u}",
+                    events[i].cat, events[i].ph, (events[i].ph == 'i' ? "\"s\":\"t\"," : ""),
+                    (unsigned long long) (events[i].ts / 1000), (unsigned int) (events[i].ts % 1000), buffer->tid);
+        }
+        written += (int) n;
+
+        if (exited) {
+            *link = buffer->next;
+            MUTEX_DESTROY(buffer->mutex);
+            free(buffer);
+        } else {
+            link = &buffer->next;
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(fp)) {
+        logger_log(trace_logger, LOGGER_ERR, "trace: error writing %s", filename);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    logger_log(trace_logger, LOGGER_INFO, "trace: wrote %d events to %s", written, filename);
+    if (overwritten) {
+        logger_log(trace_logger, LOGGER_WARNING, "trace: %llu older events were overwritten before the dump",
+                   (unsigned long long) overwritten);
+    }
+    free(filename);
+    free(events);
+    return written;
+}
+
+bool
+trace_init(logger_t *logger, const char *prefix)
+{
+    assert(prefix);
+    if (atomic_load(&enabled)) {
+        return true;
+    }
+    trace_prefix = strdup(prefix);
+    if (!trace_prefix || pthread_key_create(&buffer_key, trace_thread_exit)) {
+        free(trace_prefix);
+        trace_prefix = NULL;
+        return false;
+    }
+    trace_logger = logger;
+    atomic_store(&enabled, true);
+    return true;
+}
+
+/* call after the traced threads have stopped; events not yet dumped are lost */
+void
+trace_destroy()
+{
+    if (!atomic_load(&enabled)) {
+        return;
+    }
+    atomic_store(&enabled, false);
+    pthread_key_delete(buffer_key);
+    pthread_mutex_lock(&buffers_mutex);
+    while (buffers) {
+        trace_buffer_t *buffer = buffers;
+        buffers = buffer->next;
+        MUTEX_DESTROY(buffer->mutex);
+        free(buffer);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    free(trace_prefix);
+    trace_prefix = NULL;
+}
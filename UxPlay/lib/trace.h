@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Opt-in timeline tracer.  Begin/end (and instant) events are recorded with
+ * a monotonic timestamp into a ring buffer owned by the calling thread, and
+ * trace_dump() writes them out in the Chrome trace-event JSON format, which
+ * chrome://tracing and ui.perfetto.dev can open.  Until trace_init() is
+ * called every trace_*() call returns after a single flag test. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* events are written to <prefix>-<n>.json by each trace_dump() */
+bool trace_init(logger_t *logger, const char *prefix);
+void trace_destroy();
+bool trace_enabled();
+
+/* cat must be a string literal; name is copied (truncated to 47 chars) */
+void trace_begin(const char *cat, const char *name);
+void trace_end(const char *cat, const char *name);
+void trace_instant(const char *cat, const char *name);
+
+/* label the calling thread in the timeline */
+void trace_thread_name(const char *name);
+
+/* write out and clear the events recorded so far; can be called from any thread */
+int trace_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TRACE_H
@@ -225,6 +225,33 @@ char *utils_data_to_string(const unsigned char *data, int datalen, int chars_per
     return str;
 }
 
+/* the same as utils_data_to_string, into a caller buffer (e.g. on the stack), so that
+ * debug dumps on the streaming threads do not allocate; the dump is cut to whole bytes
+ * if it does not fit, and the number of bytes shown is returned */
+int utils_data_to_buffer(const unsigned char *data, int datalen, int chars_per_line, char *str, int size) {
+    assert(datalen >= 0);
+    assert(chars_per_line > 0);
+    assert(size > 1);
+    char *p = str;
+    int n = size;
+    int i;
+    for (i = 0; i < datalen; i++) {
+        int need = (i > 0 && i % chars_per_line == 0) ? 4 : 3;
+        if (need + 2 > n) {
+            break;
+        }
+        if (need == 4) {
+            *p++ = '\n';
+            n--;
+        }
+        snprintf(p, n, "%2.2x ", (unsigned int) data[i]);
+        n -= 3;
+        p += 3;
+    }
+    snprintf(p, n, "\n");
+    return i;
+}
+
 char *utils_data_to_text(const char *data, int datalen) {
     char *ptr = (char *) calloc(datalen + 1, sizeof(char));
     assert(ptr);
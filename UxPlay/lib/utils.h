@@ -27,6 +27,7 @@ int utils_hwaddr_airplay(char *str, int strlen, const char *hwaddr, int hwaddrle
 char *utils_parse_hex(const char *str, int str_len, int *data_len);
 char *utils_pk_to_string(const unsigned char *pk, int pk_len);
 char *utils_data_to_string(const unsigned char *data, int datalen, int chars_per_line);
+int utils_data_to_buffer(const unsigned char *data, int datalen, int chars_per_line, char *str, int size);
 char *utils_data_to_text(const char *data, int datalen);
 void ntp_timestamp_to_time(uint64_t ntp_timestamp, char *timestamp, size_t maxsize);
 void ntp_timestamp_to_seconds(uint64_t ntp_timestamp, char *timestamp, size_t maxsize);
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Video jitter buffer.
+ *
+ * The mirror thread hands over each access unit as soon as it has been
+ * received and decrypted; over Wi-Fi these arrive in bursts.  Here they are
+ * queued and released by a separate thread at
+ *
+ *     playout = pts + base_transit + target
+ *
+ * where pts is the frame timestamp already converted to the local clock by
+ * raop_ntp, base_transit tracks the smallest observed (arrival - pts), and
+ * target is the configured latency, raised to three times the RFC 3550
+ * interarrival jitter estimate when the network is worse than that.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "video_jitter.h"
+#include "threads.h"
+#include "thread_policy.h"
+
+#define SECOND_IN_NSECS 1000000000LL
+#define MSEC_IN_NSECS 1000000LL
+#define VIDEO_JITTER_SLOTS 64
+#define VIDEO_JITTER_MAX_TARGET (500 * MSEC_IN_NSECS)
+#define VIDEO_JITTER_TRANSIT_RESET SECOND_IN_NSECS  /* re-anchor after a stall or clock step */
+#define VIDEO_JITTER_TRANSIT_DRIFT 512              /* slow upward drift of the base transit */
+#define VIDEO_JITTER_REPORT_INTERVAL (5 * SECOND_IN_NSECS)
+
+typedef struct video_jitter_slot_s {
+    video_decode_struct frame;
+    int capacity;           /* allocated size of frame.data, reused between frames */
+    uint64_t playout;
+} video_jitter_slot_t;
+
+struct video_jitter_s {
+    logger_t *logger;
+    video_jitter_release_t release;
+    void *cls;
+    int64_t latency;        /* configured latency target (nsecs) */
+
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+    cond_handle_t wake_cond;
+    cond_handle_t space_cond;
+    /* held by the release thread while the callback runs, so flush() can wait for it */
+    mutex_handle_t release_mutex;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool running;
+    video_jitter_slot_t slots[VIDEO_JITTER_SLOTS];
+    int head;
+    int count;
+    bool releasing;         /* slot before head is with the release callback */
+
+    bool have_previous;
+    uint64_t previous_arrival;
+    uint64_t previous_pts;
+    int64_t base_transit;
+    int64_t jitter;         /* interarrival jitter estimate (nsecs) */
+    int64_t target;
+    uint64_t last_report;
+    unsigned int late_frames;
+    /* MUTEX LOCKED VARIABLES END */
+};
+
+static uint64_t
+video_jitter_now()
+{
+    /* same clock as raop_ntp_get_local_time() */
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static void
+video_jitter_reset_stats(video_jitter_t *jitter)
+{
+    jitter->have_previous = false;
+    jitter->base_transit = 0;
+    jitter->jitter = 0;
+    jitter->target = jitter->latency;
+    jitter->late_frames = 0;
+}
+
+/* must be called with mutex locked */
+static void
+video_jitter_update_stats(video_jitter_t *jitter, uint64_t arrival, uint64_t pts)
+{
+    int64_t transit = (int64_t) (arrival - pts);
+
+    if (!jitter->have_previous) {
+        jitter->base_transit = transit;
+    } else {
+        int64_t d = (int64_t) (arrival - jitter->previous_arrival) - (int64_t) (pts - jitter->previous_pts);
+        if (d < 0) {
+            d = -d;
+        }
+        if (d < VIDEO_JITTER_TRANSIT_RESET) {
+            jitter->jitter += (d - jitter->jitter) / 16;
+        }
+        if (transit < jitter->base_transit) {
+            jitter->base_transit = transit;
+        } else if (transit - jitter->base_transit > VIDEO_JITTER_TRANSIT_RESET) {
+            logger_log(jitter->logger, LOGGER_DEBUG, "video jitter buffer: transit time jumped by %lld msecs, re-anchoring",
+                       (long long) ((transit - jitter->base_transit) / MSEC_IN_NSECS));
+            jitter->base_transit = transit;
+        } else {
+            jitter->base_transit += (transit - jitter->base_transit) / VIDEO_JITTER_TRANSIT_DRIFT;
+        }
+    }
+    jitter->have_previous = true;
+    jitter->previous_arrival = arrival;
+    jitter->previous_pts = pts;
+
+    jitter->target = 3 * jitter->jitter;
+    if (jitter->target < jitter->latency) {
+        jitter->target = jitter->latency;
+    }
+    if (jitter->target > VIDEO_JITTER_MAX_TARGET) {
+        jitter->target = VIDEO_JITTER_MAX_TARGET;
+    }
+
+    if (arrival - jitter->last_report > VIDEO_JITTER_REPORT_INTERVAL) {
+        logger_log(jitter->logger, LOGGER_DEBUG, "video jitter buffer: jitter %lld.%03lld msecs, target %lld msecs, "
+                   "queued %d, late %u", (long long) (jitter->jitter / MSEC_IN_NSECS),
+                   (long long) ((jitter->jitter % MSEC_IN_NSECS) / 1000), (long long) (jitter->target / MSEC_IN_NSECS),
+                   jitter->count, jitter->late_frames);
+        jitter->last_report = arrival;
+        jitter->late_frames = 0;
+    }
+}
+
+static THREAD_RETVAL
+video_jitter_thread(void *arg)
+{
+    video_jitter_t *jitter = arg;
+    assert(jitter);
+    thread_policy_apply(THREAD_CLASS_MIRROR, "video_jitter");
+
+    MUTEX_LOCK(jitter->mutex);
+    while (jitter->running) {
+        if (!jitter->count) {
+            pthread_cond_wait(&jitter->wake_cond, &jitter->mutex);
+            continue;
+        }
+        video_jitter_slot_t *slot = &jitter->slots[jitter->head];
+        uint64_t now = video_jitter_now();
+        if (now < slot->playout && jitter->count < VIDEO_JITTER_SLOTS) {
+            struct timespec wait_time;
+            wait_time.tv_sec = (time_t) (slot->playout / SECOND_IN_NSECS);
+            wait_time.tv_nsec = (long) (slot->playout % SECOND_IN_NSECS);
+            pthread_cond_timedwait(&jitter->wake_cond, &jitter->mutex, &wait_time);
+            continue;
+        }
+
+        /* pop the slot and hand it to the callback without holding the queue lock;
+         * enqueue() leaves it alone while releasing is set */
+        jitter->head = (jitter->head + 1) % VIDEO_JITTER_SLOTS;
+        jitter->count--;
+        jitter->releasing = true;
+        MUTEX_LOCK(jitter->release_mutex);
+        MUTEX_UNLOCK(jitter->mutex);
+        jitter->release(jitter->cls, &slot->frame);
+        MUTEX_LOCK(jitter->mutex);
+        MUTEX_UNLOCK(jitter->release_mutex);
+        jitter->releasing = false;
+        COND_SIGNAL(jitter->space_cond);
+    }
+    MUTEX_UNLOCK(jitter->mutex);
+    return 0;
+}
+
+video_jitter_t *
+video_jitter_init(logger_t *logger, unsigned int latency_ms, video_jitter_release_t release, void *cls)
+{
+    video_jitter_t *jitter;
+
+    assert(logger);
+    assert(release);
+
+    jitter = calloc(1, sizeof(video_jitter_t));
+    if (!jitter) {
+        return NULL;
+    }
+    jitter->logger = logger;
+    jitter->release = release;
+    jitter->cls = cls;
+    jitter->latency = (int64_t) latency_ms * MSEC_IN_NSECS;
+    video_jitter_reset_stats(jitter);
+
+    MUTEX_CREATE(jitter->mutex);
+    MUTEX_CREATE(jitter->release_mutex);
+    COND_CREATE(jitter->wake_cond);
+    COND_CREATE(jitter->space_cond);
+
+    jitter->running = true;
+    THREAD_CREATE(jitter->thread, video_jitter_thread, jitter);
+    if (!jitter->thread) {
+        logger_log(logger, LOGGER_ERR, "video jitter buffer: could not create release thread");
+        jitter->running = false;
+        video_jitter_destroy(jitter);
+        return NULL;
+    }
+    logger_log(logger, LOGGER_DEBUG, "video jitter buffer started, latency target %u msecs", latency_ms);
+    return jitter;
+}
+
+void
+video_jitter_enqueue(video_jitter_t *jitter, raop_ntp_t *ntp, const video_decode_struct *data)
+{
+    uint64_t arrival = raop_ntp_get_local_time(ntp);
+    uint64_t pts = data->ntp_time_local;
+
+    MUTEX_LOCK(jitter->mutex);
+    /* queue full: the release thread drains the head immediately, wait for it */
+    while (jitter->running && jitter->count + jitter->releasing == VIDEO_JITTER_SLOTS) {
+        COND_SIGNAL(jitter->wake_cond);
+        pthread_cond_wait(&jitter->space_cond, &jitter->mutex);
+    }
+    if (!jitter->running) {
+        MUTEX_UNLOCK(jitter->mutex);
+        return;
+    }
+
+    video_jitter_slot_t *slot = &jitter->slots[(jitter->head + jitter->count) % VIDEO_JITTER_SLOTS];
+    if (slot->capacity < data->data_len) {
+        unsigned char *buf = realloc(slot->frame.data, data->data_len);
+        if (!buf) {
+            MUTEX_UNLOCK(jitter->mutex);
+            logger_log(jitter->logger, LOGGER_ERR, "video jitter buffer: failed to allocate %d bytes", data->data_len);
+            return;
+        }
+        slot->frame.data = buf;
+        slot->capacity = data->data_len;
+    }
+    unsigned char *buf = slot->frame.data;
+    slot->frame = *data;
+    slot->frame.data = buf;
+    memcpy(slot->frame.data, data->data, data->data_len);
+
+    video_jitter_update_stats(jitter, arrival, pts);
+    slot->playout = pts + jitter->base_transit + jitter->target;
+    if (slot->playout < arrival) {
+        jitter->late_frames++;
+    } else if (slot->playout > arrival + VIDEO_JITTER_MAX_TARGET) {
+        slot->playout = arrival + VIDEO_JITTER_MAX_TARGET;
+    }
+    jitter->count++;
+    COND_SIGNAL(jitter->wake_cond);
+    MUTEX_UNLOCK(jitter->mutex);
+}
+
+void
+video_jitter_flush(video_jitter_t *jitter)
+{
+    MUTEX_LOCK(jitter->mutex);
+    jitter->count = 0;
+    video_jitter_reset_stats(jitter);
+    MUTEX_UNLOCK(jitter->mutex);
+
+    /* wait for a callback that may still be running with a stale frame */
+    MUTEX_LOCK(jitter->release_mutex);
+    MUTEX_UNLOCK(jitter->release_mutex);
+}
+
+void
+video_jitter_destroy(video_jitter_t *jitter)
+{
+    if (!jitter) {
+        return;
+    }
+    MUTEX_LOCK(jitter->mutex);
+    bool was_running = jitter->running;
+    jitter->running = false;
+    COND_SIGNAL(jitter->wake_cond);
+    COND_SIGNAL(jitter->space_cond);
+    MUTEX_UNLOCK(jitter->mutex);
+    if (was_running) {
+        THREAD_JOIN(jitter->thread);
+    }
+
+    for (int i = 0; i < VIDEO_JITTER_SLOTS; i++) {
+        free(jitter->slots[i].frame.data);
+    }
+    COND_DESTROY(jitter->space_cond);
+    COND_DESTROY(jitter->wake_cond);
+    MUTEX_DESTROY(jitter->release_mutex);
+    MUTEX_DESTROY(jitter->mutex);
+    free(jitter);
+}
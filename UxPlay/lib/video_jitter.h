@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2024 UxPlay contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Small playout buffer that sits between the mirror thread and the video
+ * decoder.  Access units are held until their (local-clock) presentation
+ * time plus a latency target, which grows with measured arrival jitter. */
+
+#ifndef VIDEO_JITTER_H
+#define VIDEO_JITTER_H
+
+#include <stdint.h>
+#include "logger.h"
+#include "raop_ntp.h"
+#include "stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct video_jitter_s video_jitter_t;
+
+/* called from the jitter buffer thread; data (and data->data) is only valid during the call */
+typedef void (*video_jitter_release_t)(void *cls, video_decode_struct *data);
+
+video_jitter_t *video_jitter_init(logger_t *logger, unsigned int latency_ms,
+                                  video_jitter_release_t release, void *cls);
+void video_jitter_enqueue(video_jitter_t *jitter, raop_ntp_t *ntp, const video_decode_struct *data);
+void video_jitter_flush(video_jitter_t *jitter);
+void video_jitter_destroy(video_jitter_t *jitter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIDEO_JITTER_H
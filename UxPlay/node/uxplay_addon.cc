@@ -0,0 +1,310 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * uxplay.node: runs the AirPlay server inside the Node.js (Electron main)
+ * process, instead of as a separate uxplay process talking WebSocket.
+ *
+ *   const uxplay = require('./UxPlay/build/Release/uxplay.node');
+ *   uxplay.start(['-n', 'Electron', '-nh'], {
+ *       onFrame: ({ width, height, stride, pts, data }) => { ... },   // data: ArrayBuffer, RGBA
+ *       onEvent: (event, detail) => { ... },      // see node/uxplay_embed.h
+ *   });
+ *   uxplay.setViewport(width, height, fps);
+ *   uxplay.stop();
+ *
+ * Frames are handed over as external ArrayBuffers on the mapped GstBuffer, which
+ * is released when the ArrayBuffer is garbage collected; its size is reported to
+ * V8 as external memory so that collection keeps up with the frame rate.  Where external buffers
+ * are not allowed (Electron's V8 memory cage) each frame is copied once instead.
+ * At most FRAME_QUEUE frames wait for the JS thread; newer frames are dropped
+ * while it is busy.
+ */
+
+#include <node_api.h>
+#include <glib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "uxplay_embed.h"
+#include "../renderers/video_renderer.h"
+
+#define FRAME_QUEUE 2
+
+struct frame_msg {
+    video_frame_t *frame;
+    const unsigned char *data;
+    int width, height, stride;
+    uint64_t ntp_time;
+};
+
+struct event_msg {
+    std::string event;
+    std::string detail;
+};
+
+static napi_threadsafe_function frame_tsfn = NULL;
+static napi_threadsafe_function event_tsfn = NULL;
+static std::thread server_thread;
+static std::atomic<bool> started(false);
+
+#define NAPI_CALL(env, call)                                        \
+    do {                                                            \
+        if ((call) != napi_ok) {                                    \
+            napi_throw_error((env), NULL, "uxplay: " #call " failed"); \
+            return NULL;                                            \
+        }                                                           \
+    } while (0)
+
+/* GStreamer streaming thread */
+static void on_frame(void *user_data, video_frame_t *frame, const unsigned char *data,
+                     int width, int height, int stride, uint64_t ntp_time) {
+    frame_msg *msg = new frame_msg { frame, data, width, height, stride, ntp_time };
+    if (napi_call_threadsafe_function(frame_tsfn, msg, napi_tsfn_nonblocking) != napi_ok) {
+        /* queue full (JS is behind) or closing */
+        video_renderer_release_frame(frame);
+        delete msg;
+    }
+}
+
+/* server threads */
+static void on_event(void *user_data, const char *event, const char *detail) {
+    event_msg *msg = new event_msg { event, (detail ? detail : "") };
+    if (napi_call_threadsafe_function(event_tsfn, msg, napi_tsfn_nonblocking) != napi_ok) {
+        delete msg;
+    }
+}
+
+/* the message stays with the external ArrayBuffer, to release its frame on collection */
+static void finalize_frame(napi_env env, void *data, void *hint) {
+    frame_msg *msg = (frame_msg *) hint;
+    int64_t adjusted;
+    napi_adjust_external_memory(env, -(int64_t) msg->stride * msg->height, &adjusted);
+    video_renderer_release_frame(msg->frame);
+    delete msg;
+}
+
+static void set_named(napi_env env, napi_value object, const char *name, napi_value value) {
+    napi_set_named_property(env, object, name, value);
+}
+
+static napi_value make_int(napi_env env, int value) {
+    napi_value result;
+    napi_create_int32(env, value, &result);
+    return result;
+}
+
+/* JS thread */
+static void call_js_frame(napi_env env, napi_value js_callback, void *context, void *data) {
+    frame_msg *msg = (frame_msg *) data;
+    if (!env) {
+        /* the threadsafe function is being torn down */
+        video_renderer_release_frame(msg->frame);
+        delete msg;
+        return;
+    }
+    size_t len = (size_t) msg->stride * msg->height;
+    napi_value buffer;
+    bool external = (napi_create_external_arraybuffer(env, (void *) msg->data, len, finalize_frame,
+                                                      msg, &buffer) == napi_ok);
+    if (external) {
+        /* V8 cannot see the mapped frame; without this it collects too rarely and the *
+         * pinned samples starve the decoder's buffer pool                             */
+        int64_t adjusted;
+        napi_adjust_external_memory(env, (int64_t) len, &adjusted);
+    } else {
+        void *copy;
+        napi_status status = napi_create_arraybuffer(env, len, &copy, &buffer);
+        if (status == napi_ok) {
+            memcpy(copy, msg->data, len);
+        }
+        video_renderer_release_frame(msg->frame);
+        if (status != napi_ok) {
+            delete msg;
+            return;
+        }
+    }
+
+    napi_value frame, pts;
+    napi_create_object(env, &frame);
+    set_named(env, frame, "width", make_int(env, msg->width));
+    set_named(env, frame, "height", make_int(env, msg->height));
+    set_named(env, frame, "stride", make_int(env, msg->stride));
+    /* as in the WebSocket header: presentation time in ns on the host realtime clock */
+    napi_create_bigint_uint64(env, msg->ntp_time, &pts);
+    set_named(env, frame, "pts", pts);
+    set_named(env, frame, "data", buffer);
+    if (!external) {
+        delete msg;
+    }
+
+    napi_value global;
+    napi_get_global(env, &global);
+    napi_call_function(env, global, js_callback, 1, &frame, NULL);
+}
+
+static void call_js_event(napi_env env, napi_value js_callback, void *context, void *data) {
+    event_msg *msg = (event_msg *) data;
+    if (env) {
+        napi_value global, argv[2];
+        napi_get_global(env, &global);
+        napi_create_string_utf8(env, msg->event.c_str(), NAPI_AUTO_LENGTH, &argv[0]);
+        if (msg->detail.empty()) {
+            napi_get_null(env, &argv[1]);
+        } else {
+            napi_create_string_utf8(env, msg->detail.c_str(), NAPI_AUTO_LENGTH, &argv[1]);
+        }
+        napi_call_function(env, global, js_callback, 2, argv, NULL);
+    }
+    delete msg;
+}
+
+static void server_main(std::vector<std::string> args) {
+    /* the host (Electron on Linux) runs its own loop on the global default context */
+    GMainContext *context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+
+    std::vector<char *> argv;
+    for (std::string &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(NULL);
+    uxplay_main((int) args.size(), argv.data());
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+}
+
+static napi_value get_callback(napi_env env, napi_value options, const char *name) {
+    bool has = false;
+    napi_value value = NULL;
+    napi_valuetype type = napi_undefined;
+    if (napi_has_named_property(env, options, name, &has) == napi_ok && has &&
+        napi_get_named_property(env, options, name, &value) == napi_ok &&
+        napi_typeof(env, value, &type) == napi_ok && type == napi_function) {
+        return value;
+    }
+    return NULL;
+}
+
+/* start(args: string[], { onFrame, onEvent }) */
+static napi_value start(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value argv[2];
+    NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+
+    bool is_array = false;
+    if (argc < 1 || napi_is_array(env, argv[0], &is_array) != napi_ok || !is_array) {
+        napi_throw_type_error(env, NULL, "uxplay.start: expected an array of command-line options");
+        return NULL;
+    }
+    if (started.exchange(true)) {
+        napi_throw_error(env, NULL, "uxplay.start: the server can only be started once per process");
+        return NULL;
+    }
+
+    std::vector<std::string> args { "uxplay" };
+    uint32_t n = 0;
+    NAPI_CALL(env, napi_get_array_length(env, argv[0], &n));
+    for (uint32_t i = 0; i < n; i++) {
+        napi_value element;
+        size_t len = 0;
+        NAPI_CALL(env, napi_get_element(env, argv[0], i, &element));
+        NAPI_CALL(env, napi_get_value_string_utf8(env, element, NULL, 0, &len));
+        std::string arg(len, '\0');
+        NAPI_CALL(env, napi_get_value_string_utf8(env, element, &arg[0], len + 1, &len));
+        args.push_back(arg);
+    }
+
+    napi_value on_frame_js = (argc > 1 ? get_callback(env, argv[1], "onFrame") : NULL);
+    napi_value on_event_js = (argc > 1 ? get_callback(env, argv[1], "onEvent") : NULL);
+    napi_value name;
+    if (on_frame_js) {
+        napi_create_string_utf8(env, "uxplay frames", NAPI_AUTO_LENGTH, &name);
+        NAPI_CALL(env, napi_create_threadsafe_function(env, on_frame_js, NULL, name, FRAME_QUEUE, 1,
+                                                       NULL, NULL, NULL, call_js_frame, &frame_tsfn));
+        /* do not keep the host alive on our account */
+        napi_unref_threadsafe_function(env, frame_tsfn);
+        video_renderer_set_frame_callback(on_frame, NULL);
+    }
+    if (on_event_js) {
+        napi_create_string_utf8(env, "uxplay events", NAPI_AUTO_LENGTH, &name);
+        NAPI_CALL(env, napi_create_threadsafe_function(env, on_event_js, NULL, name, 0, 1,
+                                                       NULL, NULL, NULL, call_js_event, &event_tsfn));
+        napi_unref_threadsafe_function(env, event_tsfn);
+        uxplay_set_event_callback(on_event, NULL);
+    }
+
+    server_thread = std::thread(server_main, args);
+
+    napi_value result;
+    napi_get_boolean(env, true, &result);
+    return result;
+}
+
+/* stop(): returns when the server has shut down */
+static napi_value stop(napi_env env, napi_callback_info info) {
+    if (server_thread.joinable()) {
+        uxplay_stop();
+        server_thread.join();
+    }
+    /* no server thread can call them any more */
+    video_renderer_set_frame_callback(NULL, NULL);
+    uxplay_set_event_callback(NULL, NULL);
+    if (frame_tsfn) {
+        napi_release_threadsafe_function(frame_tsfn, napi_tsfn_release);
+        frame_tsfn = NULL;
+    }
+    if (event_tsfn) {
+        napi_release_threadsafe_function(event_tsfn, napi_tsfn_release);
+        event_tsfn = NULL;
+    }
+    return NULL;
+}
+
+/* setViewport(width, height, fps): as the "viewport" WebSocket command */
+static napi_value set_viewport(napi_env env, napi_callback_info info) {
+    size_t argc = 3;
+    napi_value argv[3];
+    uint32_t value[3] = { 0, 0, 0 };
+    NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+    for (size_t i = 0; i < argc && i < 3; i++) {
+        if (napi_get_value_uint32(env, argv[i], &value[i]) != napi_ok) {
+            napi_throw_type_error(env, NULL, "uxplay.setViewport: expected (width, height, fps)");
+            return NULL;
+        }
+    }
+    video_renderer_set_viewport(value[0], value[1], value[2]);
+    return NULL;
+}
+
+static napi_value init(napi_env env, napi_value exports) {
+    napi_property_descriptor properties[] = {
+        { "start", NULL, start, NULL, NULL, NULL, napi_default, NULL },
+        { "stop", NULL, stop, NULL, NULL, NULL, napi_default, NULL },
+        { "setViewport", NULL, set_viewport, NULL, NULL, NULL, napi_default, NULL },
+    };
+    NAPI_CALL(env, napi_define_properties(env, exports, sizeof(properties) / sizeof(properties[0]), properties));
+    return exports;
+}
+
+NAPI_MODULE(uxplay, init)
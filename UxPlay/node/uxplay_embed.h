@@ -0,0 +1,53 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Entry points of uxplay.cpp when it is built into the Node.js addon
+ * (-DUXPLAY_EMBEDDED): main() becomes uxplay_main(), which the addon runs on a
+ * thread of its own, with a GMainContext of its own pushed as thread default.
+ */
+
+#ifndef UXPLAY_EMBED_H
+#define UXPLAY_EMBED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* event: "client" (detail = device name), "connect", "disconnect", "reset",
+ * "codec" (detail = "h264" or "h265"), "size" (detail = "<width>x<height>" of the stream),
+ * "report" (detail = JSON client streaming report, once a second while mirroring),
+ * "metadata" (detail = JSON "now playing" metadata and cover-art size/hash, on change) */
+typedef void (*uxplay_event_callback_t)(void *user_data, const char *event, const char *detail);
+
+/* command line as for the uxplay binary; returns when uxplay_stop() is called.
+ * Can only be run once per process (the options live in static variables). */
+int uxplay_main(int argc, char *argv[]);
+
+/* thread-safe; makes uxplay_main() return */
+void uxplay_stop();
+
+/* call before uxplay_main(); callback runs on the server threads */
+void uxplay_set_event_callback(uxplay_event_callback_t callback, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UXPLAY_EMBED_H
@@ -0,0 +1,212 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include "audio_decoder.h"
+
+/* ALAC magic cookie ("alac" atom with its ALACSpecificConfig): 352 frames per packet, 16 bit, 44100/2 */
+static const unsigned char alac_cookie[] = {
+    0x00, 0x00, 0x00, 0x24, 0x61, 0x6c, 0x61, 0x63, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x60, 0x00, 0x10, 0x28, 0x0a, 0x0e, 0x02, 0x00, 0xff,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xac, 0x44
+};
+
+/* MPEG-4 AudioSpecificConfig (ISO 14496-3 Section 1.6.2.1), 44100/2 */
+static const unsigned char aac_lc_config[] = { 0x12, 0x10 };
+static const unsigned char aac_eld_config[] = { 0xf8, 0xe8, 0x50, 0x00 };
+
+struct audio_decoder_s {
+    AVCodecContext *context;
+    AVPacket *packet;
+    AVFrame *frame;
+    unsigned char *input;   /* copy of the compressed frame, with the padding libavcodec reads past its end */
+    int input_size;
+};
+
+static int audio_decoder_channels(const AVFrame *frame) {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+    return frame->ch_layout.nb_channels;
+#else
+    return frame->channels;
+#endif
+}
+
+audio_decoder_t *audio_decoder_create(unsigned char ct) {
+    enum AVCodecID codec_id;
+    const unsigned char *extradata;
+    int extradata_size;
+    switch (ct) {
+    case 2:
+        codec_id = AV_CODEC_ID_ALAC;
+        extradata = alac_cookie;
+        extradata_size = sizeof(alac_cookie);
+        break;
+    case 4:
+        codec_id = AV_CODEC_ID_AAC;
+        extradata = aac_lc_config;
+        extradata_size = sizeof(aac_lc_config);
+        break;
+    case 8:
+        codec_id = AV_CODEC_ID_AAC;
+        extradata = aac_eld_config;
+        extradata_size = sizeof(aac_eld_config);
+        break;
+    default:
+        return NULL;
+    }
+    const AVCodec *codec = avcodec_find_decoder(codec_id);
+    if (!codec) {
+        return NULL;
+    }
+
+    audio_decoder_t *decoder = (audio_decoder_t *) calloc(1, sizeof(audio_decoder_t));
+    if (!decoder) {
+        return NULL;
+    }
+    decoder->context = avcodec_alloc_context3(codec);
+    decoder->packet = av_packet_alloc();
+    decoder->frame = av_frame_alloc();
+    if (!decoder->context || !decoder->packet || !decoder->frame) {
+        audio_decoder_destroy(decoder);
+        return NULL;
+    }
+    decoder->context->extradata = (uint8_t *) av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!decoder->context->extradata) {
+        audio_decoder_destroy(decoder);
+        return NULL;
+    }
+    memcpy(decoder->context->extradata, extradata, extradata_size);
+    decoder->context->extradata_size = extradata_size;
+    decoder->context->sample_rate = AUDIO_DECODER_RATE;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+    av_channel_layout_default(&decoder->context->ch_layout, AUDIO_DECODER_CHANNELS);
+#else
+    decoder->context->channels = AUDIO_DECODER_CHANNELS;
+#endif
+    if (avcodec_open2(decoder->context, codec, NULL) < 0) {
+        audio_decoder_destroy(decoder);
+        return NULL;
+    }
+    return decoder;
+}
+
+void audio_decoder_destroy(audio_decoder_t *decoder) {
+    if (!decoder) {
+        return;
+    }
+    avcodec_free_context(&decoder->context);
+    av_packet_free(&decoder->packet);
+    av_frame_free(&decoder->frame);
+    av_free(decoder->input);
+    free(decoder);
+}
+
+void audio_decoder_flush(audio_decoder_t *decoder) {
+    avcodec_flush_buffers(decoder->context);
+}
+
+static inline int16_t audio_decoder_float_to_s16(float sample) {
+    int value = (int) lrintf(sample * 32768.0f);
+    return (int16_t) (value > 32767 ? 32767 : (value < -32768 ? -32768 : value));
+}
+
+/* appends the decoded frame to pcm; mono is sent to both channels */
+static int audio_decoder_convert(const AVFrame *frame, int16_t *pcm, int max_frames) {
+    int channels = audio_decoder_channels(frame);
+    int n = (frame->nb_samples < max_frames ? frame->nb_samples : max_frames);
+    if (channels < 1 || channels > AUDIO_DECODER_CHANNELS) {
+        return -1;
+    }
+    int right = channels - 1;
+    switch (frame->format) {
+    case AV_SAMPLE_FMT_FLTP: {   /* AAC */
+        const float *l = (const float *) frame->extended_data[0];
+        const float *r = (const float *) frame->extended_data[right];
+        for (int i = 0; i < n; i++) {
+            pcm[2 * i] = audio_decoder_float_to_s16(l[i]);
+            pcm[2 * i + 1] = audio_decoder_float_to_s16(r[i]);
+        }
+        break;
+    }
+    case AV_SAMPLE_FMT_S16P: {   /* ALAC, 16 bit */
+        const int16_t *l = (const int16_t *) frame->extended_data[0];
+        const int16_t *r = (const int16_t *) frame->extended_data[right];
+        for (int i = 0; i < n; i++) {
+            pcm[2 * i] = l[i];
+            pcm[2 * i + 1] = r[i];
+        }
+        break;
+    }
+    case AV_SAMPLE_FMT_S32P: {   /* ALAC, 20-32 bit */
+        const int32_t *l = (const int32_t *) frame->extended_data[0];
+        const int32_t *r = (const int32_t *) frame->extended_data[right];
+        for (int i = 0; i < n; i++) {
+            pcm[2 * i] = (int16_t) (l[i] >> 16);
+            pcm[2 * i + 1] = (int16_t) (r[i] >> 16);
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+    return n;
+}
+
+int audio_decoder_decode(audio_decoder_t *decoder, const unsigned char *data, int data_len,
+                         int16_t *pcm, int max_frames) {
+    if (data_len > decoder->input_size) {
+        av_free(decoder->input);
+        decoder->input = (unsigned char *) av_malloc(data_len + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!decoder->input) {
+            decoder->input_size = 0;
+            return -1;
+        }
+        decoder->input_size = data_len;
+    }
+    memcpy(decoder->input, data, data_len);
+    memset(decoder->input + data_len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    decoder->packet->data = decoder->input;
+    decoder->packet->size = data_len;
+
+    int ret = avcodec_send_packet(decoder->context, decoder->packet);
+    if (ret < 0) {
+        return -1;
+    }
+    int frames = 0;
+    while (1) {
+        ret = avcodec_receive_frame(decoder->context, decoder->frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            break;
+        } else if (ret < 0) {
+            return -1;
+        }
+        /* frames that do not fit are dropped, so the decoder is always drained */
+        int n = audio_decoder_convert(decoder->frame, pcm + AUDIO_DECODER_CHANNELS * frames, max_frames - frames);
+        av_frame_unref(decoder->frame);
+        if (n < 0) {
+            return -1;
+        }
+        frames += n;
+    }
+    return frames;
+}
@@ -0,0 +1,52 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * In-process decoding of the compressed AirPlay audio formats with libavcodec
+ * (already linked for video), so the audio pipelines only carry PCM.  One
+ * decoder per format, created once and reused for every session.
+ */
+
+#ifndef AUDIO_DECODER_H
+#define AUDIO_DECODER_H
+
+#include <stdint.h>
+
+#define AUDIO_DECODER_CHANNELS 2
+#define AUDIO_DECODER_RATE 44100
+
+typedef struct audio_decoder_s audio_decoder_t;
+
+/* ct: AirPlay compression type, 2 (ALAC), 4 (AAC-LC) or 8 (AAC-ELD);  *
+ * NULL if the libavcodec in use cannot decode that format             */
+audio_decoder_t *audio_decoder_create(unsigned char ct);
+void audio_decoder_destroy(audio_decoder_t *decoder);
+
+/* drop the state of the previous stream (new connection) */
+void audio_decoder_flush(audio_decoder_t *decoder);
+
+/**
+ * Decodes one compressed frame into pcm as interleaved stereo S16 (native
+ * endianness), at most max_frames sample frames.  Returns the number of
+ * sample frames written, 0 if the decoder needs more input, or -1.
+ */
+int audio_decoder_decode(audio_decoder_t *decoder, const unsigned char *data, int data_len,
+                         int16_t *pcm, int max_frames);
+
+#endif //AUDIO_DECODER_H
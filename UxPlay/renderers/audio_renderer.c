@@ -23,7 +23,13 @@
 #include <math.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/base/gstadapter.h>
 #include "audio_renderer.h"
+#include "audio_decoder.h"
+#include "stream_threads.h"
+#include "../lib/metrics.h"
+#include "../lib/trace.h"
 #define SECOND_IN_NSECS 1000000000UL
 
 #define NFORMATS 2     /* set to 4 to enable AAC_LD and PCM:  allowed, but  never seen in real-world use */
@@ -31,11 +37,10 @@
 static GstClockTime gst_audio_pipeline_base_time = GST_CLOCK_TIME_NONE;
 static logger_t *logger = NULL;
 const char * format[NFORMATS];
+static const unsigned char format_ct[4] = { 8, 2, 4, 1 };    /* AAC-ELD, ALAC, AAC-LC, PCM */
 
 static const gchar *avdec_aac = "avdec_aac";
 static const gchar *avdec_alac = "avdec_alac";
-static gboolean aac = FALSE;
-static gboolean alac = FALSE;
 static gboolean render_audio = FALSE;
 static gboolean async = FALSE;
 static gboolean vsync = FALSE;
@@ -46,12 +51,39 @@ typedef struct audio_renderer_s {
     GstElement *pipeline;
     GstElement *volume;
     unsigned char ct;
+    gboolean can_decode;        /* in-process, or with the GStreamer libav plugin */
+    audio_decoder_t *decoder;   /* NULL: the pipeline decodes */
+    GstBufferPool *pool;        /* decoded PCM blocks, reused */
+    GstAdapter *pcm_adapter;    /* decoded audio waiting to fill a chunk (pcm appsink thread) */
+    uint64_t pcm_ntp_time;      /* of the first sample in pcm_adapter */
 } audio_renderer_t ;
 static audio_renderer_t *renderer_type[NFORMATS];
 static audio_renderer_t *renderer = NULL;
 
+/* optional copy of the decoded audio for the consumer */
+#define PCM_RATE 44100
+#define PCM_CHANNELS 2
+#define PCM_BYTES_PER_FRAME (2 * PCM_CHANNELS)
+#define PCM_MAX_GAP (20 * GST_MSECOND)    /* larger timestamp jumps restart the chunking */
+static unsigned int pcm_chunk_frames = 0;
+static audio_renderer_pcm_cb_t pcm_callback = NULL;
+static GstCaps *ntp_time_caps = NULL;     /* tags the ntp_time of each input buffer */
+
+/* the compressed frames are at most 1024 (AAC-LC) sample frames */
+#define DECODED_MAX_FRAMES 4096
+#define DECODED_POOL_BUFFERS 8
+
 /* GStreamer Caps strings for Airplay-defined audio compression types (ct) */
 
+/* output of audio_decoder, pushed when the format is decoded in-process */
+static const char decoded_caps[] = "audio/x-raw,rate=(int)44100,channels=(int)2,format="
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+                                   "S16LE"
+#else
+                                   "S16BE"
+#endif
+                                   ",layout=interleaved";
+
 /* ct = 1; linear PCM (uncompressed): 44100/16/2, S16LE */
 static const char lpcm_caps[]="audio/x-raw,rate=(int)44100,channels=(int)2,format=S16LE,layout=interleaved";
 
@@ -120,6 +152,69 @@ static gboolean check_plugin_feature (const gchar *needed_feature)
     return ret;
 }
 
+void audio_renderer_set_pcm_output(unsigned int chunk_ms, audio_renderer_pcm_cb_t callback) {
+    pcm_chunk_frames = (callback ? PCM_RATE * chunk_ms / 1000 : 0);
+    pcm_callback = callback;
+}
+
+/* timeline marker for the tracer (option -trace); user_data is the event name */
+static GstPadProbeReturn trace_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    trace_instant("gst", (const char *) user_data);
+    return GST_PAD_PROBE_OK;
+}
+
+/* ntp_time of a decoded buffer: the reference timestamp attached to the compressed  *
+ * input is carried through the decoder; without it (GStreamer < 1.14), fall back to *
+ * the pipeline clock                                                                */
+static uint64_t pcm_buffer_ntp_time(GstBuffer *buffer, GstClock *clock) {
+#if GST_CHECK_VERSION(1,14,0)
+    GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta(buffer, ntp_time_caps);
+    if (meta) {
+        return meta->timestamp;
+    }
+#endif
+    if (sync && GST_BUFFER_PTS_IS_VALID(buffer)) {
+        return GST_BUFFER_PTS(buffer) + gst_audio_pipeline_base_time;
+    }
+    return (uint64_t) gst_clock_get_time(clock);
+}
+
+static GstFlowReturn on_pcm_sample(GstAppSink *sink, gpointer user_data) {
+    audio_renderer_t *r = (audio_renderer_t *) user_data;
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample) {
+        return GST_FLOW_ERROR;
+    }
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(sink));
+    uint64_t ntp_time = pcm_buffer_ntp_time(buffer, clock);
+    if (clock) {
+        gst_object_unref(clock);
+    }
+
+    /* the chunks are fixed-size, so stamps are interpolated between input buffers */
+    gsize queued = gst_adapter_available(r->pcm_adapter);
+    uint64_t expected = r->pcm_ntp_time + gst_util_uint64_scale(queued / PCM_BYTES_PER_FRAME, GST_SECOND, PCM_RATE);
+    if (!queued) {
+        r->pcm_ntp_time = ntp_time;
+    } else if (ntp_time > expected + PCM_MAX_GAP || ntp_time + PCM_MAX_GAP < expected) {
+        gst_adapter_clear(r->pcm_adapter);
+        r->pcm_ntp_time = ntp_time;
+    }
+    gst_adapter_push(r->pcm_adapter, gst_buffer_ref(buffer));
+    gst_sample_unref(sample);
+
+    gsize chunk_size = (gsize) pcm_chunk_frames * PCM_BYTES_PER_FRAME;
+    while (gst_adapter_available(r->pcm_adapter) >= chunk_size) {
+        const guint8 *pcm = gst_adapter_map(r->pcm_adapter, chunk_size);
+        pcm_callback(pcm, (int) pcm_chunk_frames, PCM_CHANNELS, PCM_RATE, r->pcm_ntp_time);
+        gst_adapter_unmap(r->pcm_adapter);
+        gst_adapter_flush(r->pcm_adapter, chunk_size);
+        r->pcm_ntp_time += gst_util_uint64_scale(pcm_chunk_frames, GST_SECOND, PCM_RATE);
+    }
+    return GST_FLOW_OK;
+}
+
 bool gstreamer_init(){
     gst_init(NULL,NULL);    
     return (bool) check_plugins ();
@@ -132,31 +227,59 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
     g_object_set(clock, "clock-type", GST_CLOCK_TYPE_REALTIME, NULL);
 
     logger = render_logger;
+    if (!ntp_time_caps) {
+        ntp_time_caps = gst_caps_new_empty_simple("timestamp/x-ntp-local");
+    }
     
-    aac = check_plugin_feature (avdec_aac);
-    alac = check_plugin_feature (avdec_alac);
+    /* the GStreamer libav plugin is only needed if libavcodec cannot decode a format itself */
+    gboolean aac = FALSE;
+    gboolean alac = FALSE;
+    gboolean aac_checked = FALSE;
+    gboolean alac_checked = FALSE;
 
     for (int i = 0; i < NFORMATS ; i++) {
         renderer_type[i] = (audio_renderer_t *)  calloc(1,sizeof(audio_renderer_t));
         g_assert(renderer_type[i]);
+        renderer_type[i]->ct = format_ct[i];
+        renderer_type[i]->decoder = audio_decoder_create(format_ct[i]);
         GString *launch = g_string_new("appsrc name=audio_source ! ");
-        g_string_append(launch, "queue ! ");
-        switch (i) {
-        case 0:    /* AAC-ELD */
-        case 2:    /* AAC-LC */
-            if (aac) g_string_append(launch, "avdec_aac ! ");
-            break;
-        case 1:    /* ALAC */
-            if (alac) g_string_append(launch, "avdec_alac ! ");
-            break;
-        case 3:   /*PCM*/
-            break;
-        default:
-            break;
+        if (renderer_type[i]->decoder) {
+            /* appsrc pushes from its own streaming thread: no queue needed */
+            renderer_type[i]->can_decode = TRUE;
+        } else {
+            g_string_append(launch, "queue ! ");
+            switch (i) {
+            case 0:    /* AAC-ELD */
+            case 2:    /* AAC-LC */
+                if (!aac_checked) {
+                    aac = check_plugin_feature (avdec_aac);
+                    aac_checked = TRUE;
+                }
+                if (aac) g_string_append(launch, "avdec_aac ! ");
+                renderer_type[i]->can_decode = aac;
+                break;
+            case 1:    /* ALAC */
+                if (!alac_checked) {
+                    alac = check_plugin_feature (avdec_alac);
+                    alac_checked = TRUE;
+                }
+                if (alac) g_string_append(launch, "avdec_alac ! ");
+                renderer_type[i]->can_decode = alac;
+                break;
+            case 3:   /*PCM*/
+                renderer_type[i]->can_decode = TRUE;
+                break;
+            default:
+                break;
+            }
         }
         g_string_append (launch, "audioconvert ! ");
         g_string_append (launch, "audioresample ! ");    /* wasapisink must resample from 44.1 kHz to 48 kHz */
-        g_string_append (launch, "volume name=volume ! level ! ");
+        g_string_append (launch, "volume name=volume ! ");
+        if (pcm_callback) {
+            g_string_append (launch, "tee name=audiotee ! queue ! ");
+        }
+        g_string_append (launch, "level ! ");
         g_string_append (launch, audiosink);
         switch(i) {
         case 1:  /*ALAC*/
@@ -178,6 +301,14 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
             }
             break;
         }
+        if (pcm_callback) {
+            /* never synchronized here: the consumer schedules the chunks by their ntp_time */
+            g_string_append (launch, " audiotee. ! queue leaky=downstream max-size-time=500000000 ! ");
+            g_string_append (launch, "audioconvert ! audioresample ! ");
+            g_string_append_printf (launch, "audio/x-raw,format=S16LE,layout=interleaved,rate=%d,channels=%d ! ",
+                                    PCM_RATE, PCM_CHANNELS);
+            g_string_append (launch, "appsink name=pcm_sink sync=false");
+        }
         renderer_type[i]->pipeline  = gst_parse_launch(launch->str, &error);
 	if (error) {
           g_error ("gst_parse_launch error (audio %d):\n %s\n", i+1, error->message);
@@ -186,34 +317,59 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
 
         g_assert (renderer_type[i]->pipeline);
         gst_pipeline_use_clock(GST_PIPELINE_CAST(renderer_type[i]->pipeline), clock);
+        stream_threads_set_policy(renderer_type[i]->pipeline, THREAD_CLASS_GST_AUDIO);
 
         renderer_type[i]->appsrc = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "audio_source");
         renderer_type[i]->volume = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "volume");
+        if (trace_enabled()) {
+            GstPad *pad = gst_element_get_static_pad(renderer_type[i]->appsrc, "src");
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, trace_probe, (gpointer) "audio appsrc", NULL);
+            gst_object_unref(pad);
+        }
+        if (pcm_callback) {
+            static GstAppSinkCallbacks pcm_callbacks = {
+                .eos         = NULL,
+                .new_preroll = NULL,
+                .new_sample  = on_pcm_sample
+            };
+            GstElement *pcm_sink = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "pcm_sink");
+            g_assert(pcm_sink);
+            renderer_type[i]->pcm_adapter = gst_adapter_new();
+            gst_app_sink_set_callbacks(GST_APP_SINK(pcm_sink), &pcm_callbacks, renderer_type[i], NULL);
+            gst_object_unref(pcm_sink);
+        }
         switch (i) {
         case 0:
             caps =  gst_caps_from_string(aac_eld_caps);
-            renderer_type[i]->ct = 8;
             format[i] = "AAC-ELD 44100/2";
             break;
         case 1:
             caps =  gst_caps_from_string(alac_caps);
-            renderer_type[i]->ct = 2;
             format[i] = "ALAC 44100/16/2";
             break;
         case 2:
             caps =  gst_caps_from_string(aac_lc_caps);
-            renderer_type[i]->ct = 4;
             format[i] = "AAC-LC 44100/2";
             break;
         case 3:
             caps =  gst_caps_from_string(lpcm_caps);
-            renderer_type[i]->ct = 1;
             format[i] = "PCM 44100/16/2 S16LE";
             break;
         default:
             break;
         }
-        logger_log(logger, LOGGER_DEBUG, "Audio format %d: %s",i+1,format[i]);
+        if (renderer_type[i]->decoder) {
+            gst_caps_unref(caps);
+            caps = gst_caps_from_string(decoded_caps);
+            renderer_type[i]->pool = gst_buffer_pool_new();
+            GstStructure *config = gst_buffer_pool_get_config(renderer_type[i]->pool);
+            gst_buffer_pool_config_set_params(config, NULL, DECODED_MAX_FRAMES * PCM_BYTES_PER_FRAME,
+                                              DECODED_POOL_BUFFERS, 0);
+            gst_buffer_pool_set_config(renderer_type[i]->pool, config);
+            gst_buffer_pool_set_active(renderer_type[i]->pool, TRUE);
+        }
+        logger_log(logger, LOGGER_DEBUG, "Audio format %d: %s%s",i+1,format[i],
+                   (renderer_type[i]->decoder ? " (decoded in-process by libavcodec)" : ""));
         logger_log(logger, LOGGER_DEBUG, "GStreamer audio pipeline %d: \"%s\"", i+1, launch->str);
         g_string_free(launch, TRUE);
         g_object_set(renderer_type[i]->appsrc, "caps", caps, "stream-type", 0, "is-live", TRUE, "format", GST_FORMAT_TIME, NULL);
@@ -226,6 +382,9 @@ void audio_renderer_stop() {
     if (renderer) {
         gst_app_src_end_of_stream(GST_APP_SRC(renderer->appsrc));
         gst_element_set_state (renderer->pipeline, GST_STATE_NULL);
+        if (renderer->pcm_adapter) {
+            gst_adapter_clear(renderer->pcm_adapter);
+        }
         renderer = NULL;
     }
 }
@@ -242,18 +401,20 @@ static void get_renderer_type(unsigned char *ct, int *id) {
     switch (*id) {
     case 2:
     case 0:
-        if (aac) {
+        if (renderer_type[*id]->can_decode) {
             render_audio = TRUE;
         } else {
-            logger_log(logger, LOGGER_INFO, "*** GStreamer libav plugin feature avdec_aac is missing, cannot decode AAC audio");
+            logger_log(logger, LOGGER_INFO, "*** neither libavcodec nor the GStreamer libav plugin (avdec_aac) "
+                       "can decode AAC audio");
         }
         sync = vsync;
         break;
     case 1:
-        if (alac) {
+        if (renderer_type[*id]->can_decode) {
             render_audio = TRUE;
         } else {
-            logger_log(logger, LOGGER_INFO, "*** GStreamer libav plugin feature avdec_alac is missing, cannot decode ALAC audio");
+            logger_log(logger, LOGGER_INFO, "*** neither libavcodec nor the GStreamer libav plugin (avdec_alac) "
+                       "can decode ALAC audio");
         }
         sync = async;
         break;
@@ -273,14 +434,23 @@ void  audio_renderer_start(unsigned char *ct) {
         if(*ct != renderer->ct) {
             gst_app_src_end_of_stream(GST_APP_SRC(renderer->appsrc));
             gst_element_set_state (renderer->pipeline, GST_STATE_NULL);
+            if (renderer->pcm_adapter) {
+                gst_adapter_clear(renderer->pcm_adapter);
+            }
             logger_log(logger, LOGGER_INFO, "changed audio connection, format %s", format[id]);
             renderer = renderer_type[id];
+            if (renderer->decoder) {
+                audio_decoder_flush(renderer->decoder);
+            }
             gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
             gst_audio_pipeline_base_time = gst_element_get_base_time(renderer->appsrc);
         }
     } else if (id >= 0) {
         logger_log(logger, LOGGER_INFO, "start audio connection, format %s", format[id]);
         renderer = renderer_type[id];
+        if (renderer->decoder) {
+            audio_decoder_flush(renderer->decoder);
+        }
         gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
         gst_audio_pipeline_base_time = gst_element_get_base_time(renderer->appsrc);
     } else {
@@ -314,13 +484,6 @@ void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned s
      *                   but is 0x80, 0x81 or 0x82: 0x100000(00,01,10) in ios9, ios10 devices          *
      * first byte of AAC_LC should be 0xff (ADTS) (but has never been  seen).                          */
     
-    buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
-    g_assert(buffer != NULL);
-    //g_print("audio latency %8.6f\n", (double) latency / SECOND_IN_NSECS);
-    if (sync) {
-        GST_BUFFER_PTS(buffer) = pts;
-    }
-    gst_buffer_fill(buffer, 0, data, *data_len);
     switch (renderer->ct){
     case 8: /*AAC-ELD*/
         switch (data[0]){
@@ -347,12 +510,47 @@ void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned s
         valid = true;
         break;
     }
-    if (valid) {
-        gst_app_src_push_buffer(GST_APP_SRC(renderer->appsrc), buffer);
-    } else {
+    if (!valid) {
+        metrics_add(METRIC_AUDIO_DECRYPT_FAILURES, 1);
         logger_log(logger, LOGGER_ERR, "*** ERROR invalid  audio frame (compression_type %d) skipped ", renderer->ct);
         logger_log(logger, LOGGER_ERR, "***       first byte of invalid frame was  0x%2.2x ", (unsigned int) data[0]);
+        return;
+    }
+
+    if (renderer->decoder) {
+        /* decode here, into a PCM block from the pool: only PCM goes down the pipeline */
+        GstMapInfo map;
+        if (gst_buffer_pool_acquire_buffer(renderer->pool, &buffer, NULL) != GST_FLOW_OK) {
+            return;
+        }
+        gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+        int frames = audio_decoder_decode(renderer->decoder, data, *data_len, (int16_t *) map.data,
+                                          (int) (map.size / PCM_BYTES_PER_FRAME));
+        gst_buffer_unmap(buffer, &map);
+        if (frames <= 0) {
+            gst_buffer_unref(buffer);
+            if (frames < 0) {
+                logger_log(logger, LOGGER_DEBUG, "audio frame (compression_type %d) could not be decoded", renderer->ct);
+            }
+            return;
+        }
+        gst_buffer_set_size(buffer, (gssize) frames * PCM_BYTES_PER_FRAME);
+    } else {
+        buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
+        g_assert(buffer != NULL);
+        gst_buffer_fill(buffer, 0, data, *data_len);
     }
+    //g_print("audio latency %8.6f\n", (double) latency / SECOND_IN_NSECS);
+    if (sync) {
+        GST_BUFFER_PTS(buffer) = pts;
+    }
+#if GST_CHECK_VERSION(1,14,0)
+    if (pcm_callback) {
+        gst_buffer_add_reference_timestamp_meta(buffer, ntp_time_caps, (GstClockTime) *ntp_time, GST_CLOCK_TIME_NONE);
+    }
+#endif
+    gst_app_src_push_buffer(GST_APP_SRC(renderer->appsrc), buffer);
+    metrics_set(METRIC_AUDIO_QUEUE_BYTES, (int64_t) gst_app_src_get_current_level_bytes(GST_APP_SRC(renderer->appsrc)));
 }
 
 void audio_renderer_set_volume(double volume) {
@@ -373,6 +571,14 @@ void audio_renderer_destroy() {
         renderer_type[i]->appsrc = NULL;
 	gst_object_unref (renderer_type[i]->pipeline);
         renderer_type[i]->pipeline = NULL;
+        if (renderer_type[i]->pcm_adapter) {
+            g_object_unref (renderer_type[i]->pcm_adapter);
+        }
+        if (renderer_type[i]->pool) {
+            gst_buffer_pool_set_active (renderer_type[i]->pool, FALSE);
+            gst_object_unref (renderer_type[i]->pool);
+        }
+        audio_decoder_destroy(renderer_type[i]->decoder);
         free(renderer_type[i]);
     }
 }
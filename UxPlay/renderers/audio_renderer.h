@@ -32,7 +32,13 @@ extern "C" {
 #include <stdbool.h>
 #include "../lib/logger.h"
 
+typedef void (*audio_renderer_pcm_cb_t)(const unsigned char *pcm, int frames, int channels, int rate,
+                                        uint64_t ntp_time);
+
 bool gstreamer_init();
+/* also deliver the decoded audio (after volume) as S16LE chunks of chunk_ms, stamped with  *
+ * the ntp_time (local clock, nsecs) of their first sample; call before audio_renderer_init */
+void audio_renderer_set_pcm_output(unsigned int chunk_ms, audio_renderer_pcm_cb_t callback);
 void audio_renderer_init(logger_t *logger, const char* audiosink, const bool *audio_sync, const bool *video_sync);
 void audio_renderer_start(unsigned char* compression_type);
 void audio_renderer_stop();
@@ -0,0 +1,245 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Posted commands are pushed onto a lock-free stack; the main loop takes the
+ * whole stack with one atomic exchange and reverses it, so there is a single
+ * consumer and no ABA problem.  On Linux the wakeup is an eventfd polled by the
+ * GSource; elsewhere g_source_set_ready_time() (thread-safe) is used instead.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "control_queue.h"
+
+typedef struct control_node_s {
+    struct control_node_s *next;
+    control_cmd_t cmd;
+} control_node_t;
+
+typedef struct control_source_s {
+    GSource source;
+    control_handler_t handler;
+    void *user_data;
+} control_source_t;
+
+static _Atomic(control_node_t *) pending = NULL;
+static control_node_t *held = NULL;    /* taken from pending, oldest first; consumer only */
+static GSource *control_source = NULL;
+#ifdef __linux__
+static int wakeup_fd = -1;
+#else
+static GMutex source_mutex;    /* guards control_source for the posting threads */
+#endif
+
+static void
+control_queue_free_list(control_node_t *node)
+{
+    while (node) {
+        control_node_t *next = node->next;
+        g_free(node->cmd.url);
+        g_free(node);
+        node = next;
+    }
+}
+
+/* moves everything posted so far to the end of held */
+static void
+control_queue_take()
+{
+    control_node_t *list = atomic_exchange_explicit(&pending, NULL, memory_order_acquire);
+
+    /* the stack is newest first */
+    control_node_t *ordered = NULL;
+    while (list) {
+        control_node_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    control_node_t **tail = &held;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = ordered;
+}
+
+static gboolean
+control_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    control_source_t *control = (control_source_t *) source;
+#ifdef __linux__
+    uint64_t count;
+    if (read(wakeup_fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN: already consumed by an earlier dispatch */
+    }
+#else
+    g_source_set_ready_time(source, -1);
+#endif
+    control_queue_take();
+    control_node_t *ordered = held;
+    held = NULL;
+    for (control_node_t *node = ordered; node; node = node->next) {
+        control->handler(&node->cmd, control->user_data);
+    }
+    control_queue_free_list(ordered);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs control_source_funcs = {
+    NULL,    /* prepare: never ready without a wakeup, no timeout */
+    NULL,    /* check: the eventfd (or the ready time) decides */
+    control_source_dispatch,
+    NULL,
+};
+
+static void
+control_queue_wakeup()
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        /* EAGAIN: counter saturated, a wakeup is pending anyway */
+    }
+#else
+    g_mutex_lock(&source_mutex);
+    if (control_source) {
+        g_source_set_ready_time(control_source, 0);
+    }
+    g_mutex_unlock(&source_mutex);
+#endif
+}
+
+bool
+control_queue_init()
+{
+#ifdef __linux__
+    if (wakeup_fd < 0) {
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return wakeup_fd >= 0;
+#else
+    return true;
+#endif
+}
+
+void
+control_queue_destroy()
+{
+    control_queue_detach();
+    control_queue_free_list(atomic_exchange(&pending, NULL));
+    control_queue_free_list(held);
+    held = NULL;
+#ifdef __linux__
+    if (wakeup_fd >= 0) {
+        close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+#endif
+}
+
+bool
+control_queue_post(control_cmd_type_t type, const char *url)
+{
+    control_node_t *node = g_try_new0(control_node_t, 1);
+    if (!node) {
+        return false;
+    }
+    node->cmd.type = type;
+    node->cmd.url = g_strdup(url);
+    node->next = atomic_load_explicit(&pending, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&pending, &node->next, node,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+    control_queue_wakeup();
+    return true;
+}
+
+guint
+control_queue_attach(control_handler_t handler, void *user_data)
+{
+    g_assert(!control_source);
+    GSource *source = g_source_new(&control_source_funcs, sizeof(control_source_t));
+    control_source_t *control = (control_source_t *) source;
+    control->handler = handler;
+    control->user_data = user_data;
+    g_source_set_name(source, "uxplay control queue");
+#ifdef __linux__
+    /* commands posted while detached have left the eventfd readable */
+    g_source_add_unix_fd(source, wakeup_fd, G_IO_IN);
+    control_source = source;
+#else
+    g_mutex_lock(&source_mutex);
+    control_source = source;
+    if (held || atomic_load(&pending)) {
+        g_source_set_ready_time(source, 0);
+    }
+    g_mutex_unlock(&source_mutex);
+#endif
+    /* the node addon runs the main loop in a context of its own */
+    return g_source_attach(source, g_main_context_get_thread_default());
+}
+
+void
+control_queue_drop(control_cmd_type_t type)
+{
+    control_queue_take();
+    control_node_t **link = &held;
+    while (*link) {
+        control_node_t *node = *link;
+        if (node->cmd.type == type) {
+            *link = node->next;
+            node->next = NULL;
+            control_queue_free_list(node);
+        } else {
+            link = &node->next;
+        }
+    }
+    if (held) {
+        /* dispatched at once if attached, else on attach */
+        control_queue_wakeup();
+    }
+}
+
+void
+control_queue_detach()
+{
+    if (!control_source) {
+        return;
+    }
+    GSource *source = control_source;
+#ifndef __linux__
+    g_mutex_lock(&source_mutex);
+#endif
+    control_source = NULL;
+#ifndef __linux__
+    g_mutex_unlock(&source_mutex);
+#endif
+    g_source_destroy(source);
+    g_source_unref(source);
+}
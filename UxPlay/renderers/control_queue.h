@@ -0,0 +1,69 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Commands from the server threads (raop, raop_ntp, raop_rtp_mirror callbacks)
+ * to the GLib main loop.  Posting never blocks; the main loop is woken at once
+ * (through an eventfd on Linux) and handles the commands in the order posted.
+ * Commands posted while no main loop is attached wait for the next one.
+ */
+
+#ifndef CONTROL_QUEUE_H
+#define CONTROL_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <glib.h>
+
+typedef enum control_cmd_type_e {
+    CONTROL_RESET,       /* leave the main loop: connection lost or closed */
+    CONTROL_RELAUNCH,    /* leave the main loop and rebuild the video renderer */
+    CONTROL_PLAY_URL,    /* rebuild the video renderer for HLS playback of url */
+    CONTROL_QUIT,        /* leave the main loop and stop the server (as SIGTERM) */
+} control_cmd_type_t;
+
+typedef struct control_cmd_s {
+    control_cmd_type_t type;
+    char *url;           /* CONTROL_PLAY_URL only */
+} control_cmd_t;
+
+/* runs on the main loop thread; cmd is freed when it returns */
+typedef void (*control_handler_t)(const control_cmd_t *cmd, void *user_data);
+
+bool control_queue_init();
+void control_queue_destroy();
+
+/* thread-safe, lock-free; url is copied */
+bool control_queue_post(control_cmd_type_t type, const char *url);
+
+/* add/remove the queue's GSource to/from the thread-default main context */
+guint control_queue_attach(control_handler_t handler, void *user_data);
+void control_queue_detach();
+
+/* main loop thread, or while detached: forget the commands of this type posted so far */
+void control_queue_drop(control_cmd_type_t type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CONTROL_QUEUE_H
@@ -0,0 +1,158 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "frame_delta.h"
+
+#define BYTES_PER_PIXEL 4
+/* above this fraction of changed tiles (in percent) a full frame is cheaper for the consumer */
+#define MAX_DIRTY_PERCENT 60
+
+struct frame_delta_s {
+    int tile_size;
+    int keyframe_interval;
+    int frames_since_keyframe;
+    bool force_keyframe;
+
+    unsigned char *previous;   /* copy of the last frame, width * 4 bytes per row */
+    int width, height;
+    int tiles_x, tiles_y;
+    bool *dirty;               /* one flag per tile column of the current band */
+    frame_delta_rect_t *rects;
+};
+
+frame_delta_t *frame_delta_init(int tile_size, int keyframe_interval) {
+    frame_delta_t *delta = (frame_delta_t *) calloc(1, sizeof(frame_delta_t));
+    if (!delta) {
+        return NULL;
+    }
+    delta->tile_size = tile_size;
+    delta->keyframe_interval = keyframe_interval;
+    delta->force_keyframe = true;
+    return delta;
+}
+
+void frame_delta_destroy(frame_delta_t *delta) {
+    if (delta) {
+        free(delta->previous);
+        free(delta->dirty);
+        free(delta->rects);
+        free(delta);
+    }
+}
+
+void frame_delta_force_keyframe(frame_delta_t *delta) {
+    delta->force_keyframe = true;
+}
+
+static bool frame_delta_resize(frame_delta_t *delta, int width, int height) {
+    int tiles_x = (width + delta->tile_size - 1) / delta->tile_size;
+    int tiles_y = (height + delta->tile_size - 1) / delta->tile_size;
+    unsigned char *previous = (unsigned char *) realloc(delta->previous, (size_t) width * height * BYTES_PER_PIXEL);
+    bool *dirty = (bool *) realloc(delta->dirty, tiles_x * sizeof(bool));
+    frame_delta_rect_t *rects = (frame_delta_rect_t *) realloc(delta->rects, tiles_x * tiles_y * sizeof(frame_delta_rect_t));
+    if (previous) delta->previous = previous;
+    if (dirty) delta->dirty = dirty;
+    if (rects) delta->rects = rects;
+    if (!previous || !dirty || !rects) {
+        delta->width = delta->height = 0;
+        return false;
+    }
+    delta->width = width;
+    delta->height = height;
+    delta->tiles_x = tiles_x;
+    delta->tiles_y = tiles_y;
+    return true;
+}
+
+static void frame_delta_copy(frame_delta_t *delta, const unsigned char *data, int stride) {
+    size_t row_bytes = (size_t) delta->width * BYTES_PER_PIXEL;
+    for (int y = 0; y < delta->height; y++) {
+        memcpy(delta->previous + y * row_bytes, data + (size_t) y * stride, row_bytes);
+    }
+}
+
+int frame_delta_update(frame_delta_t *delta, const unsigned char *data, int width, int height,
+                       int stride, const frame_delta_rect_t **rects) {
+    size_t row_bytes = (size_t) width * BYTES_PER_PIXEL;
+    size_t tile_bytes = (size_t) delta->tile_size * BYTES_PER_PIXEL;
+    int n_rects = 0;
+
+    if (width != delta->width || height != delta->height) {
+        if (!frame_delta_resize(delta, width, height)) {
+            return FRAME_DELTA_KEYFRAME;
+        }
+        delta->force_keyframe = true;
+    }
+    if (delta->force_keyframe || ++delta->frames_since_keyframe >= delta->keyframe_interval) {
+        frame_delta_copy(delta, data, stride);
+        delta->force_keyframe = false;
+        delta->frames_since_keyframe = 0;
+        return FRAME_DELTA_KEYFRAME;
+    }
+
+    /* Rows are compared whole first: on mostly static screens nearly all rows are    *
+     * unchanged, and one long memcmp (vectorized by libc) is the cheapest test.      *
+     * Changed rows are split into tile columns and copied into the reference frame.  */
+    for (int ty = 0; ty < delta->tiles_y; ty++) {
+        int y0 = ty * delta->tile_size;
+        int y1 = (y0 + delta->tile_size < height ? y0 + delta->tile_size : height);
+        bool band_dirty = false;
+        memset(delta->dirty, 0, delta->tiles_x * sizeof(bool));
+        for (int y = y0; y < y1; y++) {
+            const unsigned char *row = data + (size_t) y * stride;
+            unsigned char *previous_row = delta->previous + y * row_bytes;
+            if (!memcmp(row, previous_row, row_bytes)) {
+                continue;
+            }
+            for (int tx = 0; tx < delta->tiles_x; tx++) {
+                if (delta->dirty[tx]) {
+                    continue;
+                }
+                size_t offset = tx * tile_bytes;
+                size_t len = (offset + tile_bytes < row_bytes ? tile_bytes : row_bytes - offset);
+                if (memcmp(row + offset, previous_row + offset, len)) {
+                    delta->dirty[tx] = true;
+                }
+            }
+            memcpy(previous_row, row, row_bytes);
+            band_dirty = true;
+        }
+        if (!band_dirty) {
+            continue;
+        }
+        for (int tx = 0; tx < delta->tiles_x; tx++) {
+            if (delta->dirty[tx]) {
+                frame_delta_rect_t *rect = &delta->rects[n_rects++];
+                rect->x = (uint16_t) (tx * delta->tile_size);
+                rect->y = (uint16_t) y0;
+                rect->w = (uint16_t) (rect->x + delta->tile_size < width ? delta->tile_size : width - rect->x);
+                rect->h = (uint16_t) (y1 - y0);
+            }
+        }
+    }
+
+    if (n_rects * 100 > delta->tiles_x * delta->tiles_y * MAX_DIRTY_PERCENT) {
+        delta->frames_since_keyframe = 0;
+        return FRAME_DELTA_KEYFRAME;
+    }
+    *rects = delta->rects;
+    return n_rects;
+}
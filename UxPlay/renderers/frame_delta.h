@@ -0,0 +1,59 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Tile-based change detection for the raw RGBA frames sent to the consumer.
+ * Each frame is compared with the previous one in square tiles; only tiles
+ * that changed need to be sent.
+ */
+
+#ifndef FRAME_DELTA_H
+#define FRAME_DELTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FRAME_DELTA_KEYFRAME  -1   /* send the whole frame */
+
+typedef struct frame_delta_s frame_delta_t;
+
+typedef struct {
+    uint16_t x, y, w, h;   /* in pixels */
+} frame_delta_rect_t;
+
+/**
+ * tile_size: tile edge in pixels; keyframe_interval: a full frame is sent at least
+ * this often (in frames), so a consumer that missed or mangled an update recovers.
+ */
+frame_delta_t *frame_delta_init(int tile_size, int keyframe_interval);
+void frame_delta_destroy(frame_delta_t *delta);
+
+/* next call to frame_delta_update() returns FRAME_DELTA_KEYFRAME */
+void frame_delta_force_keyframe(frame_delta_t *delta);
+
+/**
+ * Compares an RGBA frame with the previous one and remembers it.  Returns
+ * FRAME_DELTA_KEYFRAME, 0 (nothing changed: skip the frame), or the number of
+ * changed tiles, whose rectangles are returned in *rects (owned by delta,
+ * valid until the next call).
+ */
+int frame_delta_update(frame_delta_t *delta, const unsigned char *data, int width, int height,
+                       int stride, const frame_delta_rect_t **rects);
+
+#endif //FRAME_DELTA_H
@@ -0,0 +1,182 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "frame_hub.h"
+
+struct frame_hub_sub_s {
+    frame_hub_t *hub;
+    void **queue;        /* ring of queue_len frame references */
+    int queue_len;
+    int head, count;
+    frame_hub_drop_t drop;
+    void (*notify)(frame_hub_sub_t *sub, void *user_data);
+    void *user_data;
+    frame_hub_sub_t *next;
+};
+
+struct frame_hub_s {
+    void (*ref)(void *frame);
+    void (*unref)(void *frame);
+    /* publish_mutex keeps the subscriber list stable while a frame is handed out
+     * (and notify callbacks run); mutex guards the list and the queues */
+    pthread_mutex_t publish_mutex;
+    pthread_mutex_t mutex;
+    frame_hub_sub_t *subs;
+    int n_subs;
+};
+
+frame_hub_t *frame_hub_create(void (*ref)(void *frame), void (*unref)(void *frame)) {
+    frame_hub_t *hub = (frame_hub_t *) calloc(1, sizeof(frame_hub_t));
+    if (!hub) {
+        return NULL;
+    }
+    hub->ref = ref;
+    hub->unref = unref;
+    pthread_mutex_init(&hub->publish_mutex, NULL);
+    pthread_mutex_init(&hub->mutex, NULL);
+    return hub;
+}
+
+void frame_hub_destroy(frame_hub_t *hub) {
+    if (!hub) {
+        return;
+    }
+    while (hub->subs) {
+        frame_hub_unsubscribe(hub, hub->subs);
+    }
+    pthread_mutex_destroy(&hub->publish_mutex);
+    pthread_mutex_destroy(&hub->mutex);
+    free(hub);
+}
+
+frame_hub_sub_t *frame_hub_subscribe(frame_hub_t *hub, int queue_len, frame_hub_drop_t drop,
+                                     void (*notify)(frame_hub_sub_t *sub, void *user_data),
+                                     void *user_data) {
+    if (queue_len < 1) {
+        queue_len = 1;
+    }
+    frame_hub_sub_t *sub = (frame_hub_sub_t *) calloc(1, sizeof(frame_hub_sub_t));
+    if (!sub) {
+        return NULL;
+    }
+    sub->queue = (void **) calloc(queue_len, sizeof(void *));
+    if (!sub->queue) {
+        free(sub);
+        return NULL;
+    }
+    sub->hub = hub;
+    sub->queue_len = queue_len;
+    sub->drop = drop;
+    sub->notify = notify;
+    sub->user_data = user_data;
+
+    pthread_mutex_lock(&hub->publish_mutex);
+    pthread_mutex_lock(&hub->mutex);
+    sub->next = hub->subs;
+    hub->subs = sub;
+    hub->n_subs++;
+    pthread_mutex_unlock(&hub->mutex);
+    pthread_mutex_unlock(&hub->publish_mutex);
+    return sub;
+}
+
+/* call with hub->mutex held */
+static void frame_hub_sub_clear(frame_hub_sub_t *sub) {
+    while (sub->count) {
+        sub->hub->unref(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % sub->queue_len;
+        sub->count--;
+    }
+}
+
+void frame_hub_unsubscribe(frame_hub_t *hub, frame_hub_sub_t *sub) {
+    pthread_mutex_lock(&hub->publish_mutex);
+    pthread_mutex_lock(&hub->mutex);
+    for (frame_hub_sub_t **p = &hub->subs; *p; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            hub->n_subs--;
+            break;
+        }
+    }
+    frame_hub_sub_clear(sub);
+    pthread_mutex_unlock(&hub->mutex);
+    pthread_mutex_unlock(&hub->publish_mutex);
+    free(sub->queue);
+    free(sub);
+}
+
+void *frame_hub_pop(frame_hub_sub_t *sub) {
+    void *frame = NULL;
+    pthread_mutex_lock(&sub->hub->mutex);
+    if (sub->count) {
+        frame = sub->queue[sub->head];
+        sub->head = (sub->head + 1) % sub->queue_len;
+        sub->count--;
+    }
+    pthread_mutex_unlock(&sub->hub->mutex);
+    return frame;
+}
+
+int frame_hub_publish(frame_hub_t *hub, void *frame) {
+    int dropped = 0;
+    pthread_mutex_lock(&hub->publish_mutex);
+    pthread_mutex_lock(&hub->mutex);
+    for (frame_hub_sub_t *sub = hub->subs; sub; sub = sub->next) {
+        if (sub->count == sub->queue_len) {
+            dropped++;
+            if (sub->drop == FRAME_HUB_DROP_NEWEST) {
+                continue;
+            }
+            hub->unref(sub->queue[sub->head]);
+            sub->head = (sub->head + 1) % sub->queue_len;
+            sub->count--;
+        }
+        hub->ref(frame);
+        sub->queue[(sub->head + sub->count) % sub->queue_len] = frame;
+        sub->count++;
+    }
+    pthread_mutex_unlock(&hub->mutex);
+
+    /* the list cannot change while publish_mutex is held */
+    for (frame_hub_sub_t *sub = hub->subs; sub; sub = sub->next) {
+        if (sub->notify) {
+            sub->notify(sub, sub->user_data);
+        }
+    }
+    pthread_mutex_unlock(&hub->publish_mutex);
+    return dropped;
+}
+
+void frame_hub_flush(frame_hub_t *hub) {
+    pthread_mutex_lock(&hub->mutex);
+    for (frame_hub_sub_t *sub = hub->subs; sub; sub = sub->next) {
+        frame_hub_sub_clear(sub);
+    }
+    pthread_mutex_unlock(&hub->mutex);
+}
+
+int frame_hub_count(frame_hub_t *hub) {
+    pthread_mutex_lock(&hub->mutex);
+    int n = hub->n_subs;
+    pthread_mutex_unlock(&hub->mutex);
+    return n;
+}
@@ -0,0 +1,70 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Fan-out of decoded frames to several consumers.  Each frame is published
+ * once, as a refcounted object; every subscriber gets a reference in its own
+ * bounded queue, with its own policy for what to drop when it falls behind.
+ * Subscribers can come and go while frames are being published.
+ */
+
+#ifndef FRAME_HUB_H
+#define FRAME_HUB_H
+
+#include <stdbool.h>
+
+typedef struct frame_hub_s frame_hub_t;
+typedef struct frame_hub_sub_s frame_hub_sub_t;
+
+typedef enum {
+    FRAME_HUB_DROP_OLDEST,   /* a full queue makes room for the new frame (live viewers) */
+    FRAME_HUB_DROP_NEWEST    /* a full queue refuses the new frame */
+} frame_hub_drop_t;
+
+/* ref/unref: take and release a reference to a published frame */
+frame_hub_t *frame_hub_create(void (*ref)(void *frame), void (*unref)(void *frame));
+void frame_hub_destroy(frame_hub_t *hub);
+
+/**
+ * notify (optional) runs on the publishing thread after a frame was queued for
+ * this subscriber; it may call frame_hub_pop(), but must not subscribe or
+ * unsubscribe.  queue_len >= 1.
+ */
+frame_hub_sub_t *frame_hub_subscribe(frame_hub_t *hub, int queue_len, frame_hub_drop_t drop,
+                                     void (*notify)(frame_hub_sub_t *sub, void *user_data),
+                                     void *user_data);
+
+/* releases the frames still queued; sub is invalid afterwards */
+void frame_hub_unsubscribe(frame_hub_t *hub, frame_hub_sub_t *sub);
+
+/* oldest queued frame, or NULL; the caller owns the reference it returns */
+void *frame_hub_pop(frame_hub_sub_t *sub);
+
+/**
+ * Queues frame for every subscriber (taking a reference for each; the caller
+ * keeps its own).  Returns the number of frames dropped by full queues.
+ */
+int frame_hub_publish(frame_hub_t *hub, void *frame);
+
+/* releases all queued frames (e.g. before the pipeline producing them goes away) */
+void frame_hub_flush(frame_hub_t *hub);
+
+int frame_hub_count(frame_hub_t *hub);
+
+#endif //FRAME_HUB_H
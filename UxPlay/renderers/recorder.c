@@ -0,0 +1,382 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * The recording pipeline is separate from the renderers:
+ *
+ *   appsrc name=rec_video ! h26xparse ! queue ! mux.
+ *   appsrc name=rec_audio ! queue ! mux.
+ *   mp4mux|matroskamux name=mux ! filesink buffer-mode=full
+ *
+ * The receive threads only copy each access unit / audio frame into a
+ * GstBuffer and hand it to appsrc, which queues it for the pipeline's own
+ * streaming threads; muxing and file writes (in large blocks) happen there.
+ * If the writer falls behind, data is dropped rather than blocking.
+ * Timestamps are the NTP-derived local times used by the renderers, relative
+ * to the first recorded video keyframe (or audio frame, for audio-only sessions).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include "recorder.h"
+
+#define RECORDER_MAX_QUEUED_BYTES (32 * 1024 * 1024)   /* per appsrc, then drop */
+#define RECORDER_WRITE_SIZE (1024 * 1024)              /* filesink block size */
+#define RECORDER_AUDIO_GAP (500 * GST_MSECOND)         /* audio silent longer than this: send GAP */
+#define RECORDER_EOS_TIMEOUT (5 * GST_SECOND)
+
+/* same codec_data as the audio renderer (see audio_renderer.c) */
+static const char alac_caps[] = "audio/x-alac,channels=(int)2,rate=(int)44100,stream-format=raw,codec_data=(buffer)"
+                           "00000024""616c6163""00000000""00000160""0010280a""0e0200ff""00000000""00000000""0000ac44";
+static const char aac_eld_caps[] = "audio/mpeg,mpegversion=(int)4,channels=(int)2,rate=(int)44100,stream-format=raw,"
+                           "codec_data=(buffer)f8e85000";
+static const char h264_caps[] = "video/x-h264,stream-format=(string)byte-stream,alignment=(string)au";
+static const char h265_caps[] = "video/x-h265,stream-format=(string)byte-stream,alignment=(string)au";
+
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recorder_cond = PTHREAD_COND_INITIALIZER;
+static logger_t *logger = NULL;
+static char *base_name = NULL;           /* NULL: recording disabled */
+static const char *extension = NULL;
+static bool use_matroska = false;
+static unsigned int file_count = 0;
+static unsigned int finishing = 0;       /* files still being finalized in the background */
+
+/* streams announced for the current session */
+static bool session_video = false;
+static bool session_h265 = false;
+static unsigned char session_ct = 0;
+
+/* the file being written */
+static GstElement *pipeline = NULL;
+static GstElement *video_src = NULL, *audio_src = NULL;
+static bool file_h265 = false;
+static unsigned char file_ct = 0;
+static char *file_name = NULL;
+static GstClockTime base_time = 0;
+static GstClockTime audio_end = 0;       /* end of the last audio frame (or gap) sent */
+static unsigned int dropped = 0;
+
+typedef struct {
+    GstElement *pipeline;
+    char *file_name;
+} recorder_finish_t;
+
+static bool is_keyframe(const unsigned char *data, int data_len, bool h265) {
+    /* access units start with the SPS (h264) or VPS (h265) when they carry a keyframe */
+    if (data_len < 5) {
+        return false;
+    }
+    if (h265) {
+        return (((data[4] >> 1) & 0x3f) == 32);
+    }
+    return ((data[4] & 0x1f) == 7);
+}
+
+static void *recorder_finish_thread(void *arg) {
+    recorder_finish_t *finish = (recorder_finish_t *) arg;
+    GstBus *bus = gst_element_get_bus(finish->pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, RECORDER_EOS_TIMEOUT,
+                                                 (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+        logger_log(logger, LOGGER_INFO, "recording saved to %s", finish->file_name);
+    } else {
+        logger_log(logger, LOGGER_ERR, "recording %s may be incomplete (%s)", finish->file_name,
+                   msg ? "pipeline error" : "timed out waiting for end of stream");
+    }
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(finish->pipeline, GST_STATE_NULL);
+    gst_object_unref(finish->pipeline);
+    free(finish->file_name);
+    free(finish);
+
+    pthread_mutex_lock(&recorder_mutex);
+    finishing--;
+    pthread_cond_broadcast(&recorder_cond);
+    pthread_mutex_unlock(&recorder_mutex);
+    return NULL;
+}
+
+/* called with recorder_mutex held */
+static void finish_file() {
+    if (!pipeline) {
+        return;
+    }
+    if (video_src) {
+        gst_app_src_end_of_stream(GST_APP_SRC(video_src));
+        gst_object_unref(video_src);
+        video_src = NULL;
+    }
+    if (audio_src) {
+        gst_app_src_end_of_stream(GST_APP_SRC(audio_src));
+        gst_object_unref(audio_src);
+        audio_src = NULL;
+    }
+    if (dropped) {
+        logger_log(logger, LOGGER_WARNING, "recording %s: %u frames dropped (disk too slow)", file_name, dropped);
+    }
+
+    /* waiting for the muxer to write its index can take a while: do it off this thread */
+    recorder_finish_t *finish = (recorder_finish_t *) malloc(sizeof(recorder_finish_t));
+    pthread_t thread;
+    if (finish) {
+        finish->pipeline = pipeline;
+        finish->file_name = file_name;
+        if (!pthread_create(&thread, NULL, recorder_finish_thread, finish)) {
+            pthread_detach(thread);
+            finishing++;
+            pipeline = NULL;
+            file_name = NULL;
+            return;
+        }
+        free(finish);
+    }
+    logger_log(logger, LOGGER_ERR, "recording %s: could not finalize in the background", file_name);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    pipeline = NULL;
+    free(file_name);
+    file_name = NULL;
+}
+
+/* called with recorder_mutex held */
+static bool start_file(bool video, bool h265, unsigned char ct) {
+    GError *error = NULL;
+    GString *launch = g_string_new(NULL);
+
+    if (ct != 2 && ct != 8) {
+        ct = 0;    /* only ALAC and AAC-ELD have been seen from clients */
+    }
+    if (video) {
+        g_string_append_printf(launch, "appsrc name=rec_video ! %s ! queue ! mux. ",
+                               h265 ? "h265parse" : "h264parse");
+    }
+    if (ct) {
+        g_string_append(launch, "appsrc name=rec_audio ! queue ! mux. ");
+    }
+    if (use_matroska) {
+        g_string_append(launch, "matroskamux name=mux ! ");
+    } else {
+        /* fragmented, so the file stays playable even if uxplay is killed */
+        g_string_append(launch, "mp4mux name=mux fragment-duration=1000 ! ");
+    }
+    g_string_append_printf(launch, "filesink name=rec_sink buffer-mode=full buffer-size=%d",
+                           RECORDER_WRITE_SIZE);
+
+    GstElement *new_pipeline = gst_parse_launch(launch->str, &error);
+    if (error) {
+        logger_log(logger, LOGGER_ERR, "recorder: GStreamer pipeline error:\n %s\n\"%s\"", error->message, launch->str);
+        g_clear_error(&error);
+        g_string_free(launch, TRUE);
+        if (new_pipeline) {
+            gst_object_unref(new_pipeline);
+        }
+        return false;
+    }
+    logger_log(logger, LOGGER_DEBUG, "GStreamer recording pipeline:\n\"%s\"", launch->str);
+    g_string_free(launch, TRUE);
+
+    size_t len = strlen(base_name) + strlen(extension) + 16;
+    file_name = (char *) malloc(len);
+    if (!file_name) {
+        gst_object_unref(new_pipeline);
+        return false;
+    }
+    snprintf(file_name, len, "%s.%u%s", base_name, ++file_count, extension);
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(new_pipeline), "rec_sink");
+    g_object_set(sink, "location", file_name, NULL);
+    gst_object_unref(sink);
+
+    if (video) {
+        GstCaps *caps = gst_caps_from_string(h265 ? h265_caps : h264_caps);
+        video_src = gst_bin_get_by_name(GST_BIN(new_pipeline), "rec_video");
+        g_object_set(video_src, "caps", caps, "is-live", TRUE, "format", GST_FORMAT_TIME,
+                     "max-bytes", (guint64) RECORDER_MAX_QUEUED_BYTES, "block", FALSE, NULL);
+        gst_caps_unref(caps);
+    }
+    if (ct) {
+        GstCaps *caps = gst_caps_from_string(ct == 2 ? alac_caps : aac_eld_caps);
+        audio_src = gst_bin_get_by_name(GST_BIN(new_pipeline), "rec_audio");
+        g_object_set(audio_src, "caps", caps, "is-live", TRUE, "format", GST_FORMAT_TIME,
+                     "max-bytes", (guint64) RECORDER_MAX_QUEUED_BYTES, "block", FALSE, NULL);
+        gst_caps_unref(caps);
+    }
+
+    if (gst_element_set_state(new_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        logger_log(logger, LOGGER_ERR, "recorder: could not start writing %s", file_name);
+        gst_element_set_state(new_pipeline, GST_STATE_NULL);
+        if (video_src) gst_object_unref(video_src);
+        if (audio_src) gst_object_unref(audio_src);
+        video_src = audio_src = NULL;
+        gst_object_unref(new_pipeline);
+        free(file_name);
+        file_name = NULL;
+        return false;
+    }
+    pipeline = new_pipeline;
+    file_h265 = h265;
+    file_ct = ct;
+    audio_end = 0;
+    dropped = 0;
+    logger_log(logger, LOGGER_INFO, "recording %s%s to %s", video ? (h265 ? "h265 video" : "h264 video") : "",
+               ct ? (ct == 2 ? " ALAC audio" : " AAC-ELD audio") : "", file_name);
+    return true;
+}
+
+/* called with recorder_mutex held: copy into a GstBuffer and queue it, unless the writer is behind */
+static void push(GstElement *src, const unsigned char *data, int data_len, GstClockTime pts, GstClockTime duration) {
+    if (gst_app_src_get_current_level_bytes(GST_APP_SRC(src)) >= RECORDER_MAX_QUEUED_BYTES) {
+        if (dropped++ % 100 == 0) {
+            logger_log(logger, LOGGER_WARNING, "recorder is falling behind, dropping data (%u dropped)", dropped);
+        }
+        return;
+    }
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, data_len, NULL);
+    if (!buffer) {
+        return;
+    }
+    gst_buffer_fill(buffer, 0, data, data_len);
+    GST_BUFFER_PTS(buffer) = pts;
+    GST_BUFFER_DTS(buffer) = pts;
+    GST_BUFFER_DURATION(buffer) = duration;
+    gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
+}
+
+bool recorder_init(logger_t *render_logger, const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    logger = render_logger;
+    pthread_mutex_lock(&recorder_mutex);
+    free(base_name);
+    base_name = strdup(filename);
+    if (!base_name) {
+        pthread_mutex_unlock(&recorder_mutex);
+        return false;
+    }
+    if (dot && (!strcmp(dot, ".mkv") || !strcmp(dot, ".mp4") || !strcmp(dot, ".mov"))) {
+        base_name[dot - filename] = '\0';
+        extension = (!strcmp(dot, ".mkv") ? ".mkv" : (!strcmp(dot, ".mov") ? ".mov" : ".mp4"));
+    } else {
+        extension = ".mp4";
+    }
+    use_matroska = !strcmp(extension, ".mkv");
+    pthread_mutex_unlock(&recorder_mutex);
+    return true;
+}
+
+void recorder_set_video_codec(bool is_h265) {
+    pthread_mutex_lock(&recorder_mutex);
+    if (pipeline && (!video_src || file_h265 != is_h265)) {
+        finish_file();    /* audio-only file, or codec changed: start a new file */
+    }
+    session_video = true;
+    session_h265 = is_h265;
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+void recorder_set_audio_format(unsigned char ct) {
+    pthread_mutex_lock(&recorder_mutex);
+    if (pipeline && ct != file_ct && (ct == 2 || ct == 8)) {
+        finish_file();    /* video-only file, or audio format changed: the next keyframe starts a new file */
+    }
+    session_ct = ct;
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+void recorder_push_video(const unsigned char *data, int data_len, uint64_t ntp_time) {
+    pthread_mutex_lock(&recorder_mutex);
+    if (!base_name) {
+        pthread_mutex_unlock(&recorder_mutex);
+        return;
+    }
+    if (!pipeline) {
+        /* a new file must start with a keyframe */
+        if (!is_keyframe(data, data_len, session_h265) || !start_file(true, session_h265, session_ct)) {
+            pthread_mutex_unlock(&recorder_mutex);
+            return;
+        }
+        base_time = (GstClockTime) ntp_time;
+    }
+    if (video_src && (GstClockTime) ntp_time >= base_time) {
+        GstClockTime pts = (GstClockTime) ntp_time - base_time;
+        push(video_src, data, data_len, pts, GST_CLOCK_TIME_NONE);
+        /* AirPlay only sends audio while there is sound: tell the muxer not to wait for it */
+        if (audio_src && pts > audio_end + RECORDER_AUDIO_GAP) {
+            GstClockTime gap_end = pts - RECORDER_AUDIO_GAP / 2;
+            /* appsrc queues serialized events in order with its buffers */
+            gst_element_send_event(audio_src, gst_event_new_gap(audio_end, gap_end - audio_end));
+            audio_end = gap_end;
+        }
+    }
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+void recorder_push_audio(const unsigned char *data, int data_len, uint64_t ntp_time) {
+    pthread_mutex_lock(&recorder_mutex);
+    if (!base_name) {
+        pthread_mutex_unlock(&recorder_mutex);
+        return;
+    }
+    if (!pipeline) {
+        /* only ALAC (non-mirror AirPlay) is recorded on its own; mirror-mode *
+         * AAC-ELD audio waits for the first video keyframe                  */
+        if (session_video || session_ct != 2 || !start_file(false, false, session_ct)) {
+            pthread_mutex_unlock(&recorder_mutex);
+            return;
+        }
+        base_time = (GstClockTime) ntp_time;
+    }
+    if (audio_src && (GstClockTime) ntp_time >= base_time) {
+        GstClockTime pts = (GstClockTime) ntp_time - base_time;
+        /* samples per frame: ALAC 352, AAC-ELD 480 */
+        GstClockTime duration = gst_util_uint64_scale_int(file_ct == 2 ? 352 : 480, GST_SECOND, 44100);
+        if (pts >= audio_end || audio_end == 0) {
+            push(audio_src, data, data_len, pts, duration);
+            audio_end = pts + duration;
+        }
+    }
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+void recorder_stop() {
+    pthread_mutex_lock(&recorder_mutex);
+    finish_file();
+    session_video = false;
+    session_h265 = false;
+    session_ct = 0;
+    pthread_mutex_unlock(&recorder_mutex);
+}
+
+void recorder_destroy() {
+    pthread_mutex_lock(&recorder_mutex);
+    finish_file();
+    /* files must be complete before uxplay exits */
+    while (finishing) {
+        pthread_cond_wait(&recorder_cond, &recorder_mutex);
+    }
+    free(base_name);
+    base_name = NULL;
+    pthread_mutex_unlock(&recorder_mutex);
+}
@@ -0,0 +1,58 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Session recorder: muxes the compressed H264/H265 video and AAC-ELD/ALAC
+ * audio received from the client into MP4 or Matroska, without decoding.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../lib/logger.h"
+
+/**
+ * Enable recording; each session is written to <base>.<n>.<ext>, where the
+ * extension of filename (.mp4, .mov or .mkv) selects the container.
+ */
+bool recorder_init(logger_t *logger, const char *filename);
+void recorder_destroy();
+
+/* announce the streams of the current session (raop callbacks) */
+void recorder_set_video_codec(bool is_h265);
+void recorder_set_audio_format(unsigned char ct);
+
+/* never block: data is dropped (and counted) if the writer falls behind */
+void recorder_push_video(const unsigned char *data, int data_len, uint64_t ntp_time);
+void recorder_push_audio(const unsigned char *data, int data_len, uint64_t ntp_time);
+
+/* finish the current file (written out in the background); the next session starts a new one */
+void recorder_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RECORDER_H
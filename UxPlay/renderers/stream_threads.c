@@ -0,0 +1,44 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include "stream_threads.h"
+
+/* runs in the thread that posted the message */
+static GstBusSyncReply stream_threads_sync_handler(GstBus *bus, GstMessage *message, gpointer user_data) {
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS) {
+        return GST_BUS_PASS;
+    }
+    GstStreamStatusType type;
+    GstElement *owner = NULL;
+    gst_message_parse_stream_status(message, &type, &owner);
+    if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+        /* e.g. "queue0:src", the name GStreamer gives the thread */
+        gchar *name = g_strdup_printf("%s:%s", (owner ? GST_ELEMENT_NAME(owner) : "?"),
+                                      GST_MESSAGE_SRC_NAME(message));
+        thread_policy_apply((thread_class_t) GPOINTER_TO_INT(user_data), name);
+        g_free(name);
+    }
+    return GST_BUS_PASS;
+}
+
+void stream_threads_set_policy(GstElement *pipeline, thread_class_t thread_class) {
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, stream_threads_sync_handler, GINT_TO_POINTER(thread_class), NULL);
+    gst_object_unref(bus);
+}
@@ -0,0 +1,35 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Placement of the GStreamer streaming threads: they are created by the
+ * pipeline, so they are found through the STREAM_STATUS message each one
+ * posts (from itself) when it enters its loop.
+ */
+
+#ifndef STREAM_THREADS_H
+#define STREAM_THREADS_H
+
+#include <gst/gst.h>
+#include "../lib/thread_policy.h"
+
+/* call on a new pipeline, before it is set to PAUSED/PLAYING */
+void stream_threads_set_policy(GstElement *pipeline, thread_class_t thread_class);
+
+#endif //STREAM_THREADS_H
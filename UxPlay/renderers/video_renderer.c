@@ -23,7 +23,14 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include "video_renderer.h"
+#include "frame_delta.h"
+#include "frame_hub.h"
+#include "stream_threads.h"
+#include "../lib/metrics.h"
+#include "../lib/trace.h"
 #include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <time.h>
 
 
 #include <libwebsockets.h>
@@ -40,12 +47,130 @@
 static struct lws_context *ws_context;
 static struct lws *ws_wsi;  // "websocket interface"
 static bool connected = false;
+static struct lws *preview_wsi;  // separate connection (path /preview) for thumbnails
+static bool preview_connected = false;
+static unsigned int preview_width = 0, preview_fps = 0;   /* 0 = no preview branch */
+static int viewers_port = 0;   /* 0 = no listener for extra viewers */
+
+/* PCM chunks and streaming reports for the consumer, and preview thumbnails, come from *
+ * other threads; lws_write() may only be called from the service thread, so they are  *
+ * queued here and written from the WRITEABLE callbacks, like the frames.              */
+#define WS_MAX_QUEUED_MESSAGES 64
+
+typedef struct ws_message_s {
+    struct ws_message_s *next;
+    size_t size;
+    unsigned char buf[];      /* LWS_PRE + size bytes */
+} ws_message_t;
+
+static pthread_mutex_t ws_message_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ws_message_t *consumer_messages = NULL;    /* oldest first */
+static int n_consumer_messages = 0;
+static ws_message_t *preview_message = NULL;      /* only the latest thumbnail is kept */
+
+/* in-process consumer: frames are handed over instead of being sent */
+static video_frame_callback_t frame_callback = NULL;
+static void *frame_callback_data = NULL;
+
+/**
+ * Every binary message sent to the consumer starts with this 24-byte header
+ * (all fields little-endian), so frame size can change between messages:
+ *   0  uint32 magic "UXPF"
+ *   4  uint16 message type (WS_MSG_*)
+ *   6  uint16 flags (reserved, 0)
+ *   8  uint16 width
+ *  10  uint16 height
+ *  12  uint32 stride (bytes per row of the payload)
+ *  16  uint64 pts: ntp_time (nsecs, host realtime clock) at which the content
+ *          should be presented; video and audio share this timebase
+ *
+ * WS_MSG_FRAME_RGBA carries a whole frame.  WS_MSG_FRAME_TILES only carries the
+ * tiles that changed since the previous frame (stride = 4 * tile size):
+ *   0  uint16 tile size
+ *   2  uint16 number of tiles n
+ *   4  n x { uint16 x, y, w, h }  tile rectangles, in pixels
+ *   .. tile pixels, in the same order, each tightly packed (w * 4 bytes per row)
+ * Unchanged frames are not sent at all.  A consumer that missed the previous frame
+ * (its queue overflowed, or it just connected) gets WS_MSG_FRAME_RGBA instead.
+ * WS_MSG_PREVIEW_RGBA is laid out like WS_MSG_FRAME_RGBA.
+ *
+ * WS_MSG_AUDIO_PCM (uxplay -pcm) carries a fixed-size chunk of decoded audio, with
+ * width = channels, height = sample frames, stride = bytes per sample frame:
+ *   0  uint32 sample rate
+ *   4  interleaved S16LE samples
+ *
+ * WS_MSG_STREAM_REPORT carries the client's once-a-second streaming report and the
+ * matching receive-side figures as UTF-8 JSON (stride = its length, pts = arrival).
+ */
+#define WS_HEADER_SIZE 24
+#define WS_MSG_MAGIC 0x46505855    /* "UXPF" */
+#define WS_MSG_FRAME_RGBA 1
+#define WS_MSG_FRAME_TILES 2
+#define WS_MSG_PREVIEW_RGBA 3      /* whole thumbnail, sent on the preview connection */
+#define WS_MSG_AUDIO_PCM 4
+#define WS_MSG_STREAM_REPORT 5
+#define WS_TILE_SIZE 64
+#define WS_KEYFRAME_INTERVAL 300   /* frames; bounds the damage from a mangled update */
+
+/*
+ * Each decoded frame of the appsink branch is mapped once and published to
+ * frame_hub, which gives every consumer (the in-process callback, the consumer
+ * uxplay connects to, each viewer) a reference in a bounded queue of its own.
+ * The WebSocket messages are built at most once per frame and shared.
+ */
+struct video_frame_s {
+    gint refcount;
+    GstSample *sample;
+    GstMapInfo map;
+    int width, height, stride;
+    uint64_t ntp_time;
+    uint64_t seq;                 /* consecutive numbers: a gap means a consumer missed a frame */
+    int n_rects;                  /* frame_delta_update() result vs. the previous frame */
+    unsigned char *tiles_msg;     /* WS_MSG_FRAME_TILES, built when n_rects > 0 */
+    size_t tiles_size;
+    unsigned char *full_msg;      /* WS_MSG_FRAME_RGBA, built when a session first needs it */
+    size_t full_size;
+};
+
+static frame_hub_t *frame_hub = NULL;
+static frame_hub_sub_t *frame_callback_sub = NULL;
+static gint ws_sessions = 0;    /* WebSocket consumers subscribed to frame_hub */
+
+/* one per WebSocket connection that receives frames (lws per-session data) */
+typedef struct ws_session_s {
+    frame_hub_sub_t *sub;
+    bool primary;             /* the consumer uxplay connects to: control commands, masked writes */
+    bool needs_keyframe;      /* next frame is sent whole */
+    uint64_t last_seq;
+    unsigned char *scratch;   /* client connections mask payloads in place: private copy */
+    size_t scratch_size;
+} ws_session_t;
+
+#define WS_VIEWER_QUEUE 2
+#define WS_VIEWER_MAX_QUEUE 64
+
+static void video_frame_ref(void *frame) {
+    g_atomic_int_inc(&((video_frame_t *) frame)->refcount);
+}
+
+static void video_frame_unref(void *data) {
+    video_frame_t *frame = (video_frame_t *) data;
+    if (!g_atomic_int_dec_and_test(&frame->refcount)) {
+        return;
+    }
+    gst_buffer_unmap(gst_sample_get_buffer(frame->sample), &frame->map);
+    gst_sample_unref(frame->sample);
+    free(frame->tiles_msg);
+    free(frame->full_msg);
+    free(frame);
+}
 
 /**
  * A simple background thread that runs the libwebsockets service loop,
  * so it can handle incoming/outgoing messages independently.
  */
 static void *ws_service_thread(void *arg) {
+    thread_policy_apply(THREAD_CLASS_WS, "ws_service");
     while (1) {
         lws_service(ws_context, 1000); 
         // 1000 ms poll or tweak as needed
@@ -53,28 +178,289 @@ static void *ws_service_thread(void *arg) {
     return NULL;
 }
 
-/* WebSocket callback. Adjust if you want to handle inbound messages, etc. */
+/**
+ * Control commands sent by the consumer as short text messages:
+ *   "viewport <width> <height> <fps>"   size (in device pixels) of the area the
+ *                                       frames are displayed in, and the highest
+ *                                       frame rate the consumer wants to receive.
+ *                                       width = height = 0 means "unscaled".
+ *   "refresh"                           send the next frame whole (e.g. after the
+ *                                       consumer lost its canvas contents).
+ *   "snapshot [png|jpeg]"               save the current frame (needs -snap).
+ * Viewers (-viewers) share the primary consumer's frames and can only send "refresh".
+ */
+static void handle_consumer_command(ws_session_t *session, const char *in, size_t len) {
+    char command[128];
+    unsigned int w, h, fps;
+    if (len >= sizeof(command)) {
+        return;
+    }
+    memcpy(command, in, len);
+    command[len] = '\0';
+    if (!strcmp(command, "refresh")) {
+        session->needs_keyframe = true;
+    } else if (!session->primary) {
+        return;
+    } else if (sscanf(command, "viewport %u %u %u", &w, &h, &fps) == 3) {
+        video_renderer_set_viewport(w, h, fps);
+    } else if (!strcmp(command, "snapshot") || !strcmp(command, "snapshot png")) {
+        video_renderer_snapshot(false);
+    } else if (!strcmp(command, "snapshot jpeg")) {
+        video_renderer_snapshot(true);
+    }
+}
+
+/* runs on the appsink thread: wake the service thread, which writes in WRITEABLE */
+static void ws_session_notify(frame_hub_sub_t *sub, void *user_data) {
+    lws_cancel_service(ws_context);
+}
+
+static void ws_session_open(struct lws *wsi, ws_session_t *session, bool primary) {
+    int queue_len = WS_VIEWER_QUEUE;
+    frame_hub_drop_t drop = FRAME_HUB_DROP_OLDEST;
+    char arg[32];
+    const char *value;
+
+    memset(session, 0, sizeof(ws_session_t));
+    session->primary = primary;
+    session->needs_keyframe = true;
+    if (!primary) {
+        /* ws://127.0.0.1:<port>/?queue=<n>&drop=oldest|newest */
+        if ((value = lws_get_urlarg_by_name(wsi, "queue=", arg, sizeof(arg)))) {
+            queue_len = atoi(value);
+            if (queue_len < 1 || queue_len > WS_VIEWER_MAX_QUEUE) {
+                queue_len = WS_VIEWER_QUEUE;
+            }
+        }
+        if ((value = lws_get_urlarg_by_name(wsi, "drop=", arg, sizeof(arg))) && !strcmp(value, "newest")) {
+            drop = FRAME_HUB_DROP_NEWEST;
+        }
+    }
+    session->sub = frame_hub_subscribe(frame_hub, queue_len, drop, ws_session_notify, NULL);
+    if (session->sub) {
+        g_atomic_int_inc(&ws_sessions);
+    }
+}
+
+static void ws_session_close(ws_session_t *session) {
+    if (session->sub) {
+        frame_hub_unsubscribe(frame_hub, session->sub);
+        session->sub = NULL;
+        g_atomic_int_add(&ws_sessions, -1);
+    }
+    free(session->scratch);
+    session->scratch = NULL;
+}
+
+static size_t ws_build_frame(unsigned char **ws_buf, uint16_t type, const unsigned char *data, int width,
+                             int height, int stride, uint64_t pts);
+
+/* sends the next queued frame: changed tiles if the session saw the previous frame, else the whole frame */
+static int ws_session_write(struct lws *wsi, ws_session_t *session) {
+    video_frame_t *frame = (video_frame_t *) frame_hub_pop(session->sub);
+    if (!frame) {
+        return 0;
+    }
+    bool in_step = (!session->needs_keyframe && frame->seq == session->last_seq + 1);
+    unsigned char *msg = NULL;
+    size_t msg_size = 0;
+    session->last_seq = frame->seq;
+    if (in_step && frame->n_rects == 0) {
+        /* nothing changed, nothing to send */
+    } else if (in_step && frame->tiles_msg) {
+        msg = frame->tiles_msg;
+        msg_size = frame->tiles_size;
+    } else {
+        if (!frame->full_msg) {
+            frame->full_size = ws_build_frame(&frame->full_msg, WS_MSG_FRAME_RGBA, frame->map.data,
+                                              frame->width, frame->height, frame->stride, frame->ntp_time);
+        }
+        msg = frame->full_msg;
+        msg_size = frame->full_size;
+    }
+    if (msg_size && session->primary) {
+        if (session->scratch_size < LWS_PRE + msg_size) {
+            free(session->scratch);
+            session->scratch = (unsigned char *) malloc(LWS_PRE + msg_size);
+            session->scratch_size = (session->scratch ? LWS_PRE + msg_size : 0);
+        }
+        if (session->scratch) {
+            memcpy(session->scratch + LWS_PRE, msg + LWS_PRE, msg_size);
+        }
+        msg = session->scratch;
+    }
+    if (msg_size) {
+        int sent = -1;
+        if (msg) {
+            sent = lws_write(wsi, msg + LWS_PRE, msg_size, LWS_WRITE_BINARY);
+        }
+        if (sent < 0) {
+            metrics_add(METRIC_WS_FRAMES_DROPPED, 1);
+            session->needs_keyframe = true;
+        } else {
+            session->needs_keyframe = false;
+            metrics_add(METRIC_WS_FRAMES_SENT, 1);
+            metrics_add(METRIC_WS_BYTES_SENT, msg_size);
+        }
+    }
+    video_frame_unref(frame);
+    /* more may be queued: come back when the socket can take it */
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+static ws_message_t *ws_message_new(size_t size) {
+    ws_message_t *message = (ws_message_t *) malloc(sizeof(ws_message_t) + LWS_PRE + size);
+    if (message) {
+        message->next = NULL;
+        message->size = size;
+    }
+    return message;
+}
+
+/* any thread: takes ownership of message */
+static void ws_message_queue(ws_message_t *message, bool preview) {
+    pthread_mutex_lock(&ws_message_mutex);
+    if (preview) {
+        free(preview_message);
+        preview_message = message;
+    } else if (n_consumer_messages == WS_MAX_QUEUED_MESSAGES) {
+        /* the consumer is not reading: drop rather than grow */
+        free(message);
+        message = NULL;
+    } else {
+        ws_message_t **tail = &consumer_messages;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = message;
+        n_consumer_messages++;
+    }
+    pthread_mutex_unlock(&ws_message_mutex);
+    if (message) {
+        lws_cancel_service(ws_context);
+    }
+}
+
+static void ws_message_clear(bool preview) {
+    pthread_mutex_lock(&ws_message_mutex);
+    if (preview) {
+        free(preview_message);
+        preview_message = NULL;
+    } else {
+        while (consumer_messages) {
+            ws_message_t *next = consumer_messages->next;
+            free(consumer_messages);
+            consumer_messages = next;
+        }
+        n_consumer_messages = 0;
+    }
+    pthread_mutex_unlock(&ws_message_mutex);
+}
+
+/* service thread, in WRITEABLE: writes one queued message, false if there was none */
+static bool ws_message_write(struct lws *wsi, bool preview) {
+    pthread_mutex_lock(&ws_message_mutex);
+    ws_message_t *message = (preview ? preview_message : consumer_messages);
+    if (message) {
+        if (preview) {
+            preview_message = NULL;
+        } else {
+            consumer_messages = message->next;
+            n_consumer_messages--;
+        }
+    }
+    pthread_mutex_unlock(&ws_message_mutex);
+    if (!message) {
+        return false;
+    }
+    if (lws_write(wsi, message->buf + LWS_PRE, message->size, LWS_WRITE_BINARY) >= 0) {
+        metrics_add(METRIC_WS_BYTES_SENT, message->size);
+    }
+    free(message);
+    /* more messages or frames may be queued */
+    lws_callback_on_writable(wsi);
+    return true;
+}
+
+/* WebSocket callback, for the consumer connections and (with -viewers) the viewers' */
 static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
                        void *user, void *in, size_t len) {
+    ws_session_t *session = (ws_session_t *) user;
     switch (reason) {
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            if (wsi == preview_wsi) {
+                preview_connected = true;
+                lwsl_user("WS preview client connected!\n");
+                break;
+            }
+            ws_session_open(wsi, session, true);
             connected = true;
             lwsl_user("WS client connected!\n");
             printf("ws_callback: LWS_CALLBACK_CLIENT_ESTABLISHED => connected = true\n");
             break;
 
+        case LWS_CALLBACK_ESTABLISHED:
+            ws_session_open(wsi, session, false);
+            lwsl_user("WS viewer connected!\n");
+            break;
+
         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
             lwsl_user("WS connection error!\n");
+            if (wsi == preview_wsi) {
+                preview_connected = false;
+                preview_wsi = NULL;
+                break;
+            }
             connected = false;
             break;
 
         case LWS_CALLBACK_CLIENT_RECEIVE:
-            // Typically we don't need to handle inbound frames
+        case LWS_CALLBACK_RECEIVE:
+            /* inbound text messages are control commands from the consumer */
+            if (in && len && !lws_frame_is_binary(wsi) && session && wsi != preview_wsi) {
+                handle_consumer_command(session, (const char *) in, len);
+            }
+            break;
+
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            /* frames were queued: every session with a queue gets a WRITEABLE callback */
+            lws_callback_on_writable_all_protocol(lws_get_context(wsi), lws_get_protocol(wsi));
+            break;
+
+        case LWS_CALLBACK_CLIENT_WRITEABLE:
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            if (wsi == preview_wsi) {
+                ws_message_write(wsi, true);
+                break;
+            }
+            /* PCM and reports go before frames: they are small and time-sensitive */
+            if (wsi == ws_wsi && ws_message_write(wsi, false)) {
+                break;
+            }
+            if (session && session->sub) {
+                return ws_session_write(wsi, session);
+            }
             break;
 
         case LWS_CALLBACK_CLOSED:
-            connected = false;
-            lwsl_user("WS client closed!\n");
+        case LWS_CALLBACK_CLIENT_CLOSED:
+            if (wsi == preview_wsi) {
+                preview_connected = false;
+                preview_wsi = NULL;
+                ws_message_clear(true);
+                break;
+            }
+            if (session) {
+                ws_session_close(session);
+            }
+            if (wsi == ws_wsi) {
+                connected = false;
+                ws_message_clear(false);
+                lwsl_user("WS client closed!\n");
+            } else {
+                lwsl_user("WS viewer closed!\n");
+            }
             break;
 
         default:
@@ -84,18 +470,25 @@ static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
 }
 
 /**
- * Initializes the libwebsockets client and connects to ws://localhost:8081
+ * Initializes libwebsockets: connects to the consumer at ws://localhost:8081
+ * (unless frames go to an in-process consumer), and with -viewers listens on
+ * 127.0.0.1:viewers_port for extra viewers of the same frames.
  */
-static void init_websocket_client() {
+static void init_websocket(bool connect_consumer) {
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
     
-    info.port = CONTEXT_PORT_NO_LISTEN;
+    if (viewers_port) {
+        info.port = viewers_port;
+        info.iface = "127.0.0.1";
+    } else {
+        info.port = CONTEXT_PORT_NO_LISTEN;
+    }
     info.protocols = (const struct lws_protocols[]) {
         {
             "my-protocol",
             ws_callback,
-            0,                      // per_session_data_size
+            sizeof(ws_session_t),   // per_session_data_size
             65536,                  // rx_buffer_size
             0,                      // id
             NULL,                   // user pointer
@@ -114,24 +507,34 @@ static void init_websocket_client() {
         return;
     }
 
-    struct lws_client_connect_info ccinfo;
-    memset(&ccinfo, 0, sizeof(ccinfo));
-    ccinfo.context = ws_context;
-    ccinfo.address = "localhost";
-    ccinfo.port = 8081;
-    ccinfo.path = "/";
-    ccinfo.host = lws_canonical_hostname(ws_context);
-    ccinfo.origin = "origin";
-    ccinfo.protocol = "my-protocol";
-    ccinfo.pwsi = &ws_wsi;
-    ccinfo.ssl_connection = 0;
-    
-    ws_wsi = lws_client_connect_via_info(&ccinfo);
-    if (!ws_wsi) {
-        lwsl_err("lws_client_connect_via_info failed\n");
-        return;
-    }
+    if (connect_consumer) {
+        struct lws_client_connect_info ccinfo;
+        memset(&ccinfo, 0, sizeof(ccinfo));
+        ccinfo.context = ws_context;
+        ccinfo.address = "localhost";
+        ccinfo.port = 8081;
+        ccinfo.path = "/";
+        ccinfo.host = lws_canonical_hostname(ws_context);
+        ccinfo.origin = "origin";
+        ccinfo.protocol = "my-protocol";
+        ccinfo.pwsi = &ws_wsi;
+        ccinfo.ssl_connection = 0;
+
+        ws_wsi = lws_client_connect_via_info(&ccinfo);
+        if (!ws_wsi) {
+            lwsl_err("lws_client_connect_via_info failed\n");
+        }
 
+        /* thumbnails get their own connection, so subscribers never see full frames */
+        if (ws_wsi && preview_width) {
+            ccinfo.path = "/preview";
+            ccinfo.pwsi = &preview_wsi;
+            preview_wsi = lws_client_connect_via_info(&ccinfo);
+            if (!preview_wsi) {
+                lwsl_err("lws_client_connect_via_info failed (preview)\n");
+            }
+        }
+    }
     pthread_t ws_thread;
     pthread_create(&ws_thread, NULL, ws_service_thread, NULL);
     pthread_detach(ws_thread);
@@ -154,8 +557,9 @@ static unsigned char X11_search_attempts;
 
 static GstClockTime gst_video_pipeline_base_time = GST_CLOCK_TIME_NONE;
 static logger_t *logger = NULL;
-static unsigned short width, height, width_source, height_source;  /* not currently used */
+static unsigned short width, height, width_source, height_source;  /* from the last SPS/PPS (0x01) packet */
 static bool first_packet = false;
+static bool discont_pending = false;   /* the next buffer starts a new coded video sequence */
 static bool do_sync = false;
 static bool auto_videosink = true;
 static bool hls_video = false;
@@ -163,7 +567,6 @@ static bool hls_video = false;
 static bool use_x11 = false;
 #endif
 static bool logger_debug = false;
-static bool video_terminate = false;
 
 #define NCODECS  2   /* renderers for h264 and h265 */
 
@@ -171,6 +574,9 @@ struct video_renderer_s {
     GstElement *appsrc, *pipeline;
     GstBus *bus;
     const char *codec;
+    GstElement *consumer_caps, *consumer_rate;  /* appsink branch capsfilter and videorate */
+    int source_width, source_height;            /* size of decoded frames entering videotee */
+    int consumer_width, consumer_height;        /* size currently requested from videoscale */
     bool autovideo, state_pending;
     int id;
     gboolean terminate;
@@ -247,19 +653,317 @@ static void append_videoflip(GString *launch, const videoflip_t *flip, const vid
     }
 }
 
+/*=============================*/
+/*  Consumer viewport control  */
+/*=============================*/
+
+#define DEFAULT_CONSUMER_FPS 30
+#define MAX_CONSUMER_FPS 255
+#define MAX_CONSUMER_DIMENSION 9999
+
+/* set by the consumer over the control channel, used by all renderers */
+static pthread_mutex_t viewport_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int viewport_width = 0, viewport_height = 0;   /* 0 = no scaling */
+static unsigned int viewport_fps = DEFAULT_CONSUMER_FPS;
+
+/* called with viewport_mutex held: fit decoded frames into the consumer viewport *
+ * (preserving aspect ratio, never upscaling) and renegotiate only on change       */
+static void update_consumer_caps(video_renderer_t *r) {
+    int w = 0, h = 0;
+    if (!r->consumer_caps) {
+        return;
+    }
+    if (viewport_width && viewport_height && r->source_width > 0 && r->source_height > 0) {
+        double scale_w = (double) viewport_width / r->source_width;
+        double scale_h = (double) viewport_height / r->source_height;
+        double scale = (scale_w < scale_h ? scale_w : scale_h);
+        if (scale < 1.0) {
+            w = ((int) (scale * r->source_width)) & ~1;
+            h = ((int) (scale * r->source_height)) & ~1;
+            w = (w < 2 ? 2 : w);
+            h = (h < 2 ? 2 : h);
+        }
+    }
+    if (r->consumer_rate) {
+        g_object_set(r->consumer_rate, "max-rate", (gint) viewport_fps, NULL);
+    }
+    if (w == r->consumer_width && h == r->consumer_height) {
+        return;
+    }
+    r->consumer_width = w;
+    r->consumer_height = h;
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "format", G_TYPE_STRING, "RGBA",
+                                        "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                                        NULL);
+    if (w && h) {
+        gst_caps_set_simple(caps, "width", G_TYPE_INT, w, "height", G_TYPE_INT, h, NULL);
+    }
+    /* capsfilter sends a reconfigure event upstream: videoscale renegotiates live */
+    g_object_set(r->consumer_caps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    logger_log(logger, LOGGER_DEBUG, "consumer output (%s): %dx%d (0x0 = unscaled) max %u fps",
+               r->codec, w, h, viewport_fps);
+}
+
+/* "notify::caps" on the videotee sink pad: the decoded frame size has changed */
+static void on_decoded_caps(GstPad *pad, GParamSpec *pspec, gpointer user_data) {
+    video_renderer_t *r = (video_renderer_t *) user_data;
+    int w = 0, h = 0;
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        return;
+    }
+    GstStructure *s = gst_caps_get_structure(caps, 0);
+    gst_structure_get_int(s, "width", &w);
+    gst_structure_get_int(s, "height", &h);
+    gst_caps_unref(caps);
+
+    pthread_mutex_lock(&viewport_mutex);
+    r->source_width = w;
+    r->source_height = h;
+    update_consumer_caps(r);
+    pthread_mutex_unlock(&viewport_mutex);
+}
+
+void video_renderer_set_viewport(unsigned int w, unsigned int h, unsigned int fps) {
+    if (w > MAX_CONSUMER_DIMENSION || h > MAX_CONSUMER_DIMENSION || !w != !h) {
+        logger_log(logger, LOGGER_ERR, "invalid consumer viewport %ux%u ignored", w, h);
+        return;
+    }
+    fps = (fps == 0 ? DEFAULT_CONSUMER_FPS : fps);
+    fps = (fps > MAX_CONSUMER_FPS ? MAX_CONSUMER_FPS : fps);
+
+    pthread_mutex_lock(&viewport_mutex);
+    viewport_width = w;
+    viewport_height = h;
+    viewport_fps = fps;
+    for (int i = 0; i < n_renderers; i++) {
+        if (renderer_type[i]) {
+            update_consumer_caps(renderer_type[i]);
+        }
+    }
+    pthread_mutex_unlock(&viewport_mutex);
+    logger_log(logger, LOGGER_INFO, "consumer viewport %ux%u @ %u fps", w, h, fps);
+}
+
+bool video_renderer_get_viewport(unsigned int *width, unsigned int *height, unsigned int *fps) {
+    pthread_mutex_lock(&viewport_mutex);
+    *width = viewport_width;
+    *height = viewport_height;
+    *fps = viewport_fps;
+    pthread_mutex_unlock(&viewport_mutex);
+    return (connected || frame_callback);
+}
+
+/*=====================*/
+/*      Snapshots      */
+/*=====================*/
+
+/* A snapshot request is served by a probe on the videotee sink pad: the next    *
+ * decoded frame is taken by reference (no copy) and handed to a worker thread,  *
+ * which encodes it with gst_video_convert_sample() and writes it under a        *
+ * temporary name first.  No frame is held while no snapshot is pending, so      *
+ * decoder and sink buffer pools are never pinned.                               */
+
+#define SNAPSHOT_TIMEOUT (5 * GST_SECOND)
+
+typedef struct snapshot_job_s {
+    GstSample *sample;
+    bool jpeg;
+    char *filename;
+} snapshot_job_t;
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *snapshot_prefix = NULL;            /* NULL: snapshots disabled */
+static bool snapshot_requested = false;         /* waiting for the next frame */
+static bool snapshot_jpeg = false;
+static bool snapshot_busy = false;              /* one snapshot at a time, requested or encoding */
+static unsigned int snapshot_count = 0;
+
+static void snapshot_start(snapshot_job_t *job);
+
+static GstPadProbeReturn snapshot_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    snapshot_job_t *job = NULL;
+    pthread_mutex_lock(&snapshot_mutex);
+    if (!snapshot_requested) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        return GST_PAD_PROBE_OK;
+    }
+    snapshot_requested = false;
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (caps && snapshot_prefix && (job = (snapshot_job_t *) calloc(1, sizeof(snapshot_job_t)))) {
+        char timestamp[32];
+        time_t now = time(NULL);
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", &tm_now);
+        size_t len = strlen(snapshot_prefix) + sizeof(timestamp) + 16;
+        job->filename = (char *) malloc(len);
+        if (job->filename) {
+            snprintf(job->filename, len, "%s-%s-%u.%s", snapshot_prefix, timestamp,
+                     ++snapshot_count, snapshot_jpeg ? "jpg" : "png");
+        }
+        job->sample = gst_sample_new(GST_PAD_PROBE_INFO_BUFFER(info), caps, NULL, NULL);
+        job->jpeg = snapshot_jpeg;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    if (caps) {
+        gst_caps_unref(caps);
+    }
+    snapshot_start(job);
+    return GST_PAD_PROBE_OK;
+}
+
+/* timeline markers for the tracer (option -trace); user_data is the event name */
+static GstPadProbeReturn trace_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    trace_instant("gst", (const char *) user_data);
+    return GST_PAD_PROBE_OK;
+}
+
+/* the video pipelines are going away: a request still waiting for a frame is dropped */
+static void snapshot_cancel() {
+    pthread_mutex_lock(&snapshot_mutex);
+    bool cancelled = snapshot_requested;
+    if (cancelled) {
+        snapshot_requested = false;
+        snapshot_busy = false;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    if (cancelled) {
+        logger_log(logger, LOGGER_INFO, "snapshot not taken: video stopped");
+    }
+}
+
+static void *snapshot_thread(void *arg) {
+    snapshot_job_t *job = (snapshot_job_t *) arg;
+    GError *error = NULL;
+    GstCaps *caps = gst_caps_new_empty_simple(job->jpeg ? "image/jpeg" : "image/png");
+    GstSample *image = gst_video_convert_sample(job->sample, caps, SNAPSHOT_TIMEOUT, &error);
+    gst_caps_unref(caps);
+    gst_sample_unref(job->sample);
+
+    if (!image) {
+        logger_log(logger, LOGGER_ERR, "snapshot: encoding failed: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+    } else {
+        GstBuffer *buffer = gst_sample_get_buffer(image);
+        GstMapInfo map;
+        size_t len = strlen(job->filename);
+        char *tmpname = (char *) malloc(len + 5);
+        if (tmpname && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            snprintf(tmpname, len + 5, "%s.tmp", job->filename);
+            FILE *fp = fopen(tmpname, "wb");
+            bool ok = (fp && fwrite(map.data, 1, map.size, fp) == map.size);
+            ok = (fp && fclose(fp) == 0 && ok);
+            /* rename() is atomic: readers never see a partially written image */
+            if (ok && rename(tmpname, job->filename) == 0) {
+                logger_log(logger, LOGGER_INFO, "snapshot saved to %s", job->filename);
+            } else {
+                logger_log(logger, LOGGER_ERR, "snapshot: could not write %s", job->filename);
+                remove(tmpname);
+            }
+            gst_buffer_unmap(buffer, &map);
+        }
+        free(tmpname);
+        gst_sample_unref(image);
+    }
+
+    free(job->filename);
+    free(job);
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_busy = false;
+    pthread_mutex_unlock(&snapshot_mutex);
+    return NULL;
+}
+
+void video_renderer_set_snapshot(const char *prefix) {
+    pthread_mutex_lock(&snapshot_mutex);
+    free(snapshot_prefix);
+    snapshot_prefix = (prefix ? strdup(prefix) : NULL);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+void video_renderer_snapshot(bool jpeg) {
+    const char *reason = NULL;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    if (!snapshot_prefix) {
+        reason = "snapshots are not enabled (use option -snap)";
+    } else if (snapshot_busy) {
+        reason = "previous snapshot is still being taken";
+    } else {
+        snapshot_busy = true;
+        snapshot_requested = true;
+        snapshot_jpeg = jpeg;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+
+    if (reason) {
+        logger_log(logger, LOGGER_INFO, "snapshot not taken: %s", reason);
+    }
+}
+
+/* called from the probe, without the lock; job is NULL if it could not be set up */
+static void snapshot_start(snapshot_job_t *job) {
+    if (!job || !job->filename) {
+        logger_log(logger, LOGGER_ERR, "snapshot: memory allocation failed, or no caps on the frame");
+        if (job) {
+            gst_sample_unref(job->sample);
+            free(job);
+        }
+        pthread_mutex_lock(&snapshot_mutex);
+        snapshot_busy = false;
+        pthread_mutex_unlock(&snapshot_mutex);
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, snapshot_thread, job)) {
+        logger_log(logger, LOGGER_ERR, "snapshot: could not start encoder thread");
+        gst_sample_unref(job->sample);
+        free(job->filename);
+        free(job);
+        pthread_mutex_lock(&snapshot_mutex);
+        snapshot_busy = false;
+        pthread_mutex_unlock(&snapshot_mutex);
+        return;
+    }
+    pthread_detach(thread);
+}
+
 /* Apple uses colorimetry 1:3:7:1 (BT709, sRGB) which older GStreamer versions may not fully parse. */
 static const char h264_caps[] = "video/x-h264,stream-format=(string)byte-stream,alignment=(string)au";
 static const char h265_caps[] = "video/x-h265,stream-format=(string)byte-stream,alignment=(string)au";
 
+/* New caps set on the appsrc are sent downstream just ahead of the next buffer, so parser, *
+ * decoder and sinks renegotiate inside the running pipeline instead of it being rebuilt.  */
+static void set_stream_caps(video_renderer_t *r) {
+    GstCaps *caps = gst_caps_from_string(strcmp(r->codec, h265) ? h264_caps : h265_caps);
+    if (width && height) {
+        gst_caps_set_simple(caps, "width", G_TYPE_INT, (int) width, "height", G_TYPE_INT, (int) height, NULL);
+    }
+    g_object_set(r->appsrc, "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
 void video_renderer_size(float *f_width_source, float *f_height_source, float *f_width, float *f_height) {
+    unsigned short new_width = (unsigned short)*f_width;
+    unsigned short new_height = (unsigned short)*f_height;
+    bool changed = (new_width != width || new_height != height);
     width_source = (unsigned short)*f_width_source;
     height_source = (unsigned short)*f_height_source;
-    width = (unsigned short)*f_width;
-    height = (unsigned short)*f_height;
+    width = new_width;
+    height = new_height;
     logger_log(logger, LOGGER_DEBUG,
         "begin video stream wxh = %dx%d; source %dx%d",
         width, height, width_source, height_source
     );
+    /* rotation or app switch: renegotiate in place; a codec switch sets caps in video_renderer_choose_codec */
+    if (changed && renderer && !hls_video) {
+        logger_log(logger, LOGGER_INFO, "video size changed to %dx%d, renegotiating", width, height);
+        set_stream_caps(renderer);
+    }
 }
 
 /* Helper to create a videosink for playbin, if not autovideosink */
@@ -308,6 +1012,100 @@ GstElement *make_video_sink(const char *videosink, const char *videosink_options
 static unsigned char* pending_buffer = NULL;
 static size_t pending_size = 0;
 
+
+static frame_delta_t *frame_delta = NULL;   /* only used from the appsink streaming thread */
+static GstCaps *ntp_time_caps = NULL;       /* tags each compressed frame with its ntp_time */
+
+/* the reference timestamp attached in video_renderer_render_buffer() survives decoding *
+ * and scaling; without it (GStreamer < 1.14) or sync, fall back to the time the frame   *
+ * reached the sink                                                                      */
+static uint64_t frame_ntp_time(GstBuffer *buffer, GstElement *sink) {
+#if GST_CHECK_VERSION(1,14,0)
+    GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta(buffer, ntp_time_caps);
+    if (meta) {
+        return meta->timestamp;
+    }
+#endif
+    if (do_sync && GST_BUFFER_PTS_IS_VALID(buffer)) {
+        return GST_BUFFER_PTS(buffer) + gst_video_pipeline_base_time;
+    }
+    GstClock *clock = gst_element_get_clock(sink);
+    uint64_t now = 0;
+    if (clock) {
+        now = (uint64_t) gst_clock_get_time(clock);
+        gst_object_unref(clock);
+    }
+    return now;
+}
+
+static void ws_put_le(unsigned char *p, uint64_t value, int nbytes) {
+    for (int i = 0; i < nbytes; i++) {
+        p[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void ws_write_header(unsigned char *p, uint16_t type, uint16_t flags, int width,
+                            int height, uint32_t stride, uint64_t pts) {
+    ws_put_le(p, WS_MSG_MAGIC, 4);
+    ws_put_le(p + 4, type, 2);
+    ws_put_le(p + 6, flags, 2);
+    ws_put_le(p + 8, (uint16_t) width, 2);
+    ws_put_le(p + 10, (uint16_t) height, 2);
+    ws_put_le(p + 12, stride, 4);
+    ws_put_le(p + 16, pts, 8);
+}
+
+/* returns the number of bytes to send, with the message at ws_buf + LWS_PRE */
+static size_t ws_build_frame(unsigned char **ws_buf, uint16_t type, const unsigned char *data, int width,
+                             int height, int stride, uint64_t pts) {
+    size_t msg_size = WS_HEADER_SIZE + (size_t) stride * height;
+    *ws_buf = (unsigned char *) malloc(LWS_PRE + msg_size);
+    if (!*ws_buf) {
+        return 0;
+    }
+    unsigned char *p = *ws_buf + LWS_PRE;
+    ws_write_header(p, type, 0, width, height, (uint32_t) stride, pts);
+    memcpy(p + WS_HEADER_SIZE, data, (size_t) stride * height);
+    return msg_size;
+}
+
+static size_t ws_build_tiles(unsigned char **ws_buf, const unsigned char *data, int width, int height,
+                             int stride, uint64_t pts, const frame_delta_rect_t *rects, int n_rects) {
+    size_t msg_size = WS_HEADER_SIZE + 4 + 8 * (size_t) n_rects;
+    for (int i = 0; i < n_rects; i++) {
+        msg_size += (size_t) rects[i].w * rects[i].h * 4;
+    }
+    *ws_buf = (unsigned char *) malloc(LWS_PRE + msg_size);
+    if (!*ws_buf) {
+        return 0;
+    }
+    unsigned char *p = *ws_buf + LWS_PRE;
+    ws_write_header(p, WS_MSG_FRAME_TILES, 0, width, height, WS_TILE_SIZE * 4, pts);
+    p += WS_HEADER_SIZE;
+    ws_put_le(p, WS_TILE_SIZE, 2);
+    ws_put_le(p + 2, (uint16_t) n_rects, 2);
+    p += 4;
+    for (int i = 0; i < n_rects; i++) {
+        ws_put_le(p, rects[i].x, 2);
+        ws_put_le(p + 2, rects[i].y, 2);
+        ws_put_le(p + 4, rects[i].w, 2);
+        ws_put_le(p + 6, rects[i].h, 2);
+        p += 8;
+    }
+    for (int i = 0; i < n_rects; i++) {
+        size_t row_bytes = (size_t) rects[i].w * 4;
+        const unsigned char *src = data + (size_t) rects[i].y * stride + (size_t) rects[i].x * 4;
+        for (int y = 0; y < rects[i].h; y++) {
+            memcpy(p, src, row_bytes);
+            p += row_bytes;
+            src += stride;
+        }
+    }
+    return msg_size;
+}
+
+static uint64_t frame_seq = 0;   /* only used from the appsink streaming thread */
+
 static GstFlowReturn on_new_sample(GstAppSink *sink, gpointer user_data) {
     GstSample *sample = gst_app_sink_pull_sample(sink);
     if (!sample) {
@@ -315,47 +1113,149 @@ static GstFlowReturn on_new_sample(GstAppSink *sink, gpointer user_data) {
     }
 
     GstBuffer *buffer = gst_sample_get_buffer(sample);
-    GstMapInfo map;
-    
-    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-        if (connected && ws_wsi) {
-            printf("map.size = %zu\n", map.size);
-
-            // Allocate a single large buffer for the entire frame
-            unsigned char *ws_buf = (unsigned char *)malloc(LWS_PRE + map.size);
-            if (ws_buf) {
-                // Copy the entire frame into the buffer (after the LWS padding)
-                memcpy(ws_buf + LWS_PRE, map.data, map.size);
-
-                // Debug print once
-                printf("Sending entire frame: size=%zu bytes\n", map.size);
-                if (map.size >= 4) {
-                    // Print first 4 bytes
-                    printf("First few bytes: %02x %02x %02x %02x\n",
-                           map.data[0], map.data[1], map.data[2], map.data[3]);
-                }
+    int frame_width = 0, frame_height = 0;
+    GstCaps *caps = gst_sample_get_caps(sample);
+    if (caps) {
+        GstStructure *s = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(s, "width", &frame_width);
+        gst_structure_get_int(s, "height", &frame_height);
+    }
+
+    /* the mapped sample is kept until every consumer has released it: no copy */
+    video_frame_t *frame = NULL;
+    if (frame_height > 0 && frame_hub && frame_hub_count(frame_hub)) {
+        frame = (video_frame_t *) calloc(1, sizeof(video_frame_t));
+    }
+    if (!frame || !gst_buffer_map(buffer, &frame->map, GST_MAP_READ)) {
+        free(frame);
+        gst_sample_unref(sample);
+        if (frame_delta) {
+            /* whoever subscribes next starts from a whole frame */
+            frame_delta_force_keyframe(frame_delta);
+        }
+        return GST_FLOW_OK;
+    }
+    frame->refcount = 1;
+    frame->sample = sample;
+    frame->width = frame_width;
+    frame->height = frame_height;
+    frame->stride = (int) (frame->map.size / frame_height);
+    frame->ntp_time = frame_ntp_time(buffer, GST_ELEMENT(sink));
+    frame->seq = ++frame_seq;
+    frame->n_rects = FRAME_DELTA_KEYFRAME;
+
+    /* the tiles message is shared by every WebSocket consumer that saw the previous frame */
+    if (frame_delta && g_atomic_int_get(&ws_sessions)) {
+        const frame_delta_rect_t *rects = NULL;
+        frame->n_rects = frame_delta_update(frame_delta, frame->map.data, frame_width, frame_height,
+                                            frame->stride, &rects);
+        if (frame->n_rects > 0) {
+            frame->tiles_size = ws_build_tiles(&frame->tiles_msg, frame->map.data, frame_width, frame_height,
+                                               frame->stride, frame->ntp_time, rects, frame->n_rects);
+        }
+    } else if (frame_delta) {
+        frame_delta_force_keyframe(frame_delta);
+    }
 
-                // Single WebSocket write call
-                int sent = lws_write(ws_wsi, ws_buf + LWS_PRE, map.size, LWS_WRITE_BINARY);
-                
-                free(ws_buf);
+    int dropped = frame_hub_publish(frame_hub, frame);
+    if (dropped) {
+        metrics_add(METRIC_WS_FRAMES_DROPPED, dropped);
+    }
+    video_frame_unref(frame);
+    return GST_FLOW_OK;
+}
 
-                if (sent < 0) {
-                    gst_buffer_unmap(buffer, &map);
-                    gst_sample_unref(sample);
-                    return GST_FLOW_ERROR;
-                }
-            }
+/* the in-process consumer's queue holds at most one frame, handed over as soon as it is queued */
+static void frame_callback_notify(frame_hub_sub_t *sub, void *user_data) {
+    video_frame_t *frame = (video_frame_t *) frame_hub_pop(sub);
+    if (frame) {
+        frame_callback(frame_callback_data, frame, frame->map.data, frame->width, frame->height,
+                       frame->stride, frame->ntp_time);
+    }
+}
+
+void video_renderer_set_frame_callback(video_frame_callback_t callback, void *user_data) {
+    frame_callback = callback;
+    frame_callback_data = user_data;
+}
+
+void video_renderer_release_frame(video_frame_t *frame) {
+    video_frame_unref(frame);
+}
+
+void video_renderer_set_viewers(int port) {
+    viewers_port = port;
+}
+
+/* thumbnails from the preview branch; a failed write only loses this preview */
+static GstFlowReturn on_preview_sample(GstAppSink *sink, gpointer user_data) {
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample) {
+        return GST_FLOW_ERROR;
+    }
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstMapInfo map;
+    int preview_w = 0, preview_h = 0;
+    GstCaps *caps = gst_sample_get_caps(sample);
+    if (caps) {
+        GstStructure *s = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(s, "width", &preview_w);
+        gst_structure_get_int(s, "height", &preview_h);
+    }
+    if (preview_connected && preview_wsi && preview_h > 0 && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        unsigned char *ws_buf = NULL;
+        size_t msg_size = ws_build_frame(&ws_buf, WS_MSG_PREVIEW_RGBA, map.data, preview_w, preview_h,
+                                         (int) (map.size / preview_h), frame_ntp_time(buffer, GST_ELEMENT(sink)));
+        ws_message_t *message = (msg_size ? ws_message_new(msg_size) : NULL);
+        if (message) {
+            memcpy(message->buf + LWS_PRE, ws_buf + LWS_PRE, msg_size);
+            ws_message_queue(message, true);
         }
+        free(ws_buf);
         gst_buffer_unmap(buffer, &map);
     }
-
     gst_sample_unref(sample);
     return GST_FLOW_OK;
 }
 
+/* decoded audio chunks from the audio renderer go out on the consumer connection */
+void video_renderer_send_pcm(const unsigned char *pcm, int frames, int channels, int rate, uint64_t ntp_time) {
+    if (!connected || !ws_wsi) {
+        return;
+    }
+    int stride = 2 * channels;
+    size_t msg_size = WS_HEADER_SIZE + 4 + (size_t) frames * stride;
+    ws_message_t *message = ws_message_new(msg_size);
+    if (!message) {
+        return;
+    }
+    unsigned char *p = message->buf + LWS_PRE;
+    ws_write_header(p, WS_MSG_AUDIO_PCM, 0, channels, frames, (uint32_t) stride, ntp_time);
+    ws_put_le(p + WS_HEADER_SIZE, (uint32_t) rate, 4);
+    memcpy(p + WS_HEADER_SIZE + 4, pcm, (size_t) frames * stride);
+    ws_message_queue(message, false);
+}
 
+void video_renderer_send_report(const char *json, uint64_t ntp_time) {
+    if (!connected || !ws_wsi) {
+        return;
+    }
+    size_t len = strlen(json);
+    size_t msg_size = WS_HEADER_SIZE + len;
+    ws_message_t *message = ws_message_new(msg_size);
+    if (!message) {
+        return;
+    }
+    unsigned char *p = message->buf + LWS_PRE;
+    ws_write_header(p, WS_MSG_STREAM_REPORT, 0, 0, 0, (uint32_t) len, ntp_time);
+    memcpy(p + WS_HEADER_SIZE, json, len);
+    ws_message_queue(message, false);
+}
 
+void video_renderer_set_preview(unsigned int width, unsigned int fps) {
+    preview_width = width;
+    preview_fps = fps;
+}
 
 /*==============================*/
 /*  Initialize WebSocket + Tee  */
@@ -376,7 +1276,6 @@ void video_renderer_init(logger_t *render_logger, const char *server_name,
 
     logger = render_logger;
     logger_debug = (logger_get_level(logger) >= LOGGER_DEBUG);
-    video_terminate = false;
 
     /* Set the X11 window title if needed */
     const gchar *appname = g_get_application_name();
@@ -384,8 +1283,27 @@ void video_renderer_init(logger_t *render_logger, const char *server_name,
         g_set_application_name(server_name);
     }
 
+    /* one hub for the life of the process: consumers stay subscribed across pipeline rebuilds */
+    if (!frame_hub) {
+        frame_hub = frame_hub_create(video_frame_ref, video_frame_unref);
+        if (frame_hub && frame_callback) {
+            frame_callback_sub = frame_hub_subscribe(frame_hub, 1, FRAME_HUB_DROP_OLDEST,
+                                                     frame_callback_notify, NULL);
+        }
+    }
     // Initialize the WebSocket client once; optional to move it elsewhere
-    init_websocket_client();
+    if (!ws_context && (!frame_callback || viewers_port)) {
+        init_websocket(!frame_callback);
+        if (ws_context && viewers_port) {
+            logger_log(logger, LOGGER_INFO, "video viewers can connect to ws://127.0.0.1:%d/", viewers_port);
+        }
+    }
+    if (!frame_delta) {
+        frame_delta = frame_delta_init(WS_TILE_SIZE, WS_KEYFRAME_INTERVAL);
+    }
+    if (!ntp_time_caps) {
+        ntp_time_caps = gst_caps_new_empty_simple("timestamp/x-ntp-local");
+    }
 
     if (hls_video) {
         n_renderers = 1;
@@ -458,17 +1376,35 @@ void video_renderer_init(logger_t *render_logger, const char *server_name,
              * Insert tee + appsink + local videosink 
              * We remove the old "videoscale ! videosink" lines 
              */
+            /* 
+             * The appsink branch is scaled and rate-limited to what the consumer 
+             * announces ("viewport" command): consumer_caps and consumer_rate are 
+             * updated live, without rebuilding the pipeline. 
+             */
             g_string_append(launch,
                 "tee name=videotee ! "
                 "queue max-size-buffers=2 max-size-bytes=0 max-size-time=0 leaky=downstream ! "
-                "videoscale ! videorate max-rate=30 ! "  // Limit to 30fps
+                "videoscale ! videorate name=consumer_rate drop-only=true ! "
                 "videoconvert ! "
-                "video/x-raw,format=RGBA,framerate=30/1 ! "  // Force 30fps
+                "capsfilter name=consumer_caps caps=video/x-raw,format=RGBA ! "
                 "appsink name=uxplay_sink sync=false "
                 "max-buffers=2 drop=true enable-last-sample=false "
                 "emit-signals=true "
-                "videotee. ! queue ! videoscale ! "
             );
+            /*
+             * Optional thumbnail branch for monitoring dashboards: frames are
+             * dropped by videorate before they are scaled, so it costs little.
+             */
+            if (preview_width) {
+                g_string_append_printf(launch,
+                    "videotee. ! queue max-size-buffers=1 max-size-bytes=0 max-size-time=0 leaky=downstream ! "
+                    "videorate drop-only=true max-rate=%u ! videoscale ! videoconvert ! "
+                    "video/x-raw,format=RGBA,width=%u,pixel-aspect-ratio=1/1 ! "
+                    "appsink name=preview_sink sync=false max-buffers=1 drop=true "
+                    "enable-last-sample=false ",
+                    preview_fps, preview_width);
+            }
+            g_string_append(launch, "videotee. ! queue ! videoscale ! ");
             g_string_append(launch, videosink);
 
             g_string_append(launch, " name=");
@@ -547,7 +1483,50 @@ void video_renderer_init(logger_t *render_logger, const char *server_name,
                                            NULL, NULL);
                 gst_object_unref(appsink);
             }
+            GstElement *preview_sink = gst_bin_get_by_name(
+                GST_BIN(renderer_type[i]->pipeline), "preview_sink");
+            if (preview_sink) {
+                static GstAppSinkCallbacks preview_callbacks = {
+                    .eos         = NULL,
+                    .new_preroll = NULL,
+                    .new_sample  = on_preview_sample
+                };
+                gst_app_sink_set_callbacks(GST_APP_SINK(preview_sink),
+                                           &preview_callbacks,
+                                           NULL, NULL);
+                gst_object_unref(preview_sink);
+            }
+
+            renderer_type[i]->consumer_caps = gst_bin_get_by_name(
+                GST_BIN(renderer_type[i]->pipeline), "consumer_caps");
+            renderer_type[i]->consumer_rate = gst_bin_get_by_name(
+                GST_BIN(renderer_type[i]->pipeline), "consumer_rate");
+            GstElement *videotee = gst_bin_get_by_name(
+                GST_BIN(renderer_type[i]->pipeline), "videotee");
+            if (videotee) {
+                GstPad *pad = gst_element_get_static_pad(videotee, "sink");
+                g_signal_connect(pad, "notify::caps", G_CALLBACK(on_decoded_caps), renderer_type[i]);
+                pthread_mutex_lock(&snapshot_mutex);
+                if (snapshot_prefix) {
+                    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, snapshot_probe, NULL, NULL);
+                }
+                pthread_mutex_unlock(&snapshot_mutex);
+                if (trace_enabled()) {
+                    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, trace_probe, (gpointer) "video decoded", NULL);
+                }
+                gst_object_unref(pad);
+                gst_object_unref(videotee);
+            }
+            if (trace_enabled()) {
+                GstPad *pad = gst_element_get_static_pad(renderer_type[i]->appsrc, "src");
+                gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, trace_probe, (gpointer) "video appsrc", NULL);
+                gst_object_unref(pad);
+            }
+            pthread_mutex_lock(&viewport_mutex);
+            update_consumer_caps(renderer_type[i]);
+            pthread_mutex_unlock(&viewport_mutex);
         }
+        stream_threads_set_policy(renderer_type[i]->pipeline, THREAD_CLASS_GST_VIDEO);
 
 #ifdef X_DISPLAY_FIX
         use_x11 = (strstr(videosink, "xvimagesink") 
@@ -689,8 +1668,17 @@ void video_renderer_render_buffer(unsigned char* data, int *data_len,
         if (do_sync) {
             GST_BUFFER_PTS(buffer) = pts;
         }
+        if (discont_pending) {
+            /* parser and decoder resynchronize on the new SPS/PPS without waiting for more data */
+            GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+            discont_pending = false;
+        }
         gst_buffer_fill(buffer, 0, data, *data_len);
+#if GST_CHECK_VERSION(1,14,0)
+        gst_buffer_add_reference_timestamp_meta(buffer, ntp_time_caps, (GstClockTime) *ntp_time, GST_CLOCK_TIME_NONE);
+#endif
         gst_app_src_push_buffer(GST_APP_SRC(renderer->appsrc), buffer);
+        metrics_set(METRIC_VIDEO_QUEUE_BYTES, (int64_t) gst_app_src_get_current_level_bytes(GST_APP_SRC(renderer->appsrc)));
     }
 }
 
@@ -724,6 +1712,12 @@ static void video_renderer_destroy_h26x(video_renderer_t *renderer) {
     if (renderer->appsrc) {
         gst_object_unref(renderer->appsrc);
     }
+    if (renderer->consumer_caps) {
+        gst_object_unref(renderer->consumer_caps);
+    }
+    if (renderer->consumer_rate) {
+        gst_object_unref(renderer->consumer_rate);
+    }
     gst_object_unref(renderer->pipeline);
 
 #ifdef X_DISPLAY_FIX
@@ -739,9 +1733,21 @@ static void video_renderer_destroy_h26x(video_renderer_t *renderer) {
 void video_renderer_destroy() {
     for (int i = 0; i < n_renderers; i++) {
         if (renderer_type[i]) {
-            video_renderer_destroy_h26x(renderer_type[i]);
+            pthread_mutex_lock(&viewport_mutex);
+            video_renderer_t *r = renderer_type[i];
+            renderer_type[i] = NULL;
+            pthread_mutex_unlock(&viewport_mutex);
+            video_renderer_destroy_h26x(r);
         }
     }
+    snapshot_cancel();
+    /* queued frames would keep samples of the destroyed pipelines; consumers resync with a whole frame */
+    if (frame_hub) {
+        frame_hub_flush(frame_hub);
+    }
+    /* pipelines are stopped, so no appsink callback can still be using it */
+    frame_delta_destroy(frame_delta);
+    frame_delta = NULL;
 }
 
 /* Our GStreamer bus callback for handling error/EOS, etc. */
@@ -932,14 +1938,24 @@ gboolean gstreamer_pipeline_bus_callback(GstBus *bus, GstMessage *message, void
     return TRUE;
 }
 
-/* Switch between h264/h265 pipelines once we detect the correct codec. */
+/* Switch between h264/h265 pipelines once we detect the correct codec.  Called for every *
+ * SPS/PPS (0x01) packet; the pipeline that is not in use is kept PLAYING as a standby.   */
 void video_renderer_choose_codec(bool video_is_h265) {
     g_assert(!hls_video);
     video_renderer_t *renderer_new =
         video_is_h265 ? renderer_type[1] : renderer_type[0];
+    discont_pending = true;
     if (renderer == renderer_new) {
         return;
     }
+    if (renderer_new->state_pending) {
+        /* still restarting after an earlier switch: finish that now instead of *
+         * leaving it to the bus watch, so the first frame is not lost          */
+        gst_element_set_state(renderer_new->pipeline, GST_STATE_PLAYING);
+        gst_element_get_state(renderer_new->pipeline, NULL, NULL, 100 * GST_MSECOND);
+        renderer_new->state_pending = false;
+    }
+    set_stream_caps(renderer_new);
     video_renderer_t *renderer_prev = renderer;
     renderer = renderer_new;
     gst_video_pipeline_base_time = gst_element_get_base_time(renderer->appsrc);
@@ -954,20 +1970,17 @@ void video_renderer_choose_codec(bool video_is_h265) {
     }
 }
 
-/* Called periodically if video_terminate is set. */
-unsigned int video_reset_callback(void *loop) {
-    if (video_terminate) {
-        video_terminate = false;
-        if (renderer->appsrc) {
-            gst_app_src_end_of_stream(
-                GST_APP_SRC(renderer->appsrc)
-            );
-        }
-        gst_bus_set_flushing(renderer->bus, TRUE);
-        gst_element_set_state(renderer->pipeline, GST_STATE_NULL);
-        g_main_loop_quit((GMainLoop *)loop);
+/* A new mirror stream (possibly from another client) will follow: keep the pipelines, and *
+ * their windows, and let its first SPS/PPS select and renegotiate the renderer in place.  *
+ * Returns false for HLS, where the playbin must be rebuilt.                               */
+bool video_renderer_reset_stream() {
+    if (hls_video) {
+        return false;
     }
-    return (unsigned int)TRUE;
+    first_packet = true;
+    discont_pending = true;
+    width = height = 0;    /* the next size report renegotiates */
+    return true;
 }
 
 /* Query playback info for HLS scenario, if needed. */
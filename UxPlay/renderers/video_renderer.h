@@ -106,6 +106,69 @@ void video_renderer_size(float *width_source,
                          float *width,
                          float *height);
 
+/**
+ * Set the viewport announced by the consumer (device pixels, 0x0 = unscaled)
+ * and the maximum frame rate it wants; the appsink branch is renegotiated live.
+ */
+void video_renderer_set_viewport(unsigned int width, unsigned int height, unsigned int fps);
+
+/**
+ * The viewport last announced by the consumer (width = height = 0: unscaled);
+ * returns false if no consumer is attached.
+ */
+bool video_renderer_get_viewport(unsigned int *width, unsigned int *height, unsigned int *fps);
+
+/**
+ * Enable a thumbnail output (width pixels wide, at most fps frames/sec) sent on
+ * its own WebSocket connection; call before video_renderer_init(). width = 0 disables it.
+ */
+void video_renderer_set_preview(unsigned int width, unsigned int fps);
+
+/**
+ * Also accept viewers of the consumer's frames as WebSocket connections to
+ * ws://127.0.0.1:port/ (optionally "?queue=<n>&drop=oldest|newest").  They share
+ * the decoded frames and the messages built from them.  Call before
+ * video_renderer_init(); port = 0 disables it.
+ */
+void video_renderer_set_viewers(int port);
+
+/**
+ * In-process consumer (the Node.js addon): each RGBA frame of the appsink branch is
+ * handed to callback, still mapped, instead of being sent over the WebSocket, which
+ * is then not opened at all (viewers can still connect).  The callback runs on a
+ * GStreamer streaming thread and must pass frame to video_renderer_release_frame()
+ * (from any thread) when done with data; the frame is shared with the viewers, so
+ * data must not be modified.  Call before video_renderer_init().
+ */
+typedef struct video_frame_s video_frame_t;
+typedef void (*video_frame_callback_t)(void *user_data, video_frame_t *frame, const unsigned char *data,
+                                       int width, int height, int stride, uint64_t ntp_time);
+void video_renderer_set_frame_callback(video_frame_callback_t callback, void *user_data);
+void video_renderer_release_frame(video_frame_t *frame);
+
+/**
+ * Send a chunk of decoded S16LE audio (see audio_renderer_set_pcm_output()) to the
+ * consumer, stamped with the same ntp_time timebase as the video frames.
+ */
+void video_renderer_send_pcm(const unsigned char *pcm, int frames, int channels, int rate, uint64_t ntp_time);
+
+/**
+ * Send a client streaming report (JSON, see video_report() in uxplay.cpp) to the consumer.
+ */
+void video_renderer_send_report(const char *json, uint64_t ntp_time);
+
+/**
+ * Enable snapshots: files are written as <prefix>-<date>-<time>-<n>.png (or .jpg).
+ * Call before video_renderer_init(); NULL disables them.
+ */
+void video_renderer_set_snapshot(const char *prefix);
+
+/**
+ * Save the latest decoded frame as PNG (or JPEG); encoding runs on a worker
+ * thread, so this returns immediately.
+ */
+void video_renderer_snapshot(bool jpeg);
+
 /**
  * For local info: if we want to check if the renderer is paused (not implemented in the sample).
  * Keep as a placeholder if needed.
@@ -139,9 +202,10 @@ bool video_get_playback_info(double *duration, double *position, float *rate);
 void video_renderer_choose_codec(bool is_h265);
 
 /**
- * Callback used to reset video if something triggers a re-init (internal).
+ * Prepare the mirror pipelines for a new stream without rebuilding them;
+ * returns false if they must be rebuilt (HLS).
  */
-unsigned int video_reset_callback(void *loop);
+bool video_renderer_reset_stream();
 
 #ifdef __cplusplus
 }
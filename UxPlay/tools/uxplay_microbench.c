@@ -0,0 +1,783 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * uxplay-microbench: timings of the per-packet and per-request code in lib/,
+ * written as JSON so that results can be compared between releases.
+ *
+ *   uxplay-microbench -o bench-1.71.json
+ *   uxplay-microbench -f mirror -r 9 -t 500 -cpu 2
+ *
+ * Each benchmark is calibrated to run for at least -t milliseconds, then
+ * timed -r times; the minimum, median and maximum time per operation are
+ * reported (compare medians; the spread shows how noisy the machine was).
+ * All input data comes from a fixed-seed generator, so runs are repeatable.
+ * RTSP/HTTP requests are a built-in iOS mirroring session unless a capture
+ * of the client-to-server byte stream of one connection (e.g. Wireshark
+ * "Follow TCP Stream", raw, one direction) is given with -http.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "../lib/logger.h"
+#include "../lib/byteutils.h"
+#include "../lib/mirror_buffer.h"
+#include "../lib/raop_buffer.h"
+#include "../lib/raop_rtp_mirror.h"
+#include "../lib/raop_ntp.h"
+#include "../lib/http_request.h"
+#include "../lib/airplay_video.h"
+
+#ifndef UXPLAY_VERSION
+#define UXPLAY_VERSION "unknown"    /* set from uxplay.cpp by tools/CMakeLists.txt */
+#endif
+
+#define MICROBENCH_SCHEMA 1
+#define SECOND_IN_NSECS 1000000000ULL
+#define MAX_REPETITIONS 99
+#define MAX_MESSAGES 256
+
+typedef struct bench_s bench_t;
+typedef void (*bench_run_t)(bench_t *bench, uint64_t iterations);
+
+struct bench_s {
+    const char *name;
+    char params[64];
+    bench_run_t run;
+    uint64_t bytes_per_op;    /* 0: no throughput figure */
+    void *ctx;
+};
+
+typedef struct bench_result_s {
+    uint64_t iterations;
+    double ns_min, ns_median, ns_max;
+} bench_result_t;
+
+/* results are folded into this, so that no benchmarked call is optimized away */
+static volatile uint64_t sink;
+static logger_t *logger = NULL;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+now_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static uint64_t
+rng_next()
+{
+    /* xorshift64*: fixed seed, same data on every run */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+rng_fill(unsigned char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (unsigned char) (rng_next() >> 56);
+    }
+}
+
+static void
+put_int_be(unsigned char *b, uint32_t value)
+{
+    b[0] = (unsigned char) (value >> 24);
+    b[1] = (unsigned char) (value >> 16);
+    b[2] = (unsigned char) (value >> 8);
+    b[3] = (unsigned char) value;
+}
+
+/* ---- mirror_buffer_decrypt ---- */
+
+typedef struct {
+    mirror_buffer_t *mirror;
+    unsigned char *in, *out;
+    int len;
+} mirror_ctx_t;
+
+static void *
+mirror_setup(int len)
+{
+    mirror_ctx_t *ctx = calloc(1, sizeof(mirror_ctx_t));
+    unsigned char aeskey[16];
+    uint64_t connection_id = 0x1234567890abcdefULL;
+    rng_fill(aeskey, sizeof(aeskey));
+    ctx->mirror = mirror_buffer_init(logger, aeskey);
+    mirror_buffer_init_aes(ctx->mirror, &connection_id);
+    ctx->len = len;
+    ctx->in = malloc(len);
+    ctx->out = malloc(len);
+    rng_fill(ctx->in, len);
+    return ctx;
+}
+
+static void
+bench_mirror_decrypt(bench_t *bench, uint64_t iterations)
+{
+    mirror_ctx_t *ctx = bench->ctx;
+    for (uint64_t i = 0; i < iterations; i++) {
+        mirror_buffer_decrypt(ctx->mirror, ctx->in, ctx->out, ctx->len);
+    }
+    sink += ctx->out[ctx->len - 1];
+}
+
+/* payloads are decrypted in place in the reader's buffer, where the next frame's header follows; *
+ * a short payload after one that ended mid-block must not touch it, and must still round-trip     */
+#define MIRROR_CHECK_GAP 8
+
+static bool
+mirror_check()
+{
+    static const int sizes[] = { 37, 5, 3, 1, 100, 7, 16, 9 };
+    unsigned char aeskey[16], plain[256], data[256];
+    uint64_t connection_id = 0x1234567890abcdefULL;
+    int pos;
+    bool ok = true;
+
+    rng_fill(aeskey, sizeof(aeskey));
+    rng_fill(plain, sizeof(plain));
+    memcpy(data, plain, sizeof(data));
+    mirror_buffer_t *encrypt = mirror_buffer_init(logger, aeskey);
+    mirror_buffer_t *decrypt = mirror_buffer_init(logger, aeskey);
+    mirror_buffer_init_aes(encrypt, &connection_id);
+    mirror_buffer_init_aes(decrypt, &connection_id);
+    pos = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        mirror_buffer_decrypt(encrypt, data + pos, data + pos, sizes[i]);
+        pos += sizes[i];
+        ok = ok && !memcmp(data + pos, plain + pos, MIRROR_CHECK_GAP);
+        pos += MIRROR_CHECK_GAP;
+    }
+    pos = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        mirror_buffer_decrypt(decrypt, data + pos, data + pos, sizes[i]);
+        pos += sizes[i] + MIRROR_CHECK_GAP;
+    }
+    ok = ok && !memcmp(data, plain, sizeof(data));
+    mirror_buffer_destroy(encrypt);
+    mirror_buffer_destroy(decrypt);
+    return ok;
+}
+
+/* ---- raop_buffer ---- */
+
+typedef struct {
+    raop_buffer_t *raop;
+    unsigned char packets[8][12 + 1536];
+    unsigned char *out;
+    int payload_len;
+    unsigned short seqnum;
+} audio_ctx_t;
+
+static void *
+audio_setup(int payload_len)
+{
+    audio_ctx_t *ctx = calloc(1, sizeof(audio_ctx_t));
+    unsigned char aeskey[16], aesiv[16];
+    rng_fill(aeskey, sizeof(aeskey));
+    rng_fill(aesiv, sizeof(aesiv));
+    ctx->raop = raop_buffer_init(logger, aeskey, aesiv);
+    ctx->payload_len = payload_len;
+    ctx->out = malloc(payload_len);
+    for (int i = 0; i < 8; i++) {
+        rng_fill(ctx->packets[i], 12 + payload_len);
+        ctx->packets[i][0] = 0x80;
+        ctx->packets[i][1] = 0x60;
+    }
+    return ctx;
+}
+
+static void
+bench_audio_decrypt(bench_t *bench, uint64_t iterations)
+{
+    audio_ctx_t *ctx = bench->ctx;
+    unsigned int outlen = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        raop_buffer_decrypt(ctx->raop, ctx->packets[i & 7], ctx->out, ctx->payload_len, &outlen);
+    }
+    sink += ctx->out[0] + outlen;
+}
+
+/* one packet in, one packet out; with reorder, packets arrive swapped in pairs */
+static void
+audio_enqueue_dequeue(audio_ctx_t *ctx, uint64_t iterations, bool reorder)
+{
+    uint64_t ntp = 0, rtp = 0;
+    unsigned int length;
+    unsigned short seqnum;
+    for (uint64_t i = 0; i < iterations; i++) {
+        unsigned short seq = ctx->seqnum + (unsigned short) i;
+        if (reorder) {
+            seq ^= 1;
+        }
+        unsigned char *packet = ctx->packets[i & 7];
+        packet[2] = (unsigned char) (seq >> 8);
+        packet[3] = (unsigned char) seq;
+        rtp = (uint64_t) seq * 480;
+        raop_buffer_enqueue(ctx->raop, packet, (unsigned short) (12 + ctx->payload_len), &ntp, &rtp, 1);
+        void *payload;
+        while ((payload = raop_buffer_dequeue(ctx->raop, &length, &ntp, &rtp, &seqnum, 0))) {
+            sink += length;
+            free(payload);
+        }
+    }
+    ctx->seqnum += (unsigned short) iterations;
+}
+
+static void
+bench_audio_enqueue_dequeue(bench_t *bench, uint64_t iterations)
+{
+    audio_enqueue_dequeue(bench->ctx, iterations, false);
+}
+
+static void
+bench_audio_enqueue_dequeue_reordered(bench_t *bench, uint64_t iterations)
+{
+    audio_enqueue_dequeue(bench->ctx, iterations, true);
+}
+
+/* ---- http_request_add_data ---- */
+
+typedef struct {
+    char *data;
+    int count;
+    int offset[MAX_MESSAGES];
+    int len[MAX_MESSAGES];
+} http_ctx_t;
+
+static const char *builtin_session[] = {
+    "GET /info RTSP/1.0\r\nX-Apple-ProtocolVersion: 1\r\nContent-Length: %d\r\n"
+    "Content-Type: application/x-apple-binary-plist\r\nCSeq: 0\r\nDACP-ID: 14413BE4996FEA4D\r\n"
+    "Active-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "70",
+    "POST /pair-setup RTSP/1.0\r\nContent-Length: %d\r\nContent-Type: application/octet-stream\r\n"
+    "CSeq: 1\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "32",
+    "POST /pair-verify RTSP/1.0\r\nContent-Length: %d\r\nContent-Type: application/octet-stream\r\n"
+    "CSeq: 2\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "68",
+    "POST /pair-verify RTSP/1.0\r\nContent-Length: %d\r\nContent-Type: application/octet-stream\r\n"
+    "CSeq: 3\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "68",
+    "POST /fp-setup RTSP/1.0\r\nX-Apple-ET: 32\r\nContent-Length: %d\r\nContent-Type: application/octet-stream\r\n"
+    "CSeq: 4\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "16",
+    "POST /fp-setup RTSP/1.0\r\nX-Apple-ET: 32\r\nContent-Length: %d\r\nContent-Type: application/octet-stream\r\n"
+    "CSeq: 5\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "164",
+    "SETUP rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nContent-Length: %d\r\n"
+    "Content-Type: application/x-apple-binary-plist\r\nCSeq: 6\r\nDACP-ID: 14413BE4996FEA4D\r\n"
+    "Active-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "590",
+    "GET_PARAMETER rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nContent-Length: %d\r\n"
+    "Content-Type: text/parameters\r\nCSeq: 7\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\n"
+    "User-Agent: AirPlay/690.7.1\r\n\r\n", "8",
+    "RECORD rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nCSeq: 8\r\nDACP-ID: 14413BE4996FEA4D\r\n"
+    "Active-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "0",
+    "SETUP rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nContent-Length: %d\r\n"
+    "Content-Type: application/x-apple-binary-plist\r\nCSeq: 9\r\nDACP-ID: 14413BE4996FEA4D\r\n"
+    "Active-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "226",
+    "SET_PARAMETER rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nContent-Length: %d\r\n"
+    "Content-Type: text/parameters\r\nCSeq: 10\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\n"
+    "User-Agent: AirPlay/690.7.1\r\n\r\n", "20",
+    "POST /feedback RTSP/1.0\r\nCSeq: 11\r\nDACP-ID: 14413BE4996FEA4D\r\nActive-Remote: 2543110914\r\n"
+    "User-Agent: AirPlay/690.7.1\r\n\r\n", "0",
+    "TEARDOWN rtsp://192.168.1.20/2599118217744183553 RTSP/1.0\r\nContent-Length: %d\r\n"
+    "Content-Type: application/x-apple-binary-plist\r\nCSeq: 12\r\nDACP-ID: 14413BE4996FEA4D\r\n"
+    "Active-Remote: 2543110914\r\nUser-Agent: AirPlay/690.7.1\r\n\r\n", "78",
+    NULL
+};
+
+/* builtin_session with random bodies of the sizes seen from an iOS 17 client */
+static http_ctx_t *
+http_builtin()
+{
+    http_ctx_t *ctx = calloc(1, sizeof(http_ctx_t));
+    size_t size = 0;
+    for (int i = 0; builtin_session[i]; i += 2) {
+        size += strlen(builtin_session[i]) + 16 + (size_t) atoi(builtin_session[i + 1]);
+    }
+    ctx->data = malloc(size);
+    int pos = 0;
+    for (int i = 0; builtin_session[i]; i += 2) {
+        int body = atoi(builtin_session[i + 1]);
+        int len = snprintf(ctx->data + pos, size - pos, builtin_session[i], body);
+        rng_fill((unsigned char *) ctx->data + pos + len, body);
+        ctx->offset[ctx->count] = pos;
+        ctx->len[ctx->count] = len + body;
+        ctx->count++;
+        pos += len + body;
+    }
+    return ctx;
+}
+
+/* split a raw client-to-server stream at the request boundaries (header end + Content-Length) */
+static http_ctx_t *
+http_load_capture(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", filename);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    http_ctx_t *ctx = calloc(1, sizeof(http_ctx_t));
+    ctx->data = malloc(size + 1);
+    if (fread(ctx->data, 1, size, fp) != (size_t) size) {
+        size = 0;
+    }
+    fclose(fp);
+    ctx->data[size] = '\0';
+
+    int pos = 0;
+    while (pos < size && ctx->count < MAX_MESSAGES) {
+        char *header_end = strstr(ctx->data + pos, "\r\n\r\n");
+        if (!header_end) {
+            break;
+        }
+        int len = (int) (header_end + 4 - (ctx->data + pos));
+        *header_end = '\0';
+        char *cl = strcasestr(ctx->data + pos, "\nContent-Length:");
+        if (cl) {
+            len += atoi(cl + strlen("\nContent-Length:"));
+        }
+        *header_end = '\r';
+        if (pos + len > size) {
+            break;
+        }
+        ctx->offset[ctx->count] = pos;
+        ctx->len[ctx->count] = len;
+        ctx->count++;
+        pos += len;
+    }
+    if (!ctx->count) {
+        fprintf(stderr, "%s: no complete requests found\n", filename);
+        free(ctx->data);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void
+bench_http_request(bench_t *bench, uint64_t iterations)
+{
+    http_ctx_t *ctx = bench->ctx;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int j = 0; j < ctx->count; j++) {
+            http_request_t *request = http_request_init();
+            http_request_add_data(request, ctx->data + ctx->offset[j], ctx->len[j]);
+            sink += http_request_is_complete(request);
+            http_request_destroy(request);
+        }
+    }
+}
+
+/* ---- HLS media playlists ---- */
+
+typedef struct {
+    char *condensed;
+    char *expanded;
+} playlist_ctx_t;
+
+/* a YouTube-style condensed media playlist of segments 5 s chunks */
+static playlist_ctx_t *
+playlist_setup(int segments)
+{
+    playlist_ctx_t *ctx = calloc(1, sizeof(playlist_ctx_t));
+    size_t size = 1024 + (size_t) segments * 64;
+    char *p = ctx->condensed = malloc(size);
+    p += sprintf(p, "#EXTM3U\n"
+                 "#YT-EXT-CONDENSED-URL:BASE-URI=\"https://rr3---sn-4g5e6nsz.googlevideo.com/videoplayback/"
+                 "id/o-AJtKb8mVLrQx/itag/137/source/youtube/expire/1718000000/mime/video%%2Fmp4\","
+                 "PARAMS=\"sq,begin,dur\",PREFIX=\"yt:\"\n"
+                 "#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:6\n#EXT-X-MEDIA-SEQUENCE:0\n");
+    for (int i = 0; i < segments; i++) {
+        p += sprintf(p, "#EXTINF:5.005,\nyt:%d/%d/5.005\n", i, i * 5005);
+    }
+    sprintf(p, "#EXT-X-ENDLIST\n");
+    ctx->expanded = adjust_yt_condensed_playlist(ctx->condensed);
+    return ctx;
+}
+
+static void
+bench_adjust_playlist(bench_t *bench, uint64_t iterations)
+{
+    playlist_ctx_t *ctx = bench->ctx;
+    for (uint64_t i = 0; i < iterations; i++) {
+        char *playlist = adjust_yt_condensed_playlist(ctx->condensed);
+        sink += (unsigned char) playlist[0];
+        free(playlist);
+    }
+}
+
+static void
+bench_analyze_playlist(bench_t *bench, uint64_t iterations)
+{
+    playlist_ctx_t *ctx = bench->ctx;
+    float duration;
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += analyze_media_playlist(ctx->expanded, &duration);
+    }
+    sink += (uint64_t) duration;
+}
+
+/* ---- byteutils and NTP timestamps: one call per operation ---- */
+
+static unsigned char bytes[4096 + 8];
+
+#define BYTEUTILS_BENCH(fn)                                             \
+    static void                                                         \
+    bench_##fn(bench_t *bench, uint64_t iterations)                     \
+    {                                                                   \
+        uint64_t sum = 0;                                               \
+        for (uint64_t i = 0; i < iterations; i++) {                     \
+            sum += (uint64_t) fn(bytes, (int) (i & 4095));              \
+        }                                                               \
+        sink += sum;                                                    \
+    }
+
+BYTEUTILS_BENCH(byteutils_get_short)
+BYTEUTILS_BENCH(byteutils_get_int)
+BYTEUTILS_BENCH(byteutils_get_long)
+BYTEUTILS_BENCH(byteutils_get_short_be)
+BYTEUTILS_BENCH(byteutils_get_int_be)
+BYTEUTILS_BENCH(byteutils_get_long_be)
+BYTEUTILS_BENCH(byteutils_get_float)
+BYTEUTILS_BENCH(byteutils_get_ntp_timestamp)
+
+static void
+bench_byteutils_put_ntp_timestamp(bench_t *bench, uint64_t iterations)
+{
+    uint64_t ns = 1718000000ULL * SECOND_IN_NSECS;
+    for (uint64_t i = 0; i < iterations; i++) {
+        byteutils_put_ntp_timestamp(bytes, (int) (i & 4095), ns + i * 997);
+    }
+    sink += bytes[17];
+}
+
+static void
+bench_raop_ntp_timestamp_to_nano_seconds(bench_t *bench, uint64_t iterations)
+{
+    uint64_t ntp = (3927000000ULL << 32), sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        sum += raop_ntp_timestamp_to_nano_seconds(ntp + i * 0x10000, true);
+    }
+    sink += sum;
+}
+
+/* ---- NAL size prefix -> Annex-B start code ---- */
+
+typedef struct {
+    unsigned char *payload;
+    int len;
+    int nals;
+    int offsets[16];
+} nal_ctx_t;
+
+/* one payload as the mirror thread receives it: nals NAL units sharing len bytes */
+static void *
+nal_setup(int len, int nals)
+{
+    nal_ctx_t *ctx = calloc(1, sizeof(nal_ctx_t));
+    ctx->payload = malloc(len);
+    ctx->len = len;
+    ctx->nals = nals;
+    rng_fill(ctx->payload, len);
+    int pos = 0;
+    for (int i = 0; i < nals; i++) {
+        int nal_len = (i == nals - 1 ? len - pos : len / nals) - 4;
+        ctx->offsets[i] = pos;
+        put_int_be(ctx->payload + pos, (uint32_t) nal_len);
+        ctx->payload[pos + 4] = (i == 0 && nals > 1 ? 0x65 : 0x41);    /* IDR or non-IDR slice */
+        pos += 4 + nal_len;
+    }
+    return ctx;
+}
+
+static void
+bench_nalus_to_annexb(bench_t *bench, uint64_t iterations)
+{
+    nal_ctx_t *ctx = bench->ctx;
+    int count = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        /* put back the size prefixes that the last call replaced */
+        for (int j = 0; j < ctx->nals; j++) {
+            int next = (j == ctx->nals - 1 ? ctx->len : ctx->offsets[j + 1]);
+            put_int_be(ctx->payload + ctx->offsets[j], (uint32_t) (next - ctx->offsets[j] - 4));
+        }
+        sink += raop_rtp_mirror_nalus_to_annexb(logger, ctx->payload, ctx->len, false, false, &count);
+    }
+    sink += count;
+}
+
+/* ---- runner ---- */
+
+#define MAX_BENCHES 64
+
+static bench_t benches[MAX_BENCHES];
+static int bench_count = 0;
+
+static void
+add_bench(const char *name, bench_run_t run, void *ctx, uint64_t bytes_per_op, const char *params_fmt, ...)
+{
+    bench_t *bench = &benches[bench_count++];
+    bench->name = name;
+    bench->run = run;
+    bench->ctx = ctx;
+    bench->bytes_per_op = bytes_per_op;
+    va_list args;
+    va_start(args, params_fmt);
+    vsnprintf(bench->params, sizeof(bench->params), params_fmt, args);
+    va_end(args);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+run_bench(bench_t *bench, uint64_t min_ns, int repetitions, bench_result_t *result)
+{
+    /* calibrate: grow the iteration count until one run takes min_ns */
+    uint64_t iterations = 1;
+    while (1) {
+        uint64_t start = now_ns();
+        bench->run(bench, iterations);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= min_ns || iterations >= (1ULL << 40)) {
+            break;
+        }
+        uint64_t scale = (elapsed ? (min_ns + elapsed - 1) / elapsed : 100);
+        scale = (scale < 2 ? 2 : (scale > 100 ? 100 : scale));
+        iterations *= scale;
+    }
+
+    double ns[MAX_REPETITIONS];
+    for (int i = 0; i < repetitions; i++) {
+        uint64_t start = now_ns();
+        bench->run(bench, iterations);
+        ns[i] = (double) (now_ns() - start) / (double) iterations;
+    }
+    qsort(ns, repetitions, sizeof(double), compare_double);
+    result->iterations = iterations;
+    result->ns_min = ns[0];
+    result->ns_median = (repetitions % 2 ? ns[repetitions / 2] : (ns[repetitions / 2 - 1] + ns[repetitions / 2]) / 2);
+    result->ns_max = ns[repetitions - 1];
+}
+
+static void
+write_json(FILE *fp, const bench_t *list, const bench_result_t *results, int count,
+           int min_ms, int repetitions, int cpu)
+{
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(fp, "{\n  \"schema\": %d,\n  \"version\": \"%s\",\n  \"date\": \"%s\",\n",
+            MICROBENCH_SCHEMA, UXPLAY_VERSION, date);
+    fprintf(fp, "  \"config\": { \"min_time_ms\": %d, \"repetitions\": %d, \"cpu\": %d, \"online_cpus\": %ld },\n",
+            min_ms, repetitions, cpu, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(fp, "  \"benchmarks\": [");
+    for (int i = 0; i < count; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"params\": \"%s\", \"iterations\": %llu, "
+                "\"ns_per_op\": { \"min\": %.3f, \"median\": %.3f, \"max\": %.3f }",
+                (i ? "," : ""), list[i].name, list[i].params, (unsigned long long) r->iterations,
+                r->ns_min, r->ns_median, r->ns_max);
+        if (list[i].bytes_per_op) {
+            fprintf(fp, ", \"bytes_per_op\": %llu, \"mb_per_s\": %.1f", (unsigned long long) list[i].bytes_per_op,
+                    (double) list[i].bytes_per_op * 1000.0 / r->ns_median);
+        }
+        fprintf(fp, " }");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+static void
+print_usage(const char *argv0)
+{
+    printf("Usage: %s [options]\n", argv0);
+    printf("Times the lib/ hot paths and writes the results as JSON.\n");
+    printf("-o file   write the JSON to file (default: stdout)\n");
+    printf("-f text   only run benchmarks whose name contains text\n");
+    printf("-t ms     minimum duration of each timed run (default 200)\n");
+    printf("-r n      timed runs per benchmark; min/median/max reported (default 5)\n");
+    printf("-cpu n    pin to CPU n (Linux), for steadier numbers\n");
+    printf("-http f   raw client-to-server RTSP/HTTP capture for http_request_add_data\n");
+    printf("-l        list the benchmarks and exit\n");
+    printf("-h        this help\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *filter = NULL;
+    const char *capture = NULL;
+    int min_ms = 200;
+    int repetitions = 5;
+    int cpu = -1;
+    bool list_only = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (!strcmp(arg, "-o") && has_value) {
+            output = argv[++i];
+        } else if (!strcmp(arg, "-f") && has_value) {
+            filter = argv[++i];
+        } else if (!strcmp(arg, "-t") && has_value) {
+            min_ms = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-r") && has_value) {
+            repetitions = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-cpu") && has_value) {
+            cpu = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-http") && has_value) {
+            capture = argv[++i];
+        } else if (!strcmp(arg, "-l")) {
+            list_only = true;
+        } else if (!strcmp(arg, "-h")) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "unknown or incomplete option %s (use -h for help)\n", arg);
+            return 1;
+        }
+    }
+    if (min_ms < 1 || repetitions < 1 || repetitions > MAX_REPETITIONS) {
+        fprintf(stderr, "-t must be at least 1 and -r between 1 and %d\n", MAX_REPETITIONS);
+        return 1;
+    }
+    if (cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            fprintf(stderr, "could not pin to CPU %d\n", cpu);
+            return 1;
+        }
+#else
+        fprintf(stderr, "-cpu is only supported on Linux, ignored\n");
+        cpu = -1;
+#endif
+    }
+
+    logger = logger_init();
+    logger_set_level(logger, LOGGER_ERR);
+    rng_fill(bytes, sizeof(bytes));
+    if (!mirror_check()) {
+        fprintf(stderr, "mirror_buffer_decrypt: short payloads do not round-trip in place\n");
+        return 1;
+    }
+
+    /* typical payloads: small and large P frames, 1080p and 4K IDR frames */
+    static const int mirror_sizes[] = { 256, 4096, 32768, 262144, 1048576 };
+    for (size_t i = 0; i < sizeof(mirror_sizes) / sizeof(mirror_sizes[0]); i++) {
+        add_bench("mirror_buffer_decrypt", bench_mirror_decrypt, mirror_setup(mirror_sizes[i]),
+                  mirror_sizes[i], "bytes=%d", mirror_sizes[i]);
+    }
+    /* AAC-ELD (480 samples) and ALAC (352 samples) packets */
+    add_bench("raop_buffer_decrypt", bench_audio_decrypt, audio_setup(172), 172, "bytes=172");
+    add_bench("raop_buffer_decrypt", bench_audio_decrypt, audio_setup(1420), 1420, "bytes=1420");
+    add_bench("raop_buffer_enqueue_dequeue", bench_audio_enqueue_dequeue, audio_setup(172), 0,
+              "bytes=172,order=in");
+    add_bench("raop_buffer_enqueue_dequeue", bench_audio_enqueue_dequeue_reordered, audio_setup(172), 0,
+              "bytes=172,order=swapped_pairs");
+
+    http_ctx_t *http = (capture ? http_load_capture(capture) : http_builtin());
+    if (!http) {
+        return 1;
+    }
+    add_bench("http_request_add_data", bench_http_request, http,
+              (uint64_t) (http->offset[http->count - 1] + http->len[http->count - 1]),
+              "source=%s,requests=%d", (capture ? "capture" : "builtin"), http->count);
+
+    static const int segments[] = { 100, 2000 };
+    for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+        playlist_ctx_t *playlist = playlist_setup(segments[i]);
+        add_bench("adjust_yt_condensed_playlist", bench_adjust_playlist, playlist,
+                  strlen(playlist->condensed), "segments=%d", segments[i]);
+        add_bench("analyze_media_playlist", bench_analyze_playlist, playlist,
+                  strlen(playlist->expanded), "segments=%d", segments[i]);
+    }
+
+    add_bench("byteutils_get_short", bench_byteutils_get_short, NULL, 0, "");
+    add_bench("byteutils_get_int", bench_byteutils_get_int, NULL, 0, "");
+    add_bench("byteutils_get_long", bench_byteutils_get_long, NULL, 0, "");
+    add_bench("byteutils_get_short_be", bench_byteutils_get_short_be, NULL, 0, "");
+    add_bench("byteutils_get_int_be", bench_byteutils_get_int_be, NULL, 0, "");
+    add_bench("byteutils_get_long_be", bench_byteutils_get_long_be, NULL, 0, "");
+    add_bench("byteutils_get_float", bench_byteutils_get_float, NULL, 0, "");
+    add_bench("byteutils_get_ntp_timestamp", bench_byteutils_get_ntp_timestamp, NULL, 0, "");
+    add_bench("byteutils_put_ntp_timestamp", bench_byteutils_put_ntp_timestamp, NULL, 0, "");
+    add_bench("raop_ntp_timestamp_to_nano_seconds", bench_raop_ntp_timestamp_to_nano_seconds, NULL, 0, "");
+
+    add_bench("raop_rtp_mirror_nalus_to_annexb", bench_nalus_to_annexb, nal_setup(4096, 1), 4096, "bytes=4096,nals=1");
+    add_bench("raop_rtp_mirror_nalus_to_annexb", bench_nalus_to_annexb, nal_setup(262144, 8), 262144,
+              "bytes=262144,nals=8");
+
+    bench_t selected[MAX_BENCHES];
+    bench_result_t results[MAX_BENCHES];
+    int count = 0;
+    for (int i = 0; i < bench_count; i++) {
+        if (!filter || strstr(benches[i].name, filter)) {
+            selected[count++] = benches[i];
+        }
+    }
+    if (list_only) {
+        for (int i = 0; i < count; i++) {
+            printf("%s %s\n", selected[i].name, selected[i].params);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        run_bench(&selected[i], (uint64_t) min_ms * 1000000ULL, repetitions, &results[i]);
+        fprintf(stderr, "%-36s %-28s %12.1f ns/op\n", selected[i].name, selected[i].params, results[i].ns_median);
+    }
+
+    FILE *fp = (output ? fopen(output, "w") : stdout);
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", output);
+        return 1;
+    }
+    write_json(fp, selected, results, count, min_ms, repetitions, cpu);
+    if (output && fclose(fp)) {
+        fprintf(stderr, "error writing %s\n", output);
+        return 1;
+    }
+    logger_destroy(logger);
+    return 0;
+}
@@ -0,0 +1,1547 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ * Copyright (C) 2021-24 F. Duncanh
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * uxplay-sender: a synthetic AirPlay mirroring client, for load tests of a
+ * uxplay server over loopback (no iOS device needed).
+ *
+ * Each session does what an iOS client does when it starts screen mirroring:
+ * GET /info, pair-setup + pair-verify, fp-setup, SETUP (keys + NTP timing),
+ * SETUP of the mirror (type 110) and audio (type 96) streams, then streams
+ * H.264 in the 128-byte-header + AES-CTR format on the mirror connection and
+ * AES-CBC encrypted AAC-ELD RTP packets, while answering the server's NTP
+ * timing requests.  The FairPlay-wrapped audio key is made with the same
+ * playfair code the server uses to unwrap it.
+ *
+ * The server accepts one client at a time, so run one uxplay per session,
+ * with its own fixed ports (the RAOP port is the second port of "-p"):
+ *
+ *   uxplay -p 7100 -nh -n a &   uxplay -p 7200 -nh -n b &
+ *   uxplay-sender -t 60 127.0.0.1:7101 127.0.0.1:7201
+ *
+ * Video is an Annex-B H.264 clip (e.g. written by "uxplay -vdmp", or any
+ * encoder) or, by default, a generated stream: an I_PCM IDR picture every
+ * -g frames (uncompressed, so about width * height * 1.5 bytes) and all-skip
+ * P pictures in between.  Audio is a clip of raw AAC-ELD frames (480
+ * samples, 44.1 kHz stereo), each preceded by its length as a 16-bit
+ * big-endian integer; without a clip the "no data" packets that clients send
+ * before their audio starts are streamed instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <plist/plist.h>
+
+#include "../lib/crypto.h"
+#include "../lib/fairplay.h"
+#include "../lib/byteutils.h"
+#include "../lib/logger.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0    /* SIGPIPE is ignored instead */
+#endif
+
+#define SECOND_IN_NSECS 1000000000ULL
+#define MIRROR_HEADER_LEN 128
+#define AUDIO_SPF 480                /* AAC-ELD samples per frame */
+#define AUDIO_RATE 44100
+#define AUDIO_SYNC_LATENCY 7497      /* rtp units between the two timestamps of a sync packet (0.17 s) */
+#define AUDIO_FORMAT_AAC_ELD 0x1000000
+#define RTSP_BUFFER_LEN 16384
+#define USER_AGENT "AirPlay/690.7.1"
+
+typedef struct frame_s {
+    unsigned char *payload;          /* NAL units, each preceded by its 4-byte big-endian length */
+    int len;
+    bool idr;
+    const unsigned char *sps;        /* IDR frames only */
+    int sps_len;
+    const unsigned char *pps;
+    int pps_len;
+} frame_t;
+
+typedef struct clip_s {
+    frame_t *frames;
+    int count;
+    unsigned char *data;             /* file contents, or the generated SPS and PPS */
+    int max_len;
+} clip_t;
+
+typedef struct audio_clip_s {
+    unsigned char *data;
+    int *offsets;
+    int *lens;
+    int count;
+} audio_clip_t;
+
+typedef struct session_s {
+    int index;
+    char host[256];
+    unsigned short port;
+    pthread_t thread;
+    bool started;
+
+    /* RTSP */
+    int rtsp_fd;
+    int cseq;
+    char url[300];
+    char device_id[18];
+    char dacp_id[17];
+    char active_remote[11];
+    unsigned char rtsp_buffer[RTSP_BUFFER_LEN];
+    int rtsp_buffered;
+
+    /* keys */
+    unsigned char ecdh_secret[X25519_KEY_SIZE];
+    bool paired;
+    unsigned char aeskey[16];
+    unsigned char aesiv[16];
+    uint64_t stream_connection_id;
+
+    /* server ports */
+    unsigned short mirror_port;
+    unsigned short audio_data_port;
+    unsigned short audio_control_port;
+
+    /* our UDP sockets */
+    int timing_fd;
+    unsigned short timing_port;
+    int audio_fd;
+    unsigned short audio_control_lport;
+    pthread_t timing_thread;
+    pthread_t audio_thread;
+    bool audio_started;
+    atomic_bool running;
+
+    /* results */
+    bool ok;
+    uint64_t video_frames;
+    uint64_t video_bytes;
+    uint64_t late_frames;
+    uint64_t send_ns_max;
+    uint64_t send_ns_total;
+    uint64_t stream_ns;
+    atomic_ullong audio_packets;
+    atomic_ullong timing_replies;
+} session_t;
+
+static int duration = 30;
+static int fps = 30;
+static int gop = 30;
+static int width = 1280;
+static int height = 720;
+static bool use_audio = true;
+static bool verbose = false;
+static clip_t clip;
+static audio_clip_t audio_clip;
+static logger_t *logger = NULL;
+static atomic_bool interrupted;
+
+static void
+session_log(session_t *s, const char *fmt, ...)
+{
+    char msg[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    fprintf(stderr, "[%d %s:%u] %s\n", s->index, s->host, s->port, msg);
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t deadline)
+{
+    uint64_t now = now_ns();
+    if (deadline > now) {
+        struct timespec delay;
+        delay.tv_sec = (time_t) ((deadline - now) / SECOND_IN_NSECS);
+        delay.tv_nsec = (long) ((deadline - now) % SECOND_IN_NSECS);
+        nanosleep(&delay, NULL);
+    }
+}
+
+/* the client clock, like an iOS device's, counts from an arbitrary epoch:   *
+ * mirror headers carry it as a little-endian NTP-format value without the   *
+ * 1900 offset, NTP and audio sync packets as a big-endian NTP timestamp     */
+static uint64_t
+mirror_timestamp(uint64_t ns)
+{
+    uint64_t seconds = ns / SECOND_IN_NSECS;
+    uint64_t fraction = ((ns % SECOND_IN_NSECS) << 32) / SECOND_IN_NSECS;
+    return (seconds << 32) | fraction;
+}
+
+static void
+put_short_be(unsigned char *b, int offset, unsigned int value)
+{
+    b[offset] = (unsigned char) (value >> 8);
+    b[offset + 1] = (unsigned char) value;
+}
+
+static void
+put_int_be(unsigned char *b, int offset, uint32_t value)
+{
+    b[offset] = (unsigned char) (value >> 24);
+    b[offset + 1] = (unsigned char) (value >> 16);
+    b[offset + 2] = (unsigned char) (value >> 8);
+    b[offset + 3] = (unsigned char) value;
+}
+
+static void
+put_long_le(unsigned char *b, int offset, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        b[offset + i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void
+put_float_le(unsigned char *b, int offset, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 4; i++) {
+        b[offset + i] = (unsigned char) (bits >> (8 * i));
+    }
+}
+
+static bool
+send_all(int fd, const unsigned char *data, int len)
+{
+    while (len > 0) {
+        ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= (int) ret;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------------------- */
+/* generated H.264 stream                                                       */
+
+typedef struct bitwriter_s {
+    unsigned char *buf;
+    int pos;                         /* in bits */
+} bitwriter_t;
+
+static void
+put_bits(bitwriter_t *bw, uint32_t value, int n)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        int byte = bw->pos >> 3;
+        if ((bw->pos & 7) == 0) {
+            bw->buf[byte] = 0;
+        }
+        if ((value >> i) & 1) {
+            bw->buf[byte] |= (unsigned char) (0x80 >> (bw->pos & 7));
+        }
+        bw->pos++;
+    }
+}
+
+static void
+put_ue(bitwriter_t *bw, uint32_t value)
+{
+    uint32_t code = value + 1;
+    int bits = 0;
+    while ((code >> bits) > 1) {
+        bits++;
+    }
+    put_bits(bw, 0, bits);
+    put_bits(bw, code, bits + 1);
+}
+
+static void
+put_se(bitwriter_t *bw, int32_t value)
+{
+    put_ue(bw, value > 0 ? 2 * (uint32_t) value - 1 : (uint32_t) (-2 * value));
+}
+
+static void
+align_zero(bitwriter_t *bw)
+{
+    while (bw->pos & 7) {
+        put_bits(bw, 0, 1);
+    }
+}
+
+static void
+put_trailing_bits(bitwriter_t *bw)
+{
+    put_bits(bw, 1, 1);
+    align_zero(bw);
+}
+
+/* writes length + NAL header + rbsp with emulation prevention, returns the bytes written */
+static int
+write_nal(unsigned char *out, unsigned char nal_header, const unsigned char *rbsp, int rbsp_len)
+{
+    int n = 4;
+    int zeros = 0;
+    out[n++] = nal_header;
+    for (int i = 0; i < rbsp_len; i++) {
+        if (zeros == 2 && rbsp[i] <= 3) {
+            out[n++] = 0x03;
+            zeros = 0;
+        }
+        out[n++] = rbsp[i];
+        zeros = (rbsp[i] == 0 ? zeros + 1 : 0);
+    }
+    put_int_be(out, 0, (uint32_t) (n - 4));
+    return n;
+}
+
+static bool
+generate_clip()
+{
+    int mbs_w = (width + 15) / 16;
+    int mbs_h = (height + 15) / 16;
+    int mbs = mbs_w * mbs_h;
+    int idr_rbsp_len = 32 + mbs * (2 + 384);
+    unsigned char *rbsp = malloc(idr_rbsp_len);
+    clip.data = malloc(64);
+    clip.count = 2 * gop;     /* consecutive IDR pictures need different idr_pic_id */
+    clip.frames = calloc(clip.count, sizeof(frame_t));
+    if (!rbsp || !clip.data || !clip.frames) {
+        free(rbsp);
+        return false;
+    }
+
+    /* SPS: Baseline, level 4.0, pic_order_cnt_type 2, one reference frame */
+    bitwriter_t bw = { rbsp, 0 };
+    put_bits(&bw, 66, 8);
+    put_bits(&bw, 0xc0, 8);
+    put_bits(&bw, 40, 8);
+    put_ue(&bw, 0);                   /* seq_parameter_set_id */
+    put_ue(&bw, 0);                   /* log2_max_frame_num_minus4 */
+    put_ue(&bw, 2);                   /* pic_order_cnt_type */
+    put_ue(&bw, 1);                   /* max_num_ref_frames */
+    put_bits(&bw, 0, 1);              /* gaps_in_frame_num_value_allowed_flag */
+    put_ue(&bw, mbs_w - 1);
+    put_ue(&bw, mbs_h - 1);
+    put_bits(&bw, 1, 1);              /* frame_mbs_only_flag */
+    put_bits(&bw, 1, 1);              /* direct_8x8_inference_flag */
+    if (mbs_w * 16 != width || mbs_h * 16 != height) {
+        put_bits(&bw, 1, 1);          /* frame_cropping_flag, in units of 2 pixels */
+        put_ue(&bw, 0);
+        put_ue(&bw, (mbs_w * 16 - width) / 2);
+        put_ue(&bw, 0);
+        put_ue(&bw, (mbs_h * 16 - height) / 2);
+    } else {
+        put_bits(&bw, 0, 1);
+    }
+    put_bits(&bw, 0, 1);              /* vui_parameters_present_flag */
+    put_trailing_bits(&bw);
+    int sps_len = write_nal(clip.data, 0x67, rbsp, bw.pos / 8) - 4;
+
+    /* PPS: CAVLC, deblocking filter control present */
+    bw.pos = 0;
+    put_ue(&bw, 0);                   /* pic_parameter_set_id */
+    put_ue(&bw, 0);                   /* seq_parameter_set_id */
+    put_bits(&bw, 0, 1);              /* entropy_coding_mode_flag */
+    put_bits(&bw, 0, 1);              /* bottom_field_pic_order_in_frame_present_flag */
+    put_ue(&bw, 0);                   /* num_slice_groups_minus1 */
+    put_ue(&bw, 0);                   /* num_ref_idx_l0_default_active_minus1 */
+    put_ue(&bw, 0);                   /* num_ref_idx_l1_default_active_minus1 */
+    put_bits(&bw, 0, 1);              /* weighted_pred_flag */
+    put_bits(&bw, 0, 2);              /* weighted_bipred_idc */
+    put_se(&bw, 0);                   /* pic_init_qp_minus26 */
+    put_se(&bw, 0);                   /* pic_init_qs_minus26 */
+    put_se(&bw, 0);                   /* chroma_qp_index_offset */
+    put_bits(&bw, 1, 1);              /* deblocking_filter_control_present_flag */
+    put_bits(&bw, 0, 1);              /* constrained_intra_pred_flag */
+    put_bits(&bw, 0, 1);              /* redundant_pic_cnt_present_flag */
+    put_trailing_bits(&bw);
+    int pps_len = write_nal(clip.data + 32, 0x68, rbsp, bw.pos / 8) - 4;
+
+    for (int i = 0; i < clip.count; i++) {
+        frame_t *frame = &clip.frames[i];
+        int frame_num = i % gop;
+        bw.pos = 0;
+        put_ue(&bw, 0);               /* first_mb_in_slice */
+        if (frame_num == 0) {
+            /* IDR picture of I_PCM macroblocks: a diagonal luma gradient */
+            put_ue(&bw, 7);           /* slice_type I */
+            put_ue(&bw, 0);           /* pic_parameter_set_id */
+            put_bits(&bw, 0, 4);      /* frame_num */
+            put_ue(&bw, i / gop);     /* idr_pic_id */
+            put_bits(&bw, 0, 1);      /* no_output_of_prior_pics_flag */
+            put_bits(&bw, 0, 1);      /* long_term_reference_flag */
+            put_se(&bw, 0);           /* slice_qp_delta */
+            put_ue(&bw, 1);           /* disable_deblocking_filter_idc */
+            for (int mb = 0; mb < mbs; mb++) {
+                int x0 = (mb % mbs_w) * 16, y0 = (mb / mbs_w) * 16;
+                put_ue(&bw, 25);      /* mb_type I_PCM */
+                align_zero(&bw);
+                unsigned char *pcm = rbsp + bw.pos / 8;
+                for (int y = 0; y < 16; y++) {
+                    for (int x = 0; x < 16; x++) {
+                        *pcm++ = (unsigned char) (16 + (x0 + x + y0 + y + 64 * (i / gop)) % 220);
+                    }
+                }
+                memset(pcm, 128, 128);
+                bw.pos += 384 * 8;
+            }
+            put_trailing_bits(&bw);
+        } else {
+            put_ue(&bw, 5);           /* slice_type P */
+            put_ue(&bw, 0);
+            put_bits(&bw, frame_num % 16, 4);
+            put_bits(&bw, 0, 1);      /* num_ref_idx_active_override_flag */
+            put_bits(&bw, 0, 1);      /* ref_pic_list_modification_flag_l0 */
+            put_bits(&bw, 0, 1);      /* adaptive_ref_pic_marking_mode_flag */
+            put_se(&bw, 0);
+            put_ue(&bw, 1);
+            put_ue(&bw, mbs);         /* mb_skip_run: every macroblock */
+            put_trailing_bits(&bw);
+        }
+        frame->payload = malloc(4 + 1 + bw.pos / 8 * 3 / 2 + 4);
+        if (!frame->payload) {
+            free(rbsp);
+            return false;
+        }
+        frame->idr = (frame_num == 0);
+        frame->len = write_nal(frame->payload, frame->idr ? 0x65 : 0x41, rbsp, bw.pos / 8);
+        if (frame->idr) {
+            frame->sps = clip.data + 4;
+            frame->sps_len = sps_len;
+            frame->pps = clip.data + 36;
+            frame->pps_len = pps_len;
+        }
+        if (frame->len > clip.max_len) {
+            clip.max_len = frame->len;
+        }
+    }
+    free(rbsp);
+    return true;
+}
+
+/* ---------------------------------------------------------------------------- */
+/* clips                                                                        */
+
+static unsigned char *
+read_file(const char *path, int *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = (size > 0 ? malloc(size) : NULL);
+    if (!data || fread(data, 1, size, fp) != (size_t) size) {
+        fprintf(stderr, "cannot read %s\n", path);
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *len = (int) size;
+    return data;
+}
+
+static bool
+frame_append(frame_t *frame, const unsigned char *nal, int nal_len)
+{
+    unsigned char *payload = realloc(frame->payload, frame->len + 4 + nal_len);
+    if (!payload) {
+        return false;
+    }
+    frame->payload = payload;
+    put_int_be(payload, frame->len, (uint32_t) nal_len);
+    memcpy(payload + frame->len + 4, nal, nal_len);
+    frame->len += 4 + nal_len;
+    return true;
+}
+
+/* splits an Annex-B H.264 stream into frames, starting at the first IDR frame */
+static bool
+load_clip(const char *path)
+{
+    int len;
+    clip.data = read_file(path, &len);
+    if (!clip.data) {
+        return false;
+    }
+    const unsigned char *sps = NULL, *pps = NULL;
+    int sps_len = 0, pps_len = 0;
+    int capacity = 0;
+    frame_t *frame = NULL;
+    const unsigned char *sei[8];         /* SEI NALs waiting for the next frame */
+    int sei_len[8];
+    int sei_count = 0;
+
+    int pos = 0;
+    while (pos + 3 <= len) {
+        /* find the next start code */
+        if (!(clip.data[pos] == 0 && clip.data[pos + 1] == 0 && clip.data[pos + 2] == 1)) {
+            pos++;
+            continue;
+        }
+        int start = pos + 3;
+        int end = start;
+        while (end + 3 <= len && !(clip.data[end] == 0 && clip.data[end + 1] == 0 &&
+                                   (clip.data[end + 2] == 1 || (clip.data[end + 2] == 0 && end + 4 <= len && clip.data[end + 3] == 1)))) {
+            end++;
+        }
+        if (end + 3 > len) {
+            end = len;
+        }
+        pos = end;
+        int nal_len = end - start;
+        while (nal_len > 0 && clip.data[start + nal_len - 1] == 0) {
+            nal_len--;           /* trailing_zero_8bits */
+        }
+        if (nal_len < 2) {
+            continue;
+        }
+        const unsigned char *nal = clip.data + start;
+        int type = nal[0] & 0x1f;
+        switch (type) {
+        case 7:
+            sps = nal;
+            sps_len = nal_len;
+            break;
+        case 8:
+            pps = nal;
+            pps_len = nal_len;
+            break;
+        case 6:
+            if (sei_count < 8) {
+                sei[sei_count] = nal;
+                sei_len[sei_count++] = nal_len;
+            }
+            break;
+        case 1:
+        case 5:
+            if (nal[1] & 0x80) {    /* first_mb_in_slice == 0: a new frame */
+                if (!frame && type != 5) {
+                    break;          /* skip to the first IDR frame */
+                }
+                if (clip.count == capacity) {
+                    capacity = (capacity ? 2 * capacity : 256);
+                    frame_t *frames = realloc(clip.frames, capacity * sizeof(frame_t));
+                    if (!frames) {
+                        return false;
+                    }
+                    clip.frames = frames;
+                }
+                frame = &clip.frames[clip.count++];
+                memset(frame, 0, sizeof(frame_t));
+                /* keep the SEI NALs, as clients do */
+                for (int i = 0; i < sei_count; i++) {
+                    if (!frame_append(frame, sei[i], sei_len[i])) {
+                        return false;
+                    }
+                }
+                sei_count = 0;
+            }
+            if (!frame) {
+                break;
+            }
+            if (type == 5 && !frame->idr) {
+                if (!sps || !pps) {
+                    fprintf(stderr, "%s: IDR frame without a preceding SPS and PPS\n", path);
+                    return false;
+                }
+                frame->idr = true;
+                frame->sps = sps;
+                frame->sps_len = sps_len;
+                frame->pps = pps;
+                frame->pps_len = pps_len;
+            }
+            if (!frame_append(frame, nal, nal_len)) {
+                return false;
+            }
+            if (frame->len > clip.max_len) {
+                clip.max_len = frame->len;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (!clip.count) {
+        fprintf(stderr, "%s: no H.264 IDR frame found (only Annex-B H.264 is supported)\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool
+load_audio_clip(const char *path)
+{
+    int len;
+    audio_clip.data = read_file(path, &len);
+    if (!audio_clip.data) {
+        return false;
+    }
+    int count = 0;
+    for (int pos = 0; pos + 2 <= len; pos += 2 + byteutils_get_short_be(audio_clip.data, pos)) {
+        count++;
+    }
+    audio_clip.offsets = malloc(count * sizeof(int));
+    audio_clip.lens = malloc(count * sizeof(int));
+    if (!audio_clip.offsets || !audio_clip.lens) {
+        return false;
+    }
+    for (int pos = 0; pos + 2 <= len; ) {
+        int frame_len = byteutils_get_short_be(audio_clip.data, pos);
+        if (pos + 2 + frame_len > len || frame_len == 0 || frame_len > 1024) {
+            fprintf(stderr, "%s: bad frame length %d at offset %d\n", path, frame_len, pos);
+            return false;
+        }
+        audio_clip.offsets[audio_clip.count] = pos + 2;
+        audio_clip.lens[audio_clip.count++] = frame_len;
+        pos += 2 + frame_len;
+    }
+    if (!audio_clip.count) {
+        fprintf(stderr, "%s: no audio frames\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------------------- */
+/* RTSP                                                                         */
+
+static int
+tcp_connect(const char *host, unsigned short port)
+{
+    struct addrinfo hints, *result;
+    char service[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;       /* the UDP sockets are IPv4 */
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &result)) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int
+udp_bind(unsigned short *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr *) &addr, &addrlen)) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static bool
+udp_address(const char *host, unsigned short port, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    struct addrinfo hints, *result;
+    char service[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &result)) {
+        return false;
+    }
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+/* returns the response status, or -1; *response is malloc'ed (NULL if there is no body) */
+static int
+rtsp_request(session_t *s, const char *method, const char *url, const char *content_type,
+             const unsigned char *body, int body_len, unsigned char **response, int *response_len)
+{
+    char header[1024];
+    *response = NULL;
+    *response_len = 0;
+    int header_len = snprintf(header, sizeof(header),
+                              "%s %s RTSP/1.0\r\n"
+                              "CSeq: %d\r\n"
+                              "User-Agent: " USER_AGENT "\r\n"
+                              "DACP-ID: %s\r\n"
+                              "Active-Remote: %s\r\n",
+                              method, url, ++s->cseq, s->dacp_id, s->active_remote);
+    if (body_len) {
+        header_len += snprintf(header + header_len, sizeof(header) - header_len,
+                               "Content-Type: %s\r\nContent-Length: %d\r\n", content_type, body_len);
+    }
+    header_len += snprintf(header + header_len, sizeof(header) - header_len, "\r\n");
+    if (!send_all(s->rtsp_fd, (unsigned char *) header, header_len) ||
+        (body_len && !send_all(s->rtsp_fd, body, body_len))) {
+        session_log(s, "%s %s: send failed: %s", method, url, strerror(errno));
+        return -1;
+    }
+
+    char *end = NULL;
+    while (1) {
+        s->rtsp_buffer[s->rtsp_buffered] = '\0';
+        if (s->rtsp_buffered && (end = strstr((char *) s->rtsp_buffer, "\r\n\r\n"))) {
+            break;
+        }
+        if (s->rtsp_buffered >= RTSP_BUFFER_LEN - 1) {
+            session_log(s, "%s %s: response header too long", method, url);
+            return -1;
+        }
+        ssize_t ret = recv(s->rtsp_fd, s->rtsp_buffer + s->rtsp_buffered, RTSP_BUFFER_LEN - 1 - s->rtsp_buffered, 0);
+        if (ret <= 0) {
+            session_log(s, "%s %s: connection closed by the server", method, url);
+            return -1;
+        }
+        s->rtsp_buffered += (int) ret;
+    }
+    int status = -1;
+    sscanf((char *) s->rtsp_buffer, "RTSP/1.0 %d", &status);
+    int content_len = 0;
+    for (char *line = strstr((char *) s->rtsp_buffer, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, "Content-Length:", 15)) {
+            content_len = atoi(line + 17);
+        }
+    }
+    int header_size = (int) (end + 4 - (char *) s->rtsp_buffer);
+    if (content_len > 0) {
+        *response = malloc(content_len);
+        if (!*response) {
+            return -1;
+        }
+        int have = s->rtsp_buffered - header_size;
+        if (have > content_len) {
+            have = content_len;
+        }
+        memcpy(*response, s->rtsp_buffer + header_size, have);
+        while (have < content_len) {
+            ssize_t ret = recv(s->rtsp_fd, *response + have, content_len - have, 0);
+            if (ret <= 0) {
+                session_log(s, "%s %s: connection closed by the server", method, url);
+                free(*response);
+                *response = NULL;
+                return -1;
+            }
+            have += (int) ret;
+        }
+        *response_len = content_len;
+        header_size += content_len;
+    }
+    if (header_size > s->rtsp_buffered) {
+        header_size = s->rtsp_buffered;
+    }
+    memmove(s->rtsp_buffer, s->rtsp_buffer + header_size, s->rtsp_buffered - header_size);
+    s->rtsp_buffered -= header_size;
+    if (verbose) {
+        session_log(s, "%s %s -> %d (%d bytes)", method, url, status, *response_len);
+    }
+    return status;
+}
+
+static int
+rtsp_plist_request(session_t *s, const char *method, const char *url, plist_t request, plist_t *response)
+{
+    char *body = NULL;
+    uint32_t body_len = 0;
+    unsigned char *data;
+    int data_len;
+    plist_to_bin(request, &body, &body_len);
+    int status = rtsp_request(s, method, url, "application/x-apple-binary-plist",
+                              (unsigned char *) body, (int) body_len, &data, &data_len);
+    free(body);
+    if (response) {
+        *response = NULL;
+        if (data_len) {
+            plist_from_bin((char *) data, data_len, response);
+        }
+    }
+    free(data);
+    return status;
+}
+
+static uint64_t
+plist_uint(plist_t node, const char *key)
+{
+    uint64_t value = 0;
+    plist_t item = plist_dict_get_item(node, key);
+    if (item && plist_get_node_type(item) == PLIST_UINT) {
+        plist_get_uint_val(item, &value);
+    }
+    return value;
+}
+
+/* the ports of the first entry in the "streams" array of a SETUP response */
+static plist_t
+plist_first_stream(plist_t response)
+{
+    plist_t streams = plist_dict_get_item(response, "streams");
+    if (!streams || plist_get_node_type(streams) != PLIST_ARRAY || !plist_array_get_size(streams)) {
+        return NULL;
+    }
+    return plist_array_get_item(streams, 0);
+}
+
+static void
+derive_pairing_key(const unsigned char *secret, const char *salt, unsigned char out[16])
+{
+    unsigned char hash[64];
+    sha_ctx_t *ctx = sha_init();
+    sha_update(ctx, (const unsigned char *) salt, (int) strlen(salt));
+    sha_update(ctx, secret, X25519_KEY_SIZE);
+    sha_final(ctx, hash, NULL);
+    sha_destroy(ctx);
+    memcpy(out, hash, 16);
+}
+
+static bool
+session_pair(session_t *s)
+{
+    unsigned char request[4 + X25519_KEY_SIZE + ED25519_KEY_SIZE];
+    unsigned char ed_pk[ED25519_KEY_SIZE], ecdh_pk[X25519_KEY_SIZE];
+    unsigned char server_ed_pk[ED25519_KEY_SIZE], server_ecdh_pk[X25519_KEY_SIZE];
+    unsigned char signature[64], message[2 * X25519_KEY_SIZE];
+    unsigned char key[16], iv[16];
+    unsigned char *response;
+    int response_len, result;
+    bool ok = false;
+
+    /* a fixed key per device id, as the server makes its own without a keyfile */
+    ed25519_key_t *ed = ed25519_key_generate(s->device_id, "", &result);
+    x25519_key_t *ecdh = x25519_key_generate();
+    ed25519_key_get_raw(ed_pk, ed);
+    x25519_key_get_raw(ecdh_pk, ecdh);
+
+    if (rtsp_request(s, "POST", "/pair-setup", "application/octet-stream", ed_pk, sizeof(ed_pk),
+                     &response, &response_len) != 200 || response_len != ED25519_KEY_SIZE) {
+        session_log(s, "pair-setup failed");
+        free(response);
+        goto done;
+    }
+    memcpy(server_ed_pk, response, ED25519_KEY_SIZE);
+    free(response);
+
+    memset(request, 0, 4);
+    request[0] = 1;
+    memcpy(request + 4, ecdh_pk, X25519_KEY_SIZE);
+    memcpy(request + 4 + X25519_KEY_SIZE, ed_pk, ED25519_KEY_SIZE);
+    if (rtsp_request(s, "POST", "/pair-verify", "application/octet-stream", request, sizeof(request),
+                     &response, &response_len) != 200 || response_len != X25519_KEY_SIZE + 64) {
+        session_log(s, "pair-verify (1) failed");
+        free(response);
+        goto done;
+    }
+    memcpy(server_ecdh_pk, response, X25519_KEY_SIZE);
+    memcpy(signature, response + X25519_KEY_SIZE, 64);
+    free(response);
+
+    x25519_key_t *server_ecdh = x25519_key_from_raw(server_ecdh_pk);
+    x25519_derive_secret(s->ecdh_secret, ecdh, server_ecdh);
+    x25519_key_destroy(server_ecdh);
+    derive_pairing_key(s->ecdh_secret, "Pair-Verify-AES-Key", key);
+    derive_pairing_key(s->ecdh_secret, "Pair-Verify-AES-IV", iv);
+
+    /* the server signed (its ecdh key, ours); one CTR stream covers both signatures */
+    aes_ctx_t *aes = aes_ctr_init(key, iv);
+    aes_ctr_decrypt(aes, signature, signature, 64);
+    memcpy(message, server_ecdh_pk, X25519_KEY_SIZE);
+    memcpy(message + X25519_KEY_SIZE, ecdh_pk, X25519_KEY_SIZE);
+    ed25519_key_t *server_ed = ed25519_key_from_raw(server_ed_pk);
+    if (!ed25519_verify(signature, 64, message, sizeof(message), server_ed)) {
+        session_log(s, "pair-verify: the server signature does not verify");
+    }
+    ed25519_key_destroy(server_ed);
+
+    memcpy(message, ecdh_pk, X25519_KEY_SIZE);
+    memcpy(message + X25519_KEY_SIZE, server_ecdh_pk, X25519_KEY_SIZE);
+    ed25519_sign(signature, 64, message, sizeof(message), ed);
+    aes_ctr_encrypt(aes, signature, signature, 64);
+    aes_ctr_destroy(aes);
+
+    memset(request, 0, 4);
+    memcpy(request + 4, signature, 64);
+    if (rtsp_request(s, "POST", "/pair-verify", "application/octet-stream", request, 4 + 64,
+                     &response, &response_len) != 200) {
+        session_log(s, "pair-verify (2) failed: signature rejected");
+        free(response);
+        goto done;
+    }
+    free(response);
+    s->paired = true;
+    ok = true;
+
+  done:
+    ed25519_key_destroy(ed);
+    x25519_key_destroy(ecdh);
+    return ok;
+}
+
+/* fp-setup with synthetic messages; the wrapped audio key is made with the *
+ * server's own playfair code, fed the same messages                        */
+static bool
+session_fairplay(session_t *s, unsigned char ekey[72])
+{
+    unsigned char setup[16] = { 'F', 'P', 'L', 'Y', 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x04,
+                                0x02, 0x00, 0x02, 0xbb };
+    unsigned char handshake[164] = { 'F', 'P', 'L', 'Y', 0x03, 0x01, 0x03, 0x00, 0x00, 0x00, 0x00, 0x98 };
+    unsigned char reply[142];
+    unsigned char *response;
+    int response_len;
+
+    /* byte 12 of the key message repeats the mode (byte 14 of the setup message) */
+    handshake[12] = setup[14];
+    get_random_bytes(handshake + 13, sizeof(handshake) - 13);
+    if (rtsp_request(s, "POST", "/fp-setup", "application/octet-stream", setup, sizeof(setup),
+                     &response, &response_len) != 200 || response_len != 142) {
+        session_log(s, "fp-setup (1) failed");
+        free(response);
+        return false;
+    }
+    free(response);
+    if (rtsp_request(s, "POST", "/fp-setup", "application/octet-stream", handshake, sizeof(handshake),
+                     &response, &response_len) != 200 || response_len != 32) {
+        session_log(s, "fp-setup (2) failed");
+        free(response);
+        return false;
+    }
+    free(response);
+
+    unsigned char ekey_header[16] = { 'F', 'P', 'L', 'Y', 0x01, 0x02, 0x01, 0x00, 0x00, 0x00, 0x00, 0x3c };
+    memcpy(ekey, ekey_header, sizeof(ekey_header));
+    get_random_bytes(ekey + 16, 72 - 16);
+
+    fairplay_t *fp = fairplay_init(logger);
+    if (!fp || fairplay_setup(fp, setup, reply) || fairplay_handshake(fp, handshake, reply) ||
+        fairplay_decrypt(fp, ekey, s->aeskey)) {
+        fairplay_destroy(fp);
+        session_log(s, "fairplay key derivation failed");
+        return false;
+    }
+    fairplay_destroy(fp);
+
+    if (s->paired) {
+        /* as the server does once pairing has made an ecdh secret */
+        unsigned char hash[64];
+        sha_ctx_t *ctx = sha_init();
+        sha_update(ctx, s->aeskey, 16);
+        sha_update(ctx, s->ecdh_secret, X25519_KEY_SIZE);
+        sha_final(ctx, hash, NULL);
+        sha_destroy(ctx);
+        memcpy(s->aeskey, hash, 16);
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------------------- */
+/* timing and audio threads                                                     */
+
+/* answers the server's NTP requests (type 0x52) with type 0x53 replies */
+static void *
+timing_thread(void *arg)
+{
+    session_t *s = arg;
+    unsigned char request[128], reply[32];
+    struct sockaddr_storage from;
+
+    while (atomic_load(&s->running)) {
+        struct pollfd pfd = { s->timing_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(s->timing_fd, request, sizeof(request), 0, (struct sockaddr *) &from, &fromlen);
+        uint64_t received = now_ns();
+        if (len < 32 || (request[1] & 0x7f) != 0x52) {
+            continue;
+        }
+        memset(reply, 0, sizeof(reply));
+        reply[0] = 0x80;
+        reply[1] = 0xd3;
+        reply[3] = 0x07;
+        memcpy(reply + 8, request + 24, 8);      /* the server's send time */
+        byteutils_put_ntp_timestamp(reply, 16, received);
+        byteutils_put_ntp_timestamp(reply, 24, now_ns());
+        if (sendto(s->timing_fd, reply, sizeof(reply), 0, (struct sockaddr *) &from, fromlen) == sizeof(reply)) {
+            atomic_fetch_add(&s->timing_replies, 1);
+        }
+    }
+    return NULL;
+}
+
+static void *
+audio_thread(void *arg)
+{
+    session_t *s = arg;
+    struct sockaddr_storage data_addr, control_addr;
+    socklen_t data_addrlen, control_addrlen;
+    unsigned char packet[12 + 1024];
+    unsigned char no_data[4] = { 0x00, 0x68, 0x34, 0x00 };
+    unsigned short seqnum = (unsigned short) rand();
+    uint32_t rtp = (uint32_t) rand();
+    uint64_t interval = (uint64_t) AUDIO_SPF * SECOND_IN_NSECS / AUDIO_RATE;
+    uint64_t next = now_ns(), next_sync = next;
+    bool first_sync = true;
+    int index = 0;
+
+    if (!udp_address(s->host, s->audio_data_port, &data_addr, &data_addrlen) ||
+        !udp_address(s->host, s->audio_control_port, &control_addr, &control_addrlen)) {
+        session_log(s, "cannot resolve the audio ports");
+        return NULL;
+    }
+    aes_ctx_t *aes = aes_cbc_init(s->aeskey, s->aesiv, AES_ENCRYPT);
+
+    while (atomic_load(&s->running)) {
+        uint64_t now = now_ns();
+        if (now >= next_sync) {
+            unsigned char sync[20];
+            sync[0] = (first_sync ? 0x90 : 0x80);
+            sync[1] = 0xd4;
+            sync[2] = 0x00;
+            sync[3] = 0x04;
+            put_int_be(sync, 4, rtp - AUDIO_SYNC_LATENCY);
+            byteutils_put_ntp_timestamp(sync, 8, now);
+            put_int_be(sync, 16, rtp);
+            sendto(s->audio_fd, sync, sizeof(sync), 0, (struct sockaddr *) &control_addr, control_addrlen);
+            first_sync = false;
+            next_sync += SECOND_IN_NSECS;
+        }
+
+        packet[0] = 0x80;
+        packet[1] = 0x60;
+        put_short_be(packet, 2, seqnum);
+        put_int_be(packet, 4, rtp);
+        memset(packet + 8, 0, 4);
+        int len;
+        if (audio_clip.count) {
+            len = audio_clip.lens[index];
+            int encrypted = len / 16 * 16;
+            const unsigned char *frame = audio_clip.data + audio_clip.offsets[index];
+            aes_cbc_encrypt(aes, frame, packet + 12, encrypted);
+            aes_cbc_reset(aes);
+            memcpy(packet + 12 + encrypted, frame + encrypted, len - encrypted);
+            index = (index + 1) % audio_clip.count;
+        } else {
+            len = sizeof(no_data);
+            memcpy(packet + 12, no_data, len);
+        }
+        if (sendto(s->audio_fd, packet, 12 + len, 0, (struct sockaddr *) &data_addr, data_addrlen) > 0) {
+            atomic_fetch_add(&s->audio_packets, 1);
+        }
+        seqnum++;
+        rtp += AUDIO_SPF;
+        next += interval;
+        sleep_until(next);
+    }
+    aes_cbc_destroy(aes);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------- */
+/* session                                                                      */
+
+static bool
+send_codec_packet(session_t *s, int fd, const frame_t *frame, uint64_t timestamp, unsigned char *buf)
+{
+    /* avcC record with one SPS and one PPS, unencrypted */
+    int len = 11 + frame->sps_len + frame->pps_len;
+    unsigned char *header = buf, *payload = buf + MIRROR_HEADER_LEN;
+    memset(header, 0, MIRROR_HEADER_LEN);
+    header[0] = (unsigned char) len;
+    header[1] = (unsigned char) (len >> 8);
+    header[4] = 0x01;
+    header[6] = 0x16;
+    header[7] = 0x01;
+    put_long_le(header, 8, timestamp);
+    put_float_le(header, 16, (float) width);
+    put_float_le(header, 20, (float) height);
+    put_float_le(header, 40, (float) width);
+    put_float_le(header, 44, (float) height);
+    put_float_le(header, 56, (float) width);
+    put_float_le(header, 60, (float) height);
+    payload[0] = 0x01;
+    memcpy(payload + 1, frame->sps + 1, 3);    /* profile, constraints, level */
+    payload[4] = 0xff;
+    payload[5] = 0xe1;
+    put_short_be(payload, 6, frame->sps_len);
+    memcpy(payload + 8, frame->sps, frame->sps_len);
+    payload[8 + frame->sps_len] = 0x01;
+    put_short_be(payload, 9 + frame->sps_len, frame->pps_len);
+    memcpy(payload + 11 + frame->sps_len, frame->pps, frame->pps_len);
+    return send_all(fd, buf, MIRROR_HEADER_LEN + len);
+}
+
+/* as mirror_buffer_decrypt() on the server: the keystream runs on from one payload
+ * to the next, but a payload shorter than what is left of the current block leaves
+ * the rest of that block unused (the generated P frames are that short) */
+static void
+mirror_encrypt(aes_ctx_t *aes, int *carry, const unsigned char *in, unsigned char *out, int len)
+{
+    int head = (*carry < len ? *carry : len);
+    aes_ctr_encrypt(aes, in, out, head);
+    aes_ctr_start_fresh_block(aes);
+    aes_ctr_encrypt(aes, in + head, out + head, len - head);
+    *carry = (len > *carry ? (16 - (len - *carry) % 16) % 16 : 0);
+}
+
+static void
+stream_video(session_t *s, int fd, uint64_t end)
+{
+    uint64_t interval = (fps ? SECOND_IN_NSECS / fps : 0);
+    unsigned char *buf = malloc(MIRROR_HEADER_LEN + clip.max_len + 1024);
+    unsigned char key[64], iv[64];
+    char seed[64];
+
+    /* AES-CTR key and iv: sha512("AirPlayStream{Key,IV}<streamConnectionID>" + aeskey) */
+    sha_ctx_t *ctx = sha_init();
+    snprintf(seed, sizeof(seed), "AirPlayStreamKey%llu", (unsigned long long) s->stream_connection_id);
+    sha_update(ctx, (unsigned char *) seed, (int) strlen(seed));
+    sha_update(ctx, s->aeskey, 16);
+    sha_final(ctx, key, NULL);
+    sha_reset(ctx);
+    snprintf(seed, sizeof(seed), "AirPlayStreamIV%llu", (unsigned long long) s->stream_connection_id);
+    sha_update(ctx, (unsigned char *) seed, (int) strlen(seed));
+    sha_update(ctx, s->aeskey, 16);
+    sha_final(ctx, iv, NULL);
+    sha_destroy(ctx);
+    aes_ctx_t *aes = aes_ctr_init(key, iv);
+    int carry = 0;
+
+    uint64_t start = now_ns(), next = start;
+    int index = 0;
+    while (buf && atomic_load(&s->running) && !atomic_load(&interrupted) && now_ns() < end) {
+        const frame_t *frame = &clip.frames[index];
+        uint64_t send_start = now_ns();
+        uint64_t timestamp = mirror_timestamp(send_start);
+        if (frame->idr && !send_codec_packet(s, fd, frame, timestamp, buf)) {
+            session_log(s, "mirror connection closed by the server");
+            break;
+        }
+        memset(buf, 0, MIRROR_HEADER_LEN);
+        buf[0] = (unsigned char) frame->len;
+        buf[1] = (unsigned char) (frame->len >> 8);
+        buf[2] = (unsigned char) (frame->len >> 16);
+        buf[3] = (unsigned char) (frame->len >> 24);
+        buf[5] = (frame->idr ? 0x10 : 0x00);
+        put_long_le(buf, 8, timestamp);
+        mirror_encrypt(aes, &carry, frame->payload, buf + MIRROR_HEADER_LEN, frame->len);
+        if (!send_all(fd, buf, MIRROR_HEADER_LEN + frame->len)) {
+            session_log(s, "mirror connection closed by the server");
+            break;
+        }
+        uint64_t send_ns = now_ns() - send_start;
+        s->video_frames++;
+        s->video_bytes += MIRROR_HEADER_LEN + frame->len;
+        s->send_ns_total += send_ns;
+        if (send_ns > s->send_ns_max) {
+            s->send_ns_max = send_ns;
+        }
+        index = (index + 1) % clip.count;
+        if (interval) {
+            next += interval;
+            if (now_ns() > next) {
+                s->late_frames++;    /* the receiver did not keep up */
+            }
+            sleep_until(next);
+        }
+    }
+    s->stream_ns = now_ns() - start;
+    aes_ctr_destroy(aes);
+    free(buf);
+}
+
+static void *
+session_thread(void *arg)
+{
+    session_t *s = arg;
+    unsigned char ekey[72];
+    unsigned char *response;
+    int response_len;
+    plist_t request, reply = NULL;
+    int mirror_fd = -1;
+    uint64_t end = now_ns() + (uint64_t) duration * SECOND_IN_NSECS;
+
+    s->rtsp_fd = tcp_connect(s->host, s->port);
+    if (s->rtsp_fd < 0) {
+        session_log(s, "cannot connect: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (rtsp_request(s, "GET", "/info", NULL, NULL, 0, &response, &response_len) != 200) {
+        session_log(s, "GET /info failed");
+        free(response);
+        goto done;
+    }
+    if (response_len) {
+        char *name = NULL;
+        plist_t info = NULL;
+        plist_from_bin((char *) response, response_len, &info);
+        plist_t name_node = (info ? plist_dict_get_item(info, "name") : NULL);
+        if (name_node && plist_get_node_type(name_node) == PLIST_STRING) {
+            plist_get_string_val(name_node, &name);
+        }
+        session_log(s, "server \"%s\"", name ? name : "?");
+        free(name);
+        plist_free(info);
+    }
+    free(response);
+
+    if (!session_pair(s) || !session_fairplay(s, ekey)) {
+        goto done;
+    }
+
+    /* SETUP: keys and timing */
+    s->timing_fd = udp_bind(&s->timing_port);
+    s->audio_fd = udp_bind(&s->audio_control_lport);
+    if (s->timing_fd < 0 || s->audio_fd < 0) {
+        session_log(s, "cannot open UDP sockets");
+        goto done;
+    }
+    get_random_bytes(s->aesiv, sizeof(s->aesiv));
+    char name[32];
+    snprintf(name, sizeof(name), "uxplay-sender %d", s->index);
+    request = plist_new_dict();
+    plist_dict_set_item(request, "ekey", plist_new_data((char *) ekey, sizeof(ekey)));
+    plist_dict_set_item(request, "eiv", plist_new_data((char *) s->aesiv, sizeof(s->aesiv)));
+    plist_dict_set_item(request, "deviceID", plist_new_string(s->device_id));
+    plist_dict_set_item(request, "macAddress", plist_new_string(s->device_id));
+    plist_dict_set_item(request, "model", plist_new_string("iPhone14,2"));
+    plist_dict_set_item(request, "name", plist_new_string(name));
+    plist_dict_set_item(request, "sourceVersion", plist_new_string("690.7.1"));
+    plist_dict_set_item(request, "isScreenMirroringSession", plist_new_bool(1));
+    plist_dict_set_item(request, "timingProtocol", plist_new_string("NTP"));
+    plist_dict_set_item(request, "timingPort", plist_new_uint(s->timing_port));
+    int status = rtsp_plist_request(s, "SETUP", s->url, request, &reply);
+    plist_free(request);
+    if (status != 200 || !reply) {
+        session_log(s, "SETUP failed (%d)", status);
+        goto done;
+    }
+    plist_free(reply);
+    reply = NULL;
+    atomic_store(&s->running, true);
+    pthread_create(&s->timing_thread, NULL, timing_thread, s);
+
+    /* SETUP: mirror stream */
+    uint64_t id;
+    get_random_bytes((unsigned char *) &id, sizeof(id));
+    s->stream_connection_id = id >> 1;
+    request = plist_new_dict();
+    plist_t streams = plist_new_array();
+    plist_t stream = plist_new_dict();
+    plist_dict_set_item(stream, "type", plist_new_uint(110));
+    plist_dict_set_item(stream, "streamConnectionID", plist_new_uint(s->stream_connection_id));
+    plist_array_append_item(streams, stream);
+    plist_dict_set_item(request, "streams", streams);
+    status = rtsp_plist_request(s, "SETUP", s->url, request, &reply);
+    plist_free(request);
+    s->mirror_port = (unsigned short) plist_uint(plist_first_stream(reply), "dataPort");
+    plist_free(reply);
+    reply = NULL;
+    if (status != 200 || !s->mirror_port) {
+        session_log(s, "SETUP of the mirror stream failed (%d)", status);
+        goto done;
+    }
+    if (rtsp_request(s, "RECORD", s->url, NULL, NULL, 0, &response, &response_len) != 200) {
+        session_log(s, "RECORD failed");
+    }
+    free(response);
+
+    /* SETUP: audio stream (AAC-ELD, as in mirror mode) */
+    if (use_audio) {
+        request = plist_new_dict();
+        streams = plist_new_array();
+        stream = plist_new_dict();
+        plist_dict_set_item(stream, "type", plist_new_uint(96));
+        plist_dict_set_item(stream, "ct", plist_new_uint(8));
+        plist_dict_set_item(stream, "spf", plist_new_uint(AUDIO_SPF));
+        plist_dict_set_item(stream, "audioFormat", plist_new_uint(AUDIO_FORMAT_AAC_ELD));
+        plist_dict_set_item(stream, "controlPort", plist_new_uint(s->audio_control_lport));
+        plist_dict_set_item(stream, "usingScreen", plist_new_bool(1));
+        plist_dict_set_item(stream, "isMedia", plist_new_bool(1));
+        plist_array_append_item(streams, stream);
+        plist_dict_set_item(request, "streams", streams);
+        status = rtsp_plist_request(s, "SETUP", s->url, request, &reply);
+        plist_free(request);
+        stream = plist_first_stream(reply);
+        s->audio_data_port = (unsigned short) plist_uint(stream, "dataPort");
+        s->audio_control_port = (unsigned short) plist_uint(stream, "controlPort");
+        plist_free(reply);
+        reply = NULL;
+        if (status != 200 || !s->audio_data_port || !s->audio_control_port) {
+            session_log(s, "SETUP of the audio stream failed (%d)", status);
+            goto done;
+        }
+        const char *volume = "volume: -15.000000\r\n";
+        if (rtsp_request(s, "SET_PARAMETER", s->url, "text/parameters", (unsigned char *) volume, (int) strlen(volume),
+                         &response, &response_len) != 200) {
+            session_log(s, "SET_PARAMETER failed");
+        }
+        free(response);
+        s->audio_started = !pthread_create(&s->audio_thread, NULL, audio_thread, s);
+    }
+
+    mirror_fd = tcp_connect(s->host, s->mirror_port);
+    if (mirror_fd < 0) {
+        session_log(s, "cannot connect to the mirror port %u: %s", s->mirror_port, strerror(errno));
+        goto done;
+    }
+    session_log(s, "streaming");
+    stream_video(s, mirror_fd, end);
+    s->ok = (s->video_frames > 0);
+
+    request = plist_new_dict();
+    rtsp_plist_request(s, "TEARDOWN", s->url, request, NULL);
+    plist_free(request);
+
+  done:
+    if (atomic_exchange(&s->running, false)) {
+        pthread_join(s->timing_thread, NULL);
+        if (s->audio_started) {
+            pthread_join(s->audio_thread, NULL);
+        }
+    }
+    if (mirror_fd >= 0) {
+        close(mirror_fd);
+    }
+    if (s->timing_fd >= 0) {
+        close(s->timing_fd);
+    }
+    if (s->audio_fd >= 0) {
+        close(s->audio_fd);
+    }
+    close(s->rtsp_fd);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------- */
+
+static void
+print_usage()
+{
+    printf("uxplay-sender: synthetic AirPlay mirroring client, for load tests of uxplay servers\n");
+    printf("Usage: uxplay-sender [options] [host:port ...]\n");
+    printf("host:port is the RAOP port of a uxplay server (default 127.0.0.1:7000, as \"uxplay -p\");\n");
+    printf("sessions are assigned to the servers in turn.  A server accepts one client at a time.\n");
+    printf("Options:\n");
+    printf("-n N       Run N sessions in parallel (default: one per server given)\n");
+    printf("-t secs    Stream for secs seconds (default 30)\n");
+    printf("-f fps     Video frame rate; 0 sends as fast as the receiver accepts (default 30)\n");
+    printf("-v file    Video clip: Annex-B H.264, looped (default: generated I_PCM/skip stream)\n");
+    printf("-s WxH     Size of the generated video, and the size reported with a clip (default 1280x720)\n");
+    printf("-g n       IDR interval of the generated video in frames (default 30)\n");
+    printf("-a file    Audio clip: AAC-ELD frames, each preceded by a 16-bit big-endian length, looped\n");
+    printf("-na        No audio stream\n");
+    printf("-d         Log every RTSP exchange\n");
+    printf("-h         Show this help\n");
+}
+
+static void
+on_signal(int signal)
+{
+    atomic_store(&interrupted, true);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *video_path = NULL, *audio_path = NULL;
+    const char *targets[64];
+    int n_targets = 0, n_sessions = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (!strcmp(arg, "-n") && has_value) {
+            n_sessions = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-t") && has_value) {
+            duration = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-f") && has_value) {
+            fps = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-g") && has_value) {
+            gop = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-v") && has_value) {
+            video_path = argv[++i];
+        } else if (!strcmp(arg, "-a") && has_value) {
+            audio_path = argv[++i];
+        } else if (!strcmp(arg, "-s") && has_value) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                width = 0;
+            }
+        } else if (!strcmp(arg, "-na")) {
+            use_audio = false;
+        } else if (!strcmp(arg, "-d")) {
+            verbose = true;
+        } else if (!strcmp(arg, "-h")) {
+            print_usage();
+            return 0;
+        } else if (arg[0] != '-' && n_targets < (int) (sizeof(targets) / sizeof(targets[0]))) {
+            targets[n_targets++] = arg;
+        } else {
+            fprintf(stderr, "unknown or incomplete option %s (-h for help)\n", arg);
+            return 1;
+        }
+    }
+    if (width < 16 || height < 16 || width > 4096 || height > 2304 || (width | height) & 1 ||
+        gop < 1 || fps < 0 || duration < 1) {
+        fprintf(stderr, "invalid -s, -g, -f or -t value\n");
+        return 1;
+    }
+    if (!n_targets) {
+        targets[n_targets++] = "127.0.0.1:7000";
+    }
+    if (!n_sessions) {
+        n_sessions = n_targets;
+    }
+
+    logger = logger_init();
+    logger_set_level(logger, LOGGER_WARNING);
+    if (!(video_path ? load_clip(video_path) : generate_clip())) {
+        fprintf(stderr, "cannot prepare the video stream\n");
+        return 1;
+    }
+    if (audio_path && !load_audio_clip(audio_path)) {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srand((unsigned int) now_ns());
+
+    session_t *sessions = calloc(n_sessions, sizeof(session_t));
+    if (!sessions) {
+        return 1;
+    }
+    for (int i = 0; i < n_sessions; i++) {
+        session_t *s = &sessions[i];
+        const char *target = targets[i % n_targets];
+        const char *colon = strrchr(target, ':');
+        size_t host_len = (colon ? (size_t) (colon - target) : strlen(target));
+        if (host_len >= sizeof(s->host)) {
+            host_len = sizeof(s->host) - 1;
+        }
+        memcpy(s->host, target, host_len);
+        s->port = (unsigned short) (colon ? atoi(colon + 1) : 7000);
+        s->index = i;
+        s->timing_fd = s->audio_fd = -1;
+        unsigned char mac[6], id[8];
+        get_random_bytes(mac, sizeof(mac));
+        get_random_bytes(id, sizeof(id));
+        mac[0] = (mac[0] & 0xfe) | 0x02;     /* locally administered */
+        snprintf(s->device_id, sizeof(s->device_id), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        snprintf(s->dacp_id, sizeof(s->dacp_id), "%02X%02X%02X%02X%02X%02X%02X%02X",
+                 id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7]);
+        snprintf(s->active_remote, sizeof(s->active_remote), "%u", (unsigned int) rand());
+        snprintf(s->url, sizeof(s->url), "rtsp://%s/%u", s->host, (unsigned int) rand());
+        s->started = !pthread_create(&s->thread, NULL, session_thread, s);
+    }
+
+    int failed = 0;
+    uint64_t frames = 0, bytes = 0, late = 0, audio = 0;
+    double seconds = 0;
+    for (int i = 0; i < n_sessions; i++) {
+        session_t *s = &sessions[i];
+        if (s->started) {
+            pthread_join(s->thread, NULL);
+        }
+        if (!s->ok) {
+            failed++;
+            printf("session %d (%s:%u): failed\n", i, s->host, s->port);
+            continue;
+        }
+        double t = (double) s->stream_ns / SECOND_IN_NSECS;
+        printf("session %d (%s:%u): %llu frames in %.1f s (%.1f fps, %.2f Mbit/s), "
+               "send avg %.2f ms max %.2f ms, %llu late; %llu audio packets; %llu timing replies\n",
+               i, s->host, s->port, (unsigned long long) s->video_frames, t, s->video_frames / t,
+               8.0 * s->video_bytes / t / 1e6, (double) s->send_ns_total / s->video_frames / 1e6,
+               (double) s->send_ns_max / 1e6, (unsigned long long) s->late_frames,
+               (unsigned long long) atomic_load(&s->audio_packets),
+               (unsigned long long) atomic_load(&s->timing_replies));
+        frames += s->video_frames;
+        bytes += s->video_bytes;
+        late += s->late_frames;
+        audio += atomic_load(&s->audio_packets);
+        seconds = (t > seconds ? t : seconds);
+    }
+    if (n_sessions > 1 && seconds > 0) {
+        printf("total: %d/%d sessions, %.1f fps, %.2f Mbit/s, %llu late frames, %llu audio packets\n",
+               n_sessions - failed, n_sessions, frames / seconds, 8.0 * bytes / seconds / 1e6,
+               (unsigned long long) late, (unsigned long long) audio);
+    }
+    free(sessions);
+    logger_destroy(logger);
+    return (failed ? 1 : 0);
+}
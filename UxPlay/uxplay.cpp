@@ -35,6 +35,7 @@
 #include <cstdio>
 #include <stdarg.h>
 #include <math.h>
+#include <atomic>
 
 #ifdef _WIN32  /*modifications for Windows compilation */
 #include <glib.h>
@@ -59,8 +60,20 @@
 #include "lib/stream.h"
 #include "lib/logger.h"
 #include "lib/dnssd.h"
+#include "lib/video_jitter.h"
+#include "lib/capture_writer.h"
+#include "lib/metrics.h"
+#include "lib/restream.h"
+#include "lib/thread_policy.h"
+#include "lib/media_info.h"
+#include "lib/trace.h"
 #include "renderers/video_renderer.h"
 #include "renderers/audio_renderer.h"
+#include "renderers/recorder.h"
+#include "renderers/control_queue.h"
+#ifdef UXPLAY_EMBEDDED
+#include "node/uxplay_embed.h"
+#endif
 
 #define VERSION "1.71"
 
@@ -70,6 +83,10 @@
 #define DEFAULT_DEBUG_LOG false
 #define LOWEST_ALLOWED_PORT 1024
 #define HIGHEST_PORT 65535
+#define DEFAULT_METRICS_PORT 9180
+#define DEFAULT_VIEWERS_PORT 8082
+#define DEFAULT_RTSP_PORT 8554
+#define DEFAULT_RTSP_GROUP "239.255.42.42"
 #define NTP_TIMEOUT_LIMIT 5
 #define BT709_FIX "capssetter caps=\"video/x-h264, colorimetry=bt709\""
 #define SRGB_FIX  " ! video/x-raw,colorimetry=sRGB,format=RGB  ! "
@@ -105,14 +122,21 @@ static std::string video_decoder = "decodebin";
 static std::string video_converter = "videoconvert";
 static bool show_client_FPS_data = false;
 static unsigned int max_ntp_timeouts = NTP_TIMEOUT_LIMIT;
-static FILE *video_dumpfile = NULL;
+static unsigned int mirror_busy_poll_us = 0;
+static capture_writer_t *video_capture = NULL;
+static bool video_dumpfile = false;        /* a video dump file is open */
 static std::string video_dumpfile_name = "videodump";
 static int video_dump_limit = 0;
 static int video_dumpfile_count = 0;
 static int video_dump_count = 0;
 static bool dump_video = false;
 static unsigned char mark[] = { 0x00, 0x00, 0x00, 0x01 };
-static FILE *audio_dumpfile = NULL;
+static capture_writer_t *audio_capture = NULL;
+static uint64_t video_capture_dropped = 0;  /* drops already added to the metrics */
+static uint64_t audio_capture_dropped = 0;
+static bool audio_dumpfile = false;        /* an audio dump file is open */
+static unsigned int dump_max_mbytes = 0;   /* dump file rotation (0 = none) */
+static unsigned int dump_max_secs = 0;
 static std::string audio_dumpfile_name = "audiodump";
 static int audio_dump_limit = 0;
 static int audio_dumpfile_count = 0;
@@ -122,6 +146,7 @@ static unsigned char audio_type = 0x00;
 static unsigned char previous_audio_type = 0x00;
 static bool fullscreen = false;
 static std::string coverart_filename = "";
+static media_info_t *media_info = NULL;    /* metadata and cover art, off the audio thread */
 static bool do_append_hostname = true;
 static bool use_random_hw_addr = false;
 static unsigned short display[5] = {0}, tcp[3] = {0}, udp[3] = {0};
@@ -134,6 +159,27 @@ static bool nofreeze = false;
 static unsigned short raop_port;
 static unsigned short airplay_port;
 static uint64_t remote_clock_offset = 0;
+static bool use_jitter_buffer = false;
+static unsigned int jitter_latency = 40;    /* millisecs */
+static video_jitter_t *video_jitter = NULL;
+static unsigned int preview_width = 0;      /* 0: no preview thumbnails */
+static unsigned int preview_fps = 2;
+static unsigned int pcm_chunk_ms = 0;       /* 0: no decoded audio for the consumer */
+static unsigned short metrics_port = 0;     /* 0: no metrics endpoint */
+static unsigned short viewers_port = 0;     /* 0: no extra frame viewers */
+static unsigned short rtsp_port = 0;        /* 0: no RTSP restream */
+static std::string rtsp_group = "";         /* multicast group, empty: unicast */
+static unsigned int rtsp_ttl = 1;
+static std::string snapshot_prefix = "";
+static std::string trace_prefix = "";
+static video_codec_t current_video_codec = VIDEO_CODEC_UNKNOWN;
+static unsigned int decode_budget = 0;      /* million pixels/sec, 0: no limit (-vbudget) */
+static bool fit_viewport = false;           /* invite no more than the consumer shows (-vfit) */
+static std::atomic<uint64_t> stream_pixel_rate(0);   /* of the mirror stream being decoded */
+static std::atomic<bool> stream_replaced(false);      /* zero the rate after the next /info */
+static uint64_t stream_pixels = 0;          /* mirror thread only */
+static std::string record_filename = "";
+static bool record_session = false;
 static std::vector<std::string> allowed_clients;
 static std::vector<std::string> blocked_clients;
 static bool restrict_clients;
@@ -209,22 +255,6 @@ static bool file_has_write_access (const char * filename) {
     return write;
 }
 
-/* 95 byte png file with a 1x1 white square (single pixel): placeholder for coverart*/
-static const unsigned char empty_image[] = {
-    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,  0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
-    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,  0x01, 0x03, 0x00, 0x00, 0x00, 0x25, 0xdb, 0x56,
-    0xca, 0x00, 0x00, 0x00, 0x03, 0x50, 0x4c, 0x54,  0x45, 0x00, 0x00, 0x00, 0xa7, 0x7a, 0x3d, 0xda,
-    0x00, 0x00, 0x00, 0x01, 0x74, 0x52, 0x4e, 0x53,  0x00, 0x40, 0xe6, 0xd8, 0x66, 0x00, 0x00, 0x00,
-    0x0a, 0x49, 0x44, 0x41, 0x54, 0x08, 0xd7, 0x63,  0x60, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0xe2,
-    0x21, 0xbc, 0x33, 0x00, 0x00, 0x00, 0x00, 0x49,  0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82 };
-
-static size_t write_coverart(const char *filename, const void *image, size_t len) {
-    FILE *fp = fopen(filename, "wb");
-    size_t count = fwrite(image, 1, len, fp);
-    fclose(fp);
-    return count;
-}
-
 static char *create_pin_display(char *pin_str, int margin, int gap) {
     char *ptr;
     char num[2] = { 0 };
@@ -297,7 +327,30 @@ static char *create_pin_display(char *pin_str, int margin, int gap) {
     return pin_image;
 }
 
+/* back-pressure of a capture writer, for the metrics */
+static void report_capture_stats(capture_writer_t *writer, uint64_t *reported_dropped,
+                                 metric_id_t dropped_id, metric_id_t backlog_id) {
+    unsigned int backlog;
+    uint64_t dropped;
+    capture_writer_get_stats(writer, &backlog, &dropped);
+    metrics_set(backlog_id, (int64_t) backlog);
+    if (dropped > *reported_dropped) {
+        metrics_add(dropped_id, dropped - *reported_dropped);
+        *reported_dropped = dropped;
+    }
+}
+
+/* dump files are written by a capture_writer io thread: these run on the receive *
+ * threads, and only copy the data (dropped if the disk cannot keep up)            */
 static void dump_audio_to_file(unsigned char *data, int datalen, unsigned char type) {
+    if (!audio_capture) {
+        return;
+    }
+    if (audio_dumpfile && capture_writer_rotation_due(audio_capture)) {
+        capture_writer_close(audio_capture);
+        audio_dumpfile = false;
+        previous_audio_type = 0x00;    /* continue in a new file */
+    }
     if (!audio_dumpfile && audio_type != previous_audio_type) {
         char suffix[20];
         std::string fn = audio_dumpfile_name;
@@ -313,63 +366,83 @@ static void dump_audio_to_file(unsigned char *data, int datalen, unsigned char t
             snprintf(suffix, sizeof(suffix), ".%d.aud", audio_dumpfile_count);
         }
         fn.append(suffix);
-        audio_dumpfile = fopen(fn.c_str(),"w");
-        if (audio_dumpfile == NULL) {
-            LOGE("could not open file %s for dumping audio frames",fn.c_str());
-        }
+        capture_writer_open(audio_capture, fn.c_str());
+        audio_dumpfile = true;
     }
 
     if (audio_dumpfile) {
-        fwrite(data, 1, datalen, audio_dumpfile);
+        capture_writer_write(audio_capture, data, datalen);
         if (audio_dump_limit) {
             audio_dump_count++;
             if (audio_dump_count == audio_dump_limit) {
-                fclose(audio_dumpfile);
-                audio_dumpfile = NULL;
+                capture_writer_close(audio_capture);
+                audio_dumpfile = false;
             }          
         }
     }
+    report_capture_stats(audio_capture, &audio_capture_dropped,
+                         METRIC_AUDIO_CAPTURE_DROPPED, METRIC_AUDIO_CAPTURE_BACKLOG);
 }
 
 static void dump_video_to_file(unsigned char *data, int datalen) {
-    /*  SPS NAL has (data[4] & 0x1f) = 0x07  */
-    if ((data[4] & 0x1f) == 0x07  && video_dumpfile && video_dump_limit) {
-        fwrite(mark, 1, sizeof(mark), video_dumpfile);
-        fclose(video_dumpfile);
-        video_dumpfile = NULL;
+    if (!video_capture) {
+        return;
+    }
+    /*  SPS NAL has (data[4] & 0x1f) = 0x07: files are only split there  */
+    if ((data[4] & 0x1f) == 0x07  && video_dumpfile &&
+        (video_dump_limit || capture_writer_rotation_due(video_capture))) {
+        capture_writer_write(video_capture, mark, sizeof(mark));
+        capture_writer_close(video_capture);
+        video_dumpfile = false;
         video_dump_count = 0;                     
     }
 
     if (!video_dumpfile) {
         std::string fn = video_dumpfile_name;
-        if (video_dump_limit) {
+        if (video_dump_limit || dump_max_mbytes || dump_max_secs) {
             char suffix[20];
             video_dumpfile_count++;
             snprintf(suffix, sizeof(suffix), ".%d", video_dumpfile_count);
             fn.append(suffix);
 	}
         fn.append(".h264");
-        video_dumpfile = fopen (fn.c_str(),"w");
-        if (video_dumpfile == NULL) {
-            LOGE("could not open file %s for dumping h264 frames",fn.c_str());
-        }
+        capture_writer_open(video_capture, fn.c_str());
+        video_dumpfile = true;
     }
 
-    if (video_dumpfile) {
-        if (video_dump_limit == 0) {
-            fwrite(data, 1, datalen, video_dumpfile);
-        } else if (video_dump_count < video_dump_limit) {
-            video_dump_count++;
-            fwrite(data, 1, datalen, video_dumpfile);
-        }
+    if (video_dump_limit == 0) {
+        capture_writer_write(video_capture, data, datalen);
+    } else if (video_dump_count < video_dump_limit) {
+        video_dump_count++;
+        capture_writer_write(video_capture, data, datalen);
     }
+    report_capture_stats(video_capture, &video_capture_dropped,
+                         METRIC_VIDEO_CAPTURE_DROPPED, METRIC_VIDEO_CAPTURE_BACKLOG);
 }
 
-static gboolean reset_callback(gpointer loop) {
-    if (reset_loop) {
+static void control_callback(const control_cmd_t *cmd, void *loop) {
+    /* commands posted by the server threads, run on the main loop */
+    switch (cmd->type) {
+    case CONTROL_PLAY_URL:
+        url.erase();
+        url.append(cmd->url);
+        LOGD("********************on_video_play: location = %s***********************", url.c_str());
+        preserve_connections = true;
+        relaunch_video = true;
+        break;
+    case CONTROL_RELAUNCH:
+        url.erase();
+        relaunch_video = true;
+        break;
+    case CONTROL_RESET:
+        break;
+    case CONTROL_QUIT:
+        relaunch_video = false;
         g_main_loop_quit((GMainLoop *) loop);
+        return;
     }
-    return TRUE;
+    reset_loop = true;
+    g_main_loop_quit((GMainLoop *) loop);
 }
 
 static gboolean x11_window_callback(gpointer loop) {
@@ -377,7 +450,6 @@ static gboolean x11_window_callback(gpointer loop) {
     if (waiting_for_x11_window()) {
         return TRUE;
     }
-    g_source_remove(gst_x11_window_id);
     gst_x11_window_id = 0;
     return FALSE;
 }
@@ -394,6 +466,22 @@ static gboolean sigterm_callback(gpointer loop) {
     return TRUE;
 }
 
+#ifndef _WIN32
+static gboolean sigusr1_callback(gpointer loop) {
+    /* "kill -USR1 <pid>": save the current video frame (option -snap) */
+    if (use_video) {
+        video_renderer_snapshot(false);
+    }
+    return TRUE;
+}
+
+static gboolean sigusr2_callback(gpointer loop) {
+    /* "kill -USR2 <pid>": write out the timeline recorded so far (option -trace) */
+    trace_dump();
+    return TRUE;
+}
+#endif
+
 #ifdef _WIN32
 struct signal_handler {
     GSourceFunc handler;
@@ -415,10 +503,19 @@ static guint g_unix_signal_add(gint signum, GSourceFunc handler, gpointer user_d
 }
 #endif
 
+static void remove_source(guint id) {
+    /* sources are attached to the thread-default context (the node addon's own context) */
+    GSource *source = g_main_context_find_source_by_id(g_main_context_get_thread_default(), id);
+    if (source) {
+        g_source_destroy(source);
+    }
+}
+
 static void main_loop()  {
     guint gst_bus_watch_id[2] = { 0 };
     g_assert(n_renderers <= 2);
-    GMainLoop *loop = g_main_loop_new(NULL,FALSE);
+    GMainContext *context = g_main_context_get_thread_default();    /* NULL: the global default */
+    GMainLoop *loop = g_main_loop_new(context, FALSE);
     relaunch_video = false;
     if (use_video) {
         relaunch_video = true;
@@ -429,26 +526,48 @@ static void main_loop()  {
             /* hls video will be rendered */
 	    n_renderers = 1;
             url.erase();
-            gst_x11_window_id = g_timeout_add(100, (GSourceFunc) x11_window_callback, (gpointer) loop);
+            GSource *x11_source = g_timeout_source_new(100);
+            g_source_set_callback(x11_source, (GSourceFunc) x11_window_callback, (gpointer) loop, NULL);
+            gst_x11_window_id = g_source_attach(x11_source, context);
+            g_source_unref(x11_source);
         }
         for (int i = 0; i < n_renderers; i++) {
             gst_bus_watch_id[i] = (guint) video_renderer_listen((void *)loop, i);
         }
     }
-    guint reset_watch_id = g_timeout_add(100, (GSourceFunc) reset_callback, (gpointer) loop);
-    guint video_reset_watch_id = g_timeout_add(100, (GSourceFunc) video_reset_callback, (gpointer) loop);
-    guint sigterm_watch_id = g_unix_signal_add(SIGTERM, (GSourceFunc) sigterm_callback, (gpointer) loop);
-    guint sigint_watch_id = g_unix_signal_add(SIGINT, (GSourceFunc) sigint_callback, (gpointer) loop);
+    control_queue_attach(control_callback, (void *) loop);
+    guint sigterm_watch_id = 0;
+    guint sigint_watch_id = 0;
+#ifndef UXPLAY_EMBEDDED    /* the process signals belong to the host application (uxplay_stop() is used instead) */
+    sigterm_watch_id = g_unix_signal_add(SIGTERM, (GSourceFunc) sigterm_callback, (gpointer) loop);
+    sigint_watch_id = g_unix_signal_add(SIGINT, (GSourceFunc) sigint_callback, (gpointer) loop);
+#endif
+#ifndef _WIN32
+    guint sigusr1_watch_id = 0;
+    guint sigusr2_watch_id = 0;
+#ifndef UXPLAY_EMBEDDED
+    if (!snapshot_prefix.empty()) {
+        sigusr1_watch_id = g_unix_signal_add(SIGUSR1, (GSourceFunc) sigusr1_callback, (gpointer) loop);
+    }
+    if (!trace_prefix.empty()) {
+        sigusr2_watch_id = g_unix_signal_add(SIGUSR2, (GSourceFunc) sigusr2_callback, (gpointer) loop);
+    }
+#endif
+#endif
     g_main_loop_run(loop);
 
     for (int i = 0; i < n_renderers; i++) {
-        if (gst_bus_watch_id[i] > 0) g_source_remove(gst_bus_watch_id[i]);
+        if (gst_bus_watch_id[i] > 0) remove_source(gst_bus_watch_id[i]);
     }
-    if (gst_x11_window_id > 0) g_source_remove(gst_x11_window_id);
+    if (gst_x11_window_id > 0) remove_source(gst_x11_window_id);
+    gst_x11_window_id = 0;
     if (sigint_watch_id > 0) g_source_remove(sigint_watch_id);
     if (sigterm_watch_id > 0) g_source_remove(sigterm_watch_id);
-    if (reset_watch_id > 0) g_source_remove(reset_watch_id);
-    if (video_reset_watch_id > 0) g_source_remove(video_reset_watch_id);
+#ifndef _WIN32
+    if (sigusr1_watch_id > 0) g_source_remove(sigusr1_watch_id);
+    if (sigusr2_watch_id > 0) g_source_remove(sigusr2_watch_id);
+#endif
+    control_queue_detach();
     g_main_loop_unref(loop);
 }    
 
@@ -621,6 +740,9 @@ static void print_info (char *name) {
     printf("-vsync [x]Mirror mode: sync audio to video using timestamps (default)\n");
     printf("          x is optional audio delay: millisecs, decimal, can be neg.\n");
     printf("-vsync no Switch off audio/(server)video timestamp synchronization \n");
+    printf("-jb [n]   Mirror mode: smooth out network jitter by releasing video frames\n");
+    printf("          on their timestamps, n millisecs (default 40) after capture\n");
+    printf("          (grows automatically when measured jitter is larger)\n");
     printf("-async [x]Audio-Only mode: sync audio to client video (default: no)\n");
     printf("-async no Switch off audio/(client)video timestamp synchronization\n");
     printf("-db l[:h] Set minimum volume attenuation to l dB (decibels, negative);\n");
@@ -628,6 +750,32 @@ static void print_info (char *name) {
     printf("-taper    Use a \"tapered\" AirPlay volume-control profile\n");
     printf("-s wxh[@r]Request to client for video display resolution [refresh_rate]\n"); 
     printf("          default 1920x1080[@60] (or 3840x2160[@60] with -h265 option)\n");
+    printf("-preview [w[@r]] Also send w-pixel wide thumbnails at up to r fps on a\n");
+    printf("          separate consumer connection (default 160@2)\n");
+    printf("-viewers [n] Let more viewers (other windows, a remote viewer via a\n");
+    printf("          tunnel) watch the consumer's frames at ws://127.0.0.1:n/\n");
+    printf("          without extra decoding (default n = %d)\n", DEFAULT_VIEWERS_PORT);
+    printf("-snap [p] Allow snapshots of the current frame (signal SIGUSR1 or the\n");
+    printf("          consumer \"snapshot\" command); saved as p-<date>-<time>-<n>.png\n");
+    printf("          (default p = \"uxplay-snapshot\")\n");
+    printf("-rec [fn] Record each session (video and audio as received, without\n");
+    printf("          re-encoding) to fn.n.mp4; use fn.mkv for Matroska\n");
+    printf("          (default fn = \"uxplay-recording.mp4\")\n");
+    printf("-pcm [ms] Also send the decoded audio to the consumer in ms-millisecond\n");
+    printf("          chunks (default 20), timestamped like the video frames;\n");
+    printf("          with \"-as 0\" audio is then not played locally\n");
+    printf("-trace [p] Record a timeline of the server threads; written to\n");
+    printf("          p-n.json (Chrome/Perfetto format) at the end of each\n");
+    printf("          session and on signal SIGUSR2 (default p = \"uxplay-trace\")\n");
+    printf("-rtsp [n] Restream the mirrored screen and audio (as received) to\n");
+    printf("          RTSP viewers at rtsp://<this host>:n/ (default n = %d)\n", DEFAULT_RTSP_PORT);
+    printf("-rtspmc [g[/t]] As -rtsp, but send RTP once to multicast group g\n");
+    printf("          (ports 5004-5007, TTL t; default %s/1)\n", DEFAULT_RTSP_GROUP);
+    printf("-thread c:p[:cpus] Place the threads of class c (mirror,audio,ntp,httpd,ws,\n");
+    printf("          gst-video,gst-audio,other or all): p = fifo/prio, rr/prio,\n");
+    printf("          nice/n or empty; cpus: e.g. 2-3,6.  Can be repeated.\n");
+    printf("-metrics [n] Serve runtime metrics (Prometheus text format) at\n");
+    printf("          http://127.0.0.1:n/metrics (default n = %d)\n", DEFAULT_METRICS_PORT);
     printf("-o        Set display \"overscanned\" mode on (not usually needed)\n");
     printf("-fs       Full-screen (only works with X11, Wayland, VAAPI, D3D11)\n");
     printf("-p        Use legacy ports UDP 6000:6001:7011 TCP 7000:7001:7100\n");
@@ -658,6 +806,8 @@ static void print_info (char *name) {
     printf("-al x     Audio latency in seconds (default 0.25) reported to client.\n");
     printf("-ca <fn>  In Airplay Audio (ALAC) mode, write cover-art to file <fn>\n");
     printf("-reset n  Reset after 3n seconds client silence (default %d, 0=never)\n", NTP_TIMEOUT_LIMIT);
+    printf("-busypoll n Keep polling the mirror socket for n usecs after video data\n");
+    printf("          arrives (lower keyframe latency, at the cost of CPU; 0 = off)\n");
     printf("-nofreeze Do NOT leave frozen screen in place after reset\n");
     printf("-nc       Do NOT Close video window when client stops mirroring\n");
     printf("-nohold   Drop current connection when new client connects.\n");
@@ -668,6 +818,9 @@ static void print_info (char *name) {
     printf("-block <i>Always block connections from deviceID = <i>\n");
     printf("-FPSdata  Show video-streaming performance reports sent by client.\n");
     printf("-fps n    Set maximum allowed streaming framerate, default 30\n");
+    printf("-vbudget n Decode at most n million pixels/sec: clients are invited\n");
+    printf("          to send a lower resolution/framerate while streams run\n");
+    printf("-vfit     Invite clients to send no more than the consumer viewport\n");
     printf("-f {H|V|I}Horizontal|Vertical flip, or both=Inversion=rotate 180 deg\n");
     printf("-r {R|L}  Rotate 90 degrees Right (cw) or Left (ccw)\n");
     printf("-m [mac]  Set MAC address (also Device ID);use for concurrent UxPlays\n");
@@ -683,6 +836,10 @@ static void print_info (char *name) {
     printf("          =1,2,..; fn=\"audiodump\"; change with \"-admp [n] filename\".\n");
     printf("          x increases when audio format changes. If n is given, <= n\n");
     printf("          audio packets are dumped. \"aud\"= unknown format.\n");
+    printf("-dmpsize n Start a new -vdmp/-admp file after n MB (at the next SPS\n");
+    printf("          for video); written by a separate thread, which drops data\n");
+    printf("          (and reports it) if the disk cannot keep up\n");
+    printf("-dmptime n Start a new -vdmp/-admp file after n seconds (as -dmpsize)\n");
     printf("-d        Enable debug logging\n");
     printf("-v        Displays version information\n");
     printf("-h        Displays this help\n");
@@ -889,6 +1046,141 @@ static void parse_arguments (int argc, char *argv[]) {
                     }
                 }
             }
+        } else if (arg == "-jb") {
+            use_jitter_buffer = true;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 500;
+                if (!get_value(argv[++i], &n)) {
+                    fprintf(stderr, "invalid \"-jb %s\"; -jb n : n is a latency target 1-500 millisecs\n", argv[i]);
+                    exit(1);
+                }
+                jitter_latency = n;
+            }
+        } else if (arg == "-preview") {
+            preview_width = 160;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                std::string value(argv[++i]);
+                unsigned int w = 1920, r = 30;
+                std::size_t pos = value.find_first_of("@");
+                bool valid = true;
+                if (pos != std::string::npos) {
+                    valid = get_value(value.substr(pos + 1).c_str(), &r);
+                    value.erase(pos);
+                    preview_fps = r;
+                }
+                if (!valid || !get_value(value.c_str(), &w) || w < 16) {
+                    fprintf(stderr, "invalid \"-preview %s\"; -preview w[@r]: 16 <= w <= 1920, 1 <= r <= 30\n", argv[i]);
+                    exit(1);
+                }
+                preview_width = w;
+            }
+        } else if (arg == "-viewers") {
+            viewers_port = DEFAULT_VIEWERS_PORT;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 0;
+                if (!get_value(argv[++i], &n) || n < LOWEST_ALLOWED_PORT || n > HIGHEST_PORT) {
+                    fprintf(stderr, "invalid \"-viewers %s\"; -viewers n: %d <= n <= %d\n", argv[i],
+                            LOWEST_ALLOWED_PORT, HIGHEST_PORT);
+                    exit(1);
+                }
+                viewers_port = (unsigned short) n;
+            }
+        } else if (arg == "-pcm") {
+            pcm_chunk_ms = 20;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int ms = 0;
+                if (!get_value(argv[++i], &ms) || ms < 5 || ms > 1000) {
+                    fprintf(stderr, "invalid \"-pcm %s\"; -pcm ms: 5 <= ms <= 1000\n", argv[i]);
+                    exit(1);
+                }
+                pcm_chunk_ms = ms;
+            }
+        } else if (arg == "-trace") {
+            trace_prefix = "uxplay-trace";
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                trace_prefix.erase();
+                trace_prefix.append(argv[++i]);
+            }
+            std::string testfile = trace_prefix + ".test";
+            if (!file_has_write_access(testfile.c_str())) {
+                fprintf(stderr, "%s cannot be written to:\noption \"-trace <p>\" must be to a location with write access\n",
+                        testfile.c_str());
+                exit(1);
+            }
+        } else if (arg == "-thread") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            if (thread_policy_set(argv[++i]) < 0) {
+                fprintf(stderr, "invalid \"-thread %s\"; -thread c:p[:cpus], e.g. \"-thread audio:fifo/50:2-3\"\n"
+                        "  c: mirror, audio, ntp, httpd, ws, gst-video, gst-audio, other, or all\n"
+                        "  p: fifo/prio or rr/prio (1-99), nice/n (-20 to 19), or empty (unchanged)\n", argv[i]);
+                exit(1);
+            }
+        } else if (arg == "-rtsp") {
+            rtsp_port = DEFAULT_RTSP_PORT;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 0;
+                if (!get_value(argv[++i], &n) || n < LOWEST_ALLOWED_PORT || n > HIGHEST_PORT) {
+                    fprintf(stderr, "invalid \"-rtsp %s\"; -rtsp n: %d <= n <= %d\n", argv[i],
+                            LOWEST_ALLOWED_PORT, HIGHEST_PORT);
+                    exit(1);
+                }
+                rtsp_port = (unsigned short) n;
+            }
+        } else if (arg == "-rtspmc") {
+            if (!rtsp_port) {
+                rtsp_port = DEFAULT_RTSP_PORT;
+            }
+            rtsp_group = DEFAULT_RTSP_GROUP;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                std::string value(argv[++i]);
+                std::size_t pos = value.find_first_of("/");
+                bool valid = true;
+                if (pos != std::string::npos) {
+                    valid = get_value(value.substr(pos + 1).c_str(), &rtsp_ttl) && rtsp_ttl >= 1 && rtsp_ttl <= 255;
+                    value.erase(pos);
+                }
+                if (!valid || value.empty()) {
+                    fprintf(stderr, "invalid \"-rtspmc %s\"; -rtspmc g[/t]: multicast group g, 1 <= t <= 255\n",
+                            argv[i]);
+                    exit(1);
+                }
+                rtsp_group = value;
+            }
+        } else if (arg == "-metrics") {
+            metrics_port = DEFAULT_METRICS_PORT;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 0;
+                if (!get_value(argv[++i], &n) || n < LOWEST_ALLOWED_PORT || n > HIGHEST_PORT) {
+                    fprintf(stderr, "invalid \"-metrics %s\"; -metrics n: %d <= n <= %d\n", argv[i],
+                            LOWEST_ALLOWED_PORT, HIGHEST_PORT);
+                    exit(1);
+                }
+                metrics_port = (unsigned short) n;
+            }
+        } else if (arg == "-snap") {
+            snapshot_prefix = "uxplay-snapshot";
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                snapshot_prefix.erase();
+                snapshot_prefix.append(argv[++i]);
+            }
+            std::string testfile = snapshot_prefix + ".test";
+            if (!file_has_write_access(testfile.c_str())) {
+                fprintf(stderr, "%s cannot be written to:\noption \"-snap <p>\" must be to a location with write access\n",
+                        testfile.c_str());
+                exit(1);
+            }
+        } else if (arg == "-rec") {
+            record_session = true;
+            record_filename = "uxplay-recording.mp4";
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                record_filename.erase();
+                record_filename.append(argv[++i]);
+            }
+            if (!file_has_write_access(record_filename.c_str())) {
+                fprintf(stderr, "%s cannot be written to:\noption \"-rec <fn>\" must be to a file with write access\n",
+                        record_filename.c_str());
+                exit(1);
+            }
         } else if (arg == "-s") {
             if (!option_has_value(i, argc, argv[i], argv[i+1])) exit(1);
             std::string value(argv[++i]);
@@ -905,6 +1197,14 @@ static void parse_arguments (int argc, char *argv[]) {
                 exit(1);
             }
             display[3] = (unsigned short) n;
+        } else if (arg == "-vbudget") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            if (!get_value(argv[++i], &decode_budget) || decode_budget == 0 || decode_budget > 10000) {
+                fprintf(stderr, "invalid \"-vbudget %s\"; -vbudget n : million pixels/sec, 1 <= n <= 10000\n", argv[i]);
+                exit(1);
+            }
+        } else if (arg == "-vfit") {
+            fit_viewport = true;
         } else if (arg == "-o") {
             display[4] = 1;
         } else if (arg == "-f") {
@@ -1025,6 +1325,12 @@ static void parse_arguments (int argc, char *argv[]) {
                 fprintf(stderr, "invalid \"-reset %s\"; -reset n must have n >= 0,  default n = %d\n", argv[i], NTP_TIMEOUT_LIMIT);
                 exit(1);
             }
+        } else if (arg == "-busypoll") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            if (!get_value(argv[++i], &mirror_busy_poll_us) || mirror_busy_poll_us > 1000000) {
+                fprintf(stderr, "invalid \"-busypoll %s\"; -busypoll n needs 0 <= n <= 1000000 (microseconds)\n", argv[i]);
+                exit(1);
+            }
         } else if (arg == "-vdmp") {
             dump_video = true;
             if (i < argc - 1 && *argv[i+1] != '-') {
@@ -1073,6 +1379,17 @@ static void parse_arguments (int argc, char *argv[]) {
                     exit(1);
                 }   		
             }
+        } else if (arg == "-dmpsize" || arg == "-dmptime") {
+            unsigned int n = 0;
+            if (!option_has_value(i, argc, arg, argv[i+1]) || !get_value(argv[++i], &n) || n == 0) {
+                fprintf(stderr, "invalid \"%s %s\"; %s n needs a positive integer n\n", arg.c_str(), argv[i], arg.c_str());
+                exit(1);
+            }
+            if (arg == "-dmpsize") {
+                dump_max_mbytes = n;
+            } else {
+                dump_max_secs = n;
+            }
         } else if (arg  == "-ca" ) {
             if (option_has_value(i, argc, arg, argv[i+1])) {
                 coverart_filename.erase();
@@ -1203,142 +1520,27 @@ static void parse_arguments (int argc, char *argv[]) {
     }
 }
 
-static void process_metadata(int count, const char *dmap_tag, const unsigned char* metadata, int datalen) {
-    int dmap_type = 0;
-    /* DMAP metadata items can be strings (dmap_type = 9); other types are byte, short, int, long, date, and list.  *
-     * The DMAP item begins with a 4-character (4-letter) "dmap_tag" string that identifies the type.               */
-
-    if (debug_log) {
-        printf("%d: dmap_tag [%s], %d\n", count, dmap_tag, datalen);
-    }
-
-    /* UTF-8 String-type DMAP tags seen in Apple Music Radio are processed here.   *
-     * (DMAP tags "asal", "asar", "ascp", "asgn", "minm" ). TODO expand this */  
-    
-    if (datalen == 0) {
-        return;
-    }
-
-    if (dmap_tag[0] == 'a' && dmap_tag[1] == 's') {
-        dmap_type = 9;
-        switch (dmap_tag[2]) {
-        case 'a':
-            switch (dmap_tag[3]) {
-            case 'a':
-                printf("Album artist: ");  /*asaa*/
-                break;
-            case 'l':
-                printf("Album: ");  /*asal*/
-                break;
-            case 'r':
-                printf("Artist: ");  /*asar*/
-                break;
-            default:
-                dmap_type = 0;
-                break;
-            }
-            break;    
-        case 'c':
-            switch (dmap_tag[3]) {
-            case 'm':
-                printf("Comment: ");  /*ascm*/
-                break;
-            case 'n':
-                printf("Content description: ");  /*ascn*/
-                break;
-            case 'p':
-                printf("Composer: ");  /*ascp*/
-                break;
-            case 't':
-                printf("Category: ");  /*asct*/
-                break;
-            default:
-                dmap_type = 0;
-                break;
-            }
-            break;
-        case 's':
-            switch (dmap_tag[3]) {
-            case 'a':
-                printf("Sort Artist: "); /*assa*/
-                break;
-            case 'c':
-                printf("Sort Composer: ");  /*assc*/
-                break;
-            case 'l':
-                printf("Sort Album artist: ");  /*assl*/
-                break;
-            case 'n':
-                printf("Sort Name: ");  /*assn*/
-                break;
-            case 's':
-                printf("Sort Series: ");  /*asss*/
-                break;
-            case 'u':
-                printf("Sort Album: ");  /*assu*/
-                break;
-            default:
-                dmap_type = 0;
-                break;
-            }
-            break;
-        default:
-	    if (strcmp(dmap_tag, "asdt") == 0) {
-                printf("Description: ");
-            } else if (strcmp (dmap_tag, "asfm") == 0) {
-                printf("Format: ");
-            } else if (strcmp (dmap_tag, "asgn") == 0) {
-                printf("Genre: ");
-            } else if (strcmp (dmap_tag, "asky") == 0) {
-                printf("Keywords: ");
-            } else if (strcmp (dmap_tag, "aslc") == 0) {
-                printf("Long Content Description: ");
-            } else {
-                dmap_type = 0;
-            }
-            break;
+/* media_info worker thread: console output of the "now playing" metadata */
+static void print_metadata(void *cls, const media_info_item_t *items, int n_items) {
+    printf("==============Audio Metadata=============\n");
+    for (int i = 0; i < n_items; i++) {
+        const media_info_item_t *item = &items[i];
+        if (debug_log) {
+            printf("%d: dmap_tag [%s], %d\n", i + 1, item->tag, item->len);
         }
-    } else if (strcmp (dmap_tag, "minm") == 0) {
-        dmap_type = 9;
-        printf("Title: ");
-    }
-
-    if (dmap_type == 9) {
-        char *str = (char *) calloc(1, datalen + 1);
-        memcpy(str, metadata, datalen);
-        printf("%s", str);
-        free(str);
-    } else if (debug_log) {
-        for (int i = 0; i < datalen; i++) {
-            if (i > 0 && i % 16 == 0) printf("\n");
-            printf("%2.2x ", (int) metadata[i]);
+        if (item->len == 0) {
+            continue;
         }
-    }
-    printf("\n");
-}
-
-static int parse_dmap_header(const unsigned char *metadata, char *tag, int *len) {
-    const unsigned char *header = metadata;
-
-    bool istag = true;
-    for (int i = 0; i < 4; i++) {
-        tag[i] =  (char) *header;
-	if (!isalpha(tag[i])) {
-            istag = false;
+        if (item->label) {
+            printf("%s: %.*s", item->label, item->len, (const char *) item->data);
+        } else if (debug_log) {
+            for (int j = 0; j < item->len; j++) {
+                if (j > 0 && j % 16 == 0) printf("\n");
+                printf("%2.2x ", (int) item->data[j]);
+            }
         }
-        header++;
-    }
-
-    *len = 0;
-    for (int i = 0; i < 4; i++) {
-        *len <<= 8;
-        *len += (int) *header;
-        header++;
+        printf("\n");
     }
-    if (!istag || *len < 0) {
-        return 1;
-    }
-    return 0;
 }
 
 static int register_dnssd() {
@@ -1525,19 +1727,68 @@ static bool check_blocked_client(char *deviceid) {
     return ret;
 }
 
+#ifdef UXPLAY_EMBEDDED
+static uxplay_event_callback_t event_callback = NULL;
+static void *event_callback_data = NULL;
+
+extern "C" void uxplay_set_event_callback(uxplay_event_callback_t callback, void *user_data) {
+    event_callback = callback;
+    event_callback_data = user_data;
+}
+
+extern "C" void uxplay_stop() {
+    control_queue_post(CONTROL_QUIT, NULL);
+}
+#endif
+
+/* session events for the node addon (see node/uxplay_embed.h) */
+static void report_session_event(const char *event, const char *detail) {
+#ifdef UXPLAY_EMBEDDED
+    if (event_callback) {
+        event_callback(event_callback_data, event, detail);
+    }
+#endif
+}
+
 // Server callbacks
 
 extern "C" void video_reset(void *cls) {
     LOGD("video_reset");
-    url.erase();
-    reset_loop = true;
+    if (video_jitter) {
+        video_jitter_flush(video_jitter);
+    }
     remote_clock_offset = 0;
-    relaunch_video = true;
+    current_video_codec = VIDEO_CODEC_UNKNOWN;
+    /* with -nohold this runs before the replacing client asks for /info: its old stream *
+     * still counts against the decode budget until that has been answered               */
+    stream_replaced = true;
+    if (record_session) {
+        recorder_stop();
+    }
+    /* mirror pipelines are renegotiated in place by the next stream */
+    if (use_video && video_renderer_reset_stream()) {
+        return;
+    }
+    control_queue_post(CONTROL_RELAUNCH, NULL);
 }
 
 extern "C" void video_set_codec(void *cls, video_codec_t codec) {
     if (use_video) {
         bool video_is_h265 = (codec == VIDEO_CODEC_H265); 
+        /* a new SPS/PPS with the same codec (rotation, app switch) keeps the queued frames */
+        if (codec != current_video_codec) {
+            current_video_codec = codec;
+            report_session_event("codec", video_is_h265 ? "h265" : "h264");
+            if (video_jitter) {
+                video_jitter_flush(video_jitter);
+            }
+            if (record_session) {
+                recorder_set_video_codec(video_is_h265);
+            }
+            if (rtsp_port) {
+                restream_set_video_codec(video_is_h265);
+            }
+        }
         video_renderer_choose_codec(video_is_h265);
     }
 }
@@ -1568,6 +1819,7 @@ extern "C" void export_dacp(void *cls, const char *active_remote, const char *da
 
 extern "C" void conn_init (void *cls) {
     open_connections++;
+    report_session_event("connect", NULL);
     LOGD("Open connections: %i", open_connections);
     //video_renderer_update_background(1);
 }
@@ -1576,11 +1828,20 @@ extern "C" void conn_destroy (void *cls) {
     //video_renderer_update_background(-1);
     open_connections--;
     LOGD("Open connections: %i", open_connections);
+    report_session_event("disconnect", NULL);
     if (open_connections == 0) {
         remote_clock_offset = 0;
         if (use_audio) {
             audio_renderer_stop();
         }
+        current_video_codec = VIDEO_CODEC_UNKNOWN;
+        stream_pixel_rate = 0;
+        stream_replaced = false;
+        if (record_session) {
+            recorder_stop();
+        }
+        /* one timeline file per session */
+        trace_dump();
         if (dacpfile.length()) {
             remove (dacpfile.c_str());
         }    
@@ -1598,12 +1859,13 @@ extern "C" void conn_reset (void *cls, int timeouts, bool reset_video) {
         close_window = reset_video;    /* leave "frozen" window open if reset_video is false */
     }
     raop_stop(raop);
-    reset_loop = true;
+    report_session_event("reset", NULL);
+    control_queue_post(CONTROL_RESET, NULL);
 }
 
 extern "C" void conn_teardown(void *cls, bool *teardown_96, bool *teardown_110) {
     if (*teardown_110 && close_window) {
-        reset_loop = true;
+        control_queue_post(CONTROL_RESET, NULL);
     }
 }
 
@@ -1622,6 +1884,9 @@ extern "C" void report_client_request(void *cls, char *deviceid, char * model, c
         *admit = false;
         LOGI("*** attempt to connect by blocked client (clientID %s): DENIED\n", deviceid);
     }
+    if (*admit) {
+        report_session_event("client", name);
+    }
 }
 
 extern "C" void audio_process (void *cls, raop_ntp_t *ntp, audio_decode_struct *data) {
@@ -1633,6 +1898,12 @@ extern "C" void audio_process (void *cls, raop_ntp_t *ntp, audio_decode_struct *
             remote_clock_offset = data->ntp_time_local - data->ntp_time_remote;
         }
         data->ntp_time_remote = data->ntp_time_remote + remote_clock_offset;
+        if (record_session) {
+            recorder_push_audio(data->data, data->data_len, data->ntp_time_remote);
+        }
+        if (rtsp_port) {
+            restream_push_audio(data->data, data->data_len, data->ntp_time_remote);
+        }
         switch (data->ct) {
         case 2:
             if (audio_delay_alac) {
@@ -1661,10 +1932,25 @@ extern "C" void video_process (void *cls, raop_ntp_t *ntp, video_decode_struct *
             remote_clock_offset = data->ntp_time_local - data->ntp_time_remote;
         }
         data->ntp_time_remote = data->ntp_time_remote + remote_clock_offset;
-        video_renderer_render_buffer(data->data, &(data->data_len), &(data->nal_count), &(data->ntp_time_remote));
+        if (record_session) {
+            recorder_push_video(data->data, data->data_len, data->ntp_time_remote);
+        }
+        if (rtsp_port) {
+            restream_push_video(data->data, data->data_len, data->ntp_time_remote);
+        }
+        if (video_jitter) {
+            video_jitter_enqueue(video_jitter, ntp, data);
+        } else {
+            video_renderer_render_buffer(data->data, &(data->data_len), &(data->nal_count), &(data->ntp_time_remote));
+        }
     }
 }
 
+/* called from the jitter buffer thread when a frame is due */
+extern "C" void video_jitter_release (void *cls, video_decode_struct *data) {
+    video_renderer_render_buffer(data->data, &(data->data_len), &(data->nal_count), &(data->ntp_time_remote));
+}
+
 extern "C" void video_pause (void *cls) {
     if (use_video) {
         video_renderer_pause();
@@ -1686,6 +1972,9 @@ extern "C" void audio_flush (void *cls) {
 
 extern "C" void video_flush (void *cls) {
     if (use_video) {
+        if (video_jitter) {
+            video_jitter_flush(video_jitter);
+        }
         video_renderer_flush();
     }
 }
@@ -1750,30 +2039,128 @@ extern "C" void audio_get_format (void *cls, unsigned char *ct, unsigned short *
         break;
     }
     if (audio_dumpfile && type != audio_type) {
-        fclose(audio_dumpfile);
-        audio_dumpfile = NULL;
+        capture_writer_close(audio_capture);
+        audio_dumpfile = false;
     }
     audio_type = type;
+    if (record_session) {
+        recorder_set_audio_format(*ct);
+    }
+    if (rtsp_port) {
+        restream_set_audio_format(*ct);
+    }
     
     if (use_audio) {
       audio_renderer_start(ct);
     }
 
-    if (coverart_filename.length()) {
-        write_coverart(coverart_filename.c_str(), (const void *) empty_image, sizeof(empty_image));
+    if (media_info) {
+        media_info_clear(media_info);
     }
 }
 
 extern "C" void video_report_size(void *cls, float *width_source, float *height_source, float *width, float *height) {
     if (use_video) {
         video_renderer_size(width_source, height_source, width, height);
+        char size[24];
+        /* the mirrored stream's size, which consumers size their canvases from (not the client's screen) */
+        snprintf(size, sizeof(size), "%dx%d", (int) *width, (int) *height);
+        report_session_event("size", size);
+        /* until the client reports its frame rate, assume it sends at the maximum */
+        stream_pixels = (uint64_t) *width * (uint64_t) *height;
+        stream_replaced = false;
+        stream_pixel_rate = stream_pixels * (display[3] ? display[3] : 30);
+    }
+}
+
+/* The display advertised to a client in /info: the configured one (-s, -fps), shrunk to *
+ * the consumer viewport (-vfit), then to what is left of the decode budget (-vbudget)   *
+ * by the stream already being decoded; frame rate is given up before resolution, down  *
+ * to MIN_INVITED_FPS.                                                                   */
+#define MIN_INVITED_FPS 30
+#define MIN_INVITED_WIDTH 320
+extern "C" void video_get_display(void *cls, bool streaming, uint16_t *width, uint16_t *height, uint8_t *max_fps) {
+    double w = *width, h = *height, fps = *max_fps;
+    double load = (streaming ? 0.0 : (double) stream_pixel_rate);
+    if (!streaming && stream_replaced.exchange(false)) {
+        stream_pixel_rate = 0;
+    }
+    if (!w || !h || !fps) {
+        return;
+    }
+    unsigned int viewport_w, viewport_h, viewport_fps;
+    if (fit_viewport && video_renderer_get_viewport(&viewport_w, &viewport_h, &viewport_fps)) {
+        if (viewport_w && viewport_h) {
+            double scale = std::min(viewport_w / w, viewport_h / h);
+            if (scale < 1.0) {
+                w *= scale;
+                h *= scale;
+            }
+        }
+        fps = std::min(fps, (double) viewport_fps);
+    }
+    if (decode_budget) {
+        double available = 1e6 * decode_budget - load;
+        if (available <= 0.0) {
+            /* nothing left: invite the smallest stream (below) */
+            w = 0.0;
+            fps = std::min(fps, (double) MIN_INVITED_FPS);
+        } else if (w * h * fps > available) {
+            fps = std::max(floor(available / (w * h)), std::min(fps, (double) MIN_INVITED_FPS));
+            if (w * h * fps > available) {
+                double scale = sqrt(available / (w * h * fps));
+                w *= scale;
+                h *= scale;
+            }
+        }
+    }
+    if (w < MIN_INVITED_WIDTH) {
+        /* scaling kept the aspect ratio of the configured display */
+        h = MIN_INVITED_WIDTH * (double) *height / (double) *width;
+        w = MIN_INVITED_WIDTH;
+    }
+    *width = std::min((uint16_t) ((unsigned int) w & ~1U), *width);
+    *height = std::min((uint16_t) ((unsigned int) h & ~1U), *height);
+    *max_fps = (uint8_t) fps;
+}
+
+static void append_report_value(std::string &json, const char *name, double value) {
+    char field[64];
+    if (value < 0.0) {
+        snprintf(field, sizeof(field), "\"%s\":null,", name);
+    } else {
+        snprintf(field, sizeof(field), "\"%s\":%.3f,", name, value);
+    }
+    json += field;
+}
+
+/* once a second during mirroring: the client's streaming report, as JSON for the consumer */
+extern "C" void video_report(void *cls, video_report_struct *report) {
+    std::string json = "{";
+    append_report_value(json, "clientSentFps", report->client_sent_fps);
+    append_report_value(json, "clientSubmittedFps", report->client_submitted_fps);
+    append_report_value(json, "clientDroppedFps", report->client_dropped_fps);
+    append_report_value(json, "clientEncodeMs", report->client_encode_ms);
+    append_report_value(json, "clientSendMs", report->client_send_ms);
+    append_report_value(json, "receivedFps", report->received_fps);
+    append_report_value(json, "receivedBitrate", report->received_bitrate);
+    append_report_value(json, "arrivalDelayMs", report->arrival_delay_ms);
+    append_report_value(json, "interval", report->interval);
+    json += "\"clientDroppedFrames\":" + std::to_string(report->client_dropped_frames) + ",";
+    json += "\"time\":" + std::to_string(report->ntp_time_local) + "}";
+    if (report->received_fps > 0.0) {
+        stream_pixel_rate = (uint64_t) (stream_pixels * report->received_fps);
+    }
+    LOGD("client streaming report %s", json.c_str());
+    report_session_event("report", json.c_str());
+    if (use_video) {
+        video_renderer_send_report(json.c_str(), report->ntp_time_local);
     }
 }
 
 extern "C" void audio_set_coverart(void *cls, const void *buffer, int buflen) {
-    if (buffer && coverart_filename.length()) {
-        write_coverart(coverart_filename.c_str(), buffer, buflen);
-        LOGI("coverart size %d written to %s", buflen,  coverart_filename.c_str());
+    if (buffer && media_info) {
+        media_info_set_coverart(media_info, buffer, buflen);
     }
 }
 
@@ -1786,43 +2173,16 @@ extern "C" void audio_set_progress(void *cls, unsigned int start, unsigned int c
 }
 
 extern "C" void audio_set_metadata(void *cls, const void *buffer, int buflen) {
-    char dmap_tag[5] = {0x0};
-    const unsigned char *metadata = (const  unsigned char *) buffer;
-    int datalen;
-    int count = 0;
-
-    printf("==============Audio Metadata=============\n");
-
-    if (buflen < 8) {
-        LOGE("received invalid metadata, length %d < 8", buflen);
-        return;
-    } else if (parse_dmap_header(metadata, dmap_tag, &datalen)) {
-        LOGE("received invalid metadata, tag [%s]  datalen %d", dmap_tag, datalen);
-        return;
+    if (buffer && media_info) {
+        media_info_set_metadata(media_info, buffer, buflen);
     }
-    metadata += 8;
-    buflen -= 8;
+}
 
-    if (strcmp(dmap_tag, "mlit") != 0 || datalen != buflen) {
-        LOGE("received metadata with tag %s, but is not a DMAP listingitem, or datalen = %d !=  buflen %d",
-             dmap_tag, datalen, buflen);
-        return;
-    }
-    while (buflen >= 8) {
-        count++;
-        if (parse_dmap_header(metadata, dmap_tag, &datalen)) {
-            LOGE("received metadata with invalid DMAP header:  tag = [%s],  datalen = %d", dmap_tag, datalen);
-            return;
-        }
-        metadata += 8;
-        buflen -= 8;
-        process_metadata(count, (const char *) dmap_tag, metadata, datalen);
-        metadata += datalen;
-        buflen -= datalen;
-    }
-    if (buflen != 0) {
-      LOGE("%d bytes of metadata were not processed", buflen);
-    }
+/* media_info worker thread */
+static void media_info_changed(void *cls) {
+    char *json = media_info_get_json(media_info);
+    report_session_event("metadata", json);
+    free(json);
 }
 
 extern "C" void register_client(void *cls, const char *device_id, const char *client_pk, const char *client_name) {
@@ -1860,12 +2220,7 @@ extern "C" bool check_register(void *cls, const char *client_pk) {
 
 extern "C" void on_video_play(void *cls, const char* location, const float start_position) {
     /* start_position needs to be implemented */
-    url.erase();
-    url.append(location);
-    reset_loop = true;
-    relaunch_video = true;
-    preserve_connections = true;
-    LOGD("********************on_video_play: location = %s***********************", url.c_str());
+    control_queue_post(CONTROL_PLAY_URL, location);
 }
 
 extern "C" void on_video_scrub(void *cls, const float position) {
@@ -1951,6 +2306,8 @@ static int start_raop_server (unsigned short display[5], unsigned short tcp[3],
     raop_cbs.export_dacp = export_dacp;
     raop_cbs.video_reset = video_reset;
     raop_cbs.video_set_codec = video_set_codec;
+    raop_cbs.video_report = video_report;
+    raop_cbs.video_get_display = video_get_display;
     raop_cbs.on_video_play = on_video_play;
     raop_cbs.on_video_scrub = on_video_scrub;
     raop_cbs.on_video_rate = on_video_rate;
@@ -1982,6 +2339,7 @@ static int start_raop_server (unsigned short display[5], unsigned short tcp[3],
 
     if (show_client_FPS_data) raop_set_plist(raop, "clientFPSdata", 1);
     raop_set_plist(raop, "max_ntp_timeouts", max_ntp_timeouts);
+    raop_set_plist(raop, "mirror_busy_poll_us", (int) mirror_busy_poll_us);
     if (audiodelay >= 0) raop_set_plist(raop, "audio_delay_micros", audiodelay);
     if (require_password) raop_set_plist(raop, "pin", (int) pin);
     if (hls_support) raop_set_plist(raop, "hls", 1);
@@ -2092,7 +2450,7 @@ static void read_config_file(const char * filename, const char * uxplay_name) {
         free (argv);
     }
 }
-#ifdef GST_MACOS
+#if defined(GST_MACOS) && !defined(UXPLAY_EMBEDDED)
 /* workaround for GStreamer >= 1.22 "Official Builds" on macOS */
 #include <TargetConditionals.h>
 #include <gst/gstmacos.h>
@@ -2104,6 +2462,9 @@ int main (int argc, char *argv[]) {
 }
 
 void real_main (int argc, char *argv[]) {
+#elif defined(UXPLAY_EMBEDDED)
+/* built into the node addon, which runs it on a thread of its own */
+extern "C" int uxplay_main (int argc, char *argv[]) {
 #else
 int main (int argc, char *argv[]) {
 #endif
@@ -2134,7 +2495,10 @@ int main (int argc, char *argv[]) {
 
     LOGI("UxPlay %s: An Open-Source AirPlay mirroring and audio-streaming server.", VERSION);
 
-    if (audiosink == "0") {
+    if (audiosink == "0" && pcm_chunk_ms && use_video) {
+        /* decode for the consumer only: no local sound device is needed */
+        audiosink = "fakesink";
+    } else if (audiosink == "0") {
         use_audio = false;
         dump_audio = false;
     }
@@ -2251,20 +2615,66 @@ int main (int argc, char *argv[]) {
         exit (1);
     }
 
+    if (!control_queue_init()) {
+        LOGE ("could not create the main loop command queue: stopping");
+        exit (1);
+    }
+
     render_logger = logger_init();
     logger_set_callback(render_logger, log_callback, NULL);
     logger_set_level(render_logger, log_level);
+    thread_policy_report(render_logger);
+
+    if (dump_video) {
+        video_capture = capture_writer_init(render_logger, (uint64_t) dump_max_mbytes << 20, dump_max_secs);
+    }
+    if (dump_audio) {
+        audio_capture = capture_writer_init(render_logger, (uint64_t) dump_max_mbytes << 20, dump_max_secs);
+    }
+    if ((dump_video && !video_capture) || (dump_audio && !audio_capture)) {
+        LOGE("could not start the capture writer: data will not be dumped");
+    }
+
+    if (!trace_prefix.empty() && !trace_init(render_logger, trace_prefix.c_str())) {
+        LOGE("could not start the tracer");
+    }
+
+    if (metrics_port && metrics_server_start(render_logger, &metrics_port) < 0) {
+        LOGE("could not start the metrics endpoint on port %u", (unsigned int) metrics_port);
+    }
+
+    if (rtsp_port && restream_start(render_logger, &rtsp_port, rtsp_group.empty() ? NULL : rtsp_group.c_str(),
+                                    (unsigned char) rtsp_ttl) < 0) {
+        LOGE("could not start the RTSP restream server on port %u", (unsigned int) rtsp_port);
+    }
+
+    if (record_session && !recorder_init(render_logger, record_filename.c_str())) {
+        LOGE("session recording could not be enabled");
+        record_session = false;
+    }
 
     if (use_audio) {
+      if (pcm_chunk_ms && use_video) {
+          audio_renderer_set_pcm_output(pcm_chunk_ms, video_renderer_send_pcm);
+      }
       audio_renderer_init(render_logger, audiosink.c_str(), &audio_sync, &video_sync);
     } else {
         LOGI("audio_disabled");
     }
     if (use_video) {
+        video_renderer_set_preview(preview_width, preview_fps);
+        video_renderer_set_viewers(viewers_port);
+        video_renderer_set_snapshot(snapshot_prefix.empty() ? NULL : snapshot_prefix.c_str());
         video_renderer_init(render_logger, server_name.c_str(), videoflip, video_parser.c_str(),
                             video_decoder.c_str(), video_converter.c_str(), videosink.c_str(),
                             videosink_options.c_str(), fullscreen, video_sync, h265_support, NULL);
         video_renderer_start();
+        if (use_jitter_buffer) {
+            video_jitter = video_jitter_init(render_logger, jitter_latency, video_jitter_release, NULL);
+            if (!video_jitter) {
+                LOGE("failed to start video jitter buffer, frames will be rendered on arrival");
+            }
+        }
     }
 
     if (udp[0]) {
@@ -2286,9 +2696,14 @@ int main (int argc, char *argv[]) {
     }
     parse_hw_addr(mac_address, server_hw_addr);
 
-    if (coverart_filename.length()) {
+    media_info_callbacks_t media_info_cbs = { NULL, print_metadata, media_info_changed };
+    media_info = media_info_init(render_logger, (coverart_filename.length() ? coverart_filename.c_str() : NULL),
+                                 &media_info_cbs);
+    if (!media_info) {
+        LOGE("could not start the metadata and cover-art worker");
+    } else if (coverart_filename.length()) {
         LOGI("any AirPlay audio cover-art will be written to file  %s",coverart_filename.c_str());
-        write_coverart(coverart_filename.c_str(), (const void *) empty_image, sizeof(empty_image));
+        media_info_clear(media_info);
     }
 
     /* set default resolutions for h264 or h265*/
@@ -2321,6 +2736,8 @@ int main (int argc, char *argv[]) {
 
     main_loop();
     if (relaunch_video || reset_loop) {
+        /* the server is restarted below: this covers the resets requested until now */
+        control_queue_drop(CONTROL_RESET);
         if(reset_loop) {
             reset_loop = false;
         } else {
@@ -2328,6 +2745,9 @@ int main (int argc, char *argv[]) {
         }
         if (use_audio) audio_renderer_stop();
         if (use_video && (close_window || preserve_connections)) {
+            if (video_jitter) {
+                video_jitter_flush(video_jitter);
+            }
             video_renderer_destroy();
             if (!preserve_connections) {
                 raop_destroy_airplay_video(raop);
@@ -2358,22 +2778,37 @@ int main (int argc, char *argv[]) {
         stop_dnssd();
     }
     cleanup:
+    if (record_session) {
+        recorder_destroy();
+    }
     if (use_audio) {
         audio_renderer_destroy();
     }
     if (use_video)  {
+        video_jitter_destroy(video_jitter);
+        video_jitter = NULL;
         video_renderer_destroy();
     }
+    if (video_dumpfile) {
+        capture_writer_write(video_capture, mark, sizeof(mark));
+    }
+    /* writes out everything still queued */
+    capture_writer_destroy(audio_capture);
+    capture_writer_destroy(video_capture);
+    restream_stop();
+    metrics_server_stop();
+    trace_dump();
+    trace_destroy();
+    control_queue_destroy();
+    /* drains what is still pending, logging to render_logger */
+    media_info_destroy(media_info);
+    media_info = NULL;
     logger_destroy(render_logger);
     render_logger = NULL;
-    if(audio_dumpfile) {
-        fclose(audio_dumpfile);
-    }
-    if (video_dumpfile) {
-        fwrite(mark, 1, sizeof(mark), video_dumpfile);
-        fclose(video_dumpfile);
-    }
     if (coverart_filename.length()) {
 	remove (coverart_filename.c_str());
     }
+#ifdef UXPLAY_EMBEDDED
+    return 0;
+#endif
 }
@@ -1,10 +1,127 @@
-const { app, BrowserWindow, ipcMain } = require('electron');
+const { app, BrowserWindow, ipcMain, screen } = require('electron');
 const path = require('path');
 const WebSocket = require('ws');
 
 let mainWindow;
 
-const FRAME_SIZE = 1244160; // Exact NV12 frame size for 710x1080
+// Every binary message from uxplay starts with a 24-byte little-endian header
+// (see ws_write_header() in UxPlay/renderers/video_renderer.c)
+const HEADER_SIZE = 24;
+const MSG_MAGIC = 0x46505855; // "UXPF"
+const MSG_FRAME_RGBA = 1;
+const MSG_FRAME_TILES = 2;
+const MSG_PREVIEW_RGBA = 3;
+const MSG_AUDIO_PCM = 4;
+const MSG_STREAM_REPORT = 5;
+const MAX_PAYLOAD = HEADER_SIZE + 3840 * 2160 * 4;
+
+function parseHeader(message) {
+  if (message.length < HEADER_SIZE || message.readUInt32LE(0) !== MSG_MAGIC) {
+    return null;
+  }
+  return {
+    type: message.readUInt16LE(4),
+    flags: message.readUInt16LE(6),
+    width: message.readUInt16LE(8),
+    height: message.readUInt16LE(10),
+    stride: message.readUInt32LE(12),
+    pts: message.readBigUInt64LE(16),
+  };
+}
+
+// Payload of MSG_FRAME_TILES: uint16 tile size, uint16 count, count x
+// {uint16 x, y, w, h}, then the pixels of each tile, rows tightly packed.
+function parseTiles(payload) {
+  const count = payload.readUInt16LE(2);
+  const tiles = [];
+  let offset = 4 + 8 * count;
+  for (let i = 0; i < count; i++) {
+    const rect = 4 + 8 * i;
+    const x = payload.readUInt16LE(rect);
+    const y = payload.readUInt16LE(rect + 2);
+    const w = payload.readUInt16LE(rect + 4);
+    const h = payload.readUInt16LE(rect + 6);
+    const size = w * h * 4;
+    if (offset + size > payload.length) {
+      throw new Error('Truncated tile message');
+    }
+    tiles.push({ x, y, width: w, height: h, data: payload.subarray(offset, offset + size) });
+    offset += size;
+  }
+  return tiles;
+}
+
+// Tell uxplay how large the frames are displayed (device pixels) and the
+// display refresh rate, so it never scales or sends more than is shown.
+function sendViewport(ws) {
+  if (!mainWindow || mainWindow.isDestroyed() || ws.readyState !== WebSocket.OPEN) {
+    return;
+  }
+  const bounds = mainWindow.getContentBounds();
+  const display = screen.getDisplayMatching(bounds);
+  const width = Math.round(bounds.width * display.scaleFactor);
+  const height = Math.round(bounds.height * display.scaleFactor);
+  const fps = Math.round(display.displayFrequency || 60);
+  ws.send(`viewport ${width} ${height} ${fps}`);
+}
+
+// uxplay built as a Node addon (cmake-js with -DBUILD_NODE_ADDON=ON) runs the
+// AirPlay server inside this process: frames arrive without the WebSocket hop.
+// Without it, a separately started uxplay binary connects to the WebSocket server.
+function loadAddon() {
+  try {
+    return require('./UxPlay/build/Release/uxplay.node');
+  } catch (err) {
+    return null;
+  }
+}
+
+// Same as sendViewport(), for the embedded server.
+function setEmbeddedViewport(uxplay) {
+  if (!mainWindow || mainWindow.isDestroyed()) {
+    return;
+  }
+  const bounds = mainWindow.getContentBounds();
+  const display = screen.getDisplayMatching(bounds);
+  uxplay.setViewport(
+    Math.round(bounds.width * display.scaleFactor),
+    Math.round(bounds.height * display.scaleFactor),
+    Math.round(display.displayFrequency || 60)
+  );
+}
+
+function startEmbedded(uxplay) {
+  // uxplay command-line options, e.g. UXPLAY_ARGS="-n Electron -nh"
+  const args = (process.env.UXPLAY_ARGS || '').split(' ').filter(Boolean);
+  console.log('Starting embedded uxplay', args.join(' '));
+  uxplay.start(args, {
+    onFrame: (frame) => {
+      if (mainWindow && !mainWindow.isDestroyed()) {
+        mainWindow.webContents.send('frame-data', {
+          width: frame.width,
+          height: frame.height,
+          stride: frame.stride,
+          data: new Uint8Array(frame.data),
+        });
+      }
+    },
+    onEvent: (event, detail) => {
+      if (event === 'report') {
+        if (mainWindow && !mainWindow.isDestroyed()) {
+          mainWindow.webContents.send('stream-report', JSON.parse(detail));
+        }
+        return;
+      }
+      console.log('uxplay:', event, detail || '');
+      if (mainWindow && !mainWindow.isDestroyed()) {
+        mainWindow.webContents.send('session-event', { event, detail });
+      }
+    },
+  });
+  setEmbeddedViewport(uxplay);
+  mainWindow.on('resize', () => setEmbeddedViewport(uxplay));
+  app.on('will-quit', () => uxplay.stop());
+}
 
 function createWindow() {
   mainWindow = new BrowserWindow({
@@ -22,55 +139,126 @@ function createWindow() {
 }
 
 function createWebSocketServer() {
-  const width = 710;
-  const height = 1080;
-  const FRAME_SIZE = width * height * 4; // 4 bytes per pixel for RGBA
-  
-  console.log(`Setting up WebSocket server for RGBA frames (${width}x${height}, ${FRAME_SIZE} bytes per frame)`);
+  console.log('Setting up WebSocket server for RGBA frames');
   
   const wss = new WebSocket.Server({ 
     port: 8081,
     perMessageDeflate: false,
-    maxPayload: FRAME_SIZE
+    maxPayload: MAX_PAYLOAD
   });
   
-  wss.on('connection', (ws) => {
+  // uxplay -preview sends thumbnails on its own connection (path /preview);
+  // monitoring dashboards connect on /dashboard and receive only those.
+  const dashboards = new Set();
+
+  wss.on('connection', (ws, req) => {
+    if (req.url === '/dashboard') {
+      dashboards.add(ws);
+      ws.on('close', () => dashboards.delete(ws));
+      ws.on('error', (error) => console.error('Dashboard WebSocket error:', error));
+      return;
+    }
+    if (req.url === '/preview') {
+      ws.on('message', (message) => {
+        const header = parseHeader(message);
+        if (!header || header.type !== MSG_PREVIEW_RGBA) {
+          return;
+        }
+        for (const dashboard of dashboards) {
+          if (dashboard.readyState === WebSocket.OPEN && dashboard.bufferedAmount === 0) {
+            dashboard.send(message);
+          }
+        }
+      });
+      ws.on('error', (error) => console.error('Preview WebSocket error:', error));
+      return;
+    }
+
     console.log('WebSocket client connected');
     
     ws.binaryType = 'nodebuffer';
-    let frameBuffer = Buffer.alloc(0);
 
     if (ws._socket) {
       ws._socket.setNoDelay(true);
       ws._socket.setKeepAlive(true, 30000);
     }
 
+    const onResize = () => sendViewport(ws);
+    sendViewport(ws);
+    // Tiles only update the canvas: after a renderer reload, or when the
+    // renderer finds its canvas does not match them, ask for a whole frame.
+    const requestRefresh = () => {
+      if (ws.readyState === WebSocket.OPEN) {
+        ws.send('refresh');
+      }
+    };
+    ipcMain.on('request-refresh', requestRefresh);
+    if (mainWindow && !mainWindow.isDestroyed()) {
+      mainWindow.on('resize', onResize);
+      mainWindow.webContents.on('did-finish-load', requestRefresh);
+    }
+
     ws.on('message', (message) => {
       try {
-        frameBuffer = Buffer.concat([frameBuffer, message]);
-        
-        // If we have a complete RGBA frame
-        if (frameBuffer.length >= FRAME_SIZE) {
-          console.log('Sending complete RGBA frame');
+        const header = parseHeader(message);
+        if (!header) {
+          console.error('Dropping message without a valid header');
+          return;
+        }
+        if (header.type === MSG_FRAME_RGBA) {
           if (mainWindow && !mainWindow.isDestroyed()) {
-            mainWindow.webContents.send('frame-data', frameBuffer.slice(0, FRAME_SIZE));
+            mainWindow.webContents.send('frame-data', {
+              width: header.width,
+              height: header.height,
+              stride: header.stride,
+              data: message.subarray(HEADER_SIZE),
+            });
+          }
+        } else if (header.type === MSG_FRAME_TILES) {
+          if (mainWindow && !mainWindow.isDestroyed()) {
+            mainWindow.webContents.send('frame-tiles', {
+              width: header.width,
+              height: header.height,
+              tiles: parseTiles(message.subarray(HEADER_SIZE)),
+            });
+          }
+        } else if (header.type === MSG_AUDIO_PCM) {
+          // uxplay -pcm: width = channels, height = sample frames; the payload
+          // is a uint32 sample rate followed by interleaved S16LE samples
+          if (mainWindow && !mainWindow.isDestroyed()) {
+            mainWindow.webContents.send('audio-pcm', {
+              rate: message.readUInt32LE(HEADER_SIZE),
+              channels: header.width,
+              frames: header.height,
+              // presentation time on the host clock, in ms like Date.now()
+              pts: Number(header.pts) / 1e6,
+              data: message.subarray(HEADER_SIZE + 4, HEADER_SIZE + 4 + header.height * header.stride),
+            });
+          }
+        } else if (header.type === MSG_STREAM_REPORT) {
+          // once a second while mirroring: the client's streaming report (its
+          // sent fps, drops, encoder latency) beside what uxplay received
+          if (mainWindow && !mainWindow.isDestroyed()) {
+            const json = message.toString('utf8', HEADER_SIZE, HEADER_SIZE + header.stride);
+            mainWindow.webContents.send('stream-report', JSON.parse(json));
           }
-          frameBuffer = frameBuffer.slice(FRAME_SIZE);
         }
       } catch (err) {
         console.error('Error processing message:', err);
-        frameBuffer = Buffer.alloc(0);
       }
     });
 
     ws.on('error', (error) => {
       console.error('WebSocket error:', error);
-      frameBuffer = Buffer.alloc(0);
     });
 
     ws.on('close', () => {
       console.log('Client disconnected');
-      frameBuffer = Buffer.alloc(0);
+      ipcMain.removeListener('request-refresh', requestRefresh);
+      if (mainWindow && !mainWindow.isDestroyed()) {
+        mainWindow.removeListener('resize', onResize);
+        mainWindow.webContents.removeListener('did-finish-load', requestRefresh);
+      }
     });
   });
 
@@ -90,7 +278,12 @@ if (process.env.NODE_ENV === 'development') {
 
 app.whenReady().then(() => {
   createWindow();
-  createWebSocketServer();
+  const uxplay = loadAddon();
+  if (uxplay) {
+    startEmbedded(uxplay);
+  } else {
+    createWebSocketServer();
+  }
 });
 
 app.on('window-all-closed', () => {
@@ -7,9 +7,27 @@ contextBridge.exposeInMainWorld('electron', {
     if (channel === 'frame-data') {
       // Explicitly wrap the frame-data handler
       ipcRenderer.on(channel, (event, ...args) => {
-        console.log('Received frame in preload, size:', args[0]?.length);
+        console.log('Received frame in preload, size:', args[0]?.data?.length);
         func(...args);
       });
+    } else if (channel === 'frame-tiles') {
+      // Changed tiles only, drawn over the previous frame
+      ipcRenderer.on(channel, (event, ...args) => func(...args));
+    } else if (channel === 'audio-pcm') {
+      // Decoded audio chunks (uxplay -pcm)
+      ipcRenderer.on(channel, (event, ...args) => func(...args));
+    } else if (channel === 'stream-report') {
+      // Client streaming reports with receive-side figures, once a second
+      ipcRenderer.on(channel, (event, ...args) => func(...args));
+    } else if (channel === 'session-event') {
+      // Client connect/disconnect, codec and size changes (embedded uxplay only)
+      ipcRenderer.on(channel, (event, ...args) => func(...args));
+    }
+  },
+  send: (channel) => {
+    if (channel === 'request-refresh') {
+      // Ask uxplay for a whole frame (the canvas does not match the tiles)
+      ipcRenderer.send(channel);
     }
   }
 });
\ No newline at end of file
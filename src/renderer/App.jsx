@@ -1,10 +1,15 @@
 import React, { useEffect, useRef, useState } from 'react';
 
+const AUDIO_MAX_DRIFT = 0.05;  // secs; larger pts jumps restart the schedule
+const AUDIO_LATE_LEAD = 0.02;
+
 function App() {
   const canvasRef = useRef(null);
-  const [dimensions] = useState({ width: 710, height: 1080 });
+  const [dimensions, setDimensions] = useState({ width: 710, height: 1080 });
   const frameCountRef = useRef(0);
   const lastTimeRef = useRef(Date.now());
+  const audioContextRef = useRef(null);
+  const nextAudioTimeRef = useRef(0);
 
   useEffect(() => {
     const canvas = canvasRef.current;
@@ -14,37 +19,115 @@ function App() {
       alpha: false,
       desynchronized: true
     });
-    
-    canvas.width = dimensions.width;
-    canvas.height = dimensions.height;
+
+    const countFrame = () => {
+      frameCountRef.current++;
+      const now = Date.now();
+      if (now - lastTimeRef.current >= 1000) {
+        const fps = frameCountRef.current;
+        console.log(`FPS: ${fps}`);
+        frameCountRef.current = 0;
+        lastTimeRef.current = now;
+      }
+    };
+
+    // set while a whole frame has been asked for, so that a run of
+    // mismatched tile messages sends only one request
+    let refreshRequested = false;
 
     if (window.electron?.on) {
-      window.electron.on('frame-data', (frameData) => {
+      window.electron.on('frame-data', (frame) => {
+        refreshRequested = false;
         try {
-          // Direct RGBA frame handling
+          // Frame size follows the viewport negotiated with uxplay
+          if (canvas.width !== frame.width || canvas.height !== frame.height) {
+            canvas.width = frame.width;
+            canvas.height = frame.height;
+            setDimensions({ width: frame.width, height: frame.height });
+          }
+
+          // Direct RGBA frame handling (rows are tightly packed when stride == 4 * width)
           const imageData = new ImageData(
-            new Uint8ClampedArray(frameData),
-            dimensions.width,
-            dimensions.height
+            new Uint8ClampedArray(frame.data.buffer, frame.data.byteOffset, frame.stride * frame.height),
+            frame.stride / 4,
+            frame.height
           );
           
-          ctx.putImageData(imageData, 0, 0);
+          ctx.putImageData(imageData, 0, 0, 0, 0, frame.width, frame.height);
           
-          // Update FPS counter
-          frameCountRef.current++;
-          const now = Date.now();
-          if (now - lastTimeRef.current >= 1000) {
-            const fps = frameCountRef.current;
-            console.log(`FPS: ${fps}`);
-            frameCountRef.current = 0;
-            lastTimeRef.current = now;
-          }
+          countFrame();
         } catch (error) {
           console.error('Error processing frame:', error);
         }
       });
+
+      // Only the tiles that changed since the last frame; a full frame always
+      // precedes them after a size change, unless it was missed (e.g. this
+      // page was reloaded): then ask for one instead of drawing on a stale canvas.
+      window.electron.on('frame-tiles', (frame) => {
+        try {
+          if (canvas.width !== frame.width || canvas.height !== frame.height) {
+            if (!refreshRequested && window.electron.send) {
+              refreshRequested = true;
+              window.electron.send('request-refresh');
+            }
+            return;
+          }
+          for (const tile of frame.tiles) {
+            const pixels = new Uint8ClampedArray(tile.data.buffer, tile.data.byteOffset, tile.data.length);
+            ctx.putImageData(new ImageData(pixels, tile.width, tile.height), tile.x, tile.y);
+          }
+          countFrame();
+        } catch (error) {
+          console.error('Error processing tiles:', error);
+        }
+      });
+
+      // Audio chunks are scheduled at their presentation time (host clock,
+      // shared with the video frames); consecutive chunks are played back to
+      // back so that small timing noise does not cause clicks.
+      window.electron.on('audio-pcm', (chunk) => {
+        try {
+          if (!audioContextRef.current) {
+            audioContextRef.current = new AudioContext({ sampleRate: chunk.rate });
+            nextAudioTimeRef.current = 0;
+          }
+          const audioCtx = audioContextRef.current;
+          // S16LE; the IPC copy may start at an odd byte offset, which an
+          // Int16Array view does not allow
+          const samples = new DataView(chunk.data.buffer, chunk.data.byteOffset, chunk.data.byteLength);
+          const audioBuffer = audioCtx.createBuffer(chunk.channels, chunk.frames, chunk.rate);
+          for (let c = 0; c < chunk.channels; c++) {
+            const channel = audioBuffer.getChannelData(c);
+            for (let i = 0; i < chunk.frames; i++) {
+              channel[i] = samples.getInt16((i * chunk.channels + c) * 2, true) / 32768;
+            }
+          }
+          let when = audioCtx.currentTime + (chunk.pts - Date.now()) / 1000;
+          if (Math.abs(when - nextAudioTimeRef.current) < AUDIO_MAX_DRIFT) {
+            when = nextAudioTimeRef.current;
+          }
+          if (when < audioCtx.currentTime) {
+            when = audioCtx.currentTime + AUDIO_LATE_LEAD; // late: play as soon as possible
+          }
+          const source = audioCtx.createBufferSource();
+          source.buffer = audioBuffer;
+          source.connect(audioCtx.destination);
+          source.start(when);
+          nextAudioTimeRef.current = when + audioBuffer.duration;
+        } catch (error) {
+          console.error('Error processing audio:', error);
+        }
+      });
     }
-  }, [dimensions]);
+
+    return () => {
+      if (audioContextRef.current) {
+        audioContextRef.current.close();
+        audioContextRef.current = null;
+      }
+    };
+  }, []);
 
   return (
     <div className="flex flex-col items-center justify-center min-h-screen bg-gray-900 p-4">
@@ -54,8 +137,9 @@ function App() {
           ref={canvasRef}
           className="border border-gray-700 rounded-lg shadow-lg"
           style={{ 
-            width: `${dimensions.width}px`,
-            height: `${dimensions.height}px`,
+            maxWidth: '100vw',
+            maxHeight: '100vh',
+            aspectRatio: `${dimensions.width} / ${dimensions.height}`,
             imageRendering: 'auto'
           }}
         />